@@ -1,10 +1,26 @@
 #pragma once
 
-// PN532 Pins
+// PN532 Pins (inbound lane)
 #define PN532_SS   5
 #define PN532_RST  21
+#define PN532_IRQ  0xFF     // P70_IRQ of the PN532, 0xFF = not connected (status polling)
+// Second PN532 on the same SPI bus (outbound lane), PN532_SS_OUT 0xFF = only one reader
+// e.g. PN532_SS_OUT 4 and PN532_RST_OUT 22 (avoid the strapping pins 0, 2, 12 and 15)
+#define PN532_SS_OUT   0xFF
+#define PN532_RST_OUT  0xFF
+#define PN532_IRQ_OUT  0xFF
+#define PN532_TIMING  TIMING_Safe  // TIMING_Fast = burst SPI transfers with short delays (short cables)
+#define PN532_SPI_CALIBRATE  false // true = find the fastest reliable SPI clock at startup (see DesfireService.h), enable after verifying the wiring
+#define PN532_AUTOPOLL  (PN532_IRQ != 0xFF) // the PN532 polls for cards by itself (InAutoPoll), only with PN532_IRQ connected
+#define PN532_BITRATE   BITRATE_106 // highest RF bit rate negotiated with the card (InPSL), BITRATE_106 = no negotiation, BITRATE_424 after testing the cards
+#define PN532_RF_PROFILE  RFPROFILE_Conservative // RF timeouts and retries of the power-up state, {"rf_profile": "fast_gate"} on topic_control selects faster ones
 #define LED_PIN    2
 #define USE_AES    true     // true = AES, false = 3DES
+#define CARD_FILE_COMM_MODE  CM_PLAIN // communication mode of the PID file: CM_PLAIN (+ CMAC) or CM_ENCRYPT (data + CRC encrypted)
+// The application master key of each card is derived from its UID and SECRET_APPLICATION_KEY (AN10922).
+// Only DesfireService::authenticateApp() uses it: the access script of the sketch authenticates with the read key only.
+#define CARD_KEY_DIVERSIFICATION  false
+#define CARD_AUTH_EV2  false // EV2/EV3 cards: AuthenticateEV2First/NonFirst + EV2 secure messaging (AES, needs a CM_MAC file, CM_ENCRYPT is EV1 only)
 
 // Servo Pin
 #define SERVO_PIN  32
@@ -27,4 +43,17 @@ const char* mqtt_pass = "Frazmqtt00";
 
 const char* topic_control = "/device/control";
 const char* topic_status = "/device/status";
-const char* topic_rfid = "/device/rfid";
\ No newline at end of file
+const char* topic_rfid = "/device/rfid";
+const char* topic_trace = "/device/trace";
+const char* topic_metrics = "/device/metrics";
+
+// A tap that takes longer than this (milliseconds) dumps the PN532 frame trace and publishes it to topic_trace
+#define SLOW_TAP_MS  1000
+
+// A card whose tap has failed is read again after this time (milliseconds) while it stays in the field
+#define TAP_RETRY_MS  1000
+
+// The tap latency percentiles of each phase (TapMetrics) are published to topic_metrics in this interval (milliseconds)
+#define METRICS_PUBLISH_MS  60000
+// Reported in the metrics payload, so the latency of firmware versions can be compared
+#define FIRMWARE_VERSION  __DATE__ " " __TIME__
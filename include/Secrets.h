@@ -19,8 +19,10 @@
 //            will be modified, because it stores the key version.
 const byte SECRET_PICC_MASTER_KEY[24] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
 
-// This 3K3DES key is used to derive a 16 byte application master key from the UID of the card and the user name.
+// This 3K3DES key is used to derive the application master key from the UID of the card and the application ID
+// (NXP AN10922, see KeyDiversifier.h and CARD_KEY_DIVERSIFICATION in Config.h).
 // The purpose is that each card will have it's unique application master key that can be calculated from known values.
+// If you set the compiler switch USE_AES = true, only the first 16 bytes of this key will be used (16 byte AES key per card).
 const byte SECRET_APPLICATION_KEY[24] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
 
 // This 3K3DES key is used to derive the 16 byte store value from the UID of the card and the user name.
@@ -280,10 +280,7 @@ bool Classic::DataExchange(byte u8_Command, byte u8_Block, byte* u8_Data, byte u
 
     memcpy(mu8_PacketBuffer + 4, u8_Data, u8_DataLen);
     
-    if (!SendCommandCheckAck(mu8_PacketBuffer, 4 + u8_DataLen))
-        return false;
-  
-    byte len = ReadData(mu8_PacketBuffer, 26);
+    int len = ExecuteCommand(mu8_PacketBuffer, 4 + u8_DataLen);
     if (len < 3 || mu8_PacketBuffer[1] != PN532_COMMAND_INDATAEXCHANGE + 1)
     {
         Utils::Print("DataExchange failed\r\n");
@@ -62,6 +62,12 @@ void Connection::publishStatus() {
   long distance = gate.getDistance();
   doc["distance"] = distance;
   doc["threshold"] = gate.getThreshold();
+  if (nfcSpiClock > 0) {
+    doc["nfc_spi_hz"] = nfcSpiClock;
+  }
+  if (nfcRfProfile) {
+    doc["nfc_rf_profile"] = nfcRfProfile;
+  }
   doc["timestamp"] = millis();
 
   char jsonBuffer[256];
@@ -106,14 +112,19 @@ void Connection::onMessageReceived(const String& topic, const String& message) {
   }
 }
 
-void Connection::publishRFID(const String& pid) {
+// reader (the lane that has read the card), bitRateKbps and tapMs (authentication + read) are added if known,
+// so the effect of the RF bit rate can be compared per tap
+void Connection::publishRFID(const String& pid, const char* reader, uint16_t bitRateKbps, uint32_t tapMs) {
   JsonDocument root;
   JsonObject doc = root.to<JsonObject>();
   
   doc["pid"] = pid;
   doc["timestamp"] = millis();
+  if (reader) doc["reader"] = reader;
+  if (bitRateKbps) doc["rf_kbps"] = bitRateKbps;
+  if (tapMs) doc["tap_ms"] = tapMs;
 
-  char jsonBuffer[100];
+  char jsonBuffer[192];
   serializeJson(doc, jsonBuffer);
 
   client.publish(mqttConfig.topics.rfid, jsonBuffer);
@@ -121,3 +132,63 @@ void Connection::publishRFID(const String& pid) {
   Serial.println(jsonBuffer);
 }
 
+// Publishes the PN532 frame trace of a slow tap. Each frame is [us since the first frame, dir, cmd, len, status]
+// (see kPN532Trace). The payload is larger than the MQTT buffer, so it is streamed.
+void Connection::publishTrace(const kPN532Trace* frames, int count, uint32_t tapMs, const char* reader) {
+  if (count <= 0) return;
+
+  JsonDocument root;
+  JsonObject doc = root.to<JsonObject>();
+
+  if (reader) doc["reader"] = reader;
+  doc["tap_ms"] = tapMs;
+  doc["timestamp"] = millis();
+  JsonArray list = doc["frames"].to<JsonArray>();
+  for (int i = 0; i < count; i++) {
+    JsonArray frame = list.add<JsonArray>();
+    frame.add(frames[i].u32_Micros - frames[0].u32_Micros);
+    frame.add(frames[i].u8_Dir);
+    frame.add(frames[i].u8_Cmd);
+    frame.add(frames[i].u16_Len);
+    frame.add(frames[i].u8_Status);
+  }
+
+  size_t length = measureJson(doc);
+  if (!client.beginPublish(mqttConfig.topics.trace, length, false)) {
+    Serial.println("[ERROR] Trace publish failed");
+    return;
+  }
+  serializeJson(doc, client);
+  client.endPublish();
+  Serial.printf("[INFO] Trace published to %s (%d frames, %u bytes)\n", mqttConfig.topics.trace, count, (unsigned)length);
+}
+
+// Publishes the tap latency percentiles (microseconds) of each phase that has been measured:
+// {"firmware": "...", "timestamp": 123, "phases": {"detect": {"count": 10, "p50": 900, "p95": 1100, "p99": 1200, "max": 1250}, ...}}
+void Connection::publishMetrics(TapMetrics& metrics) {
+  JsonDocument root;
+  JsonObject doc = root.to<JsonObject>();
+
+  if (firmwareVersion) doc["firmware"] = firmwareVersion;
+  doc["timestamp"] = millis();
+  JsonObject phases = doc["phases"].to<JsonObject>();
+  for (int i = 0; i < PHASE_COUNT; i++) {
+    TapPhase phase = (TapPhase)i;
+    if (metrics.getCount(phase) == 0) continue;
+    JsonObject entry = phases[TapMetrics::getPhaseName(phase)].to<JsonObject>();
+    entry["count"] = metrics.getCount(phase);
+    entry["p50"] = metrics.getPercentile(phase, 50);
+    entry["p95"] = metrics.getPercentile(phase, 95);
+    entry["p99"] = metrics.getPercentile(phase, 99);
+    entry["max"] = metrics.getMax(phase);
+  }
+
+  size_t length = measureJson(doc);
+  if (!client.beginPublish(mqttConfig.topics.metrics, length, false)) {
+    Serial.println("[ERROR] Metrics publish failed");
+    return;
+  }
+  serializeJson(doc, client);
+  client.endPublish();
+  Serial.printf("[INFO] Metrics published to %s (%u bytes)\n", mqttConfig.topics.metrics, (unsigned)length);
+}
@@ -8,11 +8,15 @@
 #include <PubSubClient.h>
 #include <ArduinoJson.h>
 #include <Gate.h>
+#include <PN532.h>
+#include <TapMetrics.h>
 
 struct MqttTopics {
     const char* status;
     const char* control;
     const char* rfid;
+    const char* trace;
+    const char* metrics;
 };
 
 struct MqttConfig {
@@ -32,7 +36,12 @@ public:
   void reconnect();
   void loop();
   void publishStatus();
-  void publishRFID(const String& uid);
+  void publishRFID(const String& uid, const char* reader = nullptr, uint16_t bitRateKbps = 0, uint32_t tapMs = 0);
+  void publishTrace(const kPN532Trace* frames, int count, uint32_t tapMs, const char* reader = nullptr);
+  void publishMetrics(TapMetrics& metrics);
+  void setNfcSpiClock(uint32_t hz) { nfcSpiClock = hz; }
+  void setNfcRfProfile(const char* name) { nfcRfProfile = name; }
+  void setFirmwareVersion(const char* version) { firmwareVersion = version; }
 
   void setMessageHandler(void (*handler)(const String&, const String&));
   bool isConnected() { return client.connected(); };
@@ -46,6 +55,9 @@ private:
     PubSubClient client;
     MqttConfig mqttConfig;
     Gate& gate;
+    uint32_t nfcSpiClock = 0; // reported in the status so the calibrated clock can be compared across gates
+    const char* nfcRfProfile = nullptr; // name of the PN532 RF latency profile
+    const char* firmwareVersion = nullptr; // reported with the metrics to compare the latency of firmware versions
 
     void onMessageReceived(const String& topic, const String& message);
     void (*messageHandler)(const String&, const String&) = nullptr;
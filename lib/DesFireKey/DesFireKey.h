@@ -42,10 +42,11 @@ class DESFireKey
 public:
     DESFireKey() 
     {
-        ms32_KeySize   = 0;
-        ms32_BlockSize = 0;
-        mu8_Version    = 0;
-        me_KeyType     = DF_KEY_INVALID;
+        ms32_KeySize     = 0;
+        ms32_BlockSize   = 0;
+        mu8_Version      = 0;
+        me_KeyType       = DF_KEY_INVALID;
+        ms32_CmacPending = 0;
     }
     virtual ~DESFireKey() 
     {
@@ -116,34 +117,125 @@ public:
 
     // Calculate the CMAC (Cipher-based Message Authentication Code) from the given data.
     // The CMAC is the initialization vector (IV) after a CBC encryption of the given data.
-    // ATTENTION: The content of i_Buffer will be modified!!
     bool CalculateCmac(TxBuffer& i_Buffer, byte u8_Cmac[16])
     {
-        // If the data length is not a multiple of the block size -> pad the buffer with 80,00,00,00,....
-        if ((i_Buffer.GetCount() == 0) || (i_Buffer.GetCount() % ms32_BlockSize))
+        CmacBegin();
+        return CmacUpdate(i_Buffer.GetData(), i_Buffer.GetCount()) && CmacFinal(u8_Cmac);
+    }
+
+    // Incremental CMAC calculation: CmacBegin(), then CmacUpdate() for each part of the message, then CmacFinal().
+    // The message may be passed in any number of parts directly from where it is stored (e.g. the PN532 packet buffer).
+    // Only the last block is kept pending because the subkey must be XOR-ed into it, all blocks before
+    // are encrypted immediately. The CBC starts with the current IV of the session key like CalculateCmac().
+    void CmacBegin()
+    {
+        ms32_CmacPending = 0;
+    }
+
+    bool CmacUpdate(const byte* u8_Data, int s32_Length)
+    {
+        while (s32_Length > 0)
         {
-            if (!i_Buffer.AppendUint8(0x80))
-                return false; // Buffer is full
-                
-            while (i_Buffer.GetCount() % ms32_BlockSize)
+            // A full pending block is not the last one because more data follows
+            if (ms32_CmacPending == ms32_BlockSize)
             {
-                if (!i_Buffer.AppendUint8(0x00))
-                    return false; // Buffer is full
+                if (!CryptDataCBC(CBC_SEND, KEY_ENCIPHER, mu8_CmacBlock, mu8_CmacBlock, ms32_BlockSize))
+                    return false;
+                ms32_CmacPending = 0;
             }
-            Utils::XorDataBlock(i_Buffer + i_Buffer.GetCount() - ms32_BlockSize, mu8_Cmac2, ms32_BlockSize);
-        } 
+
+            // Blocks in the middle of the data are encrypted without copying them into the pending block
+            while (ms32_CmacPending == 0 && s32_Length > ms32_BlockSize)
+            {
+                if (!CryptDataCBC(CBC_SEND, KEY_ENCIPHER, mu8_CmacBlock, u8_Data, ms32_BlockSize))
+                    return false;
+                u8_Data    += ms32_BlockSize;
+                s32_Length -= ms32_BlockSize;
+            }
+
+            int s32_Copy = min(s32_Length, ms32_BlockSize - ms32_CmacPending);
+            memcpy(mu8_CmacBlock + ms32_CmacPending, u8_Data, s32_Copy);
+            ms32_CmacPending += s32_Copy;
+            u8_Data          += s32_Copy;
+            s32_Length       -= s32_Copy;
+        }
+        return true;
+    }
+
+    bool CmacFinal(byte u8_Cmac[16])
+    {
+        // If the data length is not a multiple of the block size -> pad the last block with 80,00,00,00,....
+        if (ms32_CmacPending < ms32_BlockSize)
+        {
+            mu8_CmacBlock[ms32_CmacPending] = 0x80;
+            memset(mu8_CmacBlock + ms32_CmacPending + 1, 0, ms32_BlockSize - ms32_CmacPending - 1);
+            Utils::XorDataBlock(mu8_CmacBlock, mu8_Cmac2, ms32_BlockSize);
+        }
         else // no padding required
         {
-            Utils::XorDataBlock(i_Buffer + i_Buffer.GetCount() - ms32_BlockSize, mu8_Cmac1, ms32_BlockSize);
+            Utils::XorDataBlock(mu8_CmacBlock, mu8_Cmac1, ms32_BlockSize);
         }
+        ms32_CmacPending = 0;
 
-        if (!CryptDataCBC(CBC_SEND, KEY_ENCIPHER, i_Buffer, i_Buffer, i_Buffer.GetCount()))
+        if (!CryptDataCBC(CBC_SEND, KEY_ENCIPHER, mu8_CmacBlock, mu8_CmacBlock, ms32_BlockSize))
             return false;
-            
+
         memcpy(u8_Cmac, mu8_IV, ms32_BlockSize);
         return true;
     }
-    
+
+    // Key diversification according to NXP AN10922 (CMAC based). This key is the master key.
+    // u8_Input is the diversification input M (e.g. UID + AID), 1...31 bytes for AES, 1...15 bytes for 3DES.
+    // AES:    DivKey = CMAC(K, 01 + M)                                          -> 16 bytes
+    // 2K3DES: DivKey = CMAC(K, 21 + M) + CMAC(K, 22 + M)                        -> 16 bytes
+    // 3K3DES: DivKey = CMAC(K, 31 + M) + CMAC(K, 32 + M) + CMAC(K, 33 + M)      -> 24 bytes
+    // Other than a normal CMAC the message is always padded to 2 blocks (32 bytes AES, 16 bytes DES).
+    // The diversified key is written to u8_DivKey (GetKeySize(16) bytes).
+    bool DiversifyKey(const byte* u8_Input, int s32_Length, byte* u8_DivKey)
+    {
+        byte u8_Const;
+        int  s32_Parts;
+        switch (me_KeyType)
+        {
+            case DF_KEY_AES:    u8_Const = 0x01; s32_Parts = 1; break;
+            case DF_KEY_2K3DES: u8_Const = 0x21; s32_Parts = 2; break;
+            case DF_KEY_3K3DES: u8_Const = 0x31; s32_Parts = 3; break;
+            default:
+                Utils::Print("Invalid key\r\n");
+                return false;
+        }
+
+        int s32_MsgSize = 2 * ms32_BlockSize;
+        if (s32_Length < 1 || s32_Length >= s32_MsgSize)
+        {
+            Utils::Print("Invalid diversification input\r\n");
+            return false;
+        }
+
+        if (!GenerateCmacSubkeys())
+            return false;
+
+        for (int P=0; P<s32_Parts; P++)
+        {
+            byte u8_Msg[32] = {0};
+            u8_Msg[0] = u8_Const + P;
+            memcpy(u8_Msg + 1, u8_Input, s32_Length);
+
+            // Padded message -> the last block is XOR-ed with subkey 2, otherwise with subkey 1
+            bool b_Padded = (1 + s32_Length < s32_MsgSize);
+            if (b_Padded) u8_Msg[1 + s32_Length] = 0x80;
+            Utils::XorDataBlock(u8_Msg + ms32_BlockSize, b_Padded ? mu8_Cmac2 : mu8_Cmac1, ms32_BlockSize);
+
+            ClearIV();
+            if (!CryptDataCBC(CBC_SEND, KEY_ENCIPHER, u8_Msg, u8_Msg, s32_MsgSize))
+                return false;
+
+            memcpy(u8_DivKey + P * ms32_BlockSize, mu8_IV, ms32_BlockSize);
+        }
+        ClearIV();
+        return true;
+    }
+
     inline byte* Data()
     {
         return mu8_Key;
@@ -246,6 +338,8 @@ protected:
 
     byte mu8_Cmac1[16]; // CMAC subkey 1
     byte mu8_Cmac2[16]; // CMAC subkey 2
+    byte mu8_CmacBlock[16]; // the pending last block of an incremental CMAC calculation
+    int  ms32_CmacPending;  // count of bytes in mu8_CmacBlock
 };
 
 #endif // DESFIRE_KEY_H
@@ -39,12 +39,13 @@
 #endif
 
 Desfire::Desfire() 
-    : mi_CmacBuffer(mu8_CmacBuffer_Data, sizeof(mu8_CmacBuffer_Data))
 {
     mpi_SessionKey       = NULL;
     mu8_LastAuthKeyNo    = NOT_AUTHENTICATED;
     mu8_LastPN532Error   = 0;    
     mu32_LastApplication = 0x000000; // No application selected
+    mb_EV2Session        = false;
+    mu16_EV2CmdCtr       = 0;
 
     // The PICC master key on an empty card is a simple DES key filled with 8 zeros
     const byte ZERO_KEY[24] = {0};
@@ -55,11 +56,36 @@ Desfire::Desfire()
 
 // Whenever the RF field is switched off, these variables must be reset
 bool Desfire::SwitchOffRfField()
+{
+    OnCardReset();
+    return PN532::SwitchOffRfField();
+}
+
+// Whenever a card is activated anew, deselected or released, these variables must be reset
+void Desfire::OnCardReset()
 {
     mu8_LastAuthKeyNo    = NOT_AUTHENTICATED;
     mu32_LastApplication = 0x000000; // No application selected
+    mb_EV2Session        = false;
+}
 
-    return PN532::SwitchOffRfField();
+// The application that has been selected last. After the activation the card is at PICC level (0x000000).
+uint32_t Desfire::GetSelectedApplication()
+{
+    return mu32_LastApplication;
+}
+
+// The key number of the current session (the last successful authentication) or NOT_AUTHENTICATED.
+// The session ends with SelectApplication(), a failed command or a new activation of the card.
+byte Desfire::GetAuthenticatedKeyNo()
+{
+    return mu8_LastAuthKeyNo;
+}
+
+// true if the current session was established with AuthenticateEV2First() / AuthenticateEV2NonFirst()
+bool Desfire::IsEV2Session()
+{
+    return mb_EV2Session && mu8_LastAuthKeyNo != NOT_AUTHENTICATED;
 }
 
 /**************************************************************************
@@ -96,6 +122,10 @@ bool Desfire::Authenticate(byte u8_KeyNo, DESFireKey* pi_Key)
             return false;
     }
 
+    // The card drops the current session as soon as it receives the authentication command
+    mu8_LastAuthKeyNo = NOT_AUTHENTICATED;
+    mb_EV2Session     = false;
+
     TX_BUFFER(i_Params, 1);
     i_Params.AppendUint8(u8_KeyNo);
 
@@ -227,6 +257,193 @@ bool Desfire::Authenticate(byte u8_KeyNo, DESFireKey* pi_Key)
     return true;
 }
 
+/**************************************************************************
+    Desfire EV2 / EV3 only:
+    AuthenticateEV2First() starts a new transaction with an AES key and switches the card
+    into EV2 secure messaging. The card returns a new Transaction Identifier (TI) and the
+    Command Counter starts at zero.
+    AuthenticateEV2NonFirst() authenticates another key of the same application inside
+    the running transaction: TI and Command Counter are kept, the response is shorter and
+    the card does not send its capabilities again.
+    In both cases the session keys are derived with a CMAC over RndA and RndB (see AuthenticateEV2()).
+    After SelectApplication() the transaction has ended and AuthenticateEV2First() is required again.
+    In EV2 secure messaging commands with MAC_Tmac / MAC_Rmac transmit an 8 byte truncated MAC.
+    The encrypted communication mode (ChangeKey, ChangeKeySettings, GetRealCardID, CM_ENCRYPT files)
+    requires an EV1 authentication with Authenticate().
+**************************************************************************/
+bool Desfire::AuthenticateEV2First(byte u8_KeyNo, AES* pi_Key)
+{
+    return AuthenticateEV2(DFEV2_INS_AUTHENTICATE_EV2_FIRST, u8_KeyNo, pi_Key);
+}
+
+bool Desfire::AuthenticateEV2NonFirst(byte u8_KeyNo, AES* pi_Key)
+{
+    if (!IsEV2Session())
+    {
+        Utils::Print("AuthenticateEV2NonFirst() requires a running EV2 transaction\r\n");
+        return false;
+    }
+    return AuthenticateEV2(DFEV2_INS_AUTHENTICATE_EV2_NON_FIRST, u8_KeyNo, pi_Key);
+}
+
+/**************************************************************************
+    This function is private
+    Pass 1: The card sends E(Kx, RndB)
+    Pass 2: The reader sends E(Kx, RndA + RndB rotated)
+    Pass 3: The card sends E(Kx, TI + RndA rotated + PDcap2 + PCDcap2) (First) or E(Kx, RndA rotated) (NonFirst)
+    All encryptions use CBC with a zero IV.
+    SesAuthENCKey = CMAC(Kx, SV1), SesAuthMACKey = CMAC(Kx, SV2) with
+    SV = A5 5A (ENC) or 5A A5 (MAC) + 00 01 00 80 + RndA[0..1] + (RndA[2..7] XOR RndB[0..5]) + RndB[6..15] + RndA[8..15]
+**************************************************************************/
+bool Desfire::AuthenticateEV2(byte u8_Command, byte u8_KeyNo, AES* pi_Key)
+{
+    bool b_First = (u8_Command == DFEV2_INS_AUTHENTICATE_EV2_FIRST);
+    if (mu8_DebugLevel > 0)
+    {
+        char s8_Buf[80];
+        sprintf(s8_Buf, "\r\n*** AuthenticateEV2%s(KeyNo= %d, Key= ", b_First ? "First" : "NonFirst", u8_KeyNo);
+        Utils::Print(s8_Buf);
+        pi_Key->PrintKey();
+        Utils::Print(")\r\n");
+    }
+
+    if (!DESFireKey::CheckValid(pi_Key))
+        return false;
+
+    // The card drops the current session keys as soon as it receives the authentication command.
+    // TI and Command Counter stay valid for AuthenticateEV2NonFirst().
+    mu8_LastAuthKeyNo = NOT_AUTHENTICATED;
+
+    TX_BUFFER(i_Params, 2);
+    i_Params.AppendUint8(u8_KeyNo);
+    if (b_First) i_Params.AppendUint8(0); // LenCap = 0: no PCDcap2 sent
+
+    DESFireStatus e_Status;
+    byte u8_RndB_enc[16]; // encrypted random B
+    int s32_Read = DataExchange(u8_Command, &i_Params, u8_RndB_enc, 16, &e_Status, MAC_None);
+    if (e_Status != ST_MoreFrames || s32_Read != 16)
+    {
+        Utils::Print("Authentication failed (1)\r\n");
+        mb_EV2Session = false;
+        return false;
+    }
+
+    byte u8_RndB[16]; // decrypted random B
+    pi_Key->ClearIV();
+    if (!pi_Key->CryptDataCBC(CBC_RECEIVE, KEY_DECIPHER, u8_RndB, u8_RndB_enc, 16))
+        return false;
+
+    byte u8_RndA[16];
+    Utils::GenerateRandom(u8_RndA, 16);
+
+    TX_BUFFER(i_RndAB, 32); // (randomA + rotated randomB)
+    i_RndAB.AppendBuf(u8_RndA, 16);
+    i_RndAB.SetCount(32);
+    Utils::RotateBlockLeft(i_RndAB.GetData() + 16, u8_RndB, 16);
+
+    TX_BUFFER(i_RndAB_enc, 32); // encrypted (randomA + rotated randomB)
+    i_RndAB_enc.SetCount(32);
+    pi_Key->ClearIV();
+    if (!pi_Key->CryptDataCBC(CBC_SEND, KEY_ENCIPHER, i_RndAB_enc, i_RndAB, 32))
+        return false;
+
+    int s32_RespSize = b_First ? 32 : 16;
+    byte u8_Resp_enc[32];
+    s32_Read = DataExchange(DF_INS_ADDITIONAL_FRAME, &i_RndAB_enc, u8_Resp_enc, s32_RespSize, &e_Status, MAC_None);
+    if (e_Status != ST_Success || s32_Read != s32_RespSize)
+    {
+        Utils::Print("Authentication failed (2)\r\n");
+        mb_EV2Session = false;
+        return false;
+    }
+
+    byte u8_Resp[32];
+    pi_Key->ClearIV();
+    if (!pi_Key->CryptDataCBC(CBC_RECEIVE, KEY_DECIPHER, u8_Resp, u8_Resp_enc, s32_RespSize))
+        return false;
+
+    // AuthenticateEV2First: TI (4) + RndA rotated (16) + PDcap2 (6) + PCDcap2 (6)
+    byte* u8_RndA_dec = b_First ? u8_Resp + 4 : u8_Resp;
+    byte u8_RndA_rot[16]; // rotated random A
+    Utils::RotateBlockLeft(u8_RndA_rot, u8_RndA, 16);
+
+    if (mu8_DebugLevel > 0)
+    {
+        Utils::Print("* RndB:      ");
+        Utils::PrintHexBuf(u8_RndB, 16, LF);
+        Utils::Print("* RndA:      ");
+        Utils::PrintHexBuf(u8_RndA, 16, LF);
+        Utils::Print("* Response:  ");
+        Utils::PrintHexBuf(u8_Resp, s32_RespSize, LF);
+    }
+
+    if (memcmp(u8_RndA_dec, u8_RndA_rot, 16) != 0)
+    {
+        Utils::Print("Authentication failed (3)\r\n");
+        mb_EV2Session = false;
+        return false;
+    }
+
+    if (!GenerateEV2SessionKeys(pi_Key, u8_RndA, u8_RndB, &mi_AesSessionKey, &mi_EV2MacKey))
+        return false;
+
+    if (b_First)
+    {
+        memcpy(mu8_EV2TI, u8_Resp, 4);
+        mu16_EV2CmdCtr = 0;
+    }
+
+    if (mu8_DebugLevel > 0)
+    {
+        Utils::Print("* TI:        ");
+        Utils::PrintHexBuf(mu8_EV2TI, 4, LF);
+        Utils::Print("* SesENCKey: ");
+        mi_AesSessionKey.PrintKey(LF);
+        Utils::Print("* SesMACKey: ");
+        mi_EV2MacKey.PrintKey(LF);
+    }
+
+    mpi_SessionKey    = &mi_AesSessionKey;
+    mb_EV2Session     = true;
+    mu8_LastAuthKeyNo = u8_KeyNo;
+    return true;
+}
+
+/**************************************************************************
+    Derives the EV2 session keys SesAuthENCKey and SesAuthMACKey (AN12196) from the
+    authentication key and the random numbers of AuthenticateEV2First / NonFirst.
+    The CMAC subkeys of pi_SesMacKey are generated for the secure messaging.
+**************************************************************************/
+bool Desfire::GenerateEV2SessionKeys(AES* pi_Key, const byte u8_RndA[16], const byte u8_RndB[16], AES* pi_SesEncKey, AES* pi_SesMacKey)
+{
+    // Session vector SV1 (ENC), SV2 (MAC) differs only in the first two bytes
+    byte u8_SV[32] = { 0xA5, 0x5A, 0x00, 0x01, 0x00, 0x80 };
+    memcpy(u8_SV +  6, u8_RndA, 2);
+    for (int i=0; i<6; i++)
+    {
+        u8_SV[8 + i] = u8_RndA[2 + i] ^ u8_RndB[i];
+    }
+    memcpy(u8_SV + 14, u8_RndB + 6, 10);
+    memcpy(u8_SV + 24, u8_RndA + 8,  8);
+
+    TX_BUFFER(i_SV, 32);
+    i_SV.AppendBuf(u8_SV, 32);
+
+    if (!pi_Key->GenerateCmacSubkeys())
+        return false;
+
+    byte u8_SesKey[16];
+    pi_Key->ClearIV();
+    if (!pi_Key->CalculateCmac(i_SV, u8_SesKey) || !pi_SesEncKey->SetKeyData(u8_SesKey, 16, 0))
+        return false;
+
+    i_SV.GetData()[0] = 0x5A;
+    i_SV.GetData()[1] = 0xA5;
+    pi_Key->ClearIV();
+    return pi_Key->CalculateCmac(i_SV, u8_SesKey) && pi_SesMacKey->SetKeyData(u8_SesKey, 16, 0) &&
+           pi_SesMacKey->GenerateCmacSubkeys();
+}
+
 /**************************************************************************
     ATTENTION: 
     Be very careful when you change the PICC master key (for application {0x000000})!
@@ -257,6 +474,12 @@ bool Desfire::ChangeKey(byte u8_KeyNo, DESFireKey* pi_NewKey, DESFireKey* pi_Cur
         return false;
     }
 
+    if (mb_EV2Session)
+    {
+        Utils::Print("ChangeKey() requires an EV1 authentication\r\n");
+        return false;
+    }
+
     if (mu8_DebugLevel > 0)
     {
         Utils::Print("* SessKey IV:  ");
@@ -745,6 +968,7 @@ bool Desfire::SelectApplication(uint32_t u32_AppID)
 
     mu8_LastAuthKeyNo    = NOT_AUTHENTICATED; // set to invalid value (the selected app requires authentication)
     mu32_LastApplication = u32_AppID;
+    mb_EV2Session        = false;             // the EV2 transaction has ended
     return true;
 }
 
@@ -866,7 +1090,7 @@ bool Desfire::GetFileSettings(byte u8_FileID, DESFireFileSettings* pk_Settings)
 /**************************************************************************
     Creates a standard data file (a simple binary file) of a fixed size in the selected application.
 **************************************************************************/
-bool Desfire::CreateStdDataFile(byte u8_FileID, DESFireFilePermissions* pk_Permis, int s32_FileSize)
+bool Desfire::CreateStdDataFile(byte u8_FileID, DESFireFilePermissions* pk_Permis, int s32_FileSize, DESFireFileEncryption e_Encrypt)
 {
     if (mu8_DebugLevel > 0)
     {
@@ -879,7 +1103,7 @@ bool Desfire::CreateStdDataFile(byte u8_FileID, DESFireFilePermissions* pk_Permi
   
     TX_BUFFER(i_Params, 7);
     i_Params.AppendUint8 (u8_FileID);
-    i_Params.AppendUint8 (CM_PLAIN);
+    i_Params.AppendUint8 (e_Encrypt);
     i_Params.AppendUint16(u16_Permis);
     i_Params.AppendUint24(s32_FileSize); // only the low 3 bytes are used
 
@@ -910,8 +1134,9 @@ bool Desfire::DeleteFile(byte u8_FileID)
     If (s32_Offset + s32_Length > file length) you will get a LimitExceeded error.
     If the file permissins are not set to AR_FREE you must authenticate either
     with the key in e_ReadAccess or the key in e_ReadAndWriteAccess.   
+    e_Encrypt must be the communication mode of the file (see CreateStdDataFile())
 **************************************************************************/
-bool Desfire::ReadFileData(byte u8_FileID, int s32_Offset, int s32_Length, byte* u8_DataBuffer)
+bool Desfire::ReadFileData(byte u8_FileID, int s32_Offset, int s32_Length, byte* u8_DataBuffer, DESFireFileEncryption e_Encrypt)
 {
     if (mu8_DebugLevel > 0)
     {
@@ -920,25 +1145,56 @@ bool Desfire::ReadFileData(byte u8_FileID, int s32_Offset, int s32_Length, byte*
         Utils::Print(s8_Buf);
     }
 
-    // With intention this command does not use DF_INS_ADDITIONAL_FRAME because the CMAC must be calculated over all frames received.
-    // When reading a lot of data this could lead to a buffer overflow in mi_CmacBuffer.
+    if (e_Encrypt == CM_ENCRYPT)
+        return ReadFileDataEncrypted(u8_FileID, s32_Offset, s32_Length, u8_DataBuffer);
+
+    // EV1 calculates the CMAC for every command because it keeps the IV in sync.
+    // In EV2 secure messaging the communication mode of the file decides if a MAC is transmitted.
+    DESFireCmac e_Mac = (IsEV2Session() && e_Encrypt == CM_PLAIN) ? MAC_None : MAC_TmacRmac;
+    // Without a session key the card does not append a CMAC (see DataExchange())
+    bool b_RxMac = (e_Mac != MAC_None) && (mu8_LastAuthKeyNo != NOT_AUTHENTICATED);
+
+    // One command reads the whole block. The card sends the data in frames of up to MAX_FRAME_SIZE - 1 bytes:
+    // the first one answers DF_INS_READ_DATA, the following ones DF_INS_ADDITIONAL_FRAME (ST_MoreFrames chaining).
+    // The CMAC is calculated incrementally over all frames and verified once in the last frame.
     while (s32_Length > 0)
     {
-        int s32_Count = min(s32_Length, 48); // the maximum that can be transferred in one frame (must be a multiple of 16 if encryption is used)
+        // The card splits data + CMAC into frames. If the last frame would hold only a part of the CMAC,
+        // the last 1...7 bytes of data are read with a second command.
+        int s32_Count = s32_Length;
+        int s32_Tail  = b_RxMac ? (s32_Count + 8) % (MAX_FRAME_SIZE - 1) : 0;
+        if (s32_Tail > 0 && s32_Tail < 8)
+            s32_Count -= s32_Tail;
 
         TX_BUFFER(i_Params, 7);
         i_Params.AppendUint8 (u8_FileID);
         i_Params.AppendUint24(s32_Offset); // only the low 3 bytes are used
         i_Params.AppendUint24(s32_Count);  // only the low 3 bytes are used
-        
+        s32_Offset += s32_Count;
+        s32_Length -= s32_Count;
+
+        byte      u8_Command = DF_INS_READ_DATA;
+        TxBuffer* pi_Params  = &i_Params;
         DESFireStatus e_Status;
-        int s32_Read = DataExchange(DF_INS_READ_DATA, &i_Params, u8_DataBuffer, s32_Count, &e_Status, MAC_TmacRmac);
-        if (e_Status != ST_Success || s32_Read <= 0)
-            return false; // ST_MoreFrames is not allowed here!
+        do
+        {
+            // The received frame must fit into mu8_PacketBuffer (see DataExchange())
+            int s32_Read = DataExchange(u8_Command, pi_Params, u8_DataBuffer, min(s32_Count, PN532_PACKBUFFSIZE - 12), &e_Status, e_Mac);
+            if (s32_Read < 0 || (e_Status != ST_Success && e_Status != ST_MoreFrames))
+                return false;
+
+            s32_Count     -= s32_Read;
+            u8_DataBuffer += s32_Read;
+            u8_Command     = DF_INS_ADDITIONAL_FRAME;
+            pi_Params      = NULL;
+        }
+        while (e_Status == ST_MoreFrames);
 
-        s32_Length    -= s32_Read;
-        s32_Offset    += s32_Read;
-        u8_DataBuffer += s32_Read;
+        if (s32_Count != 0)
+        {
+            Utils::Print("ReadFileData(): Card sent less data than requested\r\n");
+            return false;
+        }
     }
     return true;
 }
@@ -947,8 +1203,9 @@ bool Desfire::ReadFileData(byte u8_FileID, int s32_Offset, int s32_Length, byte*
     Writes data to a Standard Data File or a Backup Data File.
     If the file permissins are not set to AR_FREE you must authenticate either
     with the key in e_WriteAccess or the key in e_ReadAndWriteAccess.
+    e_Encrypt must be the communication mode of the file (see CreateStdDataFile())
 **************************************************************************/
-bool Desfire::WriteFileData(byte u8_FileID, int s32_Offset, int s32_Length, const byte* u8_DataBuffer)
+bool Desfire::WriteFileData(byte u8_FileID, int s32_Offset, int s32_Length, const byte* u8_DataBuffer, DESFireFileEncryption e_Encrypt)
 {
     if (mu8_DebugLevel > 0)
     {
@@ -957,11 +1214,17 @@ bool Desfire::WriteFileData(byte u8_FileID, int s32_Offset, int s32_Length, cons
         Utils::Print(s8_Buf);
     }
 
+    if (e_Encrypt == CM_ENCRYPT)
+        return WriteFileDataEncrypted(u8_FileID, s32_Offset, s32_Length, u8_DataBuffer);
+
+    // See ReadFileData(). In EV2 secure messaging the truncated MAC (8 byte) is appended to each frame.
+    DESFireCmac e_Mac = (IsEV2Session() && e_Encrypt == CM_PLAIN) ? MAC_None : MAC_TmacRmac;
+    int s32_MacSize   = (IsEV2Session() && e_Mac != MAC_None) ? 8 : 0;
+
     // With intention this command does not use DF_INS_ADDITIONAL_FRAME because the CMAC must be calculated over all frames sent.
-    // When writing a lot of data this could lead to a buffer overflow in mi_CmacBuffer.
     while (s32_Length > 0)
     {
-        int s32_Count = min(s32_Length, MAX_FRAME_SIZE - 8); // DF_INS_WRITE_DATA + u8_FileID + s32_Offset + s32_Count = 8 bytes
+        int s32_Count = min(s32_Length, MAX_FRAME_SIZE - 8 - s32_MacSize); // DF_INS_WRITE_DATA + u8_FileID + s32_Offset + s32_Count = 8 bytes
               
         TX_BUFFER(i_Params, MAX_FRAME_SIZE); 
         i_Params.AppendUint8 (u8_FileID);
@@ -970,7 +1233,152 @@ bool Desfire::WriteFileData(byte u8_FileID, int s32_Offset, int s32_Length, cons
         i_Params.AppendBuf(u8_DataBuffer, s32_Count);
 
         DESFireStatus e_Status;
-        int s32_Read = DataExchange(DF_INS_WRITE_DATA, &i_Params, NULL, 0, &e_Status, MAC_TmacRmac);
+        int s32_Read = DataExchange(DF_INS_WRITE_DATA, &i_Params, NULL, 0, &e_Status, e_Mac);
+        if (e_Status != ST_Success || s32_Read != 0)
+            return false; // ST_MoreFrames is not allowed here!
+
+        s32_Length    -= s32_Count;
+        s32_Offset    += s32_Count;
+        u8_DataBuffer += s32_Count;
+    }
+    return true;
+}
+
+/**************************************************************************
+    This function is private
+    Reads a block of data from a file with communication mode CM_ENCRYPT.
+    The card sends Data + CRC32 (over data + status) + padding encrypted with the session key.
+    The ciphertext is received directly into u8_DataBuffer and decrypted in place.
+    Only the last block(s) that contain the CRC and the padding are decrypted in a small buffer on the stack,
+    so u8_DataBuffer needs no space for them.
+**************************************************************************/
+bool Desfire::ReadFileDataEncrypted(byte u8_FileID, int s32_Offset, int s32_Length, byte* u8_DataBuffer)
+{
+    if (mu8_LastAuthKeyNo == NOT_AUTHENTICATED)
+    {
+        Utils::Print("Not authenticated\r\n");
+        return false;
+    }
+    if (mb_EV2Session)
+    {
+        Utils::Print("CM_ENCRYPT requires an EV1 authentication\r\n");
+        return false;
+    }
+    if (s32_Length <= 0)
+        return true;
+
+    int s32_BlockSize = mpi_SessionKey->GetBlockSize();
+    int s32_CryptLen  = mpi_SessionKey->CalcPaddedBlockSize(s32_Length + 4);
+
+    TX_BUFFER(i_Params, 7);
+    i_Params.AppendUint8 (u8_FileID);
+    i_Params.AppendUint24(s32_Offset); // only the low 3 bytes are used
+    i_Params.AppendUint24(s32_Length); // only the low 3 bytes are used
+
+    // The data is received into u8_DataBuffer, the CRC and the padding behind it into u8_Tail.
+    byte u8_Tail[32];
+    int  s32_Received = 0;
+
+    byte      u8_Command = DF_INS_READ_DATA;
+    TxBuffer* pi_Params  = &i_Params;
+    DESFireStatus e_Status;
+    do
+    {
+        // The response is not MAC-ed: the command CMAC updates the IV, the decryption continues with it.
+        // The frame stays in mu8_PacketBuffer and is copied from there to its destination.
+        int s32_Read = DataExchange(u8_Command, pi_Params, NULL, min(s32_CryptLen - s32_Received, PN532_PACKBUFFSIZE - 4), &e_Status, MAC_Tmac);
+        if (s32_Read < 0 || (e_Status != ST_Success && e_Status != ST_MoreFrames))
+            return false;
+
+        const byte* pu8_Frame = mu8_PacketBuffer + 4;
+        int s32_Data = max(0, min(s32_Read, s32_Length - s32_Received));
+        memcpy(u8_DataBuffer + s32_Received, pu8_Frame, s32_Data);
+        memcpy(u8_Tail + max(0, s32_Received - s32_Length), pu8_Frame + s32_Data, s32_Read - s32_Data);
+
+        s32_Received += s32_Read;
+        u8_Command    = DF_INS_ADDITIONAL_FRAME;
+        pi_Params     = NULL;
+    }
+    while (e_Status == ST_MoreFrames);
+
+    if (s32_Received != s32_CryptLen)
+    {
+        Utils::Print("ReadFileData(): Invalid length of encrypted data\r\n");
+        return false;
+    }
+
+    // The blocks that contain only data are decrypted in place
+    int s32_Full = (s32_Length / s32_BlockSize) * s32_BlockSize;
+    if (s32_Full > 0 && !mpi_SessionKey->CryptDataCBC(CBC_RECEIVE, KEY_DECIPHER, u8_DataBuffer, u8_DataBuffer, s32_Full))
+        return false;
+
+    // The remaining 1 or 2 blocks contain the rest of the data, the CRC and the padding
+    byte u8_Last[32];
+    int  s32_Rest = s32_Length - s32_Full;
+    int  s32_Last = s32_CryptLen - s32_Full;
+    memcpy(u8_Last, u8_DataBuffer + s32_Full, s32_Rest);
+    memcpy(u8_Last + s32_Rest, u8_Tail, s32_CryptLen - s32_Length);
+    if (!mpi_SessionKey->CryptDataCBC(CBC_RECEIVE, KEY_DECIPHER, u8_Last, u8_Last, s32_Last))
+        return false;
+    memcpy(u8_DataBuffer + s32_Full, u8_Last, s32_Rest);
+
+    // The CRC must be calculated over the data + the status byte appended
+    byte u8_Status = ST_Success;
+    uint32_t u32_Crc1 = (uint32_t)u8_Last[s32_Rest] | ((uint32_t)u8_Last[s32_Rest + 1] << 8) | ((uint32_t)u8_Last[s32_Rest + 2] << 16) | ((uint32_t)u8_Last[s32_Rest + 3] << 24);
+    uint32_t u32_Crc2 = Utils::CalcCrc32(u8_DataBuffer, s32_Length, &u8_Status, 1);
+
+    bool b_Padding = true;
+    for (int i=s32_Rest + 4; i<s32_Last; i++)
+    {
+        b_Padding &= (u8_Last[i] == 0x00);
+    }
+
+    if (u32_Crc1 != u32_Crc2 || !b_Padding)
+    {
+        Utils::Print("Invalid CRC\r\n");
+        return false;
+    }
+    return true;
+}
+
+/**************************************************************************
+    This function is private
+    Writes data to a file with communication mode CM_ENCRYPT.
+    DataExchange() appends the CRC32 (over command + header + data), pads and encrypts the data.
+    The header (file, offset, length) is not encrypted.
+**************************************************************************/
+bool Desfire::WriteFileDataEncrypted(byte u8_FileID, int s32_Offset, int s32_Length, const byte* u8_DataBuffer)
+{
+    if (mu8_LastAuthKeyNo == NOT_AUTHENTICATED)
+    {
+        Utils::Print("Not authenticated\r\n");
+        return false;
+    }
+    if (mb_EV2Session)
+    {
+        Utils::Print("CM_ENCRYPT requires an EV1 authentication\r\n");
+        return false;
+    }
+
+    // Header (8 bytes) + encrypted data + CRC must fit into one frame
+    int s32_BlockSize = mpi_SessionKey->GetBlockSize();
+    int s32_MaxCount  = ((MAX_FRAME_SIZE - 8) / s32_BlockSize) * s32_BlockSize - 4;
+
+    while (s32_Length > 0)
+    {
+        int s32_Count = min(s32_Length, s32_MaxCount);
+
+        TX_BUFFER(i_Command, 8);
+        i_Command.AppendUint8 (DF_INS_WRITE_DATA);
+        i_Command.AppendUint8 (u8_FileID);
+        i_Command.AppendUint24(s32_Offset); // only the low 3 bytes are used
+        i_Command.AppendUint24(s32_Count);  // only the low 3 bytes are used
+
+        TX_BUFFER(i_Params, MAX_FRAME_SIZE);
+        i_Params.AppendBuf(u8_DataBuffer, s32_Count);
+
+        DESFireStatus e_Status;
+        int s32_Read = DataExchange(&i_Command, &i_Params, NULL, 0, &e_Status, MAC_TcryptRmac);
         if (e_Status != ST_Success || s32_Read != 0)
             return false; // ST_MoreFrames is not allowed here!
 
@@ -1050,11 +1458,15 @@ int Desfire::DataExchange(TxBuffer* pi_Command,               // in (command + p
     // - Status byte from PN532        (0 if no error)
     // - Status byte from Desfire card (0 if no error)
     // - data bytes ...
-    int s32_Overhead = 11; // Overhead added to payload = 11 bytes = 7 bytes for PN532 frame + 3 bytes for INDATAEXCHANGE response + 1 card status byte
+    int s32_Overhead = 4; // Overhead added to payload in mu8_PacketBuffer = 3 bytes for INDATAEXCHANGE response + 1 card status byte
     if (e_Mac & MAC_Rmac) s32_Overhead += 8; // + 8 bytes for CMAC
+
+    // EV2 secure messaging transmits the MAC of the command truncated to 8 bytes
+    bool b_EV2   = IsEV2Session();
+    int  s32_TxMac = (b_EV2 && (e_Mac & MAC_Tmac)) ? 8 : 0;
   
     // mu8_PacketBuffer is used for input and output
-    if (2 + pi_Command->GetCount() + pi_Params->GetCount() > PN532_PACKBUFFSIZE || s32_Overhead + s32_RecvSize > PN532_PACKBUFFSIZE)    
+    if (2 + pi_Command->GetCount() + pi_Params->GetCount() + s32_TxMac > PN532_PACKBUFFSIZE || s32_Overhead + s32_RecvSize > PN532_PACKBUFFSIZE)    
     {
         Utils::Print("DataExchange(): Invalid parameters\r\n");
         return -1;
@@ -1067,6 +1479,12 @@ int Desfire::DataExchange(TxBuffer* pi_Command,               // in (command + p
             Utils::Print("Not authenticated\r\n");
             return -1;
         }
+        // The encrypted communication mode of EV2 secure messaging is not implemented
+        if (b_EV2)
+        {
+            Utils::Print("Not supported with EV2 secure messaging\r\n");
+            return -1;
+        }
     }
 
     if (e_Mac & MAC_Tcrypt) // CRC and encrypt pi_Params
@@ -1107,18 +1525,26 @@ int Desfire::DataExchange(TxBuffer* pi_Command,               // in (command + p
     byte u8_Command = pi_Command->GetData()[0];
 
     byte u8_CalcMac[16];
-    if ((e_Mac & MAC_Tmac) &&                       // Calculate the TX CMAC only if the caller requests it 
-        (u8_Command != DF_INS_ADDITIONAL_FRAME) &&  // In case of DF_INS_ADDITIONAL_FRAME there are never parameters passed -> nothing to do here
-        (mu8_LastAuthKeyNo != NOT_AUTHENTICATED))   // No session key -> no CMAC calculation possible
-    { 
-        mi_CmacBuffer.Clear();
-        if (!mi_CmacBuffer.AppendBuf(pi_Command->GetData(), pi_Command->GetCount()) ||
-            !mi_CmacBuffer.AppendBuf(pi_Params ->GetData(), pi_Params ->GetCount()))
+    if (s32_TxMac > 0 && u8_Command != DF_INS_ADDITIONAL_FRAME)
+    {
+        // EV2: MAC over Cmd + CmdCtr + TI + command header + command data
+        if (!EV2MacBegin(u8_Command, mu16_EV2CmdCtr) ||
+            !mi_EV2MacKey.CmacUpdate(pi_Command->GetData() + 1, pi_Command->GetCount() - 1) ||
+            !mi_EV2MacKey.CmacUpdate(pi_Params ->GetData(),     pi_Params ->GetCount()) ||
+            !EV2MacFinal(u8_CalcMac))
             return -1;
-      
+    }
+    else if ((e_Mac & MAC_Tmac) &&                       // Calculate the TX CMAC only if the caller requests it 
+             (u8_Command != DF_INS_ADDITIONAL_FRAME) &&  // In case of DF_INS_ADDITIONAL_FRAME there are never parameters passed -> nothing to do here
+             (mu8_LastAuthKeyNo != NOT_AUTHENTICATED) && // No session key -> no CMAC calculation possible
+             !b_EV2)
+    { 
         // The CMAC must be calculated here although it is not transmitted, because it maintains the IV up to date.
         // The initialization vector must always be correct otherwise the card will give an integrity error the next time the session key is used.
-        if (!mpi_SessionKey->CalculateCmac(mi_CmacBuffer, u8_CalcMac))
+        mpi_SessionKey->CmacBegin();
+        if (!mpi_SessionKey->CmacUpdate(pi_Command->GetData(), pi_Command->GetCount()) ||
+            !mpi_SessionKey->CmacUpdate(pi_Params ->GetData(), pi_Params ->GetCount()) ||
+            !mpi_SessionKey->CmacFinal(u8_CalcMac))
             return -1;
 
         if (mu8_DebugLevel > 1)
@@ -1138,13 +1564,16 @@ int Desfire::DataExchange(TxBuffer* pi_Command,               // in (command + p
     memcpy(mu8_PacketBuffer + P, pi_Params->GetData(),  pi_Params->GetCount());
     P += pi_Params->GetCount();
 
-    if (!SendCommandCheckAck(mu8_PacketBuffer, P))
-        return -1;
+    if (s32_TxMac > 0 && u8_Command != DF_INS_ADDITIONAL_FRAME)
+    {
+        memcpy(mu8_PacketBuffer + P, u8_CalcMac, 8);
+        P += 8;
+    }
 
-    byte s32_Len = ReadData(mu8_PacketBuffer, s32_RecvSize + s32_Overhead);
+    int s32_Len = ExecuteCommand(mu8_PacketBuffer, P);
 
-    // ReadData() returns 3 byte if status error from the PN532
-    // ReadData() returns 4 byte if status error from the Desfire card
+    // ExecuteCommand() returns 3 byte if status error from the PN532
+    // ExecuteCommand() returns 4 byte if status error from the Desfire card
     if (s32_Len < 3 || mu8_PacketBuffer[1] != PN532_COMMAND_INDATAEXCHANGE + 1)
     {
         Utils::Print("DataExchange() failed\r\n");
@@ -1175,26 +1604,63 @@ int Desfire::DataExchange(TxBuffer* pi_Command,               // in (command + p
 
     s32_Len -= 4; // 3 bytes for INDATAEXCHANGE response + 1 byte card status
 
+    // EV2: The MAC is calculated over RC + (CmdCtr + 1) + TI + response data of all frames and truncated to 8 bytes.
+    // Each completed command increments the Command Counter, also commands without MAC.
+    if (b_EV2 && (u8_CardStatus == ST_Success || u8_CardStatus == ST_MoreFrames))
+    {
+        if (e_Mac & MAC_Rmac)
+        {
+            if (u8_Command != DF_INS_ADDITIONAL_FRAME && !EV2MacBegin(ST_Success, mu16_EV2CmdCtr + 1))
+                return -1;
+
+            if (u8_CardStatus == ST_MoreFrames)
+            {
+                if (!mi_EV2MacKey.CmacUpdate(mu8_PacketBuffer + 4, s32_Len))
+                    return -1;
+            }
+            else
+            {
+                if (s32_Len < 8)
+                {
+                    Utils::Print("MAC missing\r\n");
+                    return -1;
+                }
+                s32_Len -= 8;
+                if (!mi_EV2MacKey.CmacUpdate(mu8_PacketBuffer + 4, s32_Len) || !EV2MacFinal(u8_CalcMac))
+                    return -1;
+
+                if (memcmp(mu8_PacketBuffer + 4 + s32_Len, u8_CalcMac, 8) != 0)
+                {
+                    Utils::Print("CMAC Mismatch\r\n");
+                    return -1;
+                }
+            }
+        }
+
+        if (u8_CardStatus == ST_Success)
+            mu16_EV2CmdCtr++;
+    }
     // A CMAC may be appended to the end of the frame.
     // The CMAC calculation is important because it maintains the IV of the session key up to date.
     // If the IV is out of sync with the IV in the card, the next encryption with the session key will result in an Integrity Error.
-    if ((e_Mac & MAC_Rmac) &&                                              // Calculate RX CMAC only if the caller requests it
+    else if ((e_Mac & MAC_Rmac) &&                                              // Calculate RX CMAC only if the caller requests it
         (u8_CardStatus == ST_Success || u8_CardStatus == ST_MoreFrames) && // In case of an error there is no CMAC in the response
         (mu8_LastAuthKeyNo != NOT_AUTHENTICATED))                          // No session key -> no CMAC calculation possible
     {
         // For example GetCardVersion() calls DataExchange() 3 times:
-        // 1. u8_Command = DF_INS_GET_VERSION      -> clear CMAC buffer + append received data
-        // 2. u8_Command = DF_INS_ADDITIONAL_FRAME -> append received data
-        // 3. u8_Command = DF_INS_ADDITIONAL_FRAME -> append received data
+        // 1. u8_Command = DF_INS_GET_VERSION      -> start a new CMAC + add received data
+        // 2. u8_Command = DF_INS_ADDITIONAL_FRAME -> add received data
+        // 3. u8_Command = DF_INS_ADDITIONAL_FRAME -> add received data + status, verify the CMAC
+        // The received data is MAC-ed directly in mu8_PacketBuffer, so the length of a multi frame response is not limited.
         if (u8_Command != DF_INS_ADDITIONAL_FRAME)
         {
-            mi_CmacBuffer.Clear();
+            mpi_SessionKey->CmacBegin();
         }
 
         // This is an intermediate frame. More frames will follow. There is no CMAC in the response yet.
         if (u8_CardStatus == ST_MoreFrames)
         {
-            if (!mi_CmacBuffer.AppendBuf(mu8_PacketBuffer + 4, s32_Len))
+            if (!mpi_SessionKey->CmacUpdate(mu8_PacketBuffer + 4, s32_Len))
                 return -1;
         }
         
@@ -1206,11 +1672,9 @@ int Desfire::DataExchange(TxBuffer* pi_Command,               // in (command + p
             byte* u8_RxMac = mu8_PacketBuffer + 4 + s32_Len;
             
             // The CMAC is calculated over the RX data + the status byte appended to the END of the RX data!
-            if (!mi_CmacBuffer.AppendBuf(mu8_PacketBuffer + 4, s32_Len) ||
-                !mi_CmacBuffer.AppendUint8(u8_CardStatus))
-                return -1;
-
-            if (!mpi_SessionKey->CalculateCmac(mi_CmacBuffer, u8_CalcMac))
+            if (!mpi_SessionKey->CmacUpdate(mu8_PacketBuffer + 4, s32_Len) ||
+                !mpi_SessionKey->CmacUpdate(&u8_CardStatus, 1) ||
+                !mpi_SessionKey->CmacFinal(u8_CalcMac))
                 return -1;
 
             if (mu8_DebugLevel > 1)
@@ -1253,6 +1717,46 @@ int Desfire::DataExchange(TxBuffer* pi_Command,               // in (command + p
     return s32_Len;
 }
 
+/**************************************************************************
+    This function is private
+    Starts the EV2 MAC over u8_Head (command or response code) + Command Counter + Transaction Identifier.
+    The CBC of the MAC always starts with a zero IV.
+**************************************************************************/
+bool Desfire::EV2MacBegin(byte u8_Head, uint16_t u16_CmdCtr)
+{
+    byte u8_Ctr[2] = { (byte)u16_CmdCtr, (byte)(u16_CmdCtr >> 8) }; // LSB first
+    mi_EV2MacKey.ClearIV();
+    mi_EV2MacKey.CmacBegin();
+    return mi_EV2MacKey.CmacUpdate(&u8_Head, 1) &&
+           mi_EV2MacKey.CmacUpdate(u8_Ctr,   2) &&
+           mi_EV2MacKey.CmacUpdate(mu8_EV2TI, 4);
+}
+
+/**************************************************************************
+    This function is private
+    Finishes the EV2 MAC and truncates it to the transmitted MACt (see TruncateEV2Mac()).
+**************************************************************************/
+bool Desfire::EV2MacFinal(byte u8_MacT[8])
+{
+    byte u8_Mac[16];
+    if (!mi_EV2MacKey.CmacFinal(u8_Mac))
+        return false;
+
+    TruncateEV2Mac(u8_Mac, u8_MacT);
+    return true;
+}
+
+/**************************************************************************
+    The EV2 MACt consists of the 8 bytes at the odd positions (S1, S3,... S15) of the CMAC.
+**************************************************************************/
+void Desfire::TruncateEV2Mac(const byte u8_Mac[16], byte u8_MacT[8])
+{
+    for (int i=0; i<8; i++)
+    {
+        u8_MacT[i] = u8_Mac[2*i + 1];
+    }
+}
+
 // Checks the status byte that is returned from the card
 bool Desfire::CheckCardStatus(DESFireStatus e_Status)
 {
@@ -62,6 +62,11 @@
 #define DFEV1_INS_GET_ISO_FILE_IDS        0x61
 #define DFEV1_INS_SET_CONFIGURATION       0x5C
 
+// -------- Desfire EV2 instructions ----------
+
+#define DFEV2_INS_AUTHENTICATE_EV2_FIRST     0x71
+#define DFEV2_INS_AUTHENTICATE_EV2_NON_FIRST 0x77
+
 // ---------- ISO7816 instructions ------------
 
 #define ISO7816_INS_EXTERNAL_AUTHENTICATE 0x82
@@ -203,8 +208,8 @@ struct DESFireFilePermissions
 enum DESFireFileEncryption
 {
     CM_PLAIN   = 0x00,
-    CM_MAC     = 0x01,   // not implemented (Plain data transfer with additional MAC)
-    CM_ENCRYPT = 0x03,   // not implemented (Does not make data stored on the card more secure. Only encrypts the transfer between Teensy and the card)
+    CM_MAC     = 0x01,   // Plain data transfer with additional MAC (the same as CM_PLAIN after an EV1 authentication, in EV2 secure messaging only CM_MAC is MAC-ed)
+    CM_ENCRYPT = 0x03,   // Data + CRC32 encrypted with the session key (Does not make data stored on the card more secure. Only encrypts the transfer between Teensy and the card)
 };
 
 enum DESFireFileType
@@ -241,7 +246,7 @@ enum DESFireCmac
 {
     MAC_None   = 0,
     // Transmit data:
-    MAC_Tmac   = 1, // The CMAC must be calculated for the TX data sent to the card although this Tx CMAC is not transmitted
+    MAC_Tmac   = 1, // The CMAC must be calculated for the TX data sent to the card although this Tx CMAC is not transmitted (EV2: the truncated MAC is transmitted)
     MAC_Tcrypt = 2, // To the parameters sent to the card a CRC32 must be appended and then they must be encrypted with the session key    
     // Receive data:
     MAC_Rmac   = 4, // The CMAC must be calculated for the RX data received from the card. If status == ST_Success -> verify the CMAC in the response
@@ -263,6 +268,8 @@ class Desfire : public PN532
     bool GetFreeMemory(uint32_t* pu32_Memory);
     // ---------------------    
     bool Authenticate (byte u8_KeyNo, DESFireKey* pi_Key);
+    bool AuthenticateEV2First   (byte u8_KeyNo, AES* pi_Key);
+    bool AuthenticateEV2NonFirst(byte u8_KeyNo, AES* pi_Key);
     bool ChangeKey    (byte u8_KeyNo, DESFireKey* pi_NewKey, DESFireKey* pi_CurKey);
     bool GetKeyVersion(byte u8_KeyNo, byte* pu8_Version);
     bool GetKeySettings   (DESFireKeySettings* pe_Settg, byte* pu8_KeyCount, DESFireKeyType* pe_KeyType);
@@ -277,14 +284,21 @@ class Desfire : public PN532
     bool GetFileIDs       (byte* u8_FileIDs, byte* pu8_FileCount);
     bool GetFileSettings  (byte u8_FileID, DESFireFileSettings* pk_Settings);
     bool DeleteFile       (byte u8_FileID);
-    bool CreateStdDataFile(byte u8_FileID, DESFireFilePermissions* pk_Permis, int s32_FileSize);
-    bool ReadFileData     (byte u8_FileID, int s32_Offset, int s32_Length, byte* u8_DataBuffer);
-    bool WriteFileData    (byte u8_FileID, int s32_Offset, int s32_Length, const byte* u8_DataBuffer);
+    bool CreateStdDataFile(byte u8_FileID, DESFireFilePermissions* pk_Permis, int s32_FileSize, DESFireFileEncryption e_Encrypt = CM_PLAIN);
+    bool ReadFileData     (byte u8_FileID, int s32_Offset, int s32_Length, byte* u8_DataBuffer, DESFireFileEncryption e_Encrypt = CM_PLAIN);
+    bool WriteFileData    (byte u8_FileID, int s32_Offset, int s32_Length, const byte* u8_DataBuffer, DESFireFileEncryption e_Encrypt = CM_PLAIN);
 	bool ReadFileValue    (byte u8_FileID, uint32_t* pu32_Value);
     // ---------------------
     bool SwitchOffRfField();  // overrides PN532::SwitchOffRfField()
+    void OnCardReset();       // overrides PN532::OnCardReset()
+    uint32_t GetSelectedApplication(); // 0x000000 = PICC level
+    byte GetAuthenticatedKeyNo();      // NOT_AUTHENTICATED if no session key exists
+    bool IsEV2Session();               // true if the session uses EV2 secure messaging
     bool Selftest();
     byte GetLastPN532Error(); // See comment for this function in CPP file
+    // ---------------------
+    static bool GenerateEV2SessionKeys(AES* pi_Key, const byte u8_RndA[16], const byte u8_RndB[16], AES* pi_SesEncKey, AES* pi_SesMacKey);
+    static void TruncateEV2Mac(const byte u8_Mac[16], byte u8_MacT[8]);
 
     DES  DES2_DEFAULT_KEY; // 2K3DES key with  8 zeroes {00,00,00,00,00,00,00,00}
     DES  DES3_DEFAULT_KEY; // 3K3DES key with 24 zeroes 
@@ -294,6 +308,11 @@ class Desfire : public PN532
     int  DataExchange(byte      u8_Command, TxBuffer* pi_Params, byte* u8_RecvBuf, int s32_RecvSize, DESFireStatus* pe_Status, DESFireCmac e_Mac);
     int  DataExchange(TxBuffer* pi_Command, TxBuffer* pi_Params, byte* u8_RecvBuf, int s32_RecvSize, DESFireStatus* pe_Status, DESFireCmac e_Mac);    
     bool CheckCardStatus(DESFireStatus e_Status);
+    bool AuthenticateEV2(byte u8_Command, byte u8_KeyNo, AES* pi_Key);
+    bool EV2MacBegin(byte u8_Head, uint16_t u16_CmdCtr);
+    bool EV2MacFinal(byte u8_MacT[8]);
+    bool ReadFileDataEncrypted (byte u8_FileID, int s32_Offset, int s32_Length, byte* u8_DataBuffer);
+    bool WriteFileDataEncrypted(byte u8_FileID, int s32_Offset, int s32_Length, const byte* u8_DataBuffer);
     bool SelftestKeyChange(uint32_t u32_Application, DESFireKey* pi_DefaultKey, DESFireKey* pi_NewKeyA, DESFireKey* pi_NewKeyB);
 
     byte          mu8_LastAuthKeyNo; // The last key which did a successful authetication (0xFF if not yet authenticated)
@@ -302,10 +321,11 @@ class Desfire : public PN532
     AES           mi_AesSessionKey;
     DES           mi_DesSessionKey;
     byte          mu8_LastPN532Error;
-
-    // Must have enough space to hold the entire response from DF_INS_GET_APPLICATION_IDS (84 byte) + CMAC padding
-    byte          mu8_CmacBuffer_Data[120]; 
-    TxBuffer      mi_CmacBuffer;
+    // EV2 secure messaging (mi_AesSessionKey = SesAuthENCKey)
+    bool          mb_EV2Session;   // the last authentication was AuthenticateEV2First / NonFirst
+    AES           mi_EV2MacKey;    // SesAuthMACKey
+    byte          mu8_EV2TI[4];    // Transaction Identifier from AuthenticateEV2First
+    uint16_t      mu16_EV2CmdCtr;  // Command Counter, incremented with each command / response pair
 };
 
 #endif
@@ -0,0 +1,106 @@
+#ifndef CARD_SCRIPT_H
+#define CARD_SCRIPT_H
+#include <Arduino.h>
+#include <Desfire.h>
+#include "KeyRing.h"
+
+// Maximum count of steps in one script (DesfireService::runScript())
+#define CARD_SCRIPT_MAX_STEPS  8
+
+enum CardOp {
+    CARD_OP_SELECT,     // select the application appId (the following steps work in this application)
+    CARD_OP_AUTH,       // authenticate key keyNo of the selected application with keyData
+    CARD_OP_READ_FILE,  // read length bytes at offset of a standard data file into data
+    CARD_OP_GET_VALUE   // read the value of a value file
+};
+
+enum CardStepStatus {
+    STEP_NOT_RUN,       // a step before has failed
+    STEP_OK,
+    STEP_SKIPPED,       // the session already fulfilled this step (no RF traffic)
+    STEP_FAILED
+};
+
+// One operation of a card script. The static functions build the steps:
+// const CardStep script[] = { CardStep::select(APP), CardStep::auth(1, KEY), CardStep::readFile(2, 0, 32, data) };
+struct CardStep {
+    CardOp op;
+    uint32_t appId;                  // CARD_OP_SELECT
+    uint8_t keyNo;                   // CARD_OP_AUTH
+    const uint8_t* keyData;          // CARD_OP_AUTH: 16 byte AES key (8 byte DES key if USE_AES is false)
+    KeyRing* keyRing;                // CARD_OP_AUTH: instead of keyData the key with the version of the card key
+    uint8_t fileId;                  // CARD_OP_READ_FILE, CARD_OP_GET_VALUE
+    uint16_t offset;                 // CARD_OP_READ_FILE
+    uint16_t length;                 // CARD_OP_READ_FILE
+    DESFireFileEncryption commMode;  // CARD_OP_READ_FILE: communication mode of the file
+    uint8_t* data;                   // CARD_OP_READ_FILE: receives length bytes
+
+    static CardStep select(uint32_t appId) {
+        CardStep step = make(CARD_OP_SELECT);
+        step.appId = appId;
+        return step;
+    }
+    static CardStep auth(uint8_t keyNo, const uint8_t* keyData) {
+        CardStep step = make(CARD_OP_AUTH);
+        step.keyNo   = keyNo;
+        step.keyData = keyData;
+        return step;
+    }
+    static CardStep auth(uint8_t keyNo, KeyRing* keyRing) {
+        CardStep step = make(CARD_OP_AUTH);
+        step.keyNo   = keyNo;
+        step.keyRing = keyRing;
+        return step;
+    }
+    static CardStep readFile(uint8_t fileId, uint16_t offset, uint16_t length, uint8_t* data, DESFireFileEncryption commMode = CM_PLAIN) {
+        CardStep step = make(CARD_OP_READ_FILE);
+        step.fileId   = fileId;
+        step.offset   = offset;
+        step.length   = length;
+        step.data     = data;
+        step.commMode = commMode;
+        return step;
+    }
+    static CardStep getValue(uint8_t fileId) {
+        CardStep step = make(CARD_OP_GET_VALUE);
+        step.fileId = fileId;
+        return step;
+    }
+
+private:
+    static CardStep make(CardOp op) {
+        CardStep step;
+        memset(&step, 0, sizeof(step));
+        step.op = op;
+        step.commMode = CM_PLAIN;
+        return step;
+    }
+};
+
+struct CardStepResult {
+    CardStepStatus status;
+    uint32_t micros;       // duration of the step
+    uint32_t value;        // CARD_OP_GET_VALUE: the value of the file
+};
+
+// The result of DesfireService::runScript()
+struct CardScriptResult {
+    bool ok;
+    int failedStep;        // -1 if all steps have succeeded, CARD_SCRIPT_MAX_STEPS if the script is too long
+    int stepCount;
+    uint32_t totalMicros;
+    uint32_t authCount;    // authentications that the script has executed
+    CardStepResult steps[CARD_SCRIPT_MAX_STEPS];
+};
+
+inline const char* getCardOpName(CardOp op) {
+    switch (op) {
+        case CARD_OP_SELECT:    return "select";
+        case CARD_OP_AUTH:      return "auth";
+        case CARD_OP_READ_FILE: return "read_file";
+        case CARD_OP_GET_VALUE: return "get_value";
+    }
+    return "unknown";
+}
+
+#endif
@@ -1,17 +1,34 @@
 #include "DesfireService.h"
 
 DesfireService::DesfireService(const byte* key, byte version) 
-: CardVersion(version) {
+: spiTransport(0), CardVersion(version) {
     if (key != nullptr) {
         memcpy(PICCMasterKey, key, sizeof(PICCMasterKey));
     }
 }
 
-bool DesfireService::begin(uint8_t PN532_SS, uint8_t PN532_RST) {
+bool DesfireService::begin(uint8_t PN532_SS, uint8_t PN532_RST, uint8_t PN532_IRQ, ePN532Timing timing, bool calibrate) {
+    spiTransport = PN532HardSpi(PN532_SS);
+    if (!begin(&spiTransport, PN532_RST, PN532_IRQ, timing)) {
+        return false;
+    }
+
+    spiClock = desfireReader.GetSpiClock();
+    if (calibrate) {
+        calibrateSpiClock();
+    }
+    Serial.printf("[INFO] PN532 SPI clock: %u Hz\n", spiClock);
+    return true;
+}
+
+// Same as above for a PN532 on another bus (PN532SoftSpi, PN532I2c, PN532Hsu). The transport must outlive this service.
+bool DesfireService::begin(PN532Transport* transport, uint8_t PN532_RST, uint8_t PN532_IRQ, ePN532Timing timing) {
     initSuccess = false;
     byte IC, VerHi, VerLo, Flags;
 
-    desfireReader.InitHardwareSPI(PN532_SS, PN532_RST);
+    desfireReader.Init(transport, PN532_RST);
+    desfireReader.SetIrqPin(PN532_IRQ);
+    desfireReader.SetTiming(timing);
     desfireReader.begin();
     if (!desfireReader.GetFirmwareVersion(&IC, &VerHi, &VerLo, &Flags)) {
         Serial.println("[ERROR] PN532 not responding");
@@ -20,58 +37,353 @@ bool DesfireService::begin(uint8_t PN532_SS, uint8_t PN532_RST) {
 
     Serial.printf("[OK] PN532 Found (Chip: PN5%02X, FW: %d.%d)\n", IC, VerHi, VerLo);
     desfireReader.SamConfig();
+    Serial.printf("[INFO] PN532 transport: %s timing\n", timing == TIMING_Fast ? "fast (burst)" : "safe");
+    if (desfireReader.GetSerialBaudRate() > 0) {
+        Serial.printf("[INFO] PN532 HSU baud rate: %u\n", desfireReader.GetSerialBaudRate());
+    }
     initSuccess = true;
     Serial.println("[OK] PN532 ready");
     return true;
 }
 
-bool DesfireService::authenticatePiccMaster() {
-    #if USE_AES
-        PICCKeyCipher.SetKeyData(PICCMasterKey, sizeof(PICCMasterKey), CardVersion);
-    #else
-        PICCKeyCipher.SetKeyData(PICCMasterKey, 8, CardVersion);
-    #endif
+// Steps the SPI clock up from SPI_CALIBRATION_STEP to PN532_MAX_SPI_CLOCK and keeps the fastest reliable
+// rate minus one step as safety margin. Returns the chosen clock which is also reported by getSpiClock().
+// If no rate is reliable the clock of the timing profile stays.
+uint32_t DesfireService::calibrateSpiClock() {
+    uint32_t baseClock = desfireReader.GetSpiClock();
+    uint32_t bestClock = 0;
+
+    for (uint32_t clock = SPI_CALIBRATION_STEP; clock <= PN532_MAX_SPI_CLOCK; clock += SPI_CALIBRATION_STEP) {
+        if (!desfireReader.SetSpiClock(clock)) {
+            Serial.println("[INFO] SPI clock calibration not supported by this transport");
+            return spiClock;
+        }
+        if (!verifySpiClock(SPI_CALIBRATION_ROUNDS)) {
+            Serial.printf("[INFO] PN532 SPI clock %u Hz not reliable\n", clock);
+            break;
+        }
+        bestClock = clock;
+    }
+
+    uint32_t chosen = bestClock > SPI_CALIBRATION_STEP ? bestClock - SPI_CALIBRATION_STEP : bestClock;
+    if (chosen == 0) {
+        desfireReader.SetSpiClock(baseClock);
+        Serial.printf("[ERROR] PN532 SPI clock calibration failed, keeping %u Hz\n", baseClock);
+        return spiClock;
+    }
+
+    desfireReader.SetSpiClock(chosen);
+    spiClock = chosen;
+    Serial.printf("[OK] PN532 SPI clock calibrated: %u Hz (fastest reliable: %u Hz)\n", chosen, bestClock);
+    return spiClock;
+}
+
+// Runs round trips at the current SPI clock. The Diagnose echo checks 128 bytes in both directions
+// in addition to the checksums of the frames.
+bool DesfireService::verifySpiClock(int rounds) {
+    byte IC, VerHi, VerLo, Flags;
+    for (int i = 0; i < rounds; i++) {
+        if (!desfireReader.GetFirmwareVersion(&IC, &VerHi, &VerLo, &Flags) || IC != 0x32) {
+            return false;
+        }
+        if (!desfireReader.TestCommunication()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Non-blocking card detection for loop(): starts InListPassiveTarget (or InAutoPoll) on the PN532 and
+// returns true once a card has been found. Returns false immediately while no card is present.
+// Each card is reported once: while the card of the last tap stays in the field it is only checked
+// for presence (every PRESENCE_CHECK_INTERVAL ms), a new card is detected as soon as it has left.
+bool DesfireService::pollCard(byte* uid, byte* uidLength, eCardType* cardType) {
+    if (cardActive) {
+        if (!desfireReader.IsCommandPending()) {
+            if (millis() - lastPresenceCheck < PRESENCE_CHECK_INTERVAL)
+                return false;
+            lastPresenceCheck = millis();
+            if (!desfireReader.StartPresenceCheck()) {
+                cardActive = false;
+                return false;
+            }
+        }
+
+        bool present;
+        ePN532Result result = desfireReader.PollPresenceCheck(&present);
+        if (result == RESULT_Busy || (result == RESULT_Complete && present))
+            return false;
+        cardActive = false; // the card has left the field, the detection starts with the next call
+        return false;
+    }
+
+    if (!desfireReader.IsCommandPending()) {
+        bool started = autoPoll ? desfireReader.StartAutoPoll(0xFF, autoPollPeriod)
+                                : desfireReader.StartPassiveTargetID();
+        if (!started) {
+            Serial.println("[ERROR] Card detection could not be started");
+            return false;
+        }
+    }
+
+    ePN532Result result = autoPoll ? desfireReader.PollAutoPoll(uid, uidLength, cardType)
+                                   : desfireReader.PollPassiveTargetID(uid, uidLength, cardType);
+    if (result != RESULT_Complete || *uidLength == 0)
+        return false;
 
-    // select root (PICC) application
-    if(!desfireReader.SelectApplication(0x000000)) {
-        Serial.println("[ERROR] Select PICC application failed");
+    // The detection command waits until a card enters the field, PHASE_DETECT starts when its response is ready
+    recordPhase(PHASE_DETECT, desfireReader.GetResponseReadyTime());
+    onCardDetected(uid, *uidLength, *cardType);
+    return true;
+}
+
+// Blocking card detection with ReadPassiveTargetID(), otherwise the same as pollCard()
+bool DesfireService::readCard(byte* uid, byte* uidLength, eCardType* cardType) {
+    if (!desfireReader.ReadPassiveTargetID(uid, uidLength, cardType) || *uidLength == 0)
+        return false;
+
+    recordPhase(PHASE_DETECT, desfireReader.GetResponseReadyTime());
+    onCardDetected(uid, *uidLength, *cardType);
+    return true;
+}
+
+// Starts the session of the detected card and negotiates the bit rate
+void DesfireService::onCardDetected(const byte* uid, byte uidLength, eCardType cardType) {
+    cardActive = true;
+    if (uidLength != sessionUidLength || memcmp(uid, sessionUid, uidLength) != 0) {
+        endSession(); // another card, the session of the last one must never be reused
+        memcpy(sessionUid, uid, uidLength);
+        sessionUidLength = uidLength;
+    }
+    if ((cardType & CARD_Desfire) && maxBitRate > BITRATE_106) {
+        uint32_t start = micros();
+        desfireReader.NegotiateBitRate(maxBitRate);
+        recordPhase(PHASE_BITRATE, start);
+        // Printed only when the rate changes, Serial output would delay every tap
+        if (desfireReader.GetBitRate() != reportedBitRate) {
+            reportedBitRate = desfireReader.GetBitRate();
+            Serial.printf("[INFO] RF bit rate: %u kbps\n", getBitRate());
+        }
+    }
+    lastPresenceCheck = millis();
+}
+
+// Blocking presence check of the card of the last tap
+bool DesfireService::isCardPresent() {
+    bool present = false;
+    if (!cardActive || !desfireReader.CheckPresence(&present)) {
+        return false;
+    }
+    return present;
+}
+
+// The next pollCard() detects the card again even if it has not left the field (e.g. to retry a failed read)
+void DesfireService::releaseCard() {
+    if (desfireReader.IsCommandPending()) {
+        desfireReader.AbortCommand();
+    }
+    cardActive = false;
+}
+
+// Lets the PN532 poll for cards by itself (InAutoPoll). The PN532 only answers when a card is found,
+// so an idle loop() causes no SPI traffic with the IRQ pin and one status read per poll interval without.
+// period: 1 ... 15 (x 150 ms) between the polls while no card is present.
+void DesfireService::setAutoPoll(bool enable, uint8_t period) {
+    if (desfireReader.IsCommandPending()) {
+        desfireReader.AbortCommand(); // the next pollCard() starts the new detection mode
+    }
+    autoPoll = enable;
+    autoPollPeriod = constrain(period, 1, 15);
+}
+
+// Highest RF bit rate (ePN532BitRate) that pollCard() negotiates with a DESFire card after the detection.
+// BITRATE_106 disables the negotiation. If a higher rate fails pollCard() falls back to the next lower one.
+void DesfireService::setMaxBitRate(byte rate) {
+    maxBitRate = min(rate, (byte)BITRATE_848);
+}
+
+// Sends the RF timeouts and retries of a latency profile to the PN532 (see ePN532RfProfile).
+// Can be called at any time: a pending card detection is aborted and restarted by the next pollCard().
+bool DesfireService::setRfProfile(ePN532RfProfile profile) {
+    if (desfireReader.IsCommandPending()) {
+        desfireReader.AbortCommand();
+    }
+    if (!desfireReader.SetRfConfig(profile)) {
+        Serial.printf("[ERROR] RF profile %s could not be set\n", PN532::GetRfProfileName(profile));
         return false;
     }
+    rfProfile = profile;
+    Serial.printf("[OK] RF profile: %s\n", PN532::GetRfProfileName(profile));
+    return true;
+}
 
-    if(!desfireReader.Authenticate(0, &PICCKeyCipher)) {
+// Same as above with the name of the profile ("fast_gate", "long_range", "conservative")
+bool DesfireService::setRfProfile(const char* name) {
+    ePN532RfProfile profile;
+    if (!PN532::FindRfProfile(name, &profile)) {
+        Serial.printf("[ERROR] Unknown RF profile: %s\n", name);
+        return false;
+    }
+    return setRfProfile(profile);
+}
+
+// Authenticates with the PICC master key unless this session already exists
+bool DesfireService::authenticatePiccMaster() {
+    uint32_t start = micros();
+    uint32_t auths = authCount;
+    bool ok = piccKeyRing != nullptr ? ensureSession(0x000000, 0, piccKeyRing, &PICCKeyCipher)
+                                     : ensureSession(0x000000, 0, PICCMasterKey, USE_AES ? 16 : 8, &PICCKeyCipher);
+    if(!ok) {
         Serial.println("[ERROR] PICC Master Key authentication failed");
         return false;
     }
+    if (authCount != auths) recordPhase(PHASE_AUTH_PICC, start);
     Serial.println("[OK] PICC Master Key authentication successful");
     return true;
 }
 
-bool DesfireService::authenticateApp(const uint32_t AppId) {
-    memcpy(AppMasterKey, AppMasterKey, sizeof(AppMasterKey));
-    #if USE_AES
-        AppKeyCipher.SetKeyData(AppMasterKey, sizeof(AppMasterKey), CardVersion);
-    #else
-        AppKeyCipher.SetKeyData(AppMasterKey, 8, CardVersion);
-    #endif
+// The diversified application master keys are used by authenticateApp() (not by the card scripts).
+// Their type must fit AppKeyCipher: AES keys with USE_AES, 2K3DES / 3K3DES keys without. nullptr = fixed key
+bool DesfireService::setKeyDiversifier(KeyDiversifier* diversifier) {
+    if (diversifier != nullptr) {
+        if (!diversifier->isEnabled()) {
+            Serial.println("[ERROR] Key diversification has not been started (KeyDiversifier::begin())");
+            return false;
+        }
+        DESFireKeyType keyType = diversifier->getKeyType();
+        if ((keyType == DF_KEY_AES) != USE_AES) {
+            Serial.printf("[ERROR] Key diversification with %s keys does not match the %s application key\n",
+                          DESFireKey::GetKeyTypeAsString(keyType, diversifier->getKeySize()), USE_AES ? "AES" : "3DES");
+            return false;
+        }
+    }
+    appKeyDiversifier = diversifier;
+    return true;
+}
 
-    if(!desfireReader.SelectApplication(AppId)) {
-        Serial.println("[ERROR] Select application failed");
-        return false;
+// Authenticates with the application master key unless this session already exists.
+// With a KeyDiversifier the key of the card is derived from the UID of the last pollCard() and the application.
+bool DesfireService::authenticateApp(const uint32_t AppId) {
+    uint32_t start = micros();
+    uint32_t auths = authCount;
+    size_t keyLen = USE_AES ? 16 : 8;
+    if (appKeyDiversifier != nullptr) {
+        if (sessionUidLength == 0 || !appKeyDiversifier->getKey(sessionUid, sessionUidLength, AppId, AppMasterKey)) {
+            Serial.println("[ERROR] Application Key diversification failed");
+            return false;
+        }
+        keyLen = appKeyDiversifier->getKeySize();
     }
-    if(!desfireReader.Authenticate(0, &AppKeyCipher)) {
+    if(!ensureSession(AppId, 0, AppMasterKey, keyLen, &AppKeyCipher)) {
         Serial.println("[ERROR] Application Key authentication failed");
         return false;
     }
 
+    if (authCount != auths) recordPhase(PHASE_AUTH_APP, start);
     Serial.printf("[OK] Application 0x%06X Key authentication successful\n", AppId);
     return true;
 }
 
-String DesfireService::readDesfireFile(uint8_t fileId, uint16_t length) {
-    if (!desfireReader.ReadFileData(fileId, 0, length, buf)) {
+// Makes sure that the card has a session with the given key in the given application.
+// Only the missing steps are executed: SelectApplication() if another application is selected
+// and Authenticate() if the session key belongs to another key (or the card has been activated anew).
+// A read with the file access key needs no PICC or application master key authentication before.
+bool DesfireService::openSession(uint32_t appId, uint8_t keyNo, const uint8_t* keyData) {
+    return ensureSession(appId, keyNo, keyData, USE_AES ? 16 : 8, &keyIndexCipher);
+}
+
+// Same as above with the key of the ring that has the version of the key on the card
+bool DesfireService::openSession(uint32_t appId, uint8_t keyNo, KeyRing* keyRing) {
+    return ensureSession(appId, keyNo, keyRing, &keyIndexCipher);
+}
+
+// During a key rollout the card is asked for the version of its key (GetKeyVersion needs no authentication),
+// so the authentication never fails with the key of another version. A ring with one key needs no GetKeyVersion.
+bool DesfireService::ensureSession(uint32_t appId, uint8_t keyNo, KeyRing* keyRing, DESFireKey* cipher) {
+    if (keyRing->contains(sessionKey) &&
+        desfireReader.GetSelectedApplication() == appId &&
+        desfireReader.GetAuthenticatedKeyNo() == keyNo) {
+        return true;
+    }
+
+    const uint8_t* keyData = keyRing->getOnlyKey();
+    if (keyData == nullptr) {
+        if (desfireReader.GetSelectedApplication() != appId) {
+            endSession();
+            if (!desfireReader.SelectApplication(appId)) {
+                Serial.printf("[ERROR] Select application 0x%06X failed\n", appId);
+                return false;
+            }
+        }
+        byte version;
+        if (!desfireReader.GetKeyVersion(keyNo, &version)) {
+            Serial.printf("[ERROR] Get version of key %d failed\n", keyNo);
+            return false;
+        }
+        keyData = keyRing->getKey(version);
+        if (keyData == nullptr) {
+            keyRing->countUse(nullptr);
+            Serial.printf("[ERROR] Key %d has the unknown version 0x%02X\n", keyNo, version);
+            return false;
+        }
+    }
+
+    if (!ensureSession(appId, keyNo, keyData, USE_AES ? 16 : 8, cipher)) {
+        return false;
+    }
+    keyRing->countUse(keyData);
+    return true;
+}
+
+bool DesfireService::ensureSession(uint32_t appId, uint8_t keyNo, const uint8_t* keyData, size_t keyLen, DESFireKey* cipher) {
+    if (sessionKey == keyData &&
+        desfireReader.GetSelectedApplication() == appId &&
+        desfireReader.GetAuthenticatedKeyNo() == keyNo) {
+        return true;
+    }
+
+    endSession();
+    if (desfireReader.GetSelectedApplication() != appId && !desfireReader.SelectApplication(appId)) {
+        Serial.printf("[ERROR] Select application 0x%06X failed\n", appId);
+        return false;
+    }
+
+    cipher->SetKeyData(keyData, keyLen, CardVersion);
+    authCount++;
+    #if USE_AES
+        // Another key of the same application inside a running EV2 transaction: the shorter NonFirst authentication
+        if (useEV2) {
+            AES* aes = static_cast<AES*>(cipher);
+            bool ok = desfireReader.IsEV2Session() ? desfireReader.AuthenticateEV2NonFirst(keyNo, aes)
+                                                   : desfireReader.AuthenticateEV2First(keyNo, aes);
+            if (ok) sessionKey = keyData;
+            return ok;
+        }
+    #endif
+    if (!desfireReader.Authenticate(keyNo, cipher)) {
+        return false;
+    }
+    sessionKey = keyData;
+    return true;
+}
+
+// Reads a file with one authentication at most: the session of a previous call is reused
+// if it belongs to the same card, application and key.
+// commMode must be the communication mode of the file (CM_ENCRYPT: the data is decrypted and its CRC is checked).
+String DesfireService::readFile(uint32_t appId, uint8_t fileId, uint16_t length, uint8_t keyNo, const uint8_t* keyData, DESFireFileEncryption commMode) {
+    if (length > sizeof(buf)) {
         Serial.println("[ERROR] Read File Data failed");
         return String("");
     }
+    const CardStep steps[] = {
+        CardStep::select(appId),
+        CardStep::auth(keyNo, keyData),
+        CardStep::readFile(fileId, 0, length, buf, commMode),
+    };
+    CardScriptResult result;
+    if (!runScript(steps, &result)) {
+        return String("");
+    }
 
     Serial.printf("[OK] File %d Data (%d bytes): ", fileId, length);
     for (int i = 0; i < length; i++) {
@@ -79,17 +391,10 @@ String DesfireService::readDesfireFile(uint8_t fileId, uint16_t length) {
     }
     Utils::HexBufToAsciiBuf(buf, length, out, sizeof(out));
     String strData = String(out);
-    Serial.println(strData);
     return strData;
 }
 
-String DesfireService::readDesfireFile(uint8_t fileId, uint16_t length, uint8_t keyIndex, const uint8_t* keyData) {
-    size_t keyDataLen = USE_AES ? 16 : 8;
-
-    if (!authenticateWithIndex(keyIndex, keyData, keyDataLen)) {
-        Serial.printf("[ERROR] Authentication with key index %d failed\n", keyIndex);
-        return String("");
-    }
+String DesfireService::readDesfireFile(uint8_t fileId, uint16_t length) {
     if (!desfireReader.ReadFileData(fileId, 0, length, buf)) {
         Serial.println("[ERROR] Read File Data failed");
         return String("");
@@ -101,16 +406,113 @@ String DesfireService::readDesfireFile(uint8_t fileId, uint16_t length, uint8_t
     }
     Utils::HexBufToAsciiBuf(buf, length, out, sizeof(out));
     String strData = String(out);
+    Serial.println(strData);
     return strData;
 }
 
+// Reads a file of the selected application
+String DesfireService::readDesfireFile(uint8_t fileId, uint16_t length, uint8_t keyIndex, const uint8_t* keyData) {
+    return readFile(desfireReader.GetSelectedApplication(), fileId, length, keyIndex, keyData);
+}
+
+// Always runs a new authentication (e.g. to verify a key), the session of this key can be reused afterwards
 bool DesfireService::authenticateWithIndex(uint8_t keyIndex, const uint8_t* keyData, size_t keyLen) {
+    endSession();
     keyIndexCipher.SetKeyData(keyData, keyLen, CardVersion);
     Serial.printf("[INFO] Authenticating key index %d...\n", keyIndex);
+    authCount++;
     if (!desfireReader.Authenticate(keyIndex, &keyIndexCipher)) {
         Serial.printf("[ERROR] Authenticate key %d FAILED\n", keyIndex);
         return false;
     }
+    sessionKey = keyData;
     Serial.printf("[OK] Authenticate key %d OK\n", keyIndex);
     return true;
 }
+
+// Runs the steps of a card script in one pass and stops at the first step that fails.
+// Select and auth steps that the current session already fulfills are skipped without any RF traffic,
+// so a script always describes the complete access (select -> auth -> read) and costs only the missing round trips.
+// The data of read steps is received directly into the buffer of the step.
+bool DesfireService::runScript(const CardStep* steps, int count, CardScriptResult* result) {
+    memset(result, 0, sizeof(CardScriptResult));
+    result->failedStep = -1;
+    // A script must never succeed without having executed all of its steps
+    if (count > CARD_SCRIPT_MAX_STEPS) {
+        Serial.printf("[ERROR] Card script has %d steps (max %d)\n", count, CARD_SCRIPT_MAX_STEPS);
+        result->failedStep = CARD_SCRIPT_MAX_STEPS;
+        return false;
+    }
+    result->stepCount = count;
+    uint32_t authStart = authCount;
+    uint32_t scriptStart = micros();
+    uint32_t appId = desfireReader.GetSelectedApplication();
+
+    for (int i = 0; i < result->stepCount; i++) {
+        const CardStep& step = steps[i];
+        CardStepResult& stepResult = result->steps[i];
+        uint32_t stepStart = micros();
+        bool ok = true;
+        bool skipped = false;
+        switch (step.op) {
+            case CARD_OP_SELECT:
+                appId = step.appId;
+                skipped = (desfireReader.GetSelectedApplication() == appId);
+                if (!skipped) {
+                    endSession();
+                    ok = desfireReader.SelectApplication(appId);
+                }
+                break;
+            case CARD_OP_AUTH:
+                skipped = ((step.keyRing != nullptr ? step.keyRing->contains(sessionKey) : sessionKey == step.keyData) &&
+                           desfireReader.GetSelectedApplication() == appId &&
+                           desfireReader.GetAuthenticatedKeyNo() == step.keyNo);
+                if (!skipped) {
+                    ok = step.keyRing != nullptr ? ensureSession(appId, step.keyNo, step.keyRing, &keyIndexCipher)
+                                                 : ensureSession(appId, step.keyNo, step.keyData, USE_AES ? 16 : 8, &keyIndexCipher);
+                }
+                break;
+            case CARD_OP_READ_FILE:
+                ok = step.data != nullptr && desfireReader.ReadFileData(step.fileId, step.offset, step.length, step.data, step.commMode);
+                break;
+            case CARD_OP_GET_VALUE:
+                ok = desfireReader.ReadFileValue(step.fileId, &stepResult.value);
+                break;
+        }
+        stepResult.micros = micros() - stepStart;
+        stepResult.status = !ok ? STEP_FAILED : skipped ? STEP_SKIPPED : STEP_OK;
+        if (metrics && stepResult.status == STEP_OK) {
+            TapPhase phase = PHASE_READ_FILE;
+            switch (step.op) {
+                case CARD_OP_SELECT:    phase = PHASE_SELECT;    break;
+                case CARD_OP_AUTH:      phase = PHASE_AUTH_KEY;  break;
+                case CARD_OP_READ_FILE: phase = PHASE_READ_FILE; break;
+                case CARD_OP_GET_VALUE: phase = PHASE_GET_VALUE; break;
+            }
+            metrics->record(phase, stepResult.micros);
+        }
+        if (!ok) {
+            endSession(); // the IV of the session key may be out of sync now
+            result->failedStep = i;
+            Serial.printf("[ERROR] Card script step %d (%s) failed\n", i, getCardOpName(step.op));
+            break;
+        }
+    }
+
+    result->totalMicros = micros() - scriptStart;
+    result->authCount = authCount - authStart;
+    result->ok = (result->failedStep < 0);
+    return result->ok;
+}
+
+// Prints one line per step with its status and duration
+void DesfireService::printScriptResult(const CardStep* steps, const CardScriptResult* result) {
+    static const char* statusNames[] = { "not run", "ok", "skipped", "FAILED" };
+    for (int i = 0; i < result->stepCount; i++) {
+        const CardStepResult& stepResult = result->steps[i];
+        Serial.printf("[INFO]   %d %-9s %-7s %6.2f ms\n", i, getCardOpName(steps[i].op),
+                      statusNames[stepResult.status], stepResult.micros / 1000.0);
+    }
+    Serial.printf("[INFO]   script %s: %.2f ms, %u authentications\n", result->ok ? "ok" : "failed",
+                  result->totalMicros / 1000.0, (unsigned)result->authCount);
+}
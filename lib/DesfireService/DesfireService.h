@@ -4,22 +4,82 @@
 #include <Desfire.h>
 #include <DesFireKey.h>
 #include <Utils.h>
+#include "CardScript.h"
+#include "KeyDiversifier.h"
+#include "KeyRing.h"
+#include <TapMetrics.h>
 
 
 #define USE_AES    true 
 
+// SPI clock calibration in begin(): the clock is stepped up by SPI_CALIBRATION_STEP up to PN532_MAX_SPI_CLOCK.
+// Each step must pass SPI_CALIBRATION_ROUNDS round trips (GetFirmwareVersion + 128 byte Diagnose echo).
+// The chosen clock is one step below the fastest one that passed (safety margin).
+#define SPI_CALIBRATION_STEP    1000000
+#define SPI_CALIBRATION_ROUNDS  5
+
+// pollCard() checks in this interval (milliseconds) if the card of the last tap is still in the field
+#define PRESENCE_CHECK_INTERVAL  100
+
 class DesfireService {
 public:
     DesfireService(const byte* key = nullptr, const byte version = 0x00);
-    bool begin(uint8_t PN532_SS, uint8_t PN532_RST);
+    bool begin(uint8_t PN532_SS, uint8_t PN532_RST, uint8_t PN532_IRQ = PN532_NO_IRQ, ePN532Timing timing = TIMING_Safe, bool calibrate = false);
+    bool begin(PN532Transport* transport, uint8_t PN532_RST, uint8_t PN532_IRQ = PN532_NO_IRQ, ePN532Timing timing = TIMING_Safe);
+    bool pollCard(byte* uid, byte* uidLength, eCardType* cardType);
+    bool readCard(byte* uid, byte* uidLength, eCardType* cardType);
+    void setAutoPoll(bool enable, uint8_t period = PN532_AUTOPOLL_PERIOD);
+    void setMaxBitRate(byte rate);
+    void setEV2(bool enable) { useEV2 = enable && USE_AES; }
+    bool setKeyDiversifier(KeyDiversifier* diversifier);
+    void setPiccKeyRing(KeyRing* keyRing) { piccKeyRing = keyRing; }
+    void setMetrics(TapMetrics* tapMetrics) { metrics = tapMetrics; }
+    bool setRfProfile(ePN532RfProfile profile);
+    bool setRfProfile(const char* name);
+    ePN532RfProfile getRfProfile() { return rfProfile; }
+    uint16_t getBitRate() { return PN532::GetBitRateKbps(desfireReader.GetBitRate()); }
+    bool isCardPresent();
+    void releaseCard();
     bool authenticatePiccMaster();
     bool authenticateApp(const uint32_t AppId);
     String readDesfireFile(uint8_t fileId, uint16_t length);
     String readDesfireFile(uint8_t fileId, uint16_t length, uint8_t keyIndex, const uint8_t* keyData);
     bool authenticateWithIndex(uint8_t keyIndex, const uint8_t* keyData, size_t keyLen);
+    bool openSession(uint32_t appId, uint8_t keyNo, const uint8_t* keyData);
+    bool openSession(uint32_t appId, uint8_t keyNo, KeyRing* keyRing);
+    String readFile(uint32_t appId, uint8_t fileId, uint16_t length, uint8_t keyNo, const uint8_t* keyData, DESFireFileEncryption commMode = CM_PLAIN);
+    void endSession() { sessionKey = nullptr; }
+    bool runScript(const CardStep* steps, int count, CardScriptResult* result);
+    // For a script array: the count of steps is checked at compile time
+    template <int N> bool runScript(const CardStep (&steps)[N], CardScriptResult* result) {
+        static_assert(N <= CARD_SCRIPT_MAX_STEPS, "Card script has more than CARD_SCRIPT_MAX_STEPS steps");
+        return runScript(steps, N, result);
+    }
+    static void printScriptResult(const CardStep* steps, const CardScriptResult* result);
+    uint32_t getAuthCount() { return authCount; }
+    uint32_t calibrateSpiClock();
+    uint32_t getSpiClock() { return spiClock; }
 
     Desfire desfireReader;
 private:
+    PN532HardSpi spiTransport;
+    uint32_t spiClock = 0; // Hardware SPI clock in Hertz, 0 for other transports
+    bool verifySpiClock(int rounds);
+    void onCardDetected(const byte* uid, byte uidLength, eCardType cardType);
+    bool ensureSession(uint32_t appId, uint8_t keyNo, const uint8_t* keyData, size_t keyLen, DESFireKey* cipher);
+    bool ensureSession(uint32_t appId, uint8_t keyNo, KeyRing* keyRing, DESFireKey* cipher);
+    bool autoPoll = false;
+    bool useEV2 = false;            // AuthenticateEV2First / NonFirst instead of the EV1 authentication (AES only)
+    KeyDiversifier* appKeyDiversifier = nullptr; // derives the application master key from the UID, nullptr = fixed key
+    KeyRing* piccKeyRing = nullptr; // versions of the PICC master key during a rollout, nullptr = PICCMasterKey
+    TapMetrics* metrics = nullptr;  // latency of the tap phases, nullptr = not measured
+    void recordPhase(TapPhase phase, uint32_t start) { if (metrics) metrics->record(phase, micros() - start); }
+    uint8_t autoPollPeriod = PN532_AUTOPOLL_PERIOD;
+    bool cardActive = false;        // the card of the last tap may still be in the field
+    uint32_t lastPresenceCheck = 0;
+    byte maxBitRate = BITRATE_106;  // ePN532BitRate, pollCard() negotiates up to this rate
+    byte reportedBitRate = BITRATE_106; // the rate of the last "RF bit rate" message
+    ePN532RfProfile rfProfile = RFPROFILE_Conservative; // the PN532 starts with these values
     #if USE_AES
         AES PICCKeyCipher;
         AES AppKeyCipher;
@@ -34,6 +94,13 @@ private:
     byte AppMasterKey[24] = {0x00};
     byte CardVersion = 0x00;
 
+    // Session of the current card: Desfire tracks the selected application and the authenticated key number,
+    // the service tracks the card and the key data that was used for the authentication
+    byte sessionUid[8] = {0};
+    byte sessionUidLength = 0;
+    const uint8_t* sessionKey = nullptr;
+    uint32_t authCount = 0;          // 3-pass authentications since begin() (EV1 or EV2)
+
     byte buf[128] = {0};
     char out[64];
 };
@@ -0,0 +1,83 @@
+#include "KeyDiversifier.h"
+
+// keyType DF_KEY_AES:    masterKey has 16 bytes, the derived keys are AES keys (16 bytes)
+// keyType DF_KEY_2K3DES: masterKey has 16 bytes, the derived keys are 2K3DES keys (16 bytes)
+// keyType DF_KEY_3K3DES: masterKey has 24 bytes, the derived keys are 3K3DES keys (24 bytes)
+bool KeyDiversifier::begin(DESFireKeyType keyType, const byte* masterKey) {
+    master = nullptr;
+    clear();
+    switch (keyType) {
+        case DF_KEY_AES:
+            aesMaster.SetKeyData(masterKey, 16, 0);
+            master = &aesMaster;
+            keySize = 16;
+            break;
+        case DF_KEY_2K3DES:
+            desMaster.SetKeyData(masterKey, 16, 0);
+            master = &desMaster;
+            keySize = 16;
+            break;
+        case DF_KEY_3K3DES:
+            desMaster.SetKeyData(masterKey, 24, 0);
+            master = &desMaster;
+            keySize = 24;
+            break;
+        default:
+            Serial.println("[ERROR] Invalid key type for the key diversification");
+            return false;
+    }
+    Serial.printf("[OK] Key diversification: %s (AN10922)\n", DESFireKey::GetKeyTypeAsString(keyType, keySize));
+    return true;
+}
+
+// Wipes the cached keys
+void KeyDiversifier::clear() {
+    memset(cache, 0, sizeof(cache));
+    useCounter = 0;
+    hits = 0;
+    misses = 0;
+}
+
+// Writes the diversified key of the card (getKeySize() bytes) to key.
+// Only the first tap of a card (or after it has been displaced from the cache) calculates the key.
+bool KeyDiversifier::getKey(const byte* uid, byte uidLength, uint32_t appId, byte* key) {
+    if (master == nullptr || uidLength == 0 || uidLength > sizeof(cache[0].uid)) {
+        Serial.println("[ERROR] Key diversification not possible");
+        return false;
+    }
+
+    useCounter++;
+    CacheEntry* oldest = &cache[0];
+    for (int i = 0; i < DIVKEY_CACHE_SIZE; i++) {
+        CacheEntry* entry = &cache[i];
+        if (entry->uidLength == uidLength && entry->appId == appId && memcmp(entry->uid, uid, uidLength) == 0) {
+            entry->lastUse = useCounter;
+            memcpy(key, entry->key, keySize);
+            hits++;
+            return true;
+        }
+        if (entry->lastUse < oldest->lastUse) {
+            oldest = entry;
+        }
+    }
+
+    byte input[11];
+    memcpy(input, uid, uidLength);
+    input[uidLength]     = (byte)(appId);
+    input[uidLength + 1] = (byte)(appId >> 8);
+    input[uidLength + 2] = (byte)(appId >> 16);
+    if (!master->DiversifyKey(input, uidLength + 3, oldest->key)) {
+        oldest->uidLength = 0;
+        oldest->lastUse = 0;
+        Serial.println("[ERROR] Key diversification failed");
+        return false;
+    }
+
+    memcpy(oldest->uid, uid, uidLength);
+    oldest->uidLength = uidLength;
+    oldest->appId = appId;
+    oldest->lastUse = useCounter;
+    memcpy(key, oldest->key, keySize);
+    misses++;
+    return true;
+}
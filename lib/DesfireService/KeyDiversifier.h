@@ -0,0 +1,46 @@
+#ifndef KEY_DIVERSIFIER_H
+#define KEY_DIVERSIFIER_H
+#include <Arduino.h>
+#include <DesFireKey.h>
+#include <AES128.h>
+#include <DES.h>
+
+// Count of diversified keys that are kept in RAM (the cards that have been tapped last)
+#define DIVKEY_CACHE_SIZE  8
+
+// Derives a unique key for each card from a master key (NXP AN10922, CMAC based):
+// diversification input = UID (4 or 7 bytes) + application ID (3 bytes, LSB first).
+// The derived keys are kept in a small LRU cache keyed by UID and application,
+// so the regular users of a gate need no CMAC calculation when they tap again.
+// One diversifier can be shared by several DesfireService (the readers of one gate).
+class KeyDiversifier {
+public:
+    bool begin(DESFireKeyType keyType, const byte* masterKey);
+    bool getKey(const byte* uid, byte uidLength, uint32_t appId, byte* key);
+    int getKeySize() { return keySize; }
+    DESFireKeyType getKeyType() { return master != nullptr ? master->GetKeyType() : DF_KEY_INVALID; }
+    bool isEnabled() { return master != nullptr; }
+    void clear();
+    uint32_t getHits() { return hits; }
+    uint32_t getMisses() { return misses; }
+
+private:
+    struct CacheEntry {
+        byte uid[8];
+        byte uidLength;      // 0 = free entry
+        uint32_t appId;
+        uint32_t lastUse;    // useCounter at the last hit, the lowest one is replaced
+        byte key[24];
+    };
+
+    AES aesMaster;
+    DES desMaster;
+    DESFireKey* master = nullptr;
+    int keySize = 0;
+    CacheEntry cache[DIVKEY_CACHE_SIZE];
+    uint32_t useCounter = 0;
+    uint32_t hits = 0;
+    uint32_t misses = 0;
+};
+
+#endif
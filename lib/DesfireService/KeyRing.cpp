@@ -0,0 +1,60 @@
+#include "KeyRing.h"
+
+// version is the key version that has been stored on the card with ChangeKey() (CARD_KEY_VERSION)
+bool KeyRing::addKey(byte version, const uint8_t* keyData) {
+    if (keyData == nullptr || count >= KEYRING_MAX_KEYS || getKey(version) != nullptr) {
+        Serial.printf("[ERROR] Key version 0x%02X cannot be added to the key ring\n", version);
+        return false;
+    }
+    keys[count].version = version;
+    keys[count].keyData = keyData;
+    keys[count].uses = 0;
+    keys[count].lastUse = 0;
+    count++;
+    return true;
+}
+
+// Returns the key with this version or nullptr. Does not count as a use.
+const uint8_t* KeyRing::getKey(byte version) {
+    for (int i = 0; i < count; i++) {
+        if (keys[i].version == version) {
+            return keys[i].keyData;
+        }
+    }
+    return nullptr;
+}
+
+bool KeyRing::contains(const uint8_t* keyData) const {
+    for (int i = 0; i < count; i++) {
+        if (keys[i].keyData == keyData) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Called after a card has been authenticated with this key, nullptr = the card has an unknown version
+void KeyRing::countUse(const uint8_t* keyData) {
+    for (int i = 0; i < count; i++) {
+        if (keys[i].keyData == keyData) {
+            keys[i].uses++;
+            keys[i].lastUse = millis();
+            return;
+        }
+    }
+    unknown++;
+}
+
+void KeyRing::printUsage() {
+    for (int i = 0; i < count; i++) {
+        if (keys[i].uses == 0) {
+            Serial.printf("[INFO] Key version 0x%02X: not used\n", keys[i].version);
+        } else {
+            Serial.printf("[INFO] Key version 0x%02X: %u taps, last %u s ago\n", keys[i].version,
+                          keys[i].uses, (millis() - keys[i].lastUse) / 1000);
+        }
+    }
+    if (unknown > 0) {
+        Serial.printf("[INFO] Unknown key version: %u taps\n", unknown);
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef KEY_RING_H
+#define KEY_RING_H
+#include <Arduino.h>
+
+// Count of key versions that can be in use at the same time (e.g. the old and the new key of a rollout)
+#define KEYRING_MAX_KEYS  4
+
+// The versions of one card key (e.g. the file read key) during a key rollout.
+// DesfireService asks the card for the version of its key (GetKeyVersion needs no authentication)
+// and authenticates with the matching key directly instead of trying one key after the other.
+// The ring counts the taps per version, so it is visible when no card uses an old key anymore.
+class KeyRing {
+public:
+    bool addKey(byte version, const uint8_t* keyData);
+    const uint8_t* getKey(byte version);
+    const uint8_t* getOnlyKey() { return count == 1 ? keys[0].keyData : nullptr; }
+    bool contains(const uint8_t* keyData) const;
+    int getCount() { return count; }
+    byte getVersion(int index) { return keys[index].version; }
+    uint32_t getUseCount(int index) { return keys[index].uses; }
+    uint32_t getUnknownCount() { return unknown; }
+    void countUse(const uint8_t* keyData);
+    void printUsage();
+
+private:
+    struct Entry {
+        byte version;
+        const uint8_t* keyData;  // 16 byte AES key (8 byte DES key if USE_AES is false), must outlive the ring
+        uint32_t uses;           // successful lookups
+        uint32_t lastUse;        // millis() of the last lookup
+    };
+
+    Entry keys[KEYRING_MAX_KEYS];
+    int count = 0;
+    uint32_t unknown = 0;        // cards with a version that is not in the ring
+};
+
+#endif
@@ -0,0 +1,208 @@
+/**************************************************************************
+
+    Minimal Arduino API for the host (native) build.
+    It allows to compile the PN532, Desfire and DesfireService libraries on Linux
+    and to run them against the software PN532 in lib/PN532Emulator.
+
+    Time is virtual: delay(), delayMicroseconds() and every byte that is clocked
+    over the emulated buses advance a simulated clock instead of sleeping.
+    This makes the latency measurements deterministic and independent of the CPU
+    that runs the benchmark, while the CPU time can still be profiled.
+
+    Peripherals (PN532 emulators) register themselves as HostDevice.
+    All pin writes are forwarded to them and SPI transfers go to the device
+    whose chip select is currently low.
+
+    HardwareSerial is a real tty device (usually the pty of a PN532Emulator).
+    Each byte costs 10 bit times of the baud rate on the simulated clock.
+
+**************************************************************************/
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <algorithm>
+#include <string>
+
+using std::min;
+using std::max;
+
+#define constrain(amt, low, high)  ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+typedef uint8_t byte;
+typedef bool    boolean;
+
+#define HIGH          0x1
+#define LOW           0x0
+#define INPUT         0x0
+#define OUTPUT        0x1
+#define INPUT_PULLUP  0x2
+
+#define RISING        0x01
+#define FALLING       0x02
+#define CHANGE        0x03
+
+#define LSBFIRST      0
+#define MSBFIRST      1
+
+#define HEX           16
+#define DEC           10
+
+// Interrupt service routines do not need a special memory section on the host
+#define IRAM_ATTR
+#define digitalPinToInterrupt(p)  (p)
+
+uint32_t millis();
+uint32_t micros();
+void     delay(uint32_t u32_MilliSeconds);
+void     delayMicroseconds(uint32_t u32_MicroSeconds);
+void     delayNanoseconds(uint32_t u32_NanoSeconds); // like Teensy 4, used by Utils::DelayTicks()
+void     pinMode(uint8_t u8_Pin, uint8_t u8_Mode);
+void     digitalWrite(uint8_t u8_Pin, uint8_t u8_Level);
+int      digitalRead(uint8_t u8_Pin);
+long     random(long s32_Max);
+void     attachInterruptArg(uint8_t u8_Pin, void (*pf_Isr)(void*), void* pv_Arg, int s32_Mode);
+void     detachInterrupt(uint8_t u8_Pin);
+
+// -------------------------------------------------------------------------------------------------------------------
+
+// A peripheral that is connected to the emulated pins and buses.
+// All functions have an empty default implementation so a device only overrides what it uses.
+class HostDevice
+{
+public:
+    virtual ~HostDevice() {}
+    // Called for every digitalWrite()
+    virtual void OnPinWrite(byte u8_Pin, byte u8_Level) {}
+    // Called for digitalRead(). Return true if the device drives this pin.
+    virtual bool OnPinRead(byte u8_Pin, byte* pu8_Level) { return false; }
+    // Called for every SPI byte. Return true if the device is selected and has answered.
+    virtual bool OnSpiTransfer(byte u8_Out, byte* pu8_In) { return false; }
+    // Called whenever the simulated clock has advanced. A device may change the level of its output pins here.
+    virtual void OnTick() {}
+    // Called after HardwareSerial has written s32_Bytes to the tty s32_Fd.
+    // A device that owns the other end of the tty must receive them before returning.
+    virtual void OnSerialWrite(int s32_Fd, int s32_Bytes) {}
+};
+
+// Access to the simulated clock and the device registry of the host build.
+class Host
+{
+public:
+    static uint64_t GetNanos();
+    static void     AdvanceNanos(uint64_t u64_Nanos);
+    static void     AttachDevice(HostDevice* pi_Device);
+    static void     DetachDevice(HostDevice* pi_Device);
+    static bool     SpiTransfer(byte u8_Out, byte* pu8_In);
+    // A device reports that it has changed the level of an output pin -> runs the attached interrupt routine
+    static void     PinChanged(byte u8_Pin, byte u8_Level);
+    static void     SerialWritten(int s32_Fd, int s32_Bytes);
+    // false -> Serial output is discarded (the benchmark only prints its summary)
+    static void     SetSerialEcho(bool b_Echo);
+    static bool     GetSerialEcho();
+};
+
+// -------------------------------------------------------------------------------------------------------------------
+
+// A subset of the Arduino String class which is used by Utils and DesfireService.
+class String
+{
+public:
+    String() {}
+    String(const char* s8_Text)        : ms_Str(s8_Text ? s8_Text : "") {}
+    String(const std::string& s_Text)  : ms_Str(s_Text) {}
+    String(char c)                     : ms_Str(1, c) {}
+
+    inline const char* c_str()  const { return ms_Str.c_str(); }
+    inline unsigned int length() const { return (unsigned int)ms_Str.length(); }
+
+    inline String& operator+=(char c)                { ms_Str += c;           return *this; }
+    inline String& operator+=(const char* s8_Text)   { ms_Str += s8_Text;     return *this; }
+    inline String& operator+=(const String& s_Other) { ms_Str += s_Other.ms_Str; return *this; }
+
+    inline bool operator==(const char* s8_Text)   const { return ms_Str == s8_Text; }
+    inline bool operator==(const String& s_Other) const { return ms_Str == s_Other.ms_Str; }
+    inline bool operator!=(const char* s8_Text)   const { return ms_Str != s8_Text; }
+
+    bool endsWith(const String& s_Suffix) const
+    {
+        return ms_Str.size() >= s_Suffix.ms_Str.size() &&
+               ms_Str.compare(ms_Str.size() - s_Suffix.ms_Str.size(), std::string::npos, s_Suffix.ms_Str) == 0;
+    }
+    void trim()
+    {
+        size_t u32_First = ms_Str.find_first_not_of(" \t\r\n");
+        size_t u32_Last  = ms_Str.find_last_not_of (" \t\r\n");
+        if (u32_First == std::string::npos) ms_Str.clear();
+        else ms_Str = ms_Str.substr(u32_First, u32_Last - u32_First + 1);
+    }
+
+private:
+    std::string ms_Str;
+};
+
+inline String operator+(const String& s_Left, const String& s_Right)
+{
+    String s_Result(s_Left);
+    s_Result += s_Right;
+    return s_Result;
+}
+
+// -------------------------------------------------------------------------------------------------------------------
+
+// Serial port -> stdout
+class HostSerial
+{
+public:
+    void begin(uint32_t u32_Baud) {}
+    int  available()              { return 0; }
+    int  read()                   { return -1; }
+    void print  (const char* s8_Text);
+    void print  (const String& s_Text)  { print(s_Text.c_str()); }
+    void print  (int s32_Value);
+    void println(const char* s8_Text = "");
+    void println(const String& s_Text)  { println(s_Text.c_str()); }
+    void println(int s32_Value);
+    void printf (const char* s8_Format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+extern HostSerial Serial;
+
+// -------------------------------------------------------------------------------------------------------------------
+
+// UART (8N1) on a tty device, e.g. the pty of a PN532Emulator (see PN532Emulator::OpenSerial())
+// Only the functions of the ESP32 HardwareSerial that the PN532 library uses.
+class HardwareSerial
+{
+public:
+    HardwareSerial(const char* s8_Device = NULL);
+    ~HardwareSerial();
+
+    // Host only: the tty device that begin() opens
+    void     setDevice(const char* s8_Device);
+
+    void     begin(unsigned long u32_Baud);
+    void     end();
+    void     updateBaudRate(unsigned long u32_Baud);
+    uint32_t baudRate() { return mu32_Baud; }
+    int      available();
+    int      read();
+    size_t   write(uint8_t u8_Data);
+    size_t   write(const uint8_t* pu8_Data, size_t u32_Size);
+    void     flush();
+
+private:
+    bool     SetSpeed(uint32_t u32_Baud);
+    uint64_t ByteNanos();
+
+    std::string ms_Device;
+    int         ms32_Fd;
+    uint32_t    mu32_Baud;
+};
+
+#endif // HOST_ARDUINO_H
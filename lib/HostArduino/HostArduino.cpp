@@ -0,0 +1,369 @@
+/**************************************************************************
+
+    Minimal Arduino API for the host (native) build. See Arduino.h
+
+**************************************************************************/
+
+#include "Arduino.h"
+#include "SPI.h"
+#include "Wire.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+
+#define HOST_MAX_DEVICES     8
+#define HOST_MAX_INTERRUPTS  8
+
+struct kInterrupt
+{
+    uint8_t u8_Pin;
+    int     s32_Mode;
+    void  (*pf_Isr)(void*);
+    void*   pv_Arg;
+};
+
+HostSerial Serial;
+SPIClass   SPI;
+TwoWire    Wire;
+
+static uint64_t    gu64_Nanos = 0;
+static HostDevice* gpi_Devices[HOST_MAX_DEVICES] = { NULL };
+static bool        gb_SerialEcho = true;
+static kInterrupt  gk_Interrupts[HOST_MAX_INTERRUPTS] = {};
+
+// ---------------------------------------------------------------------------
+
+uint64_t Host::GetNanos()
+{
+    return gu64_Nanos;
+}
+
+void Host::AdvanceNanos(uint64_t u64_Nanos)
+{
+    gu64_Nanos += u64_Nanos;
+
+    for (int i=0; i<HOST_MAX_DEVICES; i++)
+    {
+        if (gpi_Devices[i])
+            gpi_Devices[i]->OnTick();
+    }
+}
+
+void Host::AttachDevice(HostDevice* pi_Device)
+{
+    for (int i=0; i<HOST_MAX_DEVICES; i++)
+    {
+        if (gpi_Devices[i] == NULL)
+        {
+            gpi_Devices[i] = pi_Device;
+            return;
+        }
+    }
+    fprintf(stderr, "Host::AttachDevice() -> too many devices\n");
+    abort();
+}
+
+void Host::DetachDevice(HostDevice* pi_Device)
+{
+    for (int i=0; i<HOST_MAX_DEVICES; i++)
+    {
+        if (gpi_Devices[i] == pi_Device)
+            gpi_Devices[i] = NULL;
+    }
+}
+
+bool Host::SpiTransfer(byte u8_Out, byte* pu8_In)
+{
+    for (int i=0; i<HOST_MAX_DEVICES; i++)
+    {
+        if (gpi_Devices[i] && gpi_Devices[i]->OnSpiTransfer(u8_Out, pu8_In))
+            return true;
+    }
+    return false;
+}
+
+void Host::PinChanged(byte u8_Pin, byte u8_Level)
+{
+    for (int i=0; i<HOST_MAX_INTERRUPTS; i++)
+    {
+        kInterrupt* pk_Int = &gk_Interrupts[i];
+        if (!pk_Int->pf_Isr || pk_Int->u8_Pin != u8_Pin)
+            continue;
+
+        if (pk_Int->s32_Mode == CHANGE ||
+           (pk_Int->s32_Mode == FALLING && u8_Level == LOW) ||
+           (pk_Int->s32_Mode == RISING  && u8_Level == HIGH))
+            pk_Int->pf_Isr(pk_Int->pv_Arg);
+    }
+}
+
+void Host::SerialWritten(int s32_Fd, int s32_Bytes)
+{
+    for (int i=0; i<HOST_MAX_DEVICES; i++)
+    {
+        if (gpi_Devices[i])
+            gpi_Devices[i]->OnSerialWrite(s32_Fd, s32_Bytes);
+    }
+}
+
+void Host::SetSerialEcho(bool b_Echo)
+{
+    gb_SerialEcho = b_Echo;
+}
+
+bool Host::GetSerialEcho()
+{
+    return gb_SerialEcho;
+}
+
+// ---------------------------------------------------------------------------
+
+uint32_t millis()
+{
+    return (uint32_t)(gu64_Nanos / 1000000);
+}
+
+uint32_t micros()
+{
+    return (uint32_t)(gu64_Nanos / 1000);
+}
+
+void delay(uint32_t u32_MilliSeconds)
+{
+    Host::AdvanceNanos((uint64_t)u32_MilliSeconds * 1000000);
+}
+
+void delayMicroseconds(uint32_t u32_MicroSeconds)
+{
+    Host::AdvanceNanos((uint64_t)u32_MicroSeconds * 1000);
+}
+
+void delayNanoseconds(uint32_t u32_NanoSeconds)
+{
+    Host::AdvanceNanos(u32_NanoSeconds);
+}
+
+void pinMode(uint8_t u8_Pin, uint8_t u8_Mode)
+{
+}
+
+void digitalWrite(uint8_t u8_Pin, uint8_t u8_Level)
+{
+    for (int i=0; i<HOST_MAX_DEVICES; i++)
+    {
+        if (gpi_Devices[i])
+            gpi_Devices[i]->OnPinWrite(u8_Pin, u8_Level);
+    }
+}
+
+int digitalRead(uint8_t u8_Pin)
+{
+    byte u8_Level;
+    for (int i=0; i<HOST_MAX_DEVICES; i++)
+    {
+        if (gpi_Devices[i] && gpi_Devices[i]->OnPinRead(u8_Pin, &u8_Level))
+            return u8_Level;
+    }
+    return HIGH; // unconnected pins read as pulled up
+}
+
+void attachInterruptArg(uint8_t u8_Pin, void (*pf_Isr)(void*), void* pv_Arg, int s32_Mode)
+{
+    detachInterrupt(u8_Pin);
+    for (int i=0; i<HOST_MAX_INTERRUPTS; i++)
+    {
+        kInterrupt* pk_Int = &gk_Interrupts[i];
+        if (pk_Int->pf_Isr == NULL)
+        {
+            pk_Int->u8_Pin   = u8_Pin;
+            pk_Int->s32_Mode = s32_Mode;
+            pk_Int->pf_Isr   = pf_Isr;
+            pk_Int->pv_Arg   = pv_Arg;
+            return;
+        }
+    }
+    fprintf(stderr, "attachInterruptArg() -> too many interrupts\n");
+    abort();
+}
+
+void detachInterrupt(uint8_t u8_Pin)
+{
+    for (int i=0; i<HOST_MAX_INTERRUPTS; i++)
+    {
+        if (gk_Interrupts[i].u8_Pin == u8_Pin)
+            gk_Interrupts[i].pf_Isr = NULL;
+    }
+}
+
+long random(long s32_Max)
+{
+    return s32_Max > 0 ? rand() % s32_Max : 0;
+}
+
+// ---------------------------------------------------------------------------
+
+void HostSerial::print(const char* s8_Text)
+{
+    if (gb_SerialEcho) fputs(s8_Text, stdout);
+}
+
+void HostSerial::print(int s32_Value)
+{
+    if (gb_SerialEcho) fprintf(stdout, "%d", s32_Value);
+}
+
+void HostSerial::println(const char* s8_Text)
+{
+    if (gb_SerialEcho) fprintf(stdout, "%s\n", s8_Text);
+}
+
+void HostSerial::println(int s32_Value)
+{
+    if (gb_SerialEcho) fprintf(stdout, "%d\n", s32_Value);
+}
+
+void HostSerial::printf(const char* s8_Format, ...)
+{
+    if (!gb_SerialEcho)
+        return;
+
+    va_list args;
+    va_start(args, s8_Format);
+    vfprintf(stdout, s8_Format, args);
+    va_end(args);
+}
+
+// ---------------------------------------------------------------------------
+
+struct kBaudRate
+{
+    uint32_t u32_Baud;
+    speed_t  u32_Speed;
+};
+
+static const kBaudRate BAUD_RATES[] =
+{
+    {   9600,   B9600 }, {  19200,  B19200 }, {  38400,  B38400 }, {  57600,  B57600 },
+    { 115200, B115200 }, { 230400, B230400 }, { 460800, B460800 }, { 921600, B921600 },
+};
+
+HardwareSerial::HardwareSerial(const char* s8_Device)
+{
+    ms32_Fd   = -1;
+    mu32_Baud = 0;
+    setDevice(s8_Device);
+}
+
+HardwareSerial::~HardwareSerial()
+{
+    end();
+}
+
+void HardwareSerial::setDevice(const char* s8_Device)
+{
+    end();
+    ms_Device = s8_Device ? s8_Device : "";
+}
+
+void HardwareSerial::begin(unsigned long u32_Baud)
+{
+    if (ms32_Fd < 0)
+    {
+        ms32_Fd = open(ms_Device.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if (ms32_Fd < 0)
+        {
+            fprintf(stderr, "HardwareSerial::begin() -> cannot open '%s'\n", ms_Device.c_str());
+            return;
+        }
+    }
+    SetSpeed(u32_Baud);
+}
+
+void HardwareSerial::end()
+{
+    if (ms32_Fd >= 0)
+        close(ms32_Fd);
+    ms32_Fd = -1;
+}
+
+void HardwareSerial::updateBaudRate(unsigned long u32_Baud)
+{
+    if (ms32_Fd >= 0)
+        SetSpeed(u32_Baud);
+}
+
+// Raw mode, the speed is visible to the other end of a pty
+bool HardwareSerial::SetSpeed(uint32_t u32_Baud)
+{
+    for (size_t i=0; i<sizeof(BAUD_RATES) / sizeof(BAUD_RATES[0]); i++)
+    {
+        if (BAUD_RATES[i].u32_Baud != u32_Baud)
+            continue;
+
+        termios k_Tio;
+        tcgetattr(ms32_Fd, &k_Tio);
+        cfmakeraw(&k_Tio);
+        cfsetispeed(&k_Tio, BAUD_RATES[i].u32_Speed);
+        cfsetospeed(&k_Tio, BAUD_RATES[i].u32_Speed);
+        tcsetattr(ms32_Fd, TCSANOW, &k_Tio);
+        mu32_Baud = u32_Baud;
+        return true;
+    }
+    fprintf(stderr, "HardwareSerial -> unsupported baud rate %u\n", u32_Baud);
+    return false;
+}
+
+// Start bit + 8 data bits + stop bit
+uint64_t HardwareSerial::ByteNanos()
+{
+    return mu32_Baud ? 10000000000ull / mu32_Baud : 0;
+}
+
+int HardwareSerial::available()
+{
+    int s32_Count = 0;
+    if (ms32_Fd < 0 || ioctl(ms32_Fd, FIONREAD, &s32_Count) < 0)
+        return 0;
+    return s32_Count;
+}
+
+int HardwareSerial::read()
+{
+    byte u8_Data;
+    if (ms32_Fd < 0 || ::read(ms32_Fd, &u8_Data, 1) != 1)
+        return -1;
+
+    Host::AdvanceNanos(ByteNanos());
+    return u8_Data;
+}
+
+size_t HardwareSerial::write(uint8_t u8_Data)
+{
+    return write(&u8_Data, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t* pu8_Data, size_t u32_Size)
+{
+    if (ms32_Fd < 0)
+        return 0;
+
+    size_t u32_Sent = 0;
+    while (u32_Sent < u32_Size)
+    {
+        ssize_t s32_Written = ::write(ms32_Fd, pu8_Data + u32_Sent, u32_Size - u32_Sent);
+        if (s32_Written <= 0)
+            break;
+        u32_Sent += s32_Written;
+    }
+
+    // The frame has been received completely when the last stop bit is on the line
+    Host::AdvanceNanos(ByteNanos() * u32_Sent);
+    Host::SerialWritten(ms32_Fd, (int)u32_Sent);
+    return u32_Sent;
+}
+
+// The bytes are passed to the other end in write() already
+void HardwareSerial::flush()
+{
+}
@@ -0,0 +1,93 @@
+/**************************************************************************
+
+    Hardware SPI bus for the host (native) build.
+    Each transferred byte advances the simulated clock by 8 clock periods
+    and is routed to the HostDevice whose chip select is low.
+    Every call of transfer() / transferBytes() additionally costs HOST_SPI_CALL_NS
+    like the driver overhead of a SPI transaction on the ESP32.
+
+**************************************************************************/
+
+#ifndef HOST_SPI_H
+#define HOST_SPI_H
+
+#include <Arduino.h>
+
+#define SPI_MODE0  0x00
+#define SPI_MODE1  0x01
+#define SPI_MODE2  0x02
+#define SPI_MODE3  0x03
+
+// Time for setting up one SPI transaction in the ESP32 HAL (locking, register setup, FIFO)
+#define HOST_SPI_CALL_NS  3000
+
+class SPISettings
+{
+public:
+    SPISettings(uint32_t u32_Clock = 1000000, uint8_t u8_BitOrder = MSBFIRST, uint8_t u8_Mode = SPI_MODE0)
+    {
+        mu32_Clock   = u32_Clock;
+        mu8_BitOrder = u8_BitOrder;
+        mu8_Mode     = u8_Mode;
+    }
+
+    uint32_t mu32_Clock;
+    uint8_t  mu8_BitOrder;
+    uint8_t  mu8_Mode;
+};
+
+class SPIClass
+{
+public:
+    SPIClass()
+    {
+        mu32_Clock = 1000000;
+    }
+    void begin() {}
+    void end()   {}
+    void beginTransaction(SPISettings k_Settings)
+    {
+        mu32_Clock = k_Settings.mu32_Clock;
+    }
+    void endTransaction() {}
+    void setFrequency(uint32_t u32_Clock)
+    {
+        mu32_Clock = u32_Clock;
+    }
+    uint32_t getFrequency()
+    {
+        return mu32_Clock;
+    }
+
+    uint8_t transfer(uint8_t u8_Data)
+    {
+        Host::AdvanceNanos(HOST_SPI_CALL_NS);
+        return TransferByte(u8_Data);
+    }
+    // pu8_Data == NULL sends 0xFF, pu8_Out == NULL discards the received bytes
+    void transferBytes(const uint8_t* pu8_Data, uint8_t* pu8_Out, uint32_t u32_Size)
+    {
+        Host::AdvanceNanos(HOST_SPI_CALL_NS);
+        for (uint32_t i=0; i<u32_Size; i++)
+        {
+            byte u8_In = TransferByte(pu8_Data ? pu8_Data[i] : 0xFF);
+            if (pu8_Out) pu8_Out[i] = u8_In;
+        }
+    }
+
+private:
+    byte TransferByte(byte u8_Data)
+    {
+        Host::AdvanceNanos(8000000000ull / mu32_Clock);
+
+        byte u8_In = 0xFF; // MISO is pulled up when no device answers
+        Host::SpiTransfer(u8_Data, &u8_In);
+        return u8_In;
+    }
+
+    uint32_t mu32_Clock;
+};
+
+extern SPIClass SPI;
+
+#endif // HOST_SPI_H
@@ -0,0 +1,27 @@
+/**************************************************************************
+
+    I2C bus for the host (native) build.
+    No device is connected: requestFrom() receives no bytes and read() returns -1.
+    It only exists so that the I2C transport of the PN532 library compiles on the host.
+
+**************************************************************************/
+
+#ifndef HOST_WIRE_H
+#define HOST_WIRE_H
+
+#include <Arduino.h>
+
+class TwoWire
+{
+public:
+    void    begin() {}
+    uint8_t requestFrom(uint8_t u8_Address, uint8_t u8_Quantity) { return 0; }
+    int     read()                                               { return -1; }
+    void    beginTransmission(uint8_t u8_Address)                {}
+    size_t  write(uint8_t u8_Data)                               { return 1; }
+    uint8_t endTransmission()                                    { return 2; } // NACK on address
+};
+
+extern TwoWire Wire;
+
+#endif // HOST_WIRE_H
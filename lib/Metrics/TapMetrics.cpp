@@ -0,0 +1,96 @@
+#include "TapMetrics.h"
+
+void TapMetrics::reset() {
+    memset(phases, 0, sizeof(phases));
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        phases[i].minMicros = 0xFFFFFFFF;
+    }
+}
+
+void TapMetrics::record(TapPhase phase, uint32_t us) {
+    Phase& p = phases[phase];
+    int bucket = getBucket(us);
+    if (p.buckets[bucket] == 0xFFFF) {
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            p.buckets[i] >>= 1;
+        }
+    }
+    p.buckets[bucket]++;
+    p.count++;
+    p.minMicros = min(p.minMicros, us);
+    p.maxMicros = max(p.maxMicros, us);
+}
+
+// 0...15 us: one bucket per microsecond, above: HIST_SUB_BUCKETS buckets per power of two
+int TapMetrics::getBucket(uint32_t us) {
+    if (us < HIST_LINEAR_LIMIT) {
+        return us;
+    }
+    if (us >= HIST_MAX_MICROS) {
+        return HIST_BUCKETS - 1;
+    }
+    int exponent = 31 - __builtin_clz(us);
+    int sub = (us >> (exponent - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+    return HIST_LINEAR_LIMIT + (exponent - HIST_SUB_BITS - 1) * HIST_SUB_BUCKETS + sub;
+}
+
+// The highest value that is counted in this bucket
+uint32_t TapMetrics::getBucketLimit(int bucket) {
+    if (bucket < HIST_LINEAR_LIMIT) {
+        return bucket;
+    }
+    int exponent = (bucket - HIST_LINEAR_LIMIT) / HIST_SUB_BUCKETS + HIST_SUB_BITS + 1;
+    int sub = (bucket - HIST_LINEAR_LIMIT) % HIST_SUB_BUCKETS;
+    return ((uint32_t)(HIST_SUB_BUCKETS + sub + 1) << (exponent - HIST_SUB_BITS)) - 1;
+}
+
+// Returns the value in microseconds below which percent % of the recorded values are (upper limit
+// of the bucket, but never above the maximum). 0 if nothing has been recorded.
+uint32_t TapMetrics::getPercentile(TapPhase phase, uint8_t percent) {
+    Phase& p = phases[phase];
+    uint32_t total = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        total += p.buckets[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    uint32_t rank = max((total * percent + 99) / 100, (uint32_t)1);
+    uint32_t sum = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        sum += p.buckets[i];
+        if (sum >= rank) {
+            return constrain(getBucketLimit(i), p.minMicros, p.maxMicros);
+        }
+    }
+    return p.maxMicros;
+}
+
+void TapMetrics::printReport() {
+    Serial.println("[INFO] Tap latency (us):   count      p50      p95      p99      max");
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        TapPhase phase = (TapPhase)i;
+        if (phases[i].count == 0) continue;
+        Serial.printf("[INFO]   %-14s %8u %8u %8u %8u %8u\n", getPhaseName(phase), phases[i].count,
+                      getPercentile(phase, 50), getPercentile(phase, 95), getPercentile(phase, 99), phases[i].maxMicros);
+    }
+}
+
+// The names in the MQTT metrics payload
+const char* TapMetrics::getPhaseName(TapPhase phase) {
+    switch (phase) {
+        case PHASE_DETECT:    return "detect";
+        case PHASE_BITRATE:   return "bitrate";
+        case PHASE_SELECT:    return "select";
+        case PHASE_AUTH_PICC: return "auth_picc";
+        case PHASE_AUTH_APP:  return "auth_app";
+        case PHASE_AUTH_KEY:  return "auth_key";
+        case PHASE_READ_FILE: return "read_file";
+        case PHASE_GET_VALUE: return "get_value";
+        case PHASE_CONVERT:   return "convert";
+        case PHASE_PUBLISH:   return "publish";
+        case PHASE_TAP:       return "tap";
+        default:              return "unknown";
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef TAP_METRICS_H
+#define TAP_METRICS_H
+#include <Arduino.h>
+
+// Histogram buckets: values below HIST_LINEAR_LIMIT microseconds have one bucket each, above that each
+// power of two is split into HIST_SUB_BUCKETS buckets (a percentile is at most 1/8 = 12.5% too high).
+// Values of HIST_MAX_MICROS and above are counted in the last bucket.
+#define HIST_SUB_BITS      3
+#define HIST_SUB_BUCKETS   (1 << HIST_SUB_BITS)
+#define HIST_LINEAR_LIMIT  (2 * HIST_SUB_BUCKETS)
+#define HIST_MAX_EXPONENT  26 // 2^27 us = 134 s
+#define HIST_BUCKETS       (HIST_LINEAR_LIMIT + (HIST_MAX_EXPONENT - HIST_SUB_BITS) * HIST_SUB_BUCKETS)
+#define HIST_MAX_MICROS    (1UL << (HIST_MAX_EXPONENT + 1))
+
+// The phases of a tap. The auth phases are only recorded if the authentication has been executed,
+// a step that the card session already fulfilled (skipped in runScript()) records nothing.
+enum TapPhase {
+    PHASE_DETECT,      // from the ready response of the detection command (InListPassiveTarget / InAutoPoll) to the detected card
+    PHASE_BITRATE,     // bit rate negotiation after the detection (InPSL)
+    PHASE_SELECT,      // SelectApplication
+    PHASE_AUTH_PICC,   // authenticatePiccMaster()
+    PHASE_AUTH_APP,    // authenticateApp()
+    PHASE_AUTH_KEY,    // authentication with the key of a card script (e.g. the file read key)
+    PHASE_READ_FILE,   // ReadFileData of a card script
+    PHASE_GET_VALUE,   // GetValue of a card script
+    PHASE_CONVERT,     // conversion of the file data to ASCII
+    PHASE_PUBLISH,     // MQTT publish of the PID
+    PHASE_TAP,         // the whole tap from the detected card to the published PID
+    PHASE_COUNT
+};
+
+// Latency histograms of the tap phases in microseconds. Fixed size, no heap: the counters are 16 bit,
+// when one of them would overflow all counters of this phase are halved (older taps weigh less).
+// One instance can be shared by several DesfireService (ReaderManager::setMetrics()).
+class TapMetrics {
+public:
+    TapMetrics() { reset(); }
+    void record(TapPhase phase, uint32_t us);
+    uint32_t getPercentile(TapPhase phase, uint8_t percent);
+    uint32_t getCount(TapPhase phase) { return phases[phase].count; }
+    uint32_t getMin(TapPhase phase) { return phases[phase].count ? phases[phase].minMicros : 0; }
+    uint32_t getMax(TapPhase phase) { return phases[phase].maxMicros; }
+    void reset();
+    void printReport();
+    static const char* getPhaseName(TapPhase phase);
+    static int getBucket(uint32_t us);
+    static uint32_t getBucketLimit(int bucket);
+
+private:
+    struct Phase {
+        uint16_t buckets[HIST_BUCKETS];
+        uint32_t count;  // all recorded values since reset() (not halved)
+        uint32_t minMicros;
+        uint32_t maxMicros;
+    };
+    Phase phases[PHASE_COUNT];
+};
+
+#endif
@@ -45,78 +45,120 @@
 
 #include "PN532.h"
 
+// The original timing of this library which was found to be reliable with long cables.
+static const kPN532Timing TIMING_SAFE = 
+{
+    PN532_HARD_SPI_CLOCK, // SPI clock
+    2000,                 // after chip select: INDISPENSABLE!! Otherwise reads bullshit
+    PN532_SOFT_SPI_DELAY, // after deselect
+    1000,                 // per received byte
+    10000,                // status polling interval
+    false,                // byte by byte
+};
+
+// The PN532 needs only a few microseconds after chip select when it is not in power down mode (after SamConfig).
+// The response is read in one burst. Use this with short cables.
+static const kPN532Timing TIMING_FAST = 
+{
+    PN532_FAST_SPI_CLOCK,
+    100,
+    10,
+    0,
+    1000,
+    true,
+};
+
+// The power-up values of the RFConfiguration (manual chapter 7.3.1)
+static const kPN532RfConfig RF_CONSERVATIVE = 
+{
+    0x0B, // ATR_RES timeout 102.4 ms
+    0x0A, // answer timeout 51.2 ms
+    0x00, // no exchange retry
+    0xFF, // ATR_REQ retries
+    0x01, // PPS retries
+    0xFF, // passive activation until a card is found
+};
+
+// A Desfire EV1 answers all commands of the gate within a few milliseconds when it lies on the reader.
+// A poll without card ends after 2 retries so the blocking ReadPassiveTargetID() does not run into PN532_TIMEOUT.
+static const kPN532RfConfig RF_FAST_GATE = 
+{
+    0x08, // ATR_RES timeout 12.8 ms
+    0x08, // answer timeout 12.8 ms: a lost card is noticed 4 times faster
+    0x00,
+    0x02,
+    0x01,
+    0x02,
+};
+
+// Cards at the edge of the field answer late or lose frames: wait longer and repeat the exchange
+static const kPN532RfConfig RF_LONG_RANGE = 
+{
+    0x0C, // ATR_RES timeout 204.8 ms
+    0x0B, // answer timeout 102.4 ms
+    0x02, // 2 exchange retries
+    0xFF,
+    0x03,
+    0xFF,
+};
+
 /**************************************************************************
     Constructor
 **************************************************************************/
 PN532::PN532()
 {
-    mu8_ClkPin     = 0;
-    mu8_MisoPin    = 0;  
-    mu8_MosiPin    = 0;  
-    mu8_SselPin    = 0;  
+    mpi_Transport  = NULL;
     mu8_ResetPin   = 0;
+    mu8_IrqPin     = PN532_NO_IRQ;
+    mb_IrqFlag     = false;
+    mu8_DebugLevel = 0;
+    mk_Timing      = TIMING_SAFE;
+    mk_RfConfig    = RF_CONSERVATIVE;
+    me_CmdState    = CMD_Idle;
+    mu32_CmdStart  = 0;
+    mu32_CmdReady  = 0;
+    mu32_CmdTimeout= 0;
+    ms32_CmdRespLen= 0;
+    mu8_CmdCode    = 0;
+    mu32_LastCheck = 0;
+    mu8_CardTA     = 0;
+    mu8_BitRate    = BITRATE_106;
+    ClearTrace();
 }
 
 /**************************************************************************
-    Initializes for hardware I2C usage.
-    param  reset     The RSTPD_N pin
-**************************************************************************/
-#if USE_HARDWARE_I2C
-    void PN532::InitI2C(byte u8_Reset)
-    {
-        mu8_ResetPin = u8_Reset;
-        Utils::SetPinMode(mu8_ResetPin, OUTPUT);
-    }
-#endif
-
-/**************************************************************************
-    Initializes for software SPI usage.
-    param  clk       SPI clock pin (SCK)
-    param  miso      SPI MISO pin
-    param  mosi      SPI MOSI pin
-    param  sel       SPI chip select pin (CS/SSEL)
-    param  reset     Location of the RSTPD_N pin
+    Selects the bus that connects the PN532.
+    param  pi_Transport  PN532HardSpi, PN532SoftSpi, PN532I2c (see PN532Transport.h)
+    param  reset         The RSTPD_N pin
 **************************************************************************/
-#if USE_SOFTWARE_SPI
-    void PN532::InitSoftwareSPI(byte u8_Clk, byte u8_Miso, byte u8_Mosi, byte u8_Sel, byte u8_Reset)
-    {
-        mu8_ClkPin     = u8_Clk;
-        mu8_MisoPin    = u8_Miso;
-        mu8_MosiPin    = u8_Mosi;
-        mu8_SselPin    = u8_Sel;
-        mu8_ResetPin   = u8_Reset;
-    
-        Utils::SetPinMode(mu8_ResetPin, OUTPUT);  
-        Utils::SetPinMode(mu8_SselPin,  OUTPUT);
-        Utils::SetPinMode(mu8_ClkPin,   OUTPUT);   
-        Utils::SetPinMode(mu8_MosiPin,  OUTPUT);
-        Utils::SetPinMode(mu8_MisoPin,  INPUT);
-    }
-#endif
+void PN532::Init(PN532Transport* pi_Transport, byte u8_Reset)
+{
+    mpi_Transport = pi_Transport;
+    mu8_ResetPin  = u8_Reset;
 
-/**************************************************************************
-    Initializes for hardware SPI uage.
-    param  sel       SPI chip select pin (CS/SSEL)
-    param  reset     Location of the RSTPD_N pin
-**************************************************************************/
-#if USE_HARDWARE_SPI
-    void PN532::InitHardwareSPI(byte u8_Sel, byte u8_Reset)
-    {
-        mu8_SselPin  = u8_Sel;
-        mu8_ResetPin = u8_Reset;
-    
-        Utils::SetPinMode(mu8_ResetPin, OUTPUT);
-        Utils::SetPinMode(mu8_SselPin,  OUTPUT);
-    }
-#endif
+    Utils::SetPinMode(mu8_ResetPin, OUTPUT);
+}
 
 /**************************************************************************
     Reset the PN532, wake up and start communication
+    HSU: switches to the highest stable baud rate of the transport.
 **************************************************************************/
 void PN532::begin() 
 {
     if (mu8_DebugLevel > 0) Utils::Print("\r\n*** begin()\r\n");
 
+    Restart();
+
+    if (mpi_Transport->GetMaxBaudRate() > mpi_Transport->GetBaudRate())
+        NegotiateBaudRate();
+}
+
+/**************************************************************************
+    Hardware reset of the PN532, then the bus is initialized and the chip is woken up.
+    In HSU mode the PN532 is at 115200 baud again after this.
+**************************************************************************/
+void PN532::Restart()
+{
     Utils::WritePin(mu8_ResetPin, HIGH);
     Utils::DelayMilli(10);
     Utils::WritePin(mu8_ResetPin, LOW);
@@ -124,28 +166,137 @@ void PN532::begin()
     Utils::WritePin(mu8_ResetPin, HIGH);
     Utils::DelayMilli(10);  // Small delay required before taking other actions after reset. See datasheet section 12.23, page 209.
   
-    #if (USE_HARDWARE_SPI || USE_SOFTWARE_SPI) 
+    mpi_Transport->Begin(&mk_Timing);
+
+    // Wake up the PN532 (chapter 7.2.11), SPI sends a sequence of 0x55 (dummy bytes)
+    if (mu8_DebugLevel > 1) Utils::Print("Send WakeUp packet\r\n");
+    mpi_Transport->WakeUp();
+}
+
+/**************************************************************************
+    Tries the baud rates from the fastest down to the maximum of the transport.
+    Each baud rate is checked with a communication line test. 
+    If the line is not stable the PN532 is reset to 115200 baud and the next lower rate is tried.
+    returns the baud rate that is used now
+**************************************************************************/
+uint32_t PN532::NegotiateBaudRate()
+{
+    const uint32_t BAUD_RATES[] = { 921600, 460800, 230400 };
+
+    for (int i=0; i<(int)(sizeof(BAUD_RATES) / sizeof(BAUD_RATES[0])); i++)
     {
-        #if USE_HARDWARE_SPI
-            SpiClass::Begin(PN532_HARD_SPI_CLOCK);
-        #endif
+        if (BAUD_RATES[i] > mpi_Transport->GetMaxBaudRate())
+            continue;
 
-        // Wake up the PN532 (chapter 7.2.11) -> send a sequence of 0x55 (dummy bytes)
-        byte u8_Buffer[20];
-        memset(u8_Buffer, PN532_WAKEUP, sizeof(u8_Buffer));
-        SendPacket(u8_Buffer, sizeof(u8_Buffer));
+        // After the wake up in HSU mode the PN532 requires SAMConfiguration first (manual chapter 7.2.11)
+        if (!SamConfig() || !SetSerialBaudRate(BAUD_RATES[i]))
+            break; // no communication at 115200 -> trying faster rates makes no sense
 
-        if (mu8_DebugLevel > 1)
-        {
-            Utils::Print("Send WakeUp packet: ");
-            Utils::PrintHexBuf(u8_Buffer, sizeof(u8_Buffer), LF);
-        }
+        if (TestCommunication())
+            return BAUD_RATES[i];
+
+        Utils::Print("NegotiateBaudRate() -> Line not stable at ");
+        Utils::PrintDec(BAUD_RATES[i], " baud\r\n");
+        Restart();
     }
-    #elif USE_HARDWARE_I2C
+    return mpi_Transport->GetBaudRate();
+}
+
+/**************************************************************************
+    HSU only: Changes the baud rate of the PN532 and of the transport.
+    The PN532 switches after the host has sent an ACK for the response (manual chapter 7.2.13).
+    param  u32_Baud   9600 ... 1288000
+**************************************************************************/
+bool PN532::SetSerialBaudRate(uint32_t u32_Baud)
+{
+    if (mu8_DebugLevel > 0)
     {
-        I2cClass::Begin();
+        Utils::Print("\r\n*** SetSerialBaudRate(");
+        Utils::PrintDec(u32_Baud, ")\r\n");
     }
-    #endif
+
+    const uint32_t BAUD_RATES[] = { 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600, 1288000 };
+    byte u8_BR = 0xFF;
+    for (int i=0; i<(int)(sizeof(BAUD_RATES) / sizeof(BAUD_RATES[0])); i++)
+    {
+        if (BAUD_RATES[i] == u32_Baud)
+            u8_BR = i;
+    }
+    if (u8_BR == 0xFF || !mpi_Transport->IsStream())
+    {
+        Utils::Print("SetSerialBaudRate() -> Invalid baud rate or no HSU transport\r\n");
+        return false;
+    }
+
+    mu8_PacketBuffer[0] = PN532_COMMAND_SETSERIALBAUDRATE;
+    mu8_PacketBuffer[1] = u8_BR;
+
+    int len = ExecuteCommand(mu8_PacketBuffer, 2);
+    if (len != 2 || mu8_PacketBuffer[1] != PN532_COMMAND_SETSERIALBAUDRATE + 1)
+    {
+        Utils::Print("SetSerialBaudRate failed\r\n");
+        return false;
+    }
+
+    byte u8_Ack[] = { 0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00 };
+    SendPacket(u8_Ack, sizeof(u8_Ack));
+    return mpi_Transport->SetBaudRate(u32_Baud);
+}
+
+/**************************************************************************
+    returns the current HSU baud rate or 0 if the PN532 is connected via SPI or I2C
+**************************************************************************/
+uint32_t PN532::GetSerialBaudRate()
+{
+    return mpi_Transport->GetBaudRate();
+}
+
+/**************************************************************************
+    Hardware SPI and fast Software SPI: Changes the SPI clock after begin() (e.g. to calibrate the bus).
+    The PN532 supports up to 5 MHz, but long cables may need a lower clock.
+    returns false if the transport cannot change the clock (Software SPI, I2C, HSU).
+**************************************************************************/
+bool PN532::SetSpiClock(uint32_t u32_Clock)
+{
+    uint32_t u32_Old = mk_Timing.u32_SpiClock;
+    mk_Timing.u32_SpiClock = u32_Clock;
+    if (mpi_Transport->UpdateClock())
+        return true;
+
+    mk_Timing.u32_SpiClock = u32_Old;
+    return false;
+}
+
+uint32_t PN532::GetSpiClock()
+{
+    return mk_Timing.u32_SpiClock;
+}
+
+/**************************************************************************
+    Communication line test (Diagnose NumTst = 0): 
+    The PN532 must return 128 bytes unchanged.
+**************************************************************************/
+bool PN532::TestCommunication()
+{
+    const int TEST_LEN = 128;
+
+    mu8_PacketBuffer[0] = PN532_COMMAND_DIAGNOSE;
+    mu8_PacketBuffer[1] = 0x00;
+    for (int i=0; i<TEST_LEN; i++)
+    {
+        mu8_PacketBuffer[2 + i] = (byte)(0x55 + i * 0x3B);
+    }
+
+    int len = ExecuteCommand(mu8_PacketBuffer, 2 + TEST_LEN);
+    if (len != 3 + TEST_LEN || mu8_PacketBuffer[1] != PN532_COMMAND_DIAGNOSE + 1)
+        return false;
+
+    for (int i=0; i<TEST_LEN; i++)
+    {
+        if (mu8_PacketBuffer[3 + i] != (byte)(0x55 + i * 0x3B))
+            return false;
+    }
+    return true;
 }
 
 /**************************************************************************
@@ -157,6 +308,50 @@ void PN532::SetDebugLevel(byte level)
     mu8_DebugLevel = level;
 }
 
+/**************************************************************************
+    Optional: The IRQ pin (P70_IRQ) of the PN532 is connected to u8_Irq.
+    The PN532 pulls this pin low when a response is ready.
+    The command engine then reacts within microseconds instead of polling the status every 10 ms.
+    Without IRQ pin (PN532_NO_IRQ) the status polling is used.
+    SamConfig() enables the IRQ pin of the PN532.
+**************************************************************************/
+void PN532::SetIrqPin(byte u8_Irq)
+{
+    mu8_IrqPin = u8_Irq;
+    mb_IrqFlag = false;
+    if (mu8_IrqPin == PN532_NO_IRQ)
+        return;
+
+    Utils::SetPinMode(mu8_IrqPin, INPUT_PULLUP);
+    Utils::AttachInterrupt(mu8_IrqPin, OnIrq, this, FALLING);
+}
+
+/**************************************************************************
+    Selects the timing of the transport (delays, SPI clock, burst transfers).
+    TIMING_Safe is the default. TIMING_Fast moves each frame in one burst.
+    The SPI clock is applied in begin(), so this must be called before begin().
+**************************************************************************/
+void PN532::SetTiming(ePN532Timing e_Timing)
+{
+    switch (e_Timing)
+    {
+        case TIMING_Fast: mk_Timing = TIMING_FAST; break;
+        default:          mk_Timing = TIMING_SAFE; break;
+    }
+}
+
+// Sets a custom timing profile
+void PN532::SetTiming(const kPN532Timing* pk_Timing)
+{
+    mk_Timing = *pk_Timing;
+}
+
+// Interrupt service routine for the IRQ pin
+void IRAM_ATTR PN532::OnIrq(void* pv_PN532)
+{
+    ((PN532*)pv_PN532)->mb_IrqFlag = true;
+}
+
 /**************************************************************************
     Gets the firmware version of the PN5xx chip
     returns:
@@ -171,10 +366,7 @@ bool PN532::GetFirmwareVersion(byte* pIcType, byte* pVersionHi, byte* pVersionLo
     if (mu8_DebugLevel > 0) Utils::Print("\r\n*** GetFirmwareVersion()\r\n");
     
     mu8_PacketBuffer[0] = PN532_COMMAND_GETFIRMWAREVERSION;
-    if (!SendCommandCheckAck(mu8_PacketBuffer, 1))
-        return 0;
-
-    byte len = ReadData(mu8_PacketBuffer, 13);
+    int len = ExecuteCommand(mu8_PacketBuffer, 1);
     if (len != 6 || mu8_PacketBuffer[1] != PN532_COMMAND_GETFIRMWAREVERSION + 1)
     {
         Utils::Print("GetFirmwareVersion failed\r\n");
@@ -200,10 +392,7 @@ bool PN532::SamConfig(void)
     mu8_PacketBuffer[2] = 0x14; // timeout 50ms * 20 = 1 second
     mu8_PacketBuffer[3] = 0x01; // use IRQ pin!
   
-    if (!SendCommandCheckAck(mu8_PacketBuffer, 4))
-        return false;
-  
-    byte len = ReadData(mu8_PacketBuffer, 9);
+    int len = ExecuteCommand(mu8_PacketBuffer, 4);
     if (len != 2 || mu8_PacketBuffer[1] != PN532_COMMAND_SAMCONFIGURATION + 1)
     {
         Utils::Print("SamConfig failed\r\n");
@@ -219,24 +408,142 @@ bool PN532::SetPassiveActivationRetries()
 {
     if (mu8_DebugLevel > 0) Utils::Print("\r\n*** SetPassiveActivationRetries()\r\n");
   
+    // one retry is enough for Mifare Classic but Desfire is slower (if you modify this, you must also modify PN532_TIMEOUT!)
+    return SetMaxRetries(0xFF, 0x01, 3);
+}
+
+/**************************************************************************
+    Sends one RFConfiguration item (manual chapter 7.3.1)
+**************************************************************************/
+bool PN532::WriteRfConfig(byte u8_Item, const byte* u8_Data, int s32_Len)
+{
     mu8_PacketBuffer[0] = PN532_COMMAND_RFCONFIGURATION;
-    mu8_PacketBuffer[1] = 5;    // Config item 5 (MaxRetries)
-    mu8_PacketBuffer[2] = 0xFF; // MxRtyATR (default = 0xFF)
-    mu8_PacketBuffer[3] = 0x01; // MxRtyPSL (default = 0x01)
-    mu8_PacketBuffer[4] = 3;    // one retry is enough for Mifare Classic but Desfire is slower (if you modify this, you must also modify PN532_TIMEOUT!)
-    
-    if (!SendCommandCheckAck(mu8_PacketBuffer, 5))
-        return false;
-  
-    byte len = ReadData(mu8_PacketBuffer, 9);
+    mu8_PacketBuffer[1] = u8_Item;
+    memcpy(mu8_PacketBuffer + 2, u8_Data, s32_Len);
+
+    int len = ExecuteCommand(mu8_PacketBuffer, 2 + s32_Len);
     if (len != 2 || mu8_PacketBuffer[1] != PN532_COMMAND_RFCONFIGURATION + 1)
     {
-        Utils::Print("SetPassiveActivationRetries failed\r\n");
+        Utils::Print("RFConfiguration failed\r\n");
         return false;
     }
     return true;
 }
 
+/**************************************************************************
+    Item 1: switches the RF field on or off.
+    b_AutoRFCA = true -> the PN532 checks for an external field before it switches its own field on.
+**************************************************************************/
+bool PN532::SetRfField(bool b_On, bool b_AutoRFCA)
+{
+    if (mu8_DebugLevel > 0) Utils::Print(b_On ? "\r\n*** SetRfField(On)\r\n" : "\r\n*** SetRfField(Off)\r\n");
+
+    byte u8_Field = (b_AutoRFCA ? 0x02 : 0x00) | (b_On ? 0x01 : 0x00);
+    return WriteRfConfig(1, &u8_Field, 1);
+}
+
+/**************************************************************************
+    Item 2: the timeout for ATR_RES and for the answer of a non-DEP target (Desfire).
+    The codes are explained at kPN532RfConfig.
+**************************************************************************/
+bool PN532::SetRfTimeouts(byte u8_AtrTimeout, byte u8_RetryTimeout)
+{
+    if (mu8_DebugLevel > 0) Utils::Print("\r\n*** SetRfTimeouts()\r\n");
+
+    byte u8_Data[] = { 0x00, u8_AtrTimeout, u8_RetryTimeout }; // the first byte is RFU
+    if (!WriteRfConfig(2, u8_Data, sizeof(u8_Data)))
+        return false;
+
+    mk_RfConfig.u8_AtrTimeout   = u8_AtrTimeout;
+    mk_RfConfig.u8_RetryTimeout = u8_RetryTimeout;
+    return true;
+}
+
+/**************************************************************************
+    Item 4: how often the PN532 repeats an exchange with the target after a timeout (0xFF = forever)
+**************************************************************************/
+bool PN532::SetMaxRetryCom(byte u8_MaxRtyCOM)
+{
+    if (mu8_DebugLevel > 0) Utils::Print("\r\n*** SetMaxRetryCom()\r\n");
+
+    if (!WriteRfConfig(4, &u8_MaxRtyCOM, 1))
+        return false;
+
+    mk_RfConfig.u8_MaxRtyCOM = u8_MaxRtyCOM;
+    return true;
+}
+
+/**************************************************************************
+    Item 5: retries of ATR_REQ, PSL_REQ / PPS and of the passive activation (0xFF = forever)
+**************************************************************************/
+bool PN532::SetMaxRetries(byte u8_MaxRtyATR, byte u8_MaxRtyPSL, byte u8_MaxRtyPassive)
+{
+    if (mu8_DebugLevel > 0) Utils::Print("\r\n*** SetMaxRetries()\r\n");
+
+    byte u8_Data[] = { u8_MaxRtyATR, u8_MaxRtyPSL, u8_MaxRtyPassive };
+    if (!WriteRfConfig(5, u8_Data, sizeof(u8_Data)))
+        return false;
+
+    mk_RfConfig.u8_MaxRtyATR     = u8_MaxRtyATR;
+    mk_RfConfig.u8_MaxRtyPSL     = u8_MaxRtyPSL;
+    mk_RfConfig.u8_MaxRtyPassive = u8_MaxRtyPassive;
+    return true;
+}
+
+/**************************************************************************
+    Sends the timeouts and retries of a latency profile to the PN532.
+    The PN532 must be idle (no pending command).
+**************************************************************************/
+bool PN532::SetRfConfig(ePN532RfProfile e_Profile)
+{
+    switch (e_Profile)
+    {
+        case RFPROFILE_FastGate:  return SetRfConfig(&RF_FAST_GATE);
+        case RFPROFILE_LongRange: return SetRfConfig(&RF_LONG_RANGE);
+        default:                  return SetRfConfig(&RF_CONSERVATIVE);
+    }
+}
+
+// Sends a custom RF configuration
+bool PN532::SetRfConfig(const kPN532RfConfig* pk_Config)
+{
+    return SetRfTimeouts(pk_Config->u8_AtrTimeout, pk_Config->u8_RetryTimeout) &&
+           SetMaxRetryCom(pk_Config->u8_MaxRtyCOM) &&
+           SetMaxRetries (pk_Config->u8_MaxRtyATR, pk_Config->u8_MaxRtyPSL, pk_Config->u8_MaxRtyPassive);
+}
+
+// The RF configuration that has been sent last (the power-up values after the constructor)
+const kPN532RfConfig* PN532::GetRfConfig()
+{
+    return &mk_RfConfig;
+}
+
+// The name of a profile as it is used in the MQTT control messages
+const char* PN532::GetRfProfileName(ePN532RfProfile e_Profile)
+{
+    switch (e_Profile)
+    {
+        case RFPROFILE_FastGate:  return "fast_gate";
+        case RFPROFILE_LongRange: return "long_range";
+        default:                  return "conservative";
+    }
+}
+
+// Reverse of GetRfProfileName(), returns false for an unknown name
+bool PN532::FindRfProfile(const char* s8_Name, ePN532RfProfile* pe_Profile)
+{
+    const ePN532RfProfile e_Profiles[] = { RFPROFILE_Conservative, RFPROFILE_FastGate, RFPROFILE_LongRange };
+    for (int i=0; i<(int)(sizeof(e_Profiles) / sizeof(e_Profiles[0])); i++)
+    {
+        if (strcmp(s8_Name, GetRfProfileName(e_Profiles[i])) == 0)
+        {
+            *pe_Profile = e_Profiles[i];
+            return true;
+        }
+    }
+    return false;
+}
+
 /**************************************************************************
     Turns the RF field off.
     When the field is on, the PN532 consumes approx 110 mA
@@ -247,20 +554,7 @@ bool PN532::SwitchOffRfField()
 {
     if (mu8_DebugLevel > 0) Utils::Print("\r\n*** SwitchOffRfField()\r\n");
   
-    mu8_PacketBuffer[0] = PN532_COMMAND_RFCONFIGURATION;
-    mu8_PacketBuffer[1] = 1; // Config item 1 (RF Field)
-    mu8_PacketBuffer[2] = 0; // Field Off
-    
-    if (!SendCommandCheckAck(mu8_PacketBuffer, 3))
-        return false;
-  
-    byte len = ReadData(mu8_PacketBuffer, 9);
-    if (len != 2 || mu8_PacketBuffer[1] != PN532_COMMAND_RFCONFIGURATION + 1)
-    {
-        Utils::Print("SwitchOffRfField failed\r\n");
-        return false;
-    }
-    return true;
+    return SetRfField(false);
 }
 
 /**************************************************************************/
@@ -302,62 +596,269 @@ bool PN532::WriteGPIO(bool P30, bool P31, bool P33, bool P35)
     mu8_PacketBuffer[1] = PN532_GPIO_VALIDATIONBIT | pinState;  // P3 Pins
     mu8_PacketBuffer[2] = 0x00;                                 // P7 GPIO Pins (not used ... taken by SPI)
                     
-    if (!SendCommandCheckAck(mu8_PacketBuffer, 3))
-        return false;
-  
-    byte len = ReadData(mu8_PacketBuffer, 9);
+    int len = ExecuteCommand(mu8_PacketBuffer, 3);
     if (len != 2 || mu8_PacketBuffer[1] != PN532_COMMAND_WRITEGPIO + 1)
     {
-        Utils::Print("WriteGPIO failed\r\n");
+        Utils::Print("WriteGPIO failed\r\n");
+        return false;
+    }
+    return true;
+}
+
+
+/**************************************************************************
+    Waits for an ISO14443A target to enter the field.
+    If the RF field has been turned off before, this command switches it on.
+
+    param u8_UidBuffer  Pointer to an 8 byte buffer that will be populated with the card's UID (4 or 7 bytes)
+    param pu8_UidLength Pointer to the variable that will hold the length of the card's UID.
+    param pe_CardType   Pointer to the variable that will hold if the card is a Desfire card
+    
+    returns false only on error!
+    returns true and *UidLength = 0 if no card was found
+    returns true and *UidLength > 0 if a card has been read successfully
+**************************************************************************/
+bool PN532::ReadPassiveTargetID(byte* u8_UidBuffer, byte* pu8_UidLength, eCardType* pe_CardType) 
+{
+    if (mu8_DebugLevel > 0) Utils::Print("\r\n*** ReadPassiveTargetID()\r\n");
+
+    if (!StartPassiveTargetID(PN532_TIMEOUT))
+        return false;
+
+    return ParsePassiveTargetID(WaitCommand(), u8_UidBuffer, pu8_UidLength, pe_CardType);
+}
+
+/**************************************************************************
+    Starts the detection of a card and returns immediately.
+    Call PollPassiveTargetID() until it does not return RESULT_Busy anymore.
+    u32_Timeout = 0 -> wait until a card enters the field or AbortCommand() is called.
+**************************************************************************/
+bool PN532::StartPassiveTargetID(uint32_t u32_Timeout)
+{
+    mu8_PacketBuffer[0] = PN532_COMMAND_INLISTPASSIVETARGET;
+    mu8_PacketBuffer[1] = 1;  // read data of 1 card (The PN532 can read max 2 targets at the same time)
+    mu8_PacketBuffer[2] = CARD_TYPE_106KB_ISO14443A; // This function currently does not support other card types.
+
+    return SubmitCommand(mu8_PacketBuffer, 3, u32_Timeout);
+}
+
+/**************************************************************************
+    Checks if the detection started with StartPassiveTargetID() has finished.
+    returns RESULT_Busy     while no card has been found (the output parameters are not touched)
+    returns RESULT_Complete with the same output as ReadPassiveTargetID() returning true
+    returns RESULT_Error    on error
+**************************************************************************/
+ePN532Result PN532::PollPassiveTargetID(byte* u8_UidBuffer, byte* pu8_UidLength, eCardType* pe_CardType)
+{
+    ePN532Result e_Result = PollCommand();
+    if (e_Result == RESULT_Busy)
+        return RESULT_Busy;
+
+    if (!ParsePassiveTargetID(CompleteCommand(), u8_UidBuffer, pu8_UidLength, pe_CardType))
+        return RESULT_Error;
+
+    return RESULT_Complete;
+}
+
+/**************************************************************************
+    Starts the card detection with InAutoPoll (manual chapter 7.3.13) and returns immediately.
+    The PN532 polls for an ISO14443-4A card every u8_Period * 150 ms without any communication with the host.
+    Only when a card has been found (or after u8_PollNr polls) the response becomes ready.
+    Call PollAutoPoll() until it does not return RESULT_Busy anymore.
+    param u8_PollNr    count of polls, 0xFF = endless
+    param u8_Period    1 ... 15 (units of 150 ms)
+    param u32_Timeout  0 -> wait until a card enters the field or AbortCommand() is called.
+**************************************************************************/
+bool PN532::StartAutoPoll(byte u8_PollNr, byte u8_Period, uint32_t u32_Timeout)
+{
+    if (mu8_DebugLevel > 0) Utils::Print("\r\n*** StartAutoPoll()\r\n");
+
+    mu8_PacketBuffer[0] = PN532_COMMAND_INAUTOPOLL;
+    mu8_PacketBuffer[1] = u8_PollNr;
+    mu8_PacketBuffer[2] = u8_Period;
+    mu8_PacketBuffer[3] = AUTOPOLL_TYPE_ISO14443_4A; // activates the card like InListPassiveTarget so InDataExchange can be used
+
+    mu32_LastCheck = Utils::GetMicros();
+    return SubmitCommand(mu8_PacketBuffer, 4, u32_Timeout);
+}
+
+/**************************************************************************
+    Checks if the detection started with StartAutoPoll() has finished.
+    Without IRQ pin the status byte is read at most once per PN532_AUTOPOLL_CHECK_US,
+    so calling this in every loop() costs almost nothing while no card is present.
+    Returns the same as PollPassiveTargetID()
+**************************************************************************/
+ePN532Result PN532::PollAutoPoll(byte* u8_UidBuffer, byte* pu8_UidLength, eCardType* pe_CardType)
+{
+    // With IRQ pin (or HSU) checking costs no bus transfer
+    uint32_t u32_Now = Utils::GetMicros();
+    bool b_Free = mu8_IrqPin != PN532_NO_IRQ || mpi_Transport->IsStream();
+    if (!b_Free && IsCommandPending() && u32_Now - mu32_LastCheck < PN532_AUTOPOLL_CHECK_US)
+        return RESULT_Busy;
+
+    mu32_LastCheck = u32_Now;
+    ePN532Result e_Result = PollCommand();
+    if (e_Result == RESULT_Busy)
+        return RESULT_Busy;
+
+    if (!ParseAutoPoll(CompleteCommand(), u8_UidBuffer, pu8_UidLength, pe_CardType))
+        return RESULT_Error;
+
+    return RESULT_Complete;
+}
+
+/**************************************************************************
+    Card presence detection with the attention request test (Diagnose NumTst = 6, manual chapter 7.2.1):
+    The PN532 sends an R(NAK) block to the active ISO14443-4 target which answers with R(ACK).
+    This takes approx. 1 ms with the card in the field and does not change the state of the card
+    (authentication and selected application stay valid).
+    If the card has left the field the PN532 waits for the timeout (RFConfiguration item 2).
+    returns false on communication error
+    *pb_Present = false if the card does not answer or if no ISO14443-4 target is active
+**************************************************************************/
+bool PN532::CheckPresence(bool* pb_Present)
+{
+    if (mu8_DebugLevel > 0) Utils::Print("\r\n*** CheckPresence()\r\n");
+
+    *pb_Present = false;
+    if (!StartPresenceCheck())
+        return false;
+
+    return ParsePresence(WaitCommand(), pb_Present);
+}
+
+/**************************************************************************
+    Non-blocking version of CheckPresence()
+    Call PollPresenceCheck() until it does not return RESULT_Busy anymore.
+**************************************************************************/
+bool PN532::StartPresenceCheck()
+{
+    mu8_PacketBuffer[0] = PN532_COMMAND_DIAGNOSE;
+    mu8_PacketBuffer[1] = 0x06; // attention request test / card presence detection
+
+    return SubmitCommand(mu8_PacketBuffer, 2);
+}
+
+ePN532Result PN532::PollPresenceCheck(bool* pb_Present)
+{
+    *pb_Present = false;
+
+    ePN532Result e_Result = PollCommand();
+    if (e_Result == RESULT_Busy)
+        return RESULT_Busy;
+
+    if (!ParsePresence(CompleteCommand(), pb_Present))
+        return RESULT_Error;
+
+    return RESULT_Complete;
+}
+
+/**************************************************************************
+    Evaluates the response of the presence check: D5 01 Status
+    Status 0x00 = the card has answered, 0x01 = timeout, 0x27 = no ISO14443-4 target
+**************************************************************************/
+bool PN532::ParsePresence(int len, bool* pb_Present)
+{
+    if (len != 3 || mu8_PacketBuffer[1] != PN532_COMMAND_DIAGNOSE + 1)
+    {
+        Utils::Print("PresenceCheck failed\r\n");
+        return false;
+    }
+
+    *pb_Present = mu8_PacketBuffer[2] == 0x00;
+    return true;
+}
+
+/**************************************************************************
+    Changes the RF bit rate of the activated ISO14443-4 card with InPSL (PPS request).
+    param  u8_BitRate  ePN532BitRate, used for both directions
+**************************************************************************/
+bool PN532::SetBitRate(byte u8_BitRate)
+{
+    if (mu8_DebugLevel > 0)
+    {
+        Utils::Print("\r\n*** SetBitRate(");
+        Utils::PrintDec(GetBitRateKbps(u8_BitRate), " kbit)\r\n");
+    }
+
+    mu8_PacketBuffer[0] = PN532_COMMAND_INPSL;
+    mu8_PacketBuffer[1] = 1;          // Target 1
+    mu8_PacketBuffer[2] = u8_BitRate; // BRit: initiator -> target
+    mu8_PacketBuffer[3] = u8_BitRate; // BRti: target -> initiator
+
+    int len = ExecuteCommand(mu8_PacketBuffer, 4);
+    if (len < 3 || mu8_PacketBuffer[1] != PN532_COMMAND_INPSL + 1)
+    {
+        Utils::Print("InPSL failed\r\n");
         return false;
     }
+    if (!CheckPN532Status(mu8_PacketBuffer[2]))
+        return false;
+
+    mu8_BitRate = u8_BitRate;
     return true;
 }
 
-
 /**************************************************************************
-    Waits for an ISO14443A target to enter the field.
-    If the RF field has been turned off before, this command switches it on.
+    Switches the activated card to the highest bit rate that the card (TA(1) of the ATS)
+    and u8_MaxRate allow. Each rate is checked with a presence check (R(NAK) -> R(ACK)).
+    If a rate does not work the card is activated again (106 kbit) and the next lower rate is tried.
+    Call this after the card has been detected and before the authentication.
+    returns the ePN532BitRate that is used now
+**************************************************************************/
+byte PN532::NegotiateBitRate(byte u8_MaxRate)
+{
+    for (int s32_Rate = min((int)u8_MaxRate, (int)BITRATE_848); s32_Rate > BITRATE_106; s32_Rate--)
+    {
+        // Only the same divisor in both directions is used: DS = 2/4/8 in bits 4..6, DR = 2/4/8 in bits 0..2
+        byte u8_Mask = (1 << (3 + s32_Rate)) | (1 << (s32_Rate - 1));
+        if ((mu8_CardTA & u8_Mask) != u8_Mask)
+            continue;
+
+        bool b_Present = false;
+        if (SetBitRate(s32_Rate) && CheckPresence(&b_Present) && b_Present)
+            return mu8_BitRate;
+
+        Utils::Print("NegotiateBitRate() -> RF not stable at ");
+        Utils::PrintDec(GetBitRateKbps(s32_Rate), " kbit\r\n");
+
+        // The card may not understand the PN532 anymore -> activate it again
+        DeselectCard();
+        mu8_BitRate = BITRATE_106;
+        if (!SelectCard())
+            break;
+    }
+    return mu8_BitRate;
+}
 
-    param u8_UidBuffer  Pointer to an 8 byte buffer that will be populated with the card's UID (4 or 7 bytes)
-    param pu8_UidLength Pointer to the variable that will hold the length of the card's UID.
-    param pe_CardType   Pointer to the variable that will hold if the card is a Desfire card
-    
-    returns false only on error!
-    returns true and *UidLength = 0 if no card was found
-    returns true and *UidLength > 0 if a card has been read successfully
+byte PN532::GetBitRate()
+{
+    return mu8_BitRate;
+}
+
+uint16_t PN532::GetBitRateKbps(byte u8_BitRate)
+{
+    return 106 << min((int)u8_BitRate, (int)BITRATE_848);
+}
+
+/**************************************************************************
+    Evaluates the response of InListPassiveTarget in mu8_PacketBuffer
+    param len   count of bytes in mu8_PacketBuffer (0 on error)
 **************************************************************************/
-bool PN532::ReadPassiveTargetID(byte* u8_UidBuffer, byte* pu8_UidLength, eCardType* pe_CardType) 
+bool PN532::ParsePassiveTargetID(int len, byte* u8_UidBuffer, byte* pu8_UidLength, eCardType* pe_CardType)
 {
-    if (mu8_DebugLevel > 0) Utils::Print("\r\n*** ReadPassiveTargetID()\r\n");
-      
     *pu8_UidLength = 0;
     *pe_CardType   = CARD_Unknown;
     memset(u8_UidBuffer, 0, 8);
-      
-    mu8_PacketBuffer[0] = PN532_COMMAND_INLISTPASSIVETARGET;
-    mu8_PacketBuffer[1] = 1;  // read data of 1 card (The PN532 can read max 2 targets at the same time)
-    mu8_PacketBuffer[2] = CARD_TYPE_106KB_ISO14443A; // This function currently does not support other card types.
-  
-    if (!SendCommandCheckAck(mu8_PacketBuffer, 3))
-        return false; // Error (no valid ACK received or timeout)
-  
+
     /* 
-    ISO14443A card response:
     mu8_PacketBuffer Description
     -------------------------------------------------------
     b0               D5 (always) (PN532_PN532TOHOST)
     b1               4B (always) (PN532_COMMAND_INLISTPASSIVETARGET + 1)
     b2               Amount of cards found
-    b3               Tag number (always 1)
-    b4,5             SENS_RES (ATQA = Answer to Request Type A)
-    b6               SEL_RES  (SAK  = Select Acknowledge)
-    b7               UID Length
-    b8..Length       UID (4 or 7 bytes)
-    nn               ATS Length     (Desfire only)
-    nn..Length-1     ATS data bytes (Desfire only)
+    b3...            Target data (see ParseTargetData())
     */ 
-    byte len = ReadData(mu8_PacketBuffer, 28);
     if (len < 3 || mu8_PacketBuffer[1] != PN532_COMMAND_INLISTPASSIVETARGET + 1)
     {
         Utils::Print("ReadPassiveTargetID failed\r\n");
@@ -373,20 +874,88 @@ bool PN532::ReadPassiveTargetID(byte* u8_UidBuffer, byte* pu8_UidLength, eCardTy
     if (cardsFound != 1)
         return true; // no card found -> this is not an error!
 
-    byte u8_IdLength = mu8_PacketBuffer[7];
-    if (u8_IdLength != 4 && u8_IdLength != 7)
+    return ParseTargetData(mu8_PacketBuffer + 3, len - 3, u8_UidBuffer, pu8_UidLength, pe_CardType);
+}
+
+/**************************************************************************
+    Evaluates the response of InAutoPoll in mu8_PacketBuffer
+    param len   count of bytes in mu8_PacketBuffer (0 on error)
+**************************************************************************/
+bool PN532::ParseAutoPoll(int len, byte* u8_UidBuffer, byte* pu8_UidLength, eCardType* pe_CardType)
+{
+    *pu8_UidLength = 0;
+    *pe_CardType   = CARD_Unknown;
+    memset(u8_UidBuffer, 0, 8);
+
+    /* 
+    mu8_PacketBuffer Description
+    -------------------------------------------------------
+    b0               D5 (always) (PN532_PN532TOHOST)
+    b1               61 (always) (PN532_COMMAND_INAUTOPOLL + 1)
+    b2               Amount of cards found
+    b3               Target type (AUTOPOLL_TYPE_ISO14443_4A)
+    b4               Length of the target data
+    b5...            Target data (see ParseTargetData())
+    */ 
+    if (len < 3 || mu8_PacketBuffer[1] != PN532_COMMAND_INAUTOPOLL + 1)
+    {
+        Utils::Print("AutoPoll failed\r\n");
+        return false;
+    }   
+
+    byte cardsFound = mu8_PacketBuffer[2]; 
+    if (mu8_DebugLevel > 0)
+    {
+        Utils::Print("Cards found: "); 
+        Utils::PrintDec(cardsFound, LF); 
+    }
+    if (cardsFound == 0 || len < 5)
+        return true; // no card found -> this is not an error!
+
+    // If 2 cards are in the field only the first one is used
+    int s32_TargetLen = min((int)mu8_PacketBuffer[4], len - 5);
+    return ParseTargetData(mu8_PacketBuffer + 5, s32_TargetLen, u8_UidBuffer, pu8_UidLength, pe_CardType);
+}
+
+/**************************************************************************
+    Evaluates the data of an ISO14443A target (InListPassiveTarget, InAutoPoll)
+    param pu8_Target  the target data in mu8_PacketBuffer
+    param s32_Len     count of bytes in pu8_Target
+**************************************************************************/
+bool PN532::ParseTargetData(const byte* pu8_Target, int s32_Len, byte* u8_UidBuffer, byte* pu8_UidLength, eCardType* pe_CardType)
+{
+    /* 
+    pu8_Target       Description
+    -------------------------------------------------------
+    b0               Tag number (always 1)
+    b1,2             SENS_RES (ATQA = Answer to Request Type A)
+    b3               SEL_RES  (SAK  = Select Acknowledge)
+    b4               UID Length
+    b5..Length       UID (4 or 7 bytes)
+    nn               ATS Length     (Desfire only)
+    nn..Length-1     ATS data bytes (Desfire only)
+    */ 
+    byte u8_IdLength = (s32_Len >= 5) ? pu8_Target[4] : 0;
+    if ((u8_IdLength != 4 && u8_IdLength != 7) || 5 + u8_IdLength > s32_Len)
     {
         Utils::Print("Card has unsupported UID length: ");
         Utils::PrintDec(u8_IdLength, LF); 
         return true; // unsupported card found -> this is not an error!
     }   
 
-    memcpy(u8_UidBuffer, mu8_PacketBuffer + 8, u8_IdLength);    
+    memcpy(u8_UidBuffer, pu8_Target + 5, u8_IdLength);    
     *pu8_UidLength = u8_IdLength;
 
+    // ATS: TL, T0, TA(1) if bit 4 of T0 is set (ISO14443-4 chapter 5.2). The card starts with 106 kbit.
+    const byte* pu8_ATS = pu8_Target + 5 + u8_IdLength;
+    int s32_AtsLen = s32_Len - 5 - u8_IdLength;
+    mu8_CardTA  = (s32_AtsLen >= 3 && pu8_ATS[0] >= 3 && (pu8_ATS[1] & 0x10)) ? pu8_ATS[2] : 0;
+    mu8_BitRate = BITRATE_106;
+    OnCardReset();
+
     // See "Mifare Identification & Card Types.pdf" in the ZIP file
-    uint16_t u16_ATQA = ((uint16_t)mu8_PacketBuffer[4] << 8) | mu8_PacketBuffer[5];
-    byte     u8_SAK   = mu8_PacketBuffer[6];
+    uint16_t u16_ATQA = ((uint16_t)pu8_Target[1] << 8) | pu8_Target[2];
+    byte     u8_SAK   = pu8_Target[3];
 
     if (u8_IdLength == 7 && u8_UidBuffer[0] != 0x80 && u16_ATQA == 0x0344 && u8_SAK == 0x20) *pe_CardType = CARD_Desfire;
     if (u8_IdLength == 4 && u8_UidBuffer[0] == 0x80 && u16_ATQA == 0x0304 && u8_SAK == 0x20) *pe_CardType = CARD_DesRandom;
@@ -427,10 +996,7 @@ bool PN532::SelectCard()
     mu8_PacketBuffer[0] = PN532_COMMAND_INSELECT;
     mu8_PacketBuffer[1] = 1; // Target 1
 
-    if (!SendCommandCheckAck(mu8_PacketBuffer, 2))
-        return false;
-  
-    byte len = ReadData(mu8_PacketBuffer, 10);
+    int len = ExecuteCommand(mu8_PacketBuffer, 2);
     if (len < 3 || mu8_PacketBuffer[1] != PN532_COMMAND_INSELECT + 1)
     {
         Utils::Print("Select failed\r\n");
@@ -456,16 +1022,14 @@ bool PN532::DeselectCard()
     mu8_PacketBuffer[0] = PN532_COMMAND_INDESELECT;
     mu8_PacketBuffer[1] = 0; // Deselect all cards
 
-    if (!SendCommandCheckAck(mu8_PacketBuffer, 2))
-        return false;
-  
-    byte len = ReadData(mu8_PacketBuffer, 10);
+    int len = ExecuteCommand(mu8_PacketBuffer, 2);
     if (len < 3 || mu8_PacketBuffer[1] != PN532_COMMAND_INDESELECT + 1)
     {
         Utils::Print("Deselect failed\r\n");
         return false;
     }
 
+    OnCardReset(); // the card has received S(DESELECT) and goes into HALT state
     return CheckPN532Status(mu8_PacketBuffer[2]);
 }
 
@@ -481,19 +1045,26 @@ bool PN532::ReleaseCard()
     mu8_PacketBuffer[0] = PN532_COMMAND_INRELEASE;
     mu8_PacketBuffer[1] = 0; // Deselect all cards
 
-    if (!SendCommandCheckAck(mu8_PacketBuffer, 2))
-        return false;
-  
-    byte len = ReadData(mu8_PacketBuffer, 10);
+    int len = ExecuteCommand(mu8_PacketBuffer, 2);
     if (len < 3 || mu8_PacketBuffer[1] != PN532_COMMAND_INRELEASE + 1)
     {
         Utils::Print("Release failed\r\n");
         return false;
     }
 
+    OnCardReset();
     return CheckPN532Status(mu8_PacketBuffer[2]);
 }
 
+/**************************************************************************
+    Called whenever a card has been activated anew (InListPassiveTarget, InAutoPoll),
+    deselected or released. The card has lost its state (selected application, authentication).
+    This function is overridden in Desfire.cpp
+**************************************************************************/
+void PN532::OnCardReset()
+{
+}
+
 /**************************************************************************
     This function is private
     It checks the status byte that is returned by some commands.
@@ -608,76 +1179,194 @@ bool PN532::CheckPN532Status(byte u8_Status)
 **************************************************************************/
 bool PN532::IsReady() 
 {
-    #if (USE_HARDWARE_SPI || USE_SOFTWARE_SPI) 
+    bool b_Ready = mpi_Transport->IsReady();
+    if (mu8_DebugLevel > 2)
+    {
+        Utils::Print("IsReady(): ");
+        Utils::PrintDec(b_Ready, LF);
+    }
+    return b_Ready;
+}
+
+/**************************************************************************
+    Returns true if the IRQ pin signals that a response is ready.
+    The pin level is checked additionally to the flag because the falling edge may
+    have occurred before the flag was reset (the IRQ pin stays low until the frame is read).
+**************************************************************************/
+bool PN532::IsIrqActive()
+{
+    return mb_IrqFlag || Utils::ReadPin(mu8_IrqPin) == LOW;
+}
+
+/**************************************************************************
+    Non-blocking check if the PN532 has a frame (ACK or response) ready to be read.
+    Uses the IRQ pin if connected, otherwise reads the status byte.
+**************************************************************************/
+bool PN532::IsResponseReady()
+{
+    if (mu8_IrqPin == PN532_NO_IRQ)
+        return IsReady();
+
+    if (!IsIrqActive())
+        return false;
+
+    mb_IrqFlag = false; // the frame is read now
+    return true;
+}
+
+/**************************************************************************
+    The interval in microseconds in which a waiting function checks if the PN532 is ready.
+**************************************************************************/
+uint16_t PN532::GetPollDelay()
+{
+    // HSU: checking for received bytes costs no bus transfer
+    if (mu8_IrqPin != PN532_NO_IRQ || mpi_Transport->IsStream())
+        return PN532_IRQ_POLL_DELAY;
+
+    return mk_Timing.u16_PollUs;
+}
+
+// ########################################################################
+// ####                       COMMAND ENGINE                          #####
+// ########################################################################
+
+/**************************************************************************
+    Sends a command to the PN532 and returns immediately without waiting for the ACK.
+    A command that is still pending is aborted.
+    After this call PollCommand() must be called until it does not return RESULT_Busy anymore.
+    param cmd          Command buffer (may be mu8_PacketBuffer)
+    param cmdlen       The size of the command in bytes
+    param u32_Timeout  Milliseconds to wait for the ACK and then for the response, 0 = wait forever
+**************************************************************************/
+bool PN532::SubmitCommand(byte* cmd, int cmdlen, uint32_t u32_Timeout)
+{
+    if (IsCommandPending())
+        AbortCommand();
+
+    if (cmdlen < 1 || cmdlen >= PN532_PACKBUFFSIZE) // + TFI
     {
-        Utils::WritePin(mu8_SselPin, LOW);
-        Utils::DelayMilli(2); // INDISPENSABLE!! Otherwise reads bullshit
+        Utils::Print("SubmitCommand(): Invalid command length\r\n");
+        me_CmdState = CMD_Failed;
+        return false;
+    }
+
+    WriteCommand(cmd, cmdlen);
 
-        if (mu8_DebugLevel > 2) Utils::Print("IsReady(): write STATUSREAD\r\n");
+    me_CmdState     = CMD_WaitAck;
+    mu32_CmdStart   = Utils::GetMillis();
+    mu32_CmdTimeout = u32_Timeout;
+    ms32_CmdRespLen = 0;
+    return true;
+}
 
-        SpiWrite(PN532_SPI_STATUSREAD);
-        byte u8_Ready = SpiRead();
+/**************************************************************************
+    Advances the command that has been started with SubmitCommand().
+    Each call only checks once if the PN532 is ready and reads the ACK or the response if it is.
+    returns RESULT_Busy     if the command has not finished yet
+    returns RESULT_Complete if the response is in mu8_PacketBuffer (see CompleteCommand())
+    returns RESULT_Error    if no command is pending or after a timeout or an invalid frame
+**************************************************************************/
+ePN532Result PN532::PollCommand()
+{
+    switch (me_CmdState)
+    {
+        case CMD_WaitAck:
+        case CMD_WaitResponse: break;
+        case CMD_Complete:     return RESULT_Complete;
+        default:               return RESULT_Error;
+    }
 
-        if (mu8_DebugLevel > 2)
+    if (!IsResponseReady())
+    {
+        if (mu32_CmdTimeout > 0 && Utils::GetMillis() - mu32_CmdStart >= mu32_CmdTimeout)
         {
-            Utils::Print("IsReady(): read ");
-            Utils::PrintHex8(u8_Ready, LF);
+            Utils::Print("PollCommand() -> TIMEOUT\r\n");
+            Trace(TRACE_In, 0, TRACE_Timeout);
+            AbortCommand(); // otherwise the PN532 may still be busy when the next command is sent
+            me_CmdState = CMD_Failed;
+            return RESULT_Error;
         }
-    
-        Utils::WritePin(mu8_SselPin, HIGH);
-        Utils::DelayMicro(PN532_SOFT_SPI_DELAY);
-        
-        return u8_Ready == PN532_SPI_READY; // 0x01
-    }
-    #elif USE_HARDWARE_I2C
-    { 
-        // After reading this byte, the bus must be released with a Stop condition
-        I2cClass::RequestFrom((byte)PN532_I2C_ADDRESS, (byte)1);
-
-        // PN532 Manual chapter 6.2.4: Before the data bytes the chip sends a Ready byte.
-        byte u8_Ready = I2cClass::Read();
-        if (mu8_DebugLevel > 2)
+        return RESULT_Busy;
+    }
+
+    if (me_CmdState == CMD_WaitAck)
+    {
+        if (!ReadAck())
         {
-            Utils::Print("IsReady(): read ");
-            Utils::PrintHex8(u8_Ready, LF);
-        }        
-        
-        return u8_Ready == PN532_I2C_READY; // 0x01
+            me_CmdState = CMD_Failed;
+            return RESULT_Error;
+        }
+
+        // The timeout for the response starts now.
+        // Check at once if the response is ready (fast commands like GetFirmwareVersion).
+        me_CmdState   = CMD_WaitResponse;
+        mu32_CmdStart = Utils::GetMillis();
+        return PollCommand();
     }
-    #endif
+
+    mu32_CmdReady   = Utils::GetMicros();
+    ms32_CmdRespLen = ReadData(mu8_PacketBuffer, sizeof(mu8_PacketBuffer));
+    me_CmdState = (ms32_CmdRespLen > 0) ? CMD_Complete : CMD_Failed;
+    return (ms32_CmdRespLen > 0) ? RESULT_Complete : RESULT_Error;
+}
+
+/**************************************************************************
+    Finishes the command.
+    returns the count of response bytes in mu8_PacketBuffer (starting with 0xD5) or 0 if the command has failed.
+**************************************************************************/
+int PN532::CompleteCommand()
+{
+    int s32_Len = (me_CmdState == CMD_Complete) ? ms32_CmdRespLen : 0;
+    me_CmdState = CMD_Idle;
+    return s32_Len;
 }
 
 /**************************************************************************
-    Waits until the PN532 is ready.
+    Aborts a pending command. 
+    The host sends an ACK frame to the PN532 which cancels the current process (PN532 manual chapter 6.2.1.3)
 **************************************************************************/
-bool PN532::WaitReady() 
+void PN532::AbortCommand()
 {
-    uint16_t timer = 0;
-    while (!IsReady()) 
+    if (IsCommandPending())
     {
-        if (timer >= PN532_TIMEOUT) 
-        {
-            Utils::Print("WaitReady() -> TIMEOUT\r\n");
-            return false;
-        }
-        Utils::DelayMilli(10);
-        timer += 10;        
+        byte u8_Ack[] = { 0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00 };
+        SendPacket(u8_Ack, sizeof(u8_Ack));
+        Trace(TRACE_Out, sizeof(u8_Ack), TRACE_Abort);
     }
-    return true;
+    me_CmdState = CMD_Idle;
 }
 
 /**************************************************************************
-    Sends a command and waits a specified period for the ACK
-    param cmd       Pointer to the command buffer
-    param cmdlen    The size of the command in bytes
+    returns true while a submitted command waits for the ACK or the response.
+**************************************************************************/
+bool PN532::IsCommandPending()
+{
+    return me_CmdState == CMD_WaitAck || me_CmdState == CMD_WaitResponse;
+}
 
-    returns  true  if everything is OK, 
-             false if timeout occured before an ACK was recieved
+/**************************************************************************
+    Synchronous part of the engine: polls the pending command until it has finished.
+    returns the count of response bytes in mu8_PacketBuffer or 0 on error
 **************************************************************************/
-bool PN532::SendCommandCheckAck(byte *cmd, byte cmdlen) 
+int PN532::WaitCommand()
 {
-    WriteCommand(cmd, cmdlen);
-    return ReadAck();
+    while (PollCommand() == RESULT_Busy)
+    {
+        Utils::DelayMicro(GetPollDelay());
+    }
+    return CompleteCommand();
+}
+
+/**************************************************************************
+    Sends a command and waits for the response.
+    returns the count of response bytes in mu8_PacketBuffer (starting with 0xD5) or 0 on error
+**************************************************************************/
+int PN532::ExecuteCommand(byte* cmd, int cmdlen)
+{
+    if (!SubmitCommand(cmd, cmdlen))
+        return 0;
+
+    return WaitCommand();
 }
 
 /**************************************************************************
@@ -687,77 +1376,72 @@ bool PN532::SendCommandCheckAck(byte *cmd, byte cmdlen)
     param  cmd       Command buffer
     param  cmdlen    Command length in bytes
 **************************************************************************/
-void PN532::WriteCommand(byte* cmd, byte cmdlen)
+void PN532::WriteCommand(byte* cmd, int cmdlen)
 {
     byte TxBuffer[PN532_PACKBUFFSIZE + 10];
     int P=0;
     TxBuffer[P++] = PN532_PREAMBLE;    // 00
     TxBuffer[P++] = PN532_STARTCODE1;  // 00
     TxBuffer[P++] = PN532_STARTCODE2;  // FF
-    TxBuffer[P++] = cmdlen + 1;
-    TxBuffer[P++] = 0xFF - cmdlen;
+
+    int frameLen = cmdlen + 1; // + TFI
+    if (frameLen > 0xFF)
+    {
+        // Extended information frame: 0xFF 0xFF + 2 byte length + length checksum
+        TxBuffer[P++] = 0xFF;
+        TxBuffer[P++] = 0xFF;
+        TxBuffer[P++] = frameLen >> 8;
+        TxBuffer[P++] = frameLen & 0xFF;
+        TxBuffer[P++] = 0x100 - ((frameLen >> 8) + (frameLen & 0xFF));
+    }
+    else
+    {
+        TxBuffer[P++] = frameLen;
+        TxBuffer[P++] = 0x100 - frameLen;
+    }
+
+    int dataStart = P;
     TxBuffer[P++] = PN532_HOSTTOPN532; // D4
     
-    for (byte i=0; i<cmdlen; i++) 
+    for (int i=0; i<cmdlen; i++) 
     {
         TxBuffer[P++] = cmd[i];
     }
 
+    // TFI + data + checksum must sum up to zero
     byte checksum = 0;
-    for (byte i=0; i<P; i++) 
+    for (int i=dataStart; i<P; i++) 
     {
        checksum += TxBuffer[i];
     }
 
-    TxBuffer[P++] = ~checksum;
+    TxBuffer[P++] = 0x100 - checksum;
     TxBuffer[P++] = PN532_POSTAMBLE; // 00
 
+    mu8_CmdCode = cmd[0];
     SendPacket(TxBuffer, P);
+    Trace(TRACE_Out, P, TRACE_OK);
    
     if (mu8_DebugLevel > 1)
     {
         Utils::Print("Sending:  ");
-        Utils::PrintHexBuf(TxBuffer, P, LF, 5, cmdlen + 6);
+        Utils::PrintHexBuf(TxBuffer, P, LF, dataStart, dataStart + frameLen);
     }
 }
 
 /**************************************************************************
     Send a data packet
 **************************************************************************/
-void PN532::SendPacket(byte* buff, byte len)
+void PN532::SendPacket(byte* buff, int len)
 {
-    #if (USE_HARDWARE_SPI || USE_SOFTWARE_SPI) 
-    {
-        Utils::WritePin(mu8_SselPin, LOW);
-        Utils::DelayMilli(2);  // INDISPENSABLE!!
-
-        if (mu8_DebugLevel > 2) Utils::Print("WriteCommand(): write DATAWRITE\r\n");
-        SpiWrite(PN532_SPI_DATAWRITE);
+    mb_IrqFlag = false; // an old response that has never been read must not signal readiness for the new command
 
-        for (byte i=0; i<len; i++) 
-        {
-            SpiWrite(buff[i]);
-        }
-
-        Utils::WritePin(mu8_SselPin, HIGH);
-        Utils::DelayMicro(PN532_SOFT_SPI_DELAY);
-    }
-    #elif USE_HARDWARE_I2C
-    {
-        Utils::DelayMilli(2); // delay is for waking up the board
-    
-        I2cClass::BeginTransmission(PN532_I2C_ADDRESS);
-        for (byte i=0; i<len; i++) 
-        {
-            I2cClass::Write(buff[i]);
-        }   
-        I2cClass::EndTransmission();
-    }
-    #endif
+    if (mu8_DebugLevel > 2) Utils::Print("SendPacket(): write frame\r\n");
+    mpi_Transport->WriteFrame(buff, len);
 }
 
 /**************************************************************************
-    Read the ACK packet (acknowledge)
+    Read the ACK packet (acknowledge). The PN532 must be ready (IsResponseReady()).
 **************************************************************************/
 bool PN532::ReadAck() 
 {
@@ -766,8 +1450,9 @@ bool PN532::ReadAck()
     
     // ATTENTION: Never read more than 6 bytes here!
     // The PN532 has a bug in SPI mode which results in the first byte of the response missing if more than 6 bytes are read here!
-    if (!ReadPacket(ackbuff, sizeof(ackbuff)))
-        return false; // Timeout
+    BeginRead(sizeof(ackbuff));
+    ReadBytes(ackbuff, sizeof(ackbuff));
+    EndRead();
 
     if (mu8_DebugLevel > 2)
     {
@@ -777,33 +1462,25 @@ bool PN532::ReadAck()
     
     if (memcmp(ackbuff, Ack, sizeof(Ack)) != 0)
     {
+        Trace(TRACE_In, sizeof(ackbuff), TRACE_NoAck);
         Utils::Print("*** No ACK frame received\r\n");
         return false;
     }
+    Trace(TRACE_In, sizeof(ackbuff), TRACE_OK);
     return true;
 }
 
 /**************************************************************************
-    Reads n bytes of data from the PN532 via SPI or I2C and checks for valid data.
-    param  buff      Pointer to the buffer where data will be written
-    param  len       Number of bytes to read
-    returns the number of bytes that have been copied to buff (< len) or 0 on error
+    Reads a response frame from the PN532 via SPI or I2C and checks it while the bytes arrive.
+    First the start code and the length are read, then exactly the remaining bytes of the frame.
+    So a short error frame does not cost the bus time of the longest expected response.
+    param  buff      Pointer to the buffer where the data bytes will be written
+    param  len       Size of buff
+    The PN532 must be ready (IsResponseReady()).
+    returns the number of data bytes that have been copied to buff or 0 on error
 **************************************************************************/
-byte PN532::ReadData(byte* buff, byte len) 
+int PN532::ReadData(byte* buff, int len) 
 { 
-    byte RxBuffer[PN532_PACKBUFFSIZE];
-        
-    const byte MIN_PACK_LEN = 2 /*start bytes*/ + 2 /*length + length checksum */ + 1 /*checksum*/;
-    if (len < MIN_PACK_LEN || len > PN532_PACKBUFFSIZE)
-    {
-        Utils::Print("ReadData(): len is invalid\r\n");
-        return 0;
-    }
-    
-    if (!ReadPacket(RxBuffer, len))
-        return 0; // timeout
-
-    // The following important validity check was completely missing in Adafruit code (added by Elmü)
     // PN532 documentation says (chapter 6.2.1.6): 
     // Before the start code (0x00 0xFF) there may be any number of additional bytes that must be ignored.
     // After the checksum there may be any number of additional bytes that must be ignored.
@@ -812,51 +1489,93 @@ byte PN532::ReadData(byte* buff, byte len)
     // preamble   0x00   -> skipped (optional, the PN532 does not send it always!!!!!)
     // start code 0x00   -> skipped
     // start code 0xFF   -> skipped
-    // length            -> skipped
+    // length            -> skipped (0xFF 0xFF + 2 byte length for an extended frame)
     // length checksum   -> skipped
     // data[0...n]       -> returned to the caller (first byte is always 0xD5)
     // checksum          -> skipped
-    // postamble         -> skipped (optional, the PN532 may not send it!)
-    // any bytes behind  -> skipped (never seen, but documentation says to ignore them)
+    // postamble         -> not read (optional, the PN532 may not send it!), HSU: read and skipped
+
+    const int MAX_LEADING = 8; // maximum count of bytes before the start code that are skipped
+    const int MAX_HEADER  = MAX_LEADING + 2 /*start code*/ + 5 /*extended length + length checksum*/;
+    byte RxBuffer[MAX_HEADER + PN532_PACKBUFFSIZE + 2 /*checksum + postamble*/];
+
+    // HSU: the postamble must be removed from the receive buffer
+    int trailer = mpi_Transport->IsStream() ? 2 : 1;
+
+    // I2C: the data is requested at once, this is the longest frame that fits into buff
+    BeginRead(MAX_HEADER + len + trailer);
 
     const char* Error = NULL;
     int Brace1 = -1;
     int Brace2 = -1;
     int dataLength = 0;
+    int P = 0; // count of bytes in RxBuffer
     do
     {
-        int startCode = -1;
-        for (int i=0; i<=len-MIN_PACK_LEN; i++)
+        // The preamble, the start code, the length and the length checksum
+        ReadBytes(RxBuffer, 5);
+        P = 5;
+
+        int startCode = 0;
+        while (RxBuffer[startCode]   != PN532_STARTCODE1 || 
+               RxBuffer[startCode+1] != PN532_STARTCODE2)
         {
-            if (RxBuffer[i]   == PN532_STARTCODE1 && 
-                RxBuffer[i+1] == PN532_STARTCODE2)
+            if (++startCode + 2 > P)
             {
-                startCode = i;
-                break;
+                if (P >= MAX_LEADING + 2)
+                    break;
+
+                ReadBytes(RxBuffer + P, 1);
+                P ++;
             }
         }
 
-        if (startCode < 0)
+        if (startCode + 2 > P)
         {
             Error = "ReadData() -> No Start Code\r\n";
             break;
         }
-        
+
+        // Leading bytes before the start code -> the length has not been read yet
         int pos = startCode + 2;
+        if (P < pos + 2)
+        {
+            ReadBytes(RxBuffer + P, pos + 2 - P);
+            P = pos + 2;
+        }
+
         dataLength      = RxBuffer[pos++];
         int lengthCheck = RxBuffer[pos++];
-        if ((dataLength + lengthCheck) != 0x100)
+        if (dataLength == 0xFF && lengthCheck == 0xFF) // extended information frame
+        {
+            ReadBytes(RxBuffer + P, pos + 3 - P);
+            P = pos + 3;
+
+            dataLength  = (RxBuffer[pos] << 8) | RxBuffer[pos+1];
+            lengthCheck = RxBuffer[pos] + RxBuffer[pos+1] + RxBuffer[pos+2];
+            pos += 3;
+            if ((lengthCheck & 0xFF) != 0 || dataLength == 0)
+            {
+                Error = "ReadData() -> Invalid extended length checksum\r\n";
+                break;
+            }
+        }
+        else if ((dataLength + lengthCheck) != 0x100)
         {
             Error = "ReadData() -> Invalid length checksum\r\n";
             break;
         }
     
-        if (len < startCode + MIN_PACK_LEN + dataLength)
+        if (dataLength > len)
         {
-            Error = "ReadData() -> Packet is longer than requested length\r\n";
+            Error = "ReadData() -> Packet is longer than the buffer\r\n";
             break;
         }
 
+        // Exactly the data bytes and the checksum (without preamble the first data byte has been read already)
+        ReadBytes(RxBuffer + P, pos + dataLength + trailer - P);
+        P = pos + dataLength + trailer;
+
         Brace1 = pos;
         for (int i=0; i<dataLength; i++)
         {
@@ -865,19 +1584,20 @@ byte PN532::ReadData(byte* buff, byte len)
         Brace2 = pos;
 
         // All returned data blocks must start with PN532TOHOST (0xD5)
-        if (dataLength < 1 || buff[0] != PN532_PN532TOHOST) 
+        if (buff[0] != PN532_PN532TOHOST) 
         {
             Error = "ReadData() -> Invalid data (no PN532TOHOST)\r\n";
             break;
         }
     
-        byte checkSum = 0;
-        for (int i=startCode; i<pos; i++)
+        // TFI + data + checksum must sum up to zero
+        byte checkSum = RxBuffer[pos];
+        for (int i=Brace1; i<Brace2; i++)
         {
             checkSum += RxBuffer[i];
         }
     
-        if (checkSum != (byte)(~RxBuffer[pos]))
+        if (checkSum != 0)
         {
             Error = "ReadData() -> Invalid checksum\r\n";
             break;
@@ -885,11 +1605,14 @@ byte PN532::ReadData(byte* buff, byte len)
     }
     while(false); // This is not a loop. Avoids using goto by using break.
 
+    EndRead();
+    Trace(TRACE_In, P, Error ? TRACE_Invalid : TRACE_OK);
+
     // Always print the package, even if it was invalid.
     if (mu8_DebugLevel > 1)
     {
         Utils::Print("Response: ");
-        Utils::PrintHexBuf(RxBuffer, len, LF, Brace1, Brace2);
+        Utils::PrintHexBuf(RxBuffer, P, LF, Brace1, Brace2);
     }
     
     if (Error)
@@ -902,122 +1625,107 @@ byte PN532::ReadData(byte* buff, byte len)
 }
 
 /**************************************************************************
-    Reads n bytes of data from the PN532 via SPI or I2C and does NOT check for valid data.
-    param  buff      Pointer to the buffer where data will be written
-    param  len       Number of bytes to read
+    Records a frame in the trace ring buffer.
+    This must be fast: it is called for every frame, also in production.
 **************************************************************************/
-bool PN532::ReadPacket(byte* buff, byte len)
-{ 
-    if (!WaitReady())
-        return false;
-        
-    #if (USE_HARDWARE_SPI || USE_SOFTWARE_SPI) 
-    {
-        Utils::WritePin(mu8_SselPin, LOW);
-        Utils::DelayMilli(2); // INDISPENSABLE!! Otherwise reads bullshit
-
-        if (mu8_DebugLevel > 2)  Utils::Print("ReadPacket(): write DATAREAD\r\n");
-        SpiWrite(PN532_SPI_DATAREAD);
-    
-        for (byte i=0; i<len; i++) 
-        {
-            Utils::DelayMilli(1);
-            buff[i] = SpiRead();
-        }
-    
-        Utils::WritePin(mu8_SselPin, HIGH);
-        Utils::DelayMicro(PN532_SOFT_SPI_DELAY);
-        return true;
-    }
-    #elif USE_HARDWARE_I2C
-    {
-        Utils::DelayMilli(2);
-    
-        // read (n+1 to take into account leading Ready byte)
-        I2cClass::RequestFrom((byte)PN532_I2C_ADDRESS, (byte)(len+1));
-
-        // PN532 Manual chapter 6.2.4: Before the data bytes the chip sends a Ready byte.
-        // It is ignored here because it has been checked already in isready()
-        byte u8_Ready = I2cClass::Read();
-        if (mu8_DebugLevel > 2)
-        {
-            Utils::Print("ReadPacket(): read ");
-            Utils::PrintHex8(u8_Ready, LF);
-        }        
-        
-        for (byte i=0; i<len; i++) 
-        {
-            Utils::DelayMilli(1);
-            buff[i] = I2cClass::Read();
-        }
-        return true;
-    }
+void PN532::Trace(byte u8_Dir, int s32_Len, byte u8_Status)
+{
+    #if PN532_TRACE_SIZE > 0
+        kPN532Trace* pk_Entry = &mk_Trace[mu32_TraceCount++ & (PN532_TRACE_SIZE - 1)];
+        pk_Entry->u32_Micros = Utils::GetMicros();
+        pk_Entry->u16_Len    = (uint16_t)s32_Len;
+        pk_Entry->u8_Cmd     = mu8_CmdCode;
+        pk_Entry->u8_Dir     = u8_Dir;
+        pk_Entry->u8_Status  = u8_Status;
     #endif
 }
 
 /**************************************************************************
-    SPI write one byte
+    Copies the newest frames of the trace to pk_Trace, the oldest frame first.
+    param  s32_Max  the size of pk_Trace (entries)
+    returns the count of copied entries
 **************************************************************************/
-void PN532::SpiWrite(byte c) 
+int PN532::GetTrace(kPN532Trace* pk_Trace, int s32_Max)
 {
-    #if USE_HARDWARE_SPI
-    {
-        SpiClass::Transfer(c);
-    }
-    #elif USE_SOFTWARE_SPI
-    {
-        Utils::WritePin(mu8_ClkPin, HIGH);
-        Utils::DelayMicro(PN532_SOFT_SPI_DELAY);
-    
-        for (int i=1; i<=128; i<<=1) 
+    #if PN532_TRACE_SIZE > 0
+        uint32_t u32_Count = min(mu32_TraceCount, (uint32_t)PN532_TRACE_SIZE);
+        if ((int)u32_Count > s32_Max)
+            u32_Count = max(s32_Max, 0);
+
+        uint32_t u32_First = mu32_TraceCount - u32_Count;
+        for (uint32_t i=0; i<u32_Count; i++)
         {
-            Utils::WritePin(mu8_ClkPin, LOW);
-            Utils::DelayMicro(PN532_SOFT_SPI_DELAY);
-            
-            byte level = (c & i) ? HIGH : LOW;
-            Utils::WritePin(mu8_MosiPin, level);
-            Utils::DelayMicro(PN532_SOFT_SPI_DELAY);        
-      
-            Utils::WritePin(mu8_ClkPin, HIGH);
-            Utils::DelayMicro(PN532_SOFT_SPI_DELAY);
+            pk_Trace[i] = mk_Trace[(u32_First + i) & (PN532_TRACE_SIZE - 1)];
         }
-    }
+        return (int)u32_Count;
+    #else
+        return 0;
+    #endif
+}
+
+void PN532::ClearTrace()
+{
+    #if PN532_TRACE_SIZE > 0
+        mu32_TraceCount = 0;
     #endif
 }
 
 /**************************************************************************
-    SPI read one byte
+    Prints the trace as a table. The delta is the time since the previous frame.
+    Call this after a slow operation, not while the timing matters.
 **************************************************************************/
-byte PN532::SpiRead(void) 
+void PN532::DumpTrace()
 {
-    #if USE_HARDWARE_SPI 
-    {
-        return SpiClass::Transfer(0x00);
-    }
-    #elif USE_SOFTWARE_SPI
-    {
-        Utils::WritePin(mu8_ClkPin, HIGH);
-        Utils::DelayMicro(PN532_SOFT_SPI_DELAY);
+    #if PN532_TRACE_SIZE > 0
+        const char* STATUS[] = { "OK", "Abort", "No ACK", "Invalid", "Timeout" };
+
+        uint32_t u32_Count = min(mu32_TraceCount, (uint32_t)PN532_TRACE_SIZE);
+        uint32_t u32_First = mu32_TraceCount - u32_Count;
 
-        int x=0;    
-        for (int i=1; i<=128; i<<=1) 
+        Utils::Print("\r\n*** PN532 frame trace (");
+        Utils::PrintDec(u32_Count, " frames)\r\n");
+        Utils::Print("  Time us  Delta us Dir Cmd  Len Status\r\n");
+
+        char s8_Line[80];
+        uint32_t u32_Prev = 0;
+        for (uint32_t i=0; i<u32_Count; i++)
         {
-            if (Utils::ReadPin(mu8_MisoPin)) 
-            {
-                x |= i;
-            }
-            Utils::WritePin(mu8_ClkPin, LOW);
-            Utils::DelayMicro(PN532_SOFT_SPI_DELAY);
-            Utils::WritePin(mu8_ClkPin, HIGH);
-            Utils::DelayMicro(PN532_SOFT_SPI_DELAY);
+            const kPN532Trace* pk_Entry = &mk_Trace[(u32_First + i) & (PN532_TRACE_SIZE - 1)];
+            uint32_t u32_Delta = (i > 0) ? pk_Entry->u32_Micros - u32_Prev : 0;
+            u32_Prev = pk_Entry->u32_Micros;
+
+            sprintf(s8_Line, "%9u %9u %s  %02X %4u %s\r\n", (unsigned)pk_Entry->u32_Micros, (unsigned)u32_Delta,
+                    pk_Entry->u8_Dir == TRACE_Out ? "->" : "<-", pk_Entry->u8_Cmd, pk_Entry->u16_Len,
+                    pk_Entry->u8_Status < 5 ? STATUS[pk_Entry->u8_Status] : "?");
+            Utils::Print(s8_Line);
         }
-        return x;
-    }
-    #else
-    {
-        return 0; // This code will never execute. Just for the compiler not to complain.
-    }
     #endif
 }
 
+/**************************************************************************
+    Starts reading the response. The PN532 must be ready (IsResponseReady()).
+    The following ReadBytes() calls continue in the same frame until EndRead().
+    param  len   I2C only: the maximum count of bytes that will be read
+**************************************************************************/
+void PN532::BeginRead(int len)
+{
+    if (mu8_DebugLevel > 2) Utils::Print("BeginRead()\r\n");
+    mpi_Transport->BeginRead(len);
+}
+
+/**************************************************************************
+    Reads the next len bytes of the frame that has been started with BeginRead()
+**************************************************************************/
+void PN532::ReadBytes(byte* buff, int len)
+{
+    if (len > 0)
+        mpi_Transport->ReadBytes(buff, len);
+}
 
+/**************************************************************************
+    Finishes the read transfer
+**************************************************************************/
+void PN532::EndRead()
+{
+    mpi_Transport->EndRead();
+}
@@ -3,28 +3,41 @@
 #define ADAFRUIT_PN532_H
 
 #include <Utils.h>
+#include "PN532Transport.h"
 
 // ----------------------------------------------------------------------
 
-// This parameter may be used to slow down the software SPI bus speed.
-// This is required when there is a long cable between the PN532 and the Teensy.
-// This delay in microseconds (not milliseconds!) is made between toggeling the CLK line.
-// Use an oscilloscope to check the resulting speed!
-// A value of 50 microseconds results in a clock signal of 10 kHz
-// A value of 0 results in maximum speed (depends on CPU speed).
-// This parameter is not used for hardware SPI mode.
-#define PN532_SOFT_SPI_DELAY  50
-
-// The clock (in Hertz) when using Hardware SPI mode
+// The clock (in Hertz) when using Hardware SPI mode with the safe timing profile (TIMING_Safe)
 // This parameter is not used for software SPI mode.
 #define PN532_HARD_SPI_CLOCK  1000000
 
+// The clock (in Hertz) of the fast timing profile (TIMING_Fast). The PN532 supports up to 5 MHz.
+#define PN532_FAST_SPI_CLOCK  4000000
+
+// The highest SPI clock (in Hertz) allowed by the datasheet
+#define PN532_MAX_SPI_CLOCK   5000000
+
 // The maximum time to wait for an answer from the PN532
 // Do NOT use infinite timeouts like in Adafruit code!
 #define PN532_TIMEOUT  1000
 
+// When the IRQ pin of the PN532 (P70_IRQ) is connected, the command engine checks the IRQ flag in this interval (microseconds)
+// instead of reading the status byte every 10 ms.
+#define PN532_IRQ_POLL_DELAY  20
+
+// Pin number for SetIrqPin() if the IRQ pin is not connected
+#define PN532_NO_IRQ  0xFF
+
 // The packet buffer is used for sending commands and for receiving responses from the PN532
-#define PN532_PACKBUFFSIZE   80
+// Frames with more than 255 bytes are transferred as extended information frames (PN532 manual chapter 6.2.1.3)
+// which carry up to 265 bytes (TFI + 264 data bytes).
+#define PN532_PACKBUFFSIZE   265
+
+// Count of frames that are kept in the trace ring buffer (see PN532::GetTrace()).
+// Must be a power of 2. Each entry needs 12 bytes of RAM. 0 disables the trace.
+#ifndef PN532_TRACE_SIZE
+    #define PN532_TRACE_SIZE  64
+#endif
 
 // ----------------------------------------------------------------------
 
@@ -70,16 +83,6 @@
 #define PN532_COMMAND_TGRESPONSETOINITIATOR (0x90)
 #define PN532_COMMAND_TGGETTARGETSTATUS     (0x8A)
 
-#define PN532_WAKEUP                        (0x55)
-
-#define PN532_SPI_STATUSREAD                (0x02)
-#define PN532_SPI_DATAWRITE                 (0x01)
-#define PN532_SPI_DATAREAD                  (0x03)
-#define PN532_SPI_READY                     (0x01)
-
-#define PN532_I2C_ADDRESS                   (0x48 >> 1)
-#define PN532_I2C_READY                     (0x01)
-
 #define PN532_GPIO_P30                      (0x01)
 #define PN532_GPIO_P31                      (0x02)
 #define PN532_GPIO_P32                      (0x04)
@@ -94,6 +97,22 @@
 #define CARD_TYPE_106KB_ISO14443B           (0x03) // card baudrate 106 kB
 #define CARD_TYPE_106KB_JEWEL               (0x04) // card baudrate 106 kB
 
+// Target types of InAutoPoll (manual chapter 7.3.13)
+#define AUTOPOLL_TYPE_GENERIC_106A          (0x00) // ISO14443-4A, Mifare and DEP
+#define AUTOPOLL_TYPE_MIFARE                (0x10) // Mifare (no RATS)
+#define AUTOPOLL_TYPE_ISO14443_4A           (0x20) // ISO14443-4A (RATS is sent, required for Desfire)
+
+// The interval of InAutoPoll in units of 150 ms (1 ... 15) while no card is in the field.
+// This is the longest additional delay until a card is detected. Between the polls the RF field is off.
+#define PN532_AUTOPOLL_PERIOD  1
+
+// Without IRQ pin PollAutoPoll() reads the status byte at most once in this interval (microseconds)
+#define PN532_AUTOPOLL_CHECK_US  10000
+
+// The highest RF bit rate for NegotiateBitRate().
+// The PN532 supports 212 and 424 kbit for ISO14443A (datasheet chapter 7.2). 848 kbit is only defined by ISO14443-4.
+#define PN532_MAX_BITRATE  BITRATE_424
+
 // Prefixes for NDEF Records (to identify record type), not used
 #define NDEF_URIPREFIX_NONE                 (0x00)
 #define NDEF_URIPREFIX_HTTP_WWWDOT          (0x01)
@@ -132,6 +151,20 @@
 #define NDEF_URIPREFIX_URN_EPC              (0x22)
 #define NDEF_URIPREFIX_URN_NFC              (0x23)
 
+enum ePN532Timing
+{
+    TIMING_Safe = 0, // the original conservative timing: 2 ms after chip select, 1 ms per received byte
+    TIMING_Fast = 1, // burst transfers with short delays
+};
+
+// Result of PN532::PollCommand()
+enum ePN532Result
+{
+    RESULT_Busy     = 0, // the command is still being executed
+    RESULT_Complete = 1, // the response has been received
+    RESULT_Error    = 2, // no command submitted, timeout, no ACK or invalid response
+};
+
 enum eCardType
 {
     CARD_Unknown   = 0, // Mifare Classic or other card
@@ -139,61 +172,202 @@ enum eCardType
     CARD_DesRandom = 3, // A Desfire card with 4 byte random UID  (bit 0 + 1)
 };
 
+// RF bit rates of InPSL (manual chapter 7.3.4), the same in both directions
+enum ePN532BitRate
+{
+    BITRATE_106 = 0, // after activation
+    BITRATE_212 = 1,
+    BITRATE_424 = 2,
+    BITRATE_848 = 3,
+};
+
+// Latency profiles of the RFConfiguration, see PN532::SetRfConfig()
+enum ePN532RfProfile
+{
+    RFPROFILE_Conservative = 0, // the power-up values of the PN532: long timeouts, the passive activation retries forever
+    RFPROFILE_FastGate     = 1, // short timeouts, a poll without card returns at once, the card must be close to the reader
+    RFPROFILE_LongRange    = 2, // long timeouts and retries for cards at the edge of the field
+};
+
+// RFConfiguration items (manual chapter 7.3.1).
+// Timeouts are the codes of the manual: 0 = none, n = 100 us * 2^(n-1) (0x01 = 100 us ... 0x0A = 51.2 ms ... 0x10 = 3.28 s)
+struct kPN532RfConfig
+{
+    byte u8_AtrTimeout;      // item 2: timeout for ATR_RES (ISO18092 targets)
+    byte u8_RetryTimeout;    // item 2: timeout for the answer of non-DEP targets (InDataExchange, presence check)
+    byte u8_MaxRtyCOM;       // item 4: retries of InDataExchange / InCommunicateThru after a timeout
+    byte u8_MaxRtyATR;       // item 5: retries of ATR_REQ
+    byte u8_MaxRtyPSL;       // item 5: retries of PSL_REQ / PPS
+    byte u8_MaxRtyPassive;   // item 5: retries of the passive activation (InListPassiveTarget), 0xFF = until a card is found
+};
+
+// Direction of a frame in the trace
+enum eTraceDir
+{
+    TRACE_Out = 0, // host -> PN532 (command, ACK that aborts a command)
+    TRACE_In  = 1, // PN532 -> host (ACK, response)
+};
+
+// Result of a frame in the trace
+enum eTraceStatus
+{
+    TRACE_OK      = 0,
+    TRACE_Abort   = 1, // the host has sent an ACK to abort the pending command
+    TRACE_NoAck   = 2, // the PN532 has not acknowledged the command
+    TRACE_Invalid = 3, // invalid response frame (start code, length, checksum)
+    TRACE_Timeout = 4, // no response within the timeout (nothing was transferred)
+};
+
+// One entry of the frame trace
+struct kPN532Trace
+{
+    uint32_t u32_Micros; // micros() after the frame has been transferred
+    uint16_t u16_Len;    // bytes on the bus (including preamble, checksums, postamble)
+    byte     u8_Cmd;     // command code of the command that the frame belongs to
+    byte     u8_Dir;     // eTraceDir
+    byte     u8_Status;  // eTraceStatus
+};
+
 class PN532
 {
  public:
     PN532();
     
-    #if USE_SOFTWARE_SPI
-        void InitSoftwareSPI(byte u8_Clk, byte u8_Miso, byte u8_Mosi, byte u8_Sel, byte u8_Reset);
-    #endif
-    #if USE_HARDWARE_SPI
-        void InitHardwareSPI(byte u8_Sel, byte u8_Reset);    
-    #endif
-    #if USE_HARDWARE_I2C
-        void InitI2C        (byte u8_Reset);
-    #endif
+    // The transport (PN532HardSpi, PN532SoftSpi, PN532I2c, ...) must exist as long as this instance.
+    void Init(PN532Transport* pi_Transport, byte u8_Reset);
     
     // Generic PN532 functions
     void begin();  
     void SetDebugLevel(byte level);
+    void SetIrqPin(byte u8_Irq);
+    void SetTiming(ePN532Timing e_Timing);
+    void SetTiming(const kPN532Timing* pk_Timing);
     bool SamConfig();
+    bool SetSerialBaudRate(uint32_t u32_Baud);
+    uint32_t GetSerialBaudRate();
+    bool SetSpiClock(uint32_t u32_Clock);
+    uint32_t GetSpiClock();
+    bool TestCommunication();
     bool GetFirmwareVersion(byte* pIcType, byte* pVersionHi, byte* pVersionLo, byte* pFlags);
     bool WriteGPIO(bool P30, bool P31, bool P33, bool P35);
     bool SetPassiveActivationRetries();
+    bool SetRfField(bool b_On, bool b_AutoRFCA = false);
+    bool SetRfTimeouts(byte u8_AtrTimeout, byte u8_RetryTimeout);
+    bool SetMaxRetryCom(byte u8_MaxRtyCOM);
+    bool SetMaxRetries(byte u8_MaxRtyATR, byte u8_MaxRtyPSL, byte u8_MaxRtyPassive);
+    bool SetRfConfig(ePN532RfProfile e_Profile);
+    bool SetRfConfig(const kPN532RfConfig* pk_Config);
+    const kPN532RfConfig* GetRfConfig();
+    static const char* GetRfProfileName(ePN532RfProfile e_Profile);
+    static bool FindRfProfile(const char* s8_Name, ePN532RfProfile* pe_Profile);
     bool DeselectCard();
     bool ReleaseCard();
     bool SelectCard();
 
-    // This function is overridden in Desfire.cpp
+    // These functions are overridden in Desfire.cpp
     virtual bool SwitchOffRfField();
+    virtual void OnCardReset();
             
     // ISO14443A functions
     bool ReadPassiveTargetID(byte* uidBuffer, byte* uidLength, eCardType* pe_CardType);
 
+    // Non-blocking command engine: SubmitCommand() sends the frame and returns at once,
+    // PollCommand() reads the ACK and the response when the PN532 is ready.
+    bool         SubmitCommand(byte* cmd, int cmdlen, uint32_t u32_Timeout = PN532_TIMEOUT);
+    ePN532Result PollCommand();
+    void         AbortCommand();
+    bool         IsCommandPending();
+    uint32_t     GetResponseReadyTime() { return mu32_CmdReady; }
+
+    // Non-blocking version of ReadPassiveTargetID()
+    bool         StartPassiveTargetID(uint32_t u32_Timeout = 0);
+    ePN532Result PollPassiveTargetID(byte* uidBuffer, byte* uidLength, eCardType* pe_CardType);
+
+    // Card detection with InAutoPoll: the PN532 polls by itself and only answers when a card has been found.
+    bool         StartAutoPoll(byte u8_PollNr = 0xFF, byte u8_Period = PN532_AUTOPOLL_PERIOD, uint32_t u32_Timeout = 0);
+    ePN532Result PollAutoPoll(byte* uidBuffer, byte* uidLength, eCardType* pe_CardType);
+
+    // Checks if the activated ISO14443-4 card (Desfire) is still in the field without selecting it again
+    bool         CheckPresence(bool* pb_Present);
+    bool         StartPresenceCheck();
+    ePN532Result PollPresenceCheck(bool* pb_Present);
+
+    // RF bit rate of the activated ISO14443-4 card (ePN532BitRate)
+    bool     SetBitRate(byte u8_BitRate);
+    byte     NegotiateBitRate(byte u8_MaxRate = PN532_MAX_BITRATE);
+    byte     GetBitRate();
+    static uint16_t GetBitRateKbps(byte u8_BitRate);
+
+    // Frame trace: the last PN532_TRACE_SIZE frames with timestamps, recorded without any debug output
+    int  GetTrace(kPN532Trace* pk_Trace, int s32_Max);
+    void ClearTrace();
+    void DumpTrace();
+
  protected:	
+    // States of the command engine
+    enum eCommandState
+    {
+        CMD_Idle,
+        CMD_WaitAck,
+        CMD_WaitResponse,
+        CMD_Complete,
+        CMD_Failed,
+    };
+
+    // Synchronous command = SubmitCommand() + PollCommand() until complete
+    int  ExecuteCommand(byte* cmd, int cmdlen);
+    int  WaitCommand();
+    int  CompleteCommand();
+    bool ParsePassiveTargetID(int len, byte* u8_UidBuffer, byte* pu8_UidLength, eCardType* pe_CardType);
+    bool ParseAutoPoll(int len, byte* u8_UidBuffer, byte* pu8_UidLength, eCardType* pe_CardType);
+    bool ParsePresence(int len, bool* pb_Present);
+    bool ParseTargetData(const byte* pu8_Target, int s32_Len, byte* u8_UidBuffer, byte* pu8_UidLength, eCardType* pe_CardType);
+
+    void     Restart();
+    uint32_t NegotiateBaudRate();
+    bool     WriteRfConfig(byte u8_Item, const byte* u8_Data, int s32_Len);
+
     // Low Level functions
     bool CheckPN532Status(byte u8_Status);
-    bool SendCommandCheckAck(byte *cmd, byte cmdlen);    
-    byte ReadData    (byte* buff, byte len);
-    bool ReadPacket  (byte* buff, byte len);
-    void WriteCommand(byte* cmd,  byte cmdlen);
-    void SendPacket  (byte* buff, byte len);
+    int  ReadData    (byte* buff, int len);
+    void BeginRead   (int len);
+    void ReadBytes   (byte* buff, int len);
+    void EndRead     ();
+    void WriteCommand(byte* cmd,  int cmdlen);
+    void SendPacket  (byte* buff, int len);
     bool IsReady();
-    bool WaitReady();
+    bool IsResponseReady();
+    uint16_t GetPollDelay();
+    bool IsIrqActive();
+    static void OnIrq(void* pv_PN532);
     bool ReadAck();
-    void SpiWrite(byte c);
-    byte SpiRead(void);
+    void Trace(byte u8_Dir, int s32_Len, byte u8_Status);
 
     byte mu8_DebugLevel;   // 0, 1, or 2
     byte mu8_PacketBuffer[PN532_PACKBUFFSIZE];
 
  private:
-    byte mu8_ClkPin;
-    byte mu8_MisoPin;  
-    byte mu8_MosiPin;  
-    byte mu8_SselPin;  
+    PN532Transport* mpi_Transport;
     byte mu8_ResetPin;
+    byte mu8_IrqPin;
+    kPN532Timing mk_Timing;
+    kPN532RfConfig mk_RfConfig;   // the RFConfiguration that has been sent to the PN532
+    volatile bool mb_IrqFlag; // set by the interrupt when the PN532 pulls the IRQ pin low
+
+    eCommandState me_CmdState;
+    uint32_t      mu32_CmdStart;   // millis() when the ACK / response wait has started
+    uint32_t      mu32_CmdTimeout; // 0 = wait forever
+    uint32_t      mu32_CmdReady;   // micros() when PollCommand() has found the response ready (before reading it)
+    int           ms32_CmdRespLen; // data bytes in mu8_PacketBuffer after the command has completed
+    byte          mu8_CmdCode;     // the command that is being executed (for the trace)
+    uint32_t      mu32_LastCheck;  // micros() of the last ready check in PollAutoPoll()
+    byte          mu8_CardTA;      // TA(1) of the ATS of the activated card (supported bit rates), 0 = 106 kbit only
+    byte          mu8_BitRate;     // ePN532BitRate of the activated card
+
+    #if PN532_TRACE_SIZE > 0
+        kPN532Trace mk_Trace[PN532_TRACE_SIZE];
+        uint32_t    mu32_TraceCount; // count of frames recorded since ClearTrace(), the ring index is this & (PN532_TRACE_SIZE - 1)
+    #endif
 };
 
 #endif
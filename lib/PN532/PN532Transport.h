@@ -0,0 +1,615 @@
+/**************************************************************************
+
+    Transports that move the frames between the host and the PN532.
+
+    The PN532 class builds and checks the frames. A transport only knows how to
+    ask the chip if it is ready and how to write and read the raw bytes on one bus:
+
+    PN532HardSpi   Hardware SPI (SpiClass)
+    PN532SoftSpi   Software SPI on 4 regular digital pins
+    PN532FastSoftSpi  Software SPI with direct GPIO register access and the clock of the timing profile
+    PN532I2c       Hardware I2C (I2cClass)
+    PN532Hsu       High speed UART (HardwareSerial) up to 921600 baud
+
+    Each PN532 instance gets its transport in PN532::Init(), so one firmware can
+    drive several readers on different buses at the same time.
+
+    Both SPI transports are the same template (PN532SpiTransport) which is
+    parameterized with a bus policy (HardSpiBus, SoftSpiBus, FastSoftSpiBus). The policy is a plain
+    class without virtual functions: the byte and bit loops are resolved at compile
+    time and inlined. PN532 calls the transport only once per frame operation
+    (status check, write frame, begin / read / end of a response).
+
+    A transport for another bus (or a mock for the host build) is derived from
+    PN532Transport and overrides the functions below.
+
+**************************************************************************/
+
+#ifndef PN532_TRANSPORT_H
+#define PN532_TRANSPORT_H
+
+#include <Utils.h>
+
+// This parameter may be used to slow down the software SPI bus speed.
+// This is required when there is a long cable between the PN532 and the Teensy.
+// This delay in microseconds (not milliseconds!) is made between toggeling the CLK line.
+// Use an oscilloscope to check the resulting speed!
+// A value of 50 microseconds results in a clock signal of 10 kHz
+// A value of 0 results in maximum speed (depends on CPU speed).
+// This parameter is not used for hardware SPI mode.
+#define PN532_SOFT_SPI_DELAY  50
+
+#define PN532_WAKEUP                        (0x55)
+
+#define PN532_SPI_STATUSREAD                (0x02)
+#define PN532_SPI_DATAWRITE                 (0x01)
+#define PN532_SPI_DATAREAD                  (0x03)
+#define PN532_SPI_READY                     (0x01)
+
+#define PN532_I2C_ADDRESS                   (0x48 >> 1)
+#define PN532_I2C_READY                     (0x01)
+// Longest I2C read transfer: the receive buffer of the Wire library (128 bytes on the ESP32, 32 on AVR)
+#ifndef PN532_I2C_MAX_READ
+    #define PN532_I2C_MAX_READ  128
+#endif
+// Preamble + start code + LEN + LCS of a response, read first to get the length of the frame
+#define PN532_I2C_HEADER_LEN  5
+// Time (milliseconds) that the PN532 may need to send the response again after a NACK frame
+#define PN532_I2C_RESEND_TIMEOUT  10
+
+// The PN532 always starts with 115200 baud in HSU mode. PN532::begin() switches to the highest stable baud rate
+// up to the maximum of the transport (SetSerialBaudRate, manual chapter 7.2.13).
+#define PN532_HSU_BAUD          115200
+#define PN532_HSU_MAX_BAUD      921600
+// The maximum time (milliseconds) to wait for the next byte of a frame that is being received
+#define PN532_HSU_BYTE_TIMEOUT  10
+
+// Timing of the SPI / I2C transport, see PN532::SetTiming()
+struct kPN532Timing
+{
+    uint32_t u32_SpiClock;   // Hardware SPI and fast Software SPI clock in Hertz
+    uint16_t u16_SelectUs;   // delay after the chip select goes low before the first byte is clocked
+    uint16_t u16_DeselectUs; // delay after the chip select goes high
+    uint16_t u16_ByteUs;     // delay before each received byte (only if b_Burst == false)
+    uint16_t u16_PollUs;     // interval for reading the status byte while a command is pending when no IRQ pin is connected
+    bool     b_Burst;        // true -> the frame is transferred with one SPI call (DMA) instead of byte by byte (Hardware SPI only)
+};
+
+// -------------------------------------------------------------------------------------------------------------------
+
+class PN532Transport
+{
+public:
+    PN532Transport()
+    {
+        mpk_Timing = NULL;
+    }
+
+    // Called from PN532::begin() after the reset. pk_Timing stays valid as long as the PN532 exists.
+    virtual void Begin(const kPN532Timing* pk_Timing) = 0;
+    // Wakes the PN532 up after the reset (chapter 7.2.11)
+    virtual void WakeUp() {}
+    // returns true if the PN532 has a frame ready to be read
+    virtual bool IsReady() = 0;
+    // Writes a complete frame
+    virtual void WriteFrame(const byte* u8_Frame, int s32_Len) = 0;
+    // Starts reading a frame. s32_MaxLen is the maximum count of bytes that will be read.
+    virtual void BeginRead(int s32_MaxLen) = 0;
+    // Reads the next bytes of the frame. May be called multiple times between BeginRead() and EndRead().
+    virtual void ReadBytes(byte* u8_Buff, int s32_Len) = 0;
+    virtual void EndRead() = 0;
+
+    // true -> the bus is a byte stream (UART): the PN532 pushes the frames, IsReady() costs no bus transfer
+    // and the postamble must be read, otherwise it would appear in front of the next frame.
+    virtual bool     IsStream()                     { return false; }
+    // UART only: the current and the highest baud rate of the host side, 0 for other buses
+    virtual uint32_t GetBaudRate()                  { return 0; }
+    virtual uint32_t GetMaxBaudRate()               { return 0; }
+    // UART only: switches the host side to another baud rate after all bytes have been sent
+    virtual bool     SetBaudRate(uint32_t u32_Baud) { return false; }
+    // Hardware SPI and fast Software SPI: applies a new kPN532Timing.u32_SpiClock to the running bus
+    virtual bool     UpdateClock()                  { return false; }
+
+protected:
+    const kPN532Timing* mpk_Timing;
+};
+
+// -------------------------------------------------------------------------------------------------------------------
+
+// Bus policy for PN532SpiTransport: Hardware SPI
+class HardSpiBus
+{
+public:
+    // The frame can be transferred with one SPI call if kPN532Timing.b_Burst is set
+    static const bool BURST = true;
+
+    inline void Begin(const kPN532Timing* pk_Timing)
+    {
+        SpiClass::Begin(pk_Timing->u32_SpiClock);
+    }
+    inline bool SetClock(uint32_t u32_Clock)
+    {
+        SpiClass::SetClock(u32_Clock);
+        return true;
+    }
+    // Several PN532 with different clocks (calibration) may share the bus: each one switches to its own clock
+    inline void Select(const kPN532Timing* pk_Timing)
+    {
+        SpiClass::UseClock(pk_Timing->u32_SpiClock);
+    }
+    inline void Write(byte u8_Data)
+    {
+        SpiClass::Transfer(u8_Data);
+    }
+    inline byte Read()
+    {
+        return SpiClass::Transfer(0x00);
+    }
+    inline void TransferBytes(const byte* pu8_Out, byte* pu8_In, int s32_Count)
+    {
+        SpiClass::TransferBytes(pu8_Out, pu8_In, s32_Count);
+    }
+};
+
+// Bus policy for PN532SpiTransport: Software SPI (LSB first, clock idle high)
+class SoftSpiBus
+{
+public:
+    static const bool BURST = false;
+
+    SoftSpiBus(byte u8_Clk, byte u8_Miso, byte u8_Mosi)
+    {
+        mu8_ClkPin  = u8_Clk;
+        mu8_MisoPin = u8_Miso;
+        mu8_MosiPin = u8_Mosi;
+    }
+
+    inline void Begin(const kPN532Timing* pk_Timing)
+    {
+        Utils::SetPinMode(mu8_ClkPin,  OUTPUT);
+        Utils::SetPinMode(mu8_MosiPin, OUTPUT);
+        Utils::SetPinMode(mu8_MisoPin, INPUT);
+    }
+    // The speed is defined by PN532_SOFT_SPI_DELAY
+    inline bool SetClock(uint32_t u32_Clock)
+    {
+        return false;
+    }
+    inline void Select(const kPN532Timing* pk_Timing) {}
+    void Write(byte c)
+    {
+        Utils::WritePin(mu8_ClkPin, HIGH);
+        Utils::DelayMicro(PN532_SOFT_SPI_DELAY);
+
+        for (int i=1; i<=128; i<<=1)
+        {
+            Utils::WritePin(mu8_ClkPin, LOW);
+            Utils::DelayMicro(PN532_SOFT_SPI_DELAY);
+
+            byte level = (c & i) ? HIGH : LOW;
+            Utils::WritePin(mu8_MosiPin, level);
+            Utils::DelayMicro(PN532_SOFT_SPI_DELAY);
+
+            Utils::WritePin(mu8_ClkPin, HIGH);
+            Utils::DelayMicro(PN532_SOFT_SPI_DELAY);
+        }
+    }
+    byte Read()
+    {
+        Utils::WritePin(mu8_ClkPin, HIGH);
+        Utils::DelayMicro(PN532_SOFT_SPI_DELAY);
+
+        int x=0;
+        for (int i=1; i<=128; i<<=1)
+        {
+            if (Utils::ReadPin(mu8_MisoPin))
+            {
+                x |= i;
+            }
+            Utils::WritePin(mu8_ClkPin, LOW);
+            Utils::DelayMicro(PN532_SOFT_SPI_DELAY);
+            Utils::WritePin(mu8_ClkPin, HIGH);
+            Utils::DelayMicro(PN532_SOFT_SPI_DELAY);
+        }
+        return x;
+    }
+    // never called because BURST == false
+    inline void TransferBytes(const byte* pu8_Out, byte* pu8_In, int s32_Count) {}
+
+private:
+    byte mu8_ClkPin;
+    byte mu8_MisoPin;
+    byte mu8_MosiPin;
+};
+
+// Bus policy for PN532SpiTransport: fast Software SPI (LSB first, clock idle high) for boards that must bit-bang
+// (pin conflicts, several readers). The same bit sequence as SoftSpiBus, but the pins are written directly
+// over the GPIO registers (FastPin) and the delay is derived from kPN532Timing.u32_SpiClock in nanoseconds,
+// so the clock comes close to Hardware SPI and follows PN532::SetSpiClock() (calibration).
+class FastSoftSpiBus
+{
+public:
+    static const bool BURST = false;
+
+    FastSoftSpiBus(byte u8_Clk, byte u8_Miso, byte u8_Mosi)
+    {
+        mu8_ClkPin   = u8_Clk;
+        mu8_MisoPin  = u8_Miso;
+        mu8_MosiPin  = u8_Mosi;
+        mu32_HalfClk = 0;
+    }
+
+    inline void Begin(const kPN532Timing* pk_Timing)
+    {
+        Utils::SetPinMode(mu8_ClkPin,  OUTPUT);
+        Utils::SetPinMode(mu8_MosiPin, OUTPUT);
+        Utils::SetPinMode(mu8_MisoPin, INPUT);
+        mi_Clk .Attach(mu8_ClkPin);
+        mi_Miso.Attach(mu8_MisoPin);
+        mi_Mosi.Attach(mu8_MosiPin);
+        mi_Clk .Write(HIGH);
+        SetClock(pk_Timing->u32_SpiClock);
+    }
+    // The time for writing the pins is not subtracted, so the real clock is a bit lower than u32_Clock
+    inline bool SetClock(uint32_t u32_Clock)
+    {
+        mu32_HalfClk = Utils::GetDelayTicks(500000000 / max(u32_Clock, (uint32_t)1));
+        return true;
+    }
+    // Each instance has its own pins and delay
+    inline void Select(const kPN532Timing* pk_Timing) {}
+    inline void Write(byte u8_Data)
+    {
+        for (int i=0; i<8; i++)
+        {
+            mi_Clk .Write(LOW);
+            mi_Mosi.Write(u8_Data & 1);
+            u8_Data >>= 1;
+            Utils::DelayTicks(mu32_HalfClk);
+            mi_Clk .Write(HIGH);
+            Utils::DelayTicks(mu32_HalfClk);
+        }
+    }
+    inline byte Read()
+    {
+        byte u8_Data = 0;
+        for (int i=0; i<8; i++)
+        {
+            u8_Data |= mi_Miso.Read() << i;
+            mi_Clk.Write(LOW);
+            Utils::DelayTicks(mu32_HalfClk);
+            mi_Clk.Write(HIGH);
+            Utils::DelayTicks(mu32_HalfClk);
+        }
+        return u8_Data;
+    }
+    // never called because BURST == false
+    inline void TransferBytes(const byte* pu8_Out, byte* pu8_In, int s32_Count) {}
+
+private:
+    byte     mu8_ClkPin;
+    byte     mu8_MisoPin;
+    byte     mu8_MosiPin;
+    uint32_t mu32_HalfClk; // Utils::DelayTicks() for one half of the clock period
+    FastPin  mi_Clk;
+    FastPin  mi_Miso;
+    FastPin  mi_Mosi;
+};
+
+// -------------------------------------------------------------------------------------------------------------------
+
+// SPI framing of the PN532 (manual chapter 6.2.5): status read, data write and data read operations
+// Bus = HardSpiBus, SoftSpiBus or FastSoftSpiBus
+template <class Bus>
+class PN532SpiTransport : public PN532Transport
+{
+public:
+    PN532SpiTransport(byte u8_Sel, const Bus& i_Bus = Bus()) : mi_Bus(i_Bus)
+    {
+        mu8_SselPin = u8_Sel;
+    }
+
+    virtual void Begin(const kPN532Timing* pk_Timing)
+    {
+        mpk_Timing = pk_Timing;
+        Utils::SetPinMode (mu8_SselPin, OUTPUT);
+        Utils::WritePin   (mu8_SselPin, HIGH);
+        mi_Bus.Begin(pk_Timing);
+    }
+
+    // Send a sequence of 0x55 (dummy bytes)
+    virtual void WakeUp()
+    {
+        byte u8_Buffer[20];
+        memset(u8_Buffer, PN532_WAKEUP, sizeof(u8_Buffer));
+        WriteFrame(u8_Buffer, sizeof(u8_Buffer));
+    }
+
+    virtual bool IsReady()
+    {
+        Select();
+        mi_Bus.Write(PN532_SPI_STATUSREAD);
+        byte u8_Ready = mi_Bus.Read();
+        Deselect();
+        return u8_Ready == PN532_SPI_READY; // 0x01
+    }
+
+    virtual void WriteFrame(const byte* u8_Frame, int s32_Len)
+    {
+        Select();
+        mi_Bus.Write(PN532_SPI_DATAWRITE);
+
+        if (Bus::BURST && mpk_Timing->b_Burst)
+        {
+            mi_Bus.TransferBytes(u8_Frame, NULL, s32_Len);
+        }
+        else
+        {
+            for (int i=0; i<s32_Len; i++)
+            {
+                mi_Bus.Write(u8_Frame[i]);
+            }
+        }
+        Deselect();
+    }
+
+    virtual void BeginRead(int s32_MaxLen)
+    {
+        Select();
+        mi_Bus.Write(PN532_SPI_DATAREAD);
+    }
+
+    virtual void ReadBytes(byte* u8_Buff, int s32_Len)
+    {
+        if (Bus::BURST && mpk_Timing->b_Burst)
+        {
+            // Clock out zeroes and receive the frame into the same buffer
+            memset(u8_Buff, 0, s32_Len);
+            mi_Bus.TransferBytes(u8_Buff, u8_Buff, s32_Len);
+            return;
+        }
+
+        for (int i=0; i<s32_Len; i++)
+        {
+            Utils::DelayMicro(mpk_Timing->u16_ByteUs);
+            u8_Buff[i] = mi_Bus.Read();
+        }
+    }
+
+    virtual void EndRead()
+    {
+        Deselect();
+    }
+
+    virtual bool UpdateClock()
+    {
+        return mpk_Timing != NULL && mi_Bus.SetClock(mpk_Timing->u32_SpiClock);
+    }
+
+protected:
+    inline void Select()
+    {
+        mi_Bus.Select(mpk_Timing);
+        Utils::WritePin(mu8_SselPin, LOW);
+        Utils::DelayMicro(mpk_Timing->u16_SelectUs); // INDISPENSABLE!! Otherwise reads bullshit
+    }
+    inline void Deselect()
+    {
+        Utils::WritePin(mu8_SselPin, HIGH);
+        Utils::DelayMicro(mpk_Timing->u16_DeselectUs);
+    }
+
+    Bus  mi_Bus;
+    byte mu8_SselPin;
+};
+
+typedef PN532SpiTransport<HardSpiBus> PN532HardSpi;
+typedef PN532SpiTransport<SoftSpiBus> PN532SoftSpi;
+typedef PN532SpiTransport<FastSoftSpiBus> PN532FastSoftSpi;
+
+// -------------------------------------------------------------------------------------------------------------------
+
+// I2C framing of the PN532 (manual chapter 6.2.4): each read starts with a Ready byte
+class PN532I2c : public PN532Transport
+{
+public:
+    virtual void Begin(const kPN532Timing* pk_Timing)
+    {
+        mpk_Timing = pk_Timing;
+        I2cClass::Begin();
+    }
+
+    virtual bool IsReady()
+    {
+        // After reading this byte, the bus must be released with a Stop condition
+        I2cClass::RequestFrom((byte)PN532_I2C_ADDRESS, (byte)1);
+        return I2cClass::Read() == PN532_I2C_READY; // 0x01
+    }
+
+    virtual void WriteFrame(const byte* u8_Frame, int s32_Len)
+    {
+        Utils::DelayMilli(2); // delay is for waking up the board
+
+        I2cClass::BeginTransmission(PN532_I2C_ADDRESS);
+        for (int i=0; i<s32_Len; i++)
+        {
+            I2cClass::Write(u8_Frame[i]);
+        }
+        I2cClass::EndTransmission();
+    }
+
+    // The I2C bus cannot continue a read transfer later, so the whole frame must be requested at once.
+    // s32_MaxLen is only the size of the caller's buffer: requesting it would transfer up to 255 bytes for
+    // each response. So the header is read first and the PN532 is asked with a NACK frame to send the same
+    // response again, which is then read with its exact length.
+    virtual void BeginRead(int s32_MaxLen)
+    {
+        Utils::DelayMilli(2);
+
+        int  s32_Len  = s32_MaxLen;
+        bool b_Resend = s32_MaxLen > PN532_I2C_HEADER_LEN + 1; // not an ACK frame
+        if (b_Resend)
+        {
+            byte u8_Header[PN532_I2C_HEADER_LEN];
+            I2cClass::RequestFrom((byte)PN532_I2C_ADDRESS, (byte)(PN532_I2C_HEADER_LEN + 1));
+            I2cClass::Read(); // Ready byte
+            for (int i=0; i<PN532_I2C_HEADER_LEN; i++)
+            {
+                u8_Header[i] = I2cClass::Read();
+            }
+
+            int s32_Frame = GetFrameLength(u8_Header);
+            if (s32_Frame > 0) s32_Len = min(s32_Frame, s32_MaxLen);
+
+            static const byte u8_Nack[] = { 0x00, 0x00, 0xFF, 0xFF, 0x00, 0x00 };
+            I2cClass::BeginTransmission(PN532_I2C_ADDRESS);
+            for (int i=0; i<(int)sizeof(u8_Nack); i++)
+            {
+                I2cClass::Write(u8_Nack[i]);
+            }
+            I2cClass::EndTransmission();
+        }
+
+        // read (n+1 to take into account leading Ready byte)
+        // A frame that does not fit into the buffer of the Wire library cannot be read (checksum error in ReadData()).
+        byte u8_Request = (byte)min(s32_Len + 1, PN532_I2C_MAX_READ);
+        uint32_t u32_Start = Utils::GetMillis();
+        while (true)
+        {
+            I2cClass::RequestFrom((byte)PN532_I2C_ADDRESS, u8_Request);
+            // After a NACK the Ready byte is 0 until the PN532 has the response again
+            if (I2cClass::Read() == PN532_I2C_READY || !b_Resend || 
+                Utils::GetMillis() - u32_Start > PN532_I2C_RESEND_TIMEOUT)
+                break;
+
+            Utils::DelayMilli(1);
+        }
+    }
+
+    virtual void ReadBytes(byte* u8_Buff, int s32_Len)
+    {
+        for (int i=0; i<s32_Len; i++)
+        {
+            Utils::DelayMicro(mpk_Timing->u16_ByteUs);
+            u8_Buff[i] = I2cClass::Read();
+        }
+    }
+
+    virtual void EndRead() {}
+
+protected:
+    // Length of the frame (preamble up to the data checksum) from its header, 0 = unknown (extended frame, invalid length)
+    static int GetFrameLength(const byte* u8_Header)
+    {
+        for (int i=0; i+3 < PN532_I2C_HEADER_LEN; i++)
+        {
+            if (u8_Header[i] != 0x00 || u8_Header[i+1] != 0xFF)
+                continue;
+
+            byte u8_Len = u8_Header[i+2];
+            byte u8_Lcs = u8_Header[i+3];
+            if (u8_Len == 0xFF || (byte)(u8_Len + u8_Lcs) != 0)
+                return 0;
+            return i + 4 + u8_Len + 1;
+        }
+        return 0;
+    }
+};
+
+// -------------------------------------------------------------------------------------------------------------------
+
+// HSU framing of the PN532 (manual chapter 6.2.3): the frames are sent as they are, there is no status byte.
+// Port = HardwareSerial. The receive buffer of the port must hold an extended frame (275 bytes),
+// on the ESP32 call setRxBufferSize(512) before begin().
+template <class Port>
+class PN532HsuTransport : public PN532Transport
+{
+public:
+    PN532HsuTransport(Port* pi_Port, uint32_t u32_MaxBaud = PN532_HSU_MAX_BAUD)
+    {
+        mpi_Port     = pi_Port;
+        mu32_MaxBaud = u32_MaxBaud;
+        mu32_Baud    = PN532_HSU_BAUD;
+    }
+
+    // Called after each reset of the PN532 which is back at 115200 baud then
+    virtual void Begin(const kPN532Timing* pk_Timing)
+    {
+        mpk_Timing = pk_Timing;
+        mu32_Baud  = PN532_HSU_BAUD;
+        mpi_Port->begin(mu32_Baud);
+        Discard();
+    }
+
+    // The PN532 wakes up from the 0x55 and needs a long preamble to be ready (manual chapter 7.2.11)
+    virtual void WakeUp()
+    {
+        byte u8_Buffer[16] = { PN532_WAKEUP, PN532_WAKEUP };
+        WriteFrame(u8_Buffer, sizeof(u8_Buffer));
+    }
+
+    virtual bool IsReady()
+    {
+        return mpi_Port->available() > 0;
+    }
+
+    virtual void WriteFrame(const byte* u8_Frame, int s32_Len)
+    {
+        mpi_Port->write(u8_Frame, s32_Len);
+    }
+
+    virtual void BeginRead(int s32_MaxLen) {}
+
+    // The bytes of a frame arrive with the speed of the UART.
+    // After a timeout the missing bytes are returned as zero which makes the frame invalid.
+    virtual void ReadBytes(byte* u8_Buff, int s32_Len)
+    {
+        int      s32_ByteUs = max(1, (int)(10000000 / mu32_Baud));
+        uint32_t u32_Start  = Utils::GetMillis();
+        for (int i=0; i<s32_Len; i++)
+        {
+            while (mpi_Port->available() <= 0)
+            {
+                if (Utils::GetMillis() - u32_Start > PN532_HSU_BYTE_TIMEOUT)
+                {
+                    memset(u8_Buff + i, 0, s32_Len - i);
+                    return;
+                }
+                Utils::DelayMicro(s32_ByteUs);
+            }
+            u8_Buff[i] = mpi_Port->read();
+        }
+    }
+
+    virtual void EndRead() {}
+
+    virtual bool     IsStream()       { return true; }
+    virtual uint32_t GetBaudRate()    { return mu32_Baud; }
+    virtual uint32_t GetMaxBaudRate() { return mu32_MaxBaud; }
+
+    virtual bool SetBaudRate(uint32_t u32_Baud)
+    {
+        mpi_Port->flush();
+        mpi_Port->updateBaudRate(u32_Baud);
+        mu32_Baud = u32_Baud;
+        Discard(); // bytes received during the switch are garbage
+        return true;
+    }
+
+protected:
+    inline void Discard()
+    {
+        while (mpi_Port->available() > 0)
+        {
+            mpi_Port->read();
+        }
+    }
+
+    Port*    mpi_Port;
+    uint32_t mu32_Baud;
+    uint32_t mu32_MaxBaud;
+};
+
+typedef PN532HsuTransport<HardwareSerial> PN532Hsu;
+
+#endif // PN532_TRANSPORT_H
@@ -0,0 +1,897 @@
+/**************************************************************************
+
+    Software model of a Desfire EV1 card for the host (native) build.
+    See DesfireCard.h
+
+    The card side of the cryptography uses the same DES / AES classes as the reader.
+    The CBC directions are mirrored: what the reader encrypts with CBC_SEND the card
+    decrypts with CBC_RECEIVE and vice versa. So both sides keep the same IV.
+
+**************************************************************************/
+
+#include "DesfireCard.h"
+
+DesfireCard::DesfireCard(const byte u8_UID[7])
+{
+    memcpy(mu8_UID, u8_UID, 7);
+    memset(&mk_Picc, 0, sizeof(mk_Picc));
+    memset(mk_Apps,  0, sizeof(mk_Apps));
+
+    // Factory default: PICC master key = DES key with 8 zeroes
+    mk_Picc.b_Used      = true;
+    mk_Picc.u32_AppID   = 0x000000;
+    mk_Picc.u8_Settings = KS_FACTORY_DEFAULT;
+    mk_Picc.u8_KeyCount = 1;
+    mk_Picc.e_KeyType   = DF_KEY_2K3DES;
+    InitKeys(&mk_Picc);
+
+    mk_Timing.u32_CommandUs   =  600;
+    mk_Timing.u32_CryptoUs    = 1800;
+    mk_Timing.u32_MacUs       =  250;
+    mk_Timing.u32_ReadByteNs  =  500;
+    mk_Timing.u32_WriteByteNs = 6000;
+
+    mb_EV2      = false;
+    mu16_CmdCtr = 0;
+    mu32_Random = 0x12345678 ^ (u8_UID[6] << 16) ^ (u8_UID[5] << 8) ^ u8_UID[4];
+    Reset();
+}
+
+// ########################################################################
+// ####                         PROVISIONING                          #####
+// ########################################################################
+
+bool DesfireCard::SetPiccKey(const byte* u8_Key, int s32_KeySize, DESFireKeyType e_KeyType, byte u8_Version)
+{
+    mk_Picc.e_KeyType = e_KeyType;
+    memset(mk_Picc.k_Keys[0].u8_Data, 0, 24);
+    memcpy(mk_Picc.k_Keys[0].u8_Data, u8_Key, s32_KeySize);
+    mk_Picc.k_Keys[0].s32_Size   = s32_KeySize;
+    mk_Picc.k_Keys[0].u8_Version = u8_Version;
+    return true;
+}
+
+bool DesfireCard::AddApplication(uint32_t u32_AppID, byte u8_Settings, byte u8_KeyCount, DESFireKeyType e_KeyType)
+{
+    if (u32_AppID == 0 || FindApp(u32_AppID) || u8_KeyCount < 1 || u8_KeyCount > DFCARD_MAX_KEYS)
+        return false;
+
+    for (int i=0; i<DFCARD_MAX_APPS; i++)
+    {
+        kApp* pk_App = &mk_Apps[i];
+        if (pk_App->b_Used)
+            continue;
+
+        memset(pk_App, 0, sizeof(kApp));
+        pk_App->b_Used      = true;
+        pk_App->u32_AppID   = u32_AppID;
+        pk_App->u8_Settings = u8_Settings;
+        pk_App->u8_KeyCount = u8_KeyCount;
+        pk_App->e_KeyType   = e_KeyType;
+        InitKeys(pk_App);
+        return true;
+    }
+    return false; // card full
+}
+
+bool DesfireCard::SetAppKey(uint32_t u32_AppID, byte u8_KeyNo, const byte* u8_Key, int s32_KeySize, byte u8_Version)
+{
+    kApp* pk_App = FindApp(u32_AppID);
+    if (!pk_App || u8_KeyNo >= pk_App->u8_KeyCount || s32_KeySize > 24)
+        return false;
+
+    kKey* pk_Key = &pk_App->k_Keys[u8_KeyNo];
+    memset(pk_Key->u8_Data, 0, 24);
+    memcpy(pk_Key->u8_Data, u8_Key, s32_KeySize);
+    pk_Key->s32_Size   = s32_KeySize;
+    pk_Key->u8_Version = u8_Version;
+    return true;
+}
+
+bool DesfireCard::AddStdDataFile(uint32_t u32_AppID, byte u8_FileID, DESFireFileEncryption e_Encrypt, DESFireFilePermissions* pk_Permis, int s32_FileSize, const byte* u8_Data)
+{
+    kApp* pk_App = FindApp(u32_AppID);
+    if (!pk_App || s32_FileSize > DFCARD_MAX_FILE_SIZE)
+        return false;
+
+    for (int i=0; i<DFCARD_MAX_FILES; i++)
+    {
+        kFile* pk_File = &pk_App->k_Files[i];
+        if (pk_File->b_Used)
+        {
+            if (pk_File->u8_FileID == u8_FileID)
+                return false;
+            continue;
+        }
+
+        memset(pk_File, 0, sizeof(kFile));
+        pk_File->b_Used     = true;
+        pk_File->u8_FileID  = u8_FileID;
+        pk_File->u8_Encrypt = e_Encrypt;
+        pk_File->u16_Permis = pk_Permis->Pack();
+        pk_File->s32_Size   = s32_FileSize;
+        if (u8_Data) memcpy(pk_File->u8_Data, u8_Data, s32_FileSize);
+        return true;
+    }
+    return false;
+}
+
+// ########################################################################
+// ####                         RF INTERFACE                          #####
+// ########################################################################
+
+// Called when the card is activated anew or leaves the field
+void DesfireCard::Reset()
+{
+    mpk_Selected    = &mk_Picc;
+    me_AuthState    = AUTH_None;
+    mu8_AuthKeyNo   = NOT_AUTHENTICATED;
+    mpi_AuthKey     = NULL;
+    mpi_SessionKey  = NULL;
+    mb_EV2Session   = false;
+    ms32_RespLen    = 0;
+    ms32_RespPos    = 0;
+    ms32_FrameCount = 0;
+    ms32_FrameIdx   = 0;
+}
+
+void DesfireCard::GetUID(byte u8_UID[7])
+{
+    memcpy(u8_UID, mu8_UID, 7);
+}
+
+// The ATS of a Desfire EV1: TL, T0, TA(1) = supports 106..848 kbit in both directions, TB(1), TC(1), historical byte
+int DesfireCard::GetATS(byte* u8_ATS)
+{
+    const byte u8_Ats[] = { 0x06, 0x75, 0x77, 0x81, 0x02, 0x80 };
+    memcpy(u8_ATS, u8_Ats, sizeof(u8_Ats));
+    return sizeof(u8_Ats);
+}
+
+/**************************************************************************
+    Executes one native command received over RF.
+    u8_Resp receives the status byte followed by the data of the frame.
+    returns the processing time of the card in microseconds
+**************************************************************************/
+uint32_t DesfireCard::Process(const byte* u8_Cmd, int s32_CmdLen, byte* u8_Resp, int* ps32_RespLen)
+{
+    uint32_t u32_Time = mk_Timing.u32_CommandUs;
+    DESFireStatus e_Status;
+
+    byte u8_Command = (s32_CmdLen > 0) ? u8_Cmd[0] : 0;
+    if (s32_CmdLen < 1)
+    {
+        e_Status = ST_WrongCommandLen;
+    }
+    else if (u8_Command == DF_INS_ADDITIONAL_FRAME && me_AuthState == AUTH_WaitRndAB)
+    {
+        ms32_RespLen    = 0;
+        ms32_RespPos    = 0;
+        ms32_FrameCount = 0;
+        ms32_FrameIdx   = 0;
+        e_Status = AuthenticateEnd(u8_Cmd + 1, s32_CmdLen - 1, &u32_Time);
+    }
+    else if (u8_Command == DF_INS_ADDITIONAL_FRAME && ms32_FrameIdx < ms32_FrameCount)
+    {
+        // Send the next frame of a chained response
+        e_Status = ST_Success;
+    }
+    else
+    {
+        me_AuthState    = AUTH_None;
+        ms32_RespLen    = 0;
+        ms32_RespPos    = 0;
+        ms32_FrameCount = 0;
+        ms32_FrameIdx   = 0;
+        mb_RespCrypt    = false;
+
+        bool b_Session = (u8_Command != DF_INS_SELECT_APPLICATION  &&
+                          u8_Command != DFEV1_INS_AUTHENTICATE_ISO &&
+                          u8_Command != DFEV1_INS_AUTHENTICATE_AES &&
+                          u8_Command != DFEV2_INS_AUTHENTICATE_EV2_FIRST     &&
+                          u8_Command != DFEV2_INS_AUTHENTICATE_EV2_NON_FIRST &&
+                          u8_Command != DF_INS_ADDITIONAL_FRAME    &&
+                          mu8_AuthKeyNo != NOT_AUTHENTICATED);
+
+        // ReadData / WriteData depend on the communication mode of the file
+        kFile* pk_File = NULL;
+        if ((u8_Command == DF_INS_READ_DATA || u8_Command == DF_INS_WRITE_DATA) && s32_CmdLen > 1 && mpk_Selected != &mk_Picc)
+            pk_File = FindFile(u8_Cmd[1]);
+
+        // EV2 secure messaging: A command in the MAC communication mode ends with the truncated MAC.
+        // File data is MAC-ed only for CM_MAC files. The EV2 full mode (CM_ENCRYPT) is not modelled.
+        bool b_EV2    = b_Session && mb_EV2Session;
+        bool b_EV2Mac = b_EV2 && (pk_File == NULL || pk_File->u8_Encrypt == CM_MAC);
+        e_Status = ST_Success;
+        if (b_EV2 && pk_File && pk_File->u8_Encrypt == CM_ENCRYPT)
+            e_Status = ST_PermissionDenied;
+
+        byte u8_MacT[8];
+        if (b_EV2Mac)
+        {
+            s32_CmdLen -= 8;
+            if (s32_CmdLen < 1 || !CalcEV2Mac(u8_Command, mu16_CmdCtr, u8_Cmd + 1, s32_CmdLen - 1, u8_MacT) ||
+                memcmp(u8_MacT, u8_Cmd + s32_CmdLen, 8) != 0)
+                e_Status = ST_IntegrityError;
+            u32_Time += mk_Timing.u32_MacUs;
+        }
+
+        // The EV1 CMAC over the command is not transmitted but it keeps the IV in sync with the reader.
+        // An encrypted command is decrypted instead (WriteData to a CM_ENCRYPT file).
+        bool b_CmdCrypt = (u8_Command == DF_INS_WRITE_DATA && IsEncrypted(pk_File));
+        byte u8_Cmac[16];
+        if (b_Session && !b_EV2 && !b_CmdCrypt)
+        {
+            UpdateCmac(u8_Cmd, s32_CmdLen, u8_Cmac);
+            u32_Time += mk_Timing.u32_MacUs;
+        }
+
+        if (e_Status == ST_Success)
+            e_Status = Execute(u8_Cmd, s32_CmdLen, &u32_Time);
+
+        // EV2: The MAC over RC + (CmdCtr + 1) + TI + response data is appended to the data.
+        // Each completed command increments the Command Counter.
+        if (b_EV2 && e_Status == ST_Success && mu8_AuthKeyNo != NOT_AUTHENTICATED)
+        {
+            if (b_EV2Mac)
+            {
+                CalcEV2Mac(ST_Success, mu16_CmdCtr + 1, mu8_Resp, ms32_RespLen, mu8_Resp + ms32_RespLen);
+                ms32_RespLen += 8;
+                u32_Time += mk_Timing.u32_MacUs;
+            }
+            mu16_CmdCtr++;
+        }
+        // The EV1 CMAC over the response data + status byte is appended to the data
+        else if (b_Session && !b_EV2 && e_Status == ST_Success && !mb_RespCrypt && mu8_AuthKeyNo != NOT_AUTHENTICATED)
+        {
+            mu8_Resp[ms32_RespLen] = ST_Success;
+            UpdateCmac(mu8_Resp, ms32_RespLen + 1, u8_Cmac);
+            memcpy(mu8_Resp + ms32_RespLen, u8_Cmac, 8);
+            ms32_RespLen += 8;
+            u32_Time += mk_Timing.u32_MacUs;
+        }
+
+        if (ms32_FrameCount > 0)
+            ms32_FrameEnd[ms32_FrameCount -1] = ms32_RespLen;
+    }
+
+    // After any error the authentication is invalidated
+    if (e_Status != ST_Success && e_Status != ST_MoreFrames)
+    {
+        kApp* pk_Selected = mpk_Selected; // the selected application stays selected
+        Reset();
+        mpk_Selected = pk_Selected;
+        u8_Resp[0] = e_Status;
+        *ps32_RespLen = 1;
+        return u32_Time;
+    }
+
+    // Split the response into frames of max DFCARD_FRAME_SIZE bytes
+    if (ms32_FrameCount == 0 || ms32_FrameEnd[ms32_FrameCount -1] < ms32_RespLen)
+    {
+        int s32_End = (ms32_FrameCount > 0) ? ms32_FrameEnd[ms32_FrameCount -1] : 0;
+        do
+        {
+            s32_End = min(s32_End + DFCARD_FRAME_SIZE, ms32_RespLen);
+            ms32_FrameEnd[ms32_FrameCount++] = s32_End;
+        }
+        while (s32_End < ms32_RespLen && ms32_FrameCount < DFCARD_MAX_FRAMES);
+    }
+
+    int s32_Count = ms32_FrameEnd[ms32_FrameIdx] - ms32_RespPos;
+    memcpy(u8_Resp + 1, mu8_Resp + ms32_RespPos, s32_Count);
+    ms32_RespPos += s32_Count;
+    ms32_FrameIdx++;
+
+    // ST_MoreFrames from the authentication is not a chained response
+    if (ms32_FrameIdx < ms32_FrameCount)
+        e_Status = ST_MoreFrames;
+
+    u8_Resp[0] = e_Status;
+    *ps32_RespLen = 1 + s32_Count;
+    return u32_Time;
+}
+
+// ########################################################################
+// ####                           COMMANDS                            #####
+// ########################################################################
+
+DESFireStatus DesfireCard::Execute(const byte* u8_Cmd, int s32_CmdLen, uint32_t* pu32_Time)
+{
+    const byte* u8_Params = u8_Cmd + 1;
+    int s32_ParamLen = s32_CmdLen - 1;
+    bool b_Picc = (mpk_Selected == &mk_Picc);
+    bool b_List = (mpk_Selected->u8_Settings & KS_LISTING_WITHOUT_MK)       || IsMasterAuthenticated();
+    bool b_Crea = (mpk_Selected->u8_Settings & KS_CREATE_DELETE_WITHOUT_MK) || IsMasterAuthenticated();
+
+    switch (u8_Cmd[0])
+    {
+        case DF_INS_SELECT_APPLICATION:
+        {
+            if (s32_ParamLen != 3) return ST_WrongCommandLen;
+            uint32_t u32_AppID = u8_Params[0] | (u8_Params[1] << 8) | (u8_Params[2] << 16);
+            kApp* pk_App = (u32_AppID == 0) ? &mk_Picc : FindApp(u32_AppID);
+            if (!pk_App) return ST_AppNotFound;
+            mpk_Selected  = pk_App;
+            mu8_AuthKeyNo = NOT_AUTHENTICATED;
+            mb_EV2Session = false; // ends the EV2 transaction
+            return ST_Success;
+        }
+
+        case DFEV1_INS_AUTHENTICATE_ISO:
+        case DFEV1_INS_AUTHENTICATE_AES:
+            if (s32_ParamLen != 1) return ST_WrongCommandLen;
+            return AuthenticateStart(u8_Cmd[0], u8_Params[0], pu32_Time);
+
+        case DFEV2_INS_AUTHENTICATE_EV2_FIRST: // KeyNo + LenCap + PCDcap2
+            if (!mb_EV2) return ST_IllegalCommand;
+            if (s32_ParamLen < 2 || s32_ParamLen != 2 + u8_Params[1]) return ST_WrongCommandLen;
+            return AuthenticateStart(u8_Cmd[0], u8_Params[0], pu32_Time);
+
+        case DFEV2_INS_AUTHENTICATE_EV2_NON_FIRST:
+            if (!mb_EV2) return ST_IllegalCommand;
+            if (s32_ParamLen != 1) return ST_WrongCommandLen;
+            if (!mb_EV2Session || mu8_AuthKeyNo == NOT_AUTHENTICATED) return ST_PermissionDenied;
+            return AuthenticateStart(u8_Cmd[0], u8_Params[0], pu32_Time);
+
+        case DF_INS_GET_VERSION:
+            return GetVersion();
+
+        case DFEV1_INS_GET_CARD_UID:
+            return GetCardUID();
+
+        case DFEV1_INS_FREE_MEM:
+        {
+            uint32_t u32_Free = 7936;
+            for (int A=0; A<DFCARD_MAX_APPS; A++)
+            {
+                for (int F=0; F<DFCARD_MAX_FILES; F++)
+                {
+                    if (mk_Apps[A].k_Files[F].b_Used) u32_Free -= (mk_Apps[A].k_Files[F].s32_Size + 31) & ~31;
+                }
+            }
+            memcpy(mu8_Resp, &u32_Free, 3);
+            ms32_RespLen = 3;
+            return ST_Success;
+        }
+
+        case DF_INS_GET_KEY_VERSION:
+            if (s32_ParamLen != 1) return ST_WrongCommandLen;
+            if (u8_Params[0] >= mpk_Selected->u8_KeyCount) return ST_KeyDoesNotExist;
+            mu8_Resp[ms32_RespLen++] = mpk_Selected->k_Keys[u8_Params[0]].u8_Version;
+            return ST_Success;
+
+        case DF_INS_GET_KEY_SETTINGS:
+            if (!b_List) return ST_AuthentError;
+            mu8_Resp[ms32_RespLen++] = mpk_Selected->u8_Settings;
+            mu8_Resp[ms32_RespLen++] = mpk_Selected->u8_KeyCount | (b_Picc ? 0 : mpk_Selected->e_KeyType);
+            return ST_Success;
+
+        case DF_INS_GET_APPLICATION_IDS:
+            if (!b_Picc) return ST_IllegalCommand;
+            if (!b_List) return ST_AuthentError;
+            for (int i=0; i<DFCARD_MAX_APPS; i++)
+            {
+                if (!mk_Apps[i].b_Used) continue;
+                memcpy(mu8_Resp + ms32_RespLen, &mk_Apps[i].u32_AppID, 3);
+                ms32_RespLen += 3;
+            }
+            return ST_Success;
+
+        case DF_INS_CREATE_APPLICATION:
+        {
+            if (!b_Picc) return ST_IllegalCommand;
+            if (!b_Crea) return ST_AuthentError;
+            if (s32_ParamLen != 5) return ST_WrongCommandLen;
+            uint32_t u32_AppID = u8_Params[0] | (u8_Params[1] << 8) | (u8_Params[2] << 16);
+            if (FindApp(u32_AppID)) return ST_DuplicateAidFiles;
+            if (!AddApplication(u32_AppID, u8_Params[3], u8_Params[4] & 0x0F, (DESFireKeyType)(u8_Params[4] & 0xC0)))
+                return ST_OutOfMemory;
+            *pu32_Time += mk_Timing.u32_WriteByteNs * 32 / 1000;
+            return ST_Success;
+        }
+
+        case DF_INS_DELETE_APPLICATION:
+        {
+            if (!b_Picc) return ST_IllegalCommand;
+            if (!IsMasterAuthenticated()) return ST_AuthentError;
+            if (s32_ParamLen != 3) return ST_WrongCommandLen;
+            kApp* pk_App = FindApp(u8_Params[0] | (u8_Params[1] << 8) | (u8_Params[2] << 16));
+            if (!pk_App) return ST_AppNotFound;
+            pk_App->b_Used = false;
+            return ST_Success;
+        }
+
+        case DF_INS_FORMAT_PICC:
+            if (!b_Picc || !IsMasterAuthenticated()) return ST_AuthentError;
+            for (int i=0; i<DFCARD_MAX_APPS; i++)
+            {
+                mk_Apps[i].b_Used = false;
+            }
+            return ST_Success;
+
+        case DF_INS_GET_FILE_IDS:
+            if (b_Picc) return ST_IllegalCommand;
+            if (!b_List) return ST_AuthentError;
+            for (int i=0; i<DFCARD_MAX_FILES; i++)
+            {
+                if (mpk_Selected->k_Files[i].b_Used)
+                    mu8_Resp[ms32_RespLen++] = mpk_Selected->k_Files[i].u8_FileID;
+            }
+            return ST_Success;
+
+        case DF_INS_GET_FILE_SETTINGS:
+        {
+            if (b_Picc) return ST_IllegalCommand;
+            if (!b_List) return ST_AuthentError;
+            if (s32_ParamLen != 1) return ST_WrongCommandLen;
+            kFile* pk_File = FindFile(u8_Params[0]);
+            if (!pk_File) return ST_FileNotFound;
+            mu8_Resp[ms32_RespLen++] = MDFT_STANDARD_DATA_FILE;
+            mu8_Resp[ms32_RespLen++] = pk_File->u8_Encrypt;
+            memcpy(mu8_Resp + ms32_RespLen, &pk_File->u16_Permis, 2);
+            memcpy(mu8_Resp + ms32_RespLen + 2, &pk_File->s32_Size, 3);
+            ms32_RespLen += 5;
+            return ST_Success;
+        }
+
+        case DF_INS_CREATE_STD_DATA_FILE:
+        {
+            if (b_Picc) return ST_IllegalCommand;
+            if (!b_Crea) return ST_AuthentError;
+            if (s32_ParamLen != 7) return ST_WrongCommandLen;
+            if (FindFile(u8_Params[0])) return ST_DuplicateAidFiles;
+
+            DESFireFilePermissions k_Permis;
+            k_Permis.Unpack(u8_Params[2] | (u8_Params[3] << 8));
+            int s32_Size = u8_Params[4] | (u8_Params[5] << 8) | (u8_Params[6] << 16);
+            if (!AddStdDataFile(mpk_Selected->u32_AppID, u8_Params[0], (DESFireFileEncryption)u8_Params[1], &k_Permis, s32_Size, NULL))
+                return ST_OutOfMemory;
+            return ST_Success;
+        }
+
+        case DF_INS_DELETE_FILE:
+        {
+            if (b_Picc) return ST_IllegalCommand;
+            if (!b_Crea) return ST_AuthentError;
+            if (s32_ParamLen != 1) return ST_WrongCommandLen;
+            kFile* pk_File = FindFile(u8_Params[0]);
+            if (!pk_File) return ST_FileNotFound;
+            pk_File->b_Used = false;
+            return ST_Success;
+        }
+
+        case DF_INS_READ_DATA:
+            return ReadData(u8_Params, s32_ParamLen, pu32_Time);
+
+        case DF_INS_WRITE_DATA:
+            return WriteData(u8_Params, s32_ParamLen, pu32_Time);
+
+        default:
+            return ST_IllegalCommand;
+    }
+}
+
+/**************************************************************************
+    Pass 1 of the authentication: the card sends the encrypted random B
+**************************************************************************/
+DESFireStatus DesfireCard::AuthenticateStart(byte u8_Command, byte u8_KeyNo, uint32_t* pu32_Time)
+{
+    bool b_EV2 = (u8_Command == DFEV2_INS_AUTHENTICATE_EV2_FIRST || u8_Command == DFEV2_INS_AUTHENTICATE_EV2_NON_FIRST);
+
+    // AuthenticateEV2NonFirst keeps TI and Command Counter of the running transaction
+    mu8_AuthKeyNo = NOT_AUTHENTICATED;
+    if (u8_Command != DFEV2_INS_AUTHENTICATE_EV2_NON_FIRST)
+        mb_EV2Session = false;
+
+    if (u8_KeyNo >= mpk_Selected->u8_KeyCount)
+        return ST_KeyDoesNotExist;
+
+    kKey* pk_Key = &mpk_Selected->k_Keys[u8_KeyNo];
+    switch (mpk_Selected->e_KeyType)
+    {
+        case DF_KEY_AES:
+            if (u8_Command != DFEV1_INS_AUTHENTICATE_AES && !b_EV2) return ST_AuthentError;
+            mi_AuthAes.SetKeyData(pk_Key->u8_Data, 16, pk_Key->u8_Version);
+            mpi_AuthKey     = &mi_AuthAes;
+            ms32_RandomSize = 16;
+            break;
+
+        case DF_KEY_2K3DES:
+        {
+            if (u8_Command != DFEV1_INS_AUTHENTICATE_ISO) return ST_AuthentError;
+            // If K1 == K2 this is a simple DES key (bit 0 stores the key version)
+            int s32_Size = 8;
+            for (int i=0; i<8; i++)
+            {
+                if ((pk_Key->u8_Data[i] & 0xFE) != (pk_Key->u8_Data[i+8] & 0xFE)) s32_Size = 16;
+            }
+            mi_AuthDes.SetKeyData(pk_Key->u8_Data, s32_Size, pk_Key->u8_Version);
+            mpi_AuthKey     = &mi_AuthDes;
+            ms32_RandomSize = 8;
+            break;
+        }
+
+        case DF_KEY_3K3DES:
+            if (u8_Command != DFEV1_INS_AUTHENTICATE_ISO) return ST_AuthentError;
+            mi_AuthDes.SetKeyData(pk_Key->u8_Data, 24, pk_Key->u8_Version);
+            mpi_AuthKey     = &mi_AuthDes;
+            ms32_RandomSize = 16;
+            break;
+
+        default:
+            return ST_AuthentError;
+    }
+
+    for (int i=0; i<ms32_RandomSize; i++)
+    {
+        mu32_Random = mu32_Random * 1103515245 + 12345;
+        mu8_RndB[i] = (byte)(mu32_Random >> 16);
+    }
+
+    mpi_AuthKey->ClearIV();
+    if (!mpi_AuthKey->CryptDataCBC(CBC_SEND, KEY_ENCIPHER, mu8_Resp, mu8_RndB, ms32_RandomSize))
+        return ST_AuthentError;
+
+    ms32_RespLen     = ms32_RandomSize;
+    mu8_PendingKeyNo = u8_KeyNo;
+    mu8_AuthCommand  = u8_Command;
+    me_AuthState     = AUTH_WaitRndAB;
+    *pu32_Time      += mk_Timing.u32_CryptoUs;
+    return ST_MoreFrames;
+}
+
+/**************************************************************************
+    Pass 2 + 3 of the authentication:
+    The card checks the rotated random B and sends the rotated random A.
+**************************************************************************/
+DESFireStatus DesfireCard::AuthenticateEnd(const byte* u8_Data, int s32_Len, uint32_t* pu32_Time)
+{
+    me_AuthState = AUTH_None;
+    *pu32_Time  += 2 * mk_Timing.u32_CryptoUs;
+
+    int s32_Size = ms32_RandomSize;
+    if (s32_Len != 2 * s32_Size)
+        return ST_WrongCommandLen;
+
+    // EV1 continues the CBC of pass 1, EV2 starts each encryption with a zero IV
+    bool b_EV2 = (mu8_AuthCommand == DFEV2_INS_AUTHENTICATE_EV2_FIRST || mu8_AuthCommand == DFEV2_INS_AUTHENTICATE_EV2_NON_FIRST);
+    if (b_EV2) mpi_AuthKey->ClearIV();
+
+    byte u8_RndAB[32];
+    if (!mpi_AuthKey->CryptDataCBC(CBC_RECEIVE, KEY_DECIPHER, u8_RndAB, u8_Data, 2 * s32_Size))
+        return ST_AuthentError;
+
+    byte u8_RndB_rot[16];
+    Utils::RotateBlockLeft(u8_RndB_rot, mu8_RndB, s32_Size);
+    if (memcmp(u8_RndAB + s32_Size, u8_RndB_rot, s32_Size) != 0)
+        return ST_AuthentError;
+
+    byte* u8_RndA = u8_RndAB;
+    if (b_EV2)
+        return AuthenticateEV2End(u8_RndA, pu32_Time);
+
+    byte u8_RndA_rot[16];
+    Utils::RotateBlockLeft(u8_RndA_rot, u8_RndA, s32_Size);
+    if (!mpi_AuthKey->CryptDataCBC(CBC_SEND, KEY_ENCIPHER, mu8_Resp, u8_RndA_rot, s32_Size))
+        return ST_AuthentError;
+    ms32_RespLen = s32_Size;
+
+    // The session key is composed from RndA and RndB exactly as in Desfire::Authenticate()
+    TX_BUFFER(i_SessKey, 24);
+    i_SessKey.AppendBuf(u8_RndA,  4);
+    i_SessKey.AppendBuf(mu8_RndB, 4);
+    if (mpi_AuthKey->GetKeySize() > 8)
+    {
+        switch (mpi_AuthKey->GetKeyType())
+        {
+            case DF_KEY_2K3DES:
+                i_SessKey.AppendBuf(u8_RndA  + 4, 4);
+                i_SessKey.AppendBuf(mu8_RndB + 4, 4);
+                break;
+            case DF_KEY_3K3DES:
+                i_SessKey.AppendBuf(u8_RndA  +  6, 4);
+                i_SessKey.AppendBuf(mu8_RndB +  6, 4);
+                i_SessKey.AppendBuf(u8_RndA  + 12, 4);
+                i_SessKey.AppendBuf(mu8_RndB + 12, 4);
+                break;
+            case DF_KEY_AES:
+                i_SessKey.AppendBuf(u8_RndA  + 12, 4);
+                i_SessKey.AppendBuf(mu8_RndB + 12, 4);
+                break;
+            default:
+                break;
+        }
+    }
+
+    if (mpi_AuthKey->GetKeyType() == DF_KEY_AES) mpi_SessionKey = &mi_AesSessionKey;
+    else                                         mpi_SessionKey = &mi_DesSessionKey;
+
+    if (!mpi_SessionKey->SetKeyData(i_SessKey, i_SessKey.GetCount(), 0) ||
+        !mpi_SessionKey->GenerateCmacSubkeys())
+        return ST_AuthentError;
+
+    mu8_AuthKeyNo = mu8_PendingKeyNo;
+    return ST_Success;
+}
+
+/**************************************************************************
+    Pass 3 of AuthenticateEV2First / NonFirst:
+    The card sends E(Kx, TI + RndA rotated + PDcap2 + PCDcap2) or E(Kx, RndA rotated)
+    and derives the session keys exactly as in Desfire::AuthenticateEV2().
+**************************************************************************/
+DESFireStatus DesfireCard::AuthenticateEV2End(const byte* u8_RndA, uint32_t* pu32_Time)
+{
+    bool b_First = (mu8_AuthCommand == DFEV2_INS_AUTHENTICATE_EV2_FIRST);
+
+    byte u8_Plain[32] = {0}; // PDcap2 and PCDcap2 stay zero
+    int  s32_Len = 16;
+    if (b_First)
+    {
+        for (int i=0; i<4; i++)
+        {
+            mu32_Random = mu32_Random * 1103515245 + 12345;
+            mu8_TI[i]   = (byte)(mu32_Random >> 16);
+        }
+        memcpy(u8_Plain, mu8_TI, 4);
+        Utils::RotateBlockLeft(u8_Plain + 4, u8_RndA, 16);
+        mu16_CmdCtr = 0;
+        s32_Len     = 32;
+    }
+    else Utils::RotateBlockLeft(u8_Plain, u8_RndA, 16);
+
+    mpi_AuthKey->ClearIV();
+    if (!mpi_AuthKey->CryptDataCBC(CBC_SEND, KEY_ENCIPHER, mu8_Resp, u8_Plain, s32_Len))
+        return ST_AuthentError;
+    ms32_RespLen = s32_Len;
+
+    TX_BUFFER(i_SV, 32);
+    i_SV.AppendUint8(0xA5);
+    i_SV.AppendUint8(0x5A);
+    i_SV.AppendUint8(0x00);
+    i_SV.AppendUint8(0x01);
+    i_SV.AppendUint8(0x00);
+    i_SV.AppendUint8(0x80);
+    i_SV.AppendBuf(u8_RndA, 2);
+    for (int i=0; i<6; i++)
+    {
+        i_SV.AppendUint8(u8_RndA[2 + i] ^ mu8_RndB[i]);
+    }
+    i_SV.AppendBuf(mu8_RndB + 6, 10);
+    i_SV.AppendBuf(u8_RndA  + 8,  8);
+
+    byte u8_SesKey[16];
+    if (!mpi_AuthKey->GenerateCmacSubkeys())
+        return ST_AuthentError;
+    mpi_AuthKey->ClearIV();
+    if (!mpi_AuthKey->CalculateCmac(i_SV, u8_SesKey) || !mi_AesSessionKey.SetKeyData(u8_SesKey, 16, 0))
+        return ST_AuthentError;
+
+    i_SV.GetData()[0] = 0x5A;
+    i_SV.GetData()[1] = 0xA5;
+    mpi_AuthKey->ClearIV();
+    if (!mpi_AuthKey->CalculateCmac(i_SV, u8_SesKey) || !mi_EV2MacKey.SetKeyData(u8_SesKey, 16, 0) ||
+        !mi_EV2MacKey.GenerateCmacSubkeys())
+        return ST_AuthentError;
+
+    *pu32_Time    += 2 * mk_Timing.u32_MacUs;
+    mpi_SessionKey = &mi_AesSessionKey;
+    mb_EV2Session  = true;
+    mu8_AuthKeyNo  = mu8_PendingKeyNo;
+    return ST_Success;
+}
+
+DESFireStatus DesfireCard::ReadData(const byte* u8_Params, int s32_Len, uint32_t* pu32_Time)
+{
+    if (mpk_Selected == &mk_Picc) return ST_IllegalCommand;
+    if (s32_Len != 7)             return ST_WrongCommandLen;
+
+    kFile* pk_File = FindFile(u8_Params[0]);
+    if (!pk_File) return ST_FileNotFound;
+
+    DESFireFilePermissions k_Permis;
+    k_Permis.Unpack(pk_File->u16_Permis);
+    if (!HasAccess(k_Permis.e_ReadAccess) && !HasAccess(k_Permis.e_ReadAndWriteAccess))
+        return ST_PermissionDenied;
+
+    int s32_Offset = u8_Params[1] | (u8_Params[2] << 8) | (u8_Params[3] << 16);
+    int s32_Count  = u8_Params[4] | (u8_Params[5] << 8) | (u8_Params[6] << 16);
+    if (s32_Count == 0) s32_Count = pk_File->s32_Size - s32_Offset; // read until the end of the file
+    if (s32_Offset + s32_Count > pk_File->s32_Size || s32_Count <= 0)
+        return ST_LimitExceeded;
+
+    memcpy(mu8_Resp, pk_File->u8_Data + s32_Offset, s32_Count);
+    ms32_RespLen = s32_Count;
+    *pu32_Time  += s32_Count * mk_Timing.u32_ReadByteNs / 1000;
+
+    // Data + CRC32 (over data + status) + zero padding encrypted with the session key, no CMAC
+    if (IsEncrypted(pk_File))
+    {
+        byte u8_Status = ST_Success;
+        uint32_t u32_Crc = Utils::CalcCrc32(mu8_Resp, s32_Count, &u8_Status, 1);
+        memcpy(mu8_Resp + s32_Count, &u32_Crc, 4);
+
+        ms32_RespLen = mpi_SessionKey->CalcPaddedBlockSize(s32_Count + 4);
+        memset(mu8_Resp + s32_Count + 4, 0, ms32_RespLen - s32_Count - 4);
+        if (!mpi_SessionKey->CryptDataCBC(CBC_SEND, KEY_ENCIPHER, mu8_Resp, mu8_Resp, ms32_RespLen))
+            return ST_IntegrityError;
+
+        mb_RespCrypt = true;
+        *pu32_Time  += mk_Timing.u32_MacUs;
+    }
+    return ST_Success;
+}
+
+DESFireStatus DesfireCard::WriteData(const byte* u8_Params, int s32_Len, uint32_t* pu32_Time)
+{
+    if (mpk_Selected == &mk_Picc) return ST_IllegalCommand;
+    if (s32_Len < 7)              return ST_WrongCommandLen;
+
+    kFile* pk_File = FindFile(u8_Params[0]);
+    if (!pk_File) return ST_FileNotFound;
+
+    DESFireFilePermissions k_Permis;
+    k_Permis.Unpack(pk_File->u16_Permis);
+    if (!HasAccess(k_Permis.e_WriteAccess) && !HasAccess(k_Permis.e_ReadAndWriteAccess))
+        return ST_PermissionDenied;
+
+    int s32_Offset = u8_Params[1] | (u8_Params[2] << 8) | (u8_Params[3] << 16);
+    int s32_Count  = u8_Params[4] | (u8_Params[5] << 8) | (u8_Params[6] << 16);
+    const byte* u8_Data = u8_Params + 7;
+
+    // The data is sent as data + CRC32 (over command + header + data) + zero padding encrypted with the session key
+    byte u8_Plain[MAX_FRAME_SIZE];
+    if (IsEncrypted(pk_File))
+    {
+        int s32_CryptLen = mpi_SessionKey->CalcPaddedBlockSize(s32_Count + 4);
+        if (s32_Len != 7 + s32_CryptLen || s32_CryptLen > (int)sizeof(u8_Plain))
+            return ST_WrongCommandLen;
+        if (!mpi_SessionKey->CryptDataCBC(CBC_RECEIVE, KEY_DECIPHER, u8_Plain, u8_Data, s32_CryptLen))
+            return ST_IntegrityError;
+
+        byte u8_Header[8] = { DF_INS_WRITE_DATA };
+        memcpy(u8_Header + 1, u8_Params, 7);
+        uint32_t u32_Crc = Utils::CalcCrc32(u8_Header, 8, u8_Plain, s32_Count);
+        for (int i=s32_Count + 4; i<s32_CryptLen; i++)
+        {
+            if (u8_Plain[i] != 0) return ST_IntegrityError;
+        }
+        if (memcmp(u8_Plain + s32_Count, &u32_Crc, 4) != 0)
+            return ST_IntegrityError;
+
+        u8_Data     = u8_Plain;
+        *pu32_Time += mk_Timing.u32_MacUs;
+    }
+    else if (s32_Len != 7 + s32_Count)
+    {
+        return ST_WrongCommandLen;
+    }
+    if (s32_Offset + s32_Count > pk_File->s32_Size)
+        return ST_LimitExceeded;
+
+    memcpy(pk_File->u8_Data + s32_Offset, u8_Data, s32_Count);
+    *pu32_Time += s32_Count * mk_Timing.u32_WriteByteNs / 1000;
+    return ST_Success;
+}
+
+// The version is sent in 3 frames: hardware (7), software (7), production (14)
+DESFireStatus DesfireCard::GetVersion()
+{
+    // Byte 3 = major version: 0x01 = EV1, 0x12 = EV2
+    byte u8_Hardware[] = { 0x04, 0x01, 0x01, 0x01, 0x00, 0x1A, 0x05 };
+    byte u8_Software[] = { 0x04, 0x01, 0x01, 0x01, 0x04, 0x1A, 0x05 };
+    if (mb_EV2) u8_Hardware[3] = u8_Software[3] = 0x12;
+    const byte u8_Batch[]    = { 0xBA, 0x54, 0xC4, 0x11, 0x00, 0x26, 0x19 }; // batch no + week + year
+
+    memcpy(mu8_Resp,      u8_Hardware, 7);
+    memcpy(mu8_Resp +  7, u8_Software, 7);
+    memcpy(mu8_Resp + 14, mu8_UID,     7);
+    memcpy(mu8_Resp + 21, u8_Batch,    7);
+    ms32_RespLen = 28;
+
+    ms32_FrameEnd[0] = 7;
+    ms32_FrameEnd[1] = 14;
+    ms32_FrameEnd[2] = 28;
+    ms32_FrameCount  = 3;
+    return ST_Success;
+}
+
+// Returns the real UID + CRC32 encrypted with the session key
+DESFireStatus DesfireCard::GetCardUID()
+{
+    if (mu8_AuthKeyNo == NOT_AUTHENTICATED)
+        return ST_AuthentError;
+
+    byte u8_Status = ST_Success;
+    uint32_t u32_Crc = Utils::CalcCrc32(mu8_UID, 7, &u8_Status, 1);
+
+    byte u8_Plain[16] = {0};
+    memcpy(u8_Plain,     mu8_UID,  7);
+    memcpy(u8_Plain + 7, &u32_Crc, 4);
+
+    int s32_Len = mpi_SessionKey->CalcPaddedBlockSize(11);
+    if (!mpi_SessionKey->CryptDataCBC(CBC_SEND, KEY_ENCIPHER, mu8_Resp, u8_Plain, s32_Len))
+        return ST_IntegrityError;
+
+    ms32_RespLen = s32_Len;
+    mb_RespCrypt = true;
+    return ST_Success;
+}
+
+// ########################################################################
+// ####                           HELPERS                             #####
+// ########################################################################
+
+DesfireCard::kApp* DesfireCard::FindApp(uint32_t u32_AppID)
+{
+    for (int i=0; i<DFCARD_MAX_APPS; i++)
+    {
+        if (mk_Apps[i].b_Used && mk_Apps[i].u32_AppID == u32_AppID)
+            return &mk_Apps[i];
+    }
+    return NULL;
+}
+
+DesfireCard::kFile* DesfireCard::FindFile(byte u8_FileID)
+{
+    for (int i=0; i<DFCARD_MAX_FILES; i++)
+    {
+        if (mpk_Selected->k_Files[i].b_Used && mpk_Selected->k_Files[i].u8_FileID == u8_FileID)
+            return &mpk_Selected->k_Files[i];
+    }
+    return NULL;
+}
+
+// All keys of a new application are zero with version 0
+void DesfireCard::InitKeys(kApp* pk_App)
+{
+    int s32_Size = (pk_App->e_KeyType == DF_KEY_3K3DES) ? 24 : 16;
+    for (int K=0; K<DFCARD_MAX_KEYS; K++)
+    {
+        memset(pk_App->k_Keys[K].u8_Data, 0, 24);
+        pk_App->k_Keys[K].s32_Size   = s32_Size;
+        pk_App->k_Keys[K].u8_Version = 0;
+    }
+}
+
+bool DesfireCard::IsMasterAuthenticated()
+{
+    return mu8_AuthKeyNo == 0;
+}
+
+// The data of the file is transferred encrypted (only after an authentication)
+bool DesfireCard::IsEncrypted(kFile* pk_File)
+{
+    return pk_File != NULL && pk_File->u8_Encrypt == CM_ENCRYPT && mu8_AuthKeyNo != NOT_AUTHENTICATED;
+}
+
+bool DesfireCard::HasAccess(byte u8_Right)
+{
+    if (u8_Right == AR_FREE)  return true;
+    if (u8_Right == AR_NEVER) return false;
+    return mu8_AuthKeyNo == u8_Right;
+}
+
+// Calculates the CMAC with the session key. This updates the IV of the session key.
+bool DesfireCard::UpdateCmac(const byte* u8_Data, int s32_Len, byte* u8_Cmac)
+{
+    mpi_SessionKey->CmacBegin();
+    return mpi_SessionKey->CmacUpdate(u8_Data, s32_Len) && mpi_SessionKey->CmacFinal(u8_Cmac);
+}
+
+// EV2 MAC over u8_Head + CmdCtr + TI + u8_Data with a zero IV, truncated to the odd bytes
+bool DesfireCard::CalcEV2Mac(byte u8_Head, uint16_t u16_CmdCtr, const byte* u8_Data, int s32_Len, byte u8_MacT[8])
+{
+    byte u8_Prefix[7] = { u8_Head, (byte)u16_CmdCtr, (byte)(u16_CmdCtr >> 8), mu8_TI[0], mu8_TI[1], mu8_TI[2], mu8_TI[3] };
+    byte u8_Mac[16];
+    mi_EV2MacKey.ClearIV();
+    mi_EV2MacKey.CmacBegin();
+    if (!mi_EV2MacKey.CmacUpdate(u8_Prefix, 7) || !mi_EV2MacKey.CmacUpdate(u8_Data, s32_Len) || !mi_EV2MacKey.CmacFinal(u8_Mac))
+        return false;
+
+    for (int i=0; i<8; i++)
+    {
+        u8_MacT[i] = u8_Mac[2*i + 1];
+    }
+    return true;
+}
@@ -0,0 +1,156 @@
+/**************************************************************************
+
+    Software model of a Desfire EV1 card for the host (native) build.
+
+    It implements the subset of the native Desfire command set that is used by
+    the Desfire class and DesfireService:
+    - GetVersion, GetCardUID, FreeMem, FormatPICC
+    - ISO (2K3DES / 3K3DES) and AES authentication
+    - Create / Delete / Select application, GetApplicationIDs, GetKeySettings, GetKeyVersion
+    - Create / Delete standard data files, GetFileIDs, GetFileSettings, ReadData, WriteData
+    - The EV1 CMAC of commands and responses after authentication
+    - Files with communication mode CM_ENCRYPT: ReadData / WriteData with data + CRC32 encrypted with the session key
+    - Response chaining with DF_INS_ADDITIONAL_FRAME
+    - Optional (mb_EV2 = true): AuthenticateEV2First / NonFirst and EV2 secure messaging in the
+      MAC communication mode (Command Counter, Transaction Identifier, truncated MAC).
+      ReadData / WriteData follow the communication mode of the file (CM_PLAIN -> no MAC).
+      The EV2 full (encrypted) mode is not modelled: CM_ENCRYPT files return ST_PermissionDenied.
+
+    Cards are personalized directly with the provisioning functions (no RF traffic).
+    Process() receives the native command that the PN532 forwards with INDATAEXCHANGE
+    and returns the response and the time in microseconds that the card needed to process it.
+
+**************************************************************************/
+
+#ifndef DESFIRE_CARD_H
+#define DESFIRE_CARD_H
+
+#include <Desfire.h>
+
+#define DFCARD_MAX_APPS        28
+#define DFCARD_MAX_KEYS        14
+#define DFCARD_MAX_FILES        8
+#define DFCARD_MAX_FILE_SIZE  512
+#define DFCARD_MAX_FRAMES      16
+// The maximum count of data bytes in one response frame (+ 1 status byte = MAX_FRAME_SIZE)
+#define DFCARD_FRAME_SIZE     (MAX_FRAME_SIZE - 1)
+// Must hold the largest response (file data + CMAC + padding) before it is split into frames
+#define DFCARD_RESP_BUFFSIZE  (DFCARD_MAX_FILE_SIZE + 40)
+
+// Rough processing times of a Desfire EV1 chip (without RF transfer time)
+struct DesfireCardTiming
+{
+    uint32_t u32_CommandUs;    // any command
+    uint32_t u32_CryptoUs;     // each encryption step of the authentication
+    uint32_t u32_MacUs;        // CMAC calculation over a command or response (also the encryption of file data)
+    uint32_t u32_ReadByteNs;   // EEPROM read per byte
+    uint32_t u32_WriteByteNs;  // EEPROM write per byte
+};
+
+class DesfireCard
+{
+public:
+    DesfireCard(const byte u8_UID[7]);
+
+    // ------------ Provisioning ------------
+    bool SetPiccKey     (const byte* u8_Key, int s32_KeySize, DESFireKeyType e_KeyType, byte u8_Version);
+    bool AddApplication (uint32_t u32_AppID, byte u8_Settings, byte u8_KeyCount, DESFireKeyType e_KeyType);
+    bool SetAppKey      (uint32_t u32_AppID, byte u8_KeyNo, const byte* u8_Key, int s32_KeySize, byte u8_Version);
+    bool AddStdDataFile (uint32_t u32_AppID, byte u8_FileID, DESFireFileEncryption e_Encrypt, DESFireFilePermissions* pk_Permis, int s32_FileSize, const byte* u8_Data);
+
+    // ------------ RF interface ------------
+    // The card has been (re)activated or has left the field -> the session is lost
+    void     Reset();
+    void     GetUID(byte u8_UID[7]);
+    int      GetATS(byte* u8_ATS); // returns the length (the first byte TL is included)
+    uint32_t Process(const byte* u8_Cmd, int s32_CmdLen, byte* u8_Resp, int* ps32_RespLen);
+
+    DesfireCardTiming mk_Timing;
+    bool              mb_EV2; // true -> the card behaves like a Desfire EV2 (default: EV1)
+
+private:
+    struct kKey
+    {
+        byte u8_Data[24];
+        int  s32_Size;
+        byte u8_Version;
+    };
+    struct kFile
+    {
+        bool     b_Used;
+        byte     u8_FileID;
+        byte     u8_Encrypt;
+        uint16_t u16_Permis;
+        int      s32_Size;
+        byte     u8_Data[DFCARD_MAX_FILE_SIZE];
+    };
+    struct kApp
+    {
+        bool           b_Used;
+        uint32_t       u32_AppID;
+        byte           u8_Settings;
+        byte           u8_KeyCount;
+        DESFireKeyType e_KeyType;
+        kKey           k_Keys[DFCARD_MAX_KEYS];
+        kFile          k_Files[DFCARD_MAX_FILES];
+    };
+    enum eAuthState
+    {
+        AUTH_None,
+        AUTH_WaitRndAB, // the card has sent RndB and waits for DF_INS_ADDITIONAL_FRAME
+    };
+
+    kApp*  FindApp (uint32_t u32_AppID);
+    kFile* FindFile(byte u8_FileID);
+    void   InitKeys(kApp* pk_App);
+    bool   IsMasterAuthenticated();
+    bool   HasAccess(byte u8_Right);
+    bool   IsEncrypted(kFile* pk_File);
+
+    DESFireStatus Execute      (const byte* u8_Cmd, int s32_CmdLen, uint32_t* pu32_Time);
+    DESFireStatus AuthenticateStart(byte u8_Command, byte u8_KeyNo, uint32_t* pu32_Time);
+    DESFireStatus AuthenticateEnd  (const byte* u8_Data, int s32_Len, uint32_t* pu32_Time);
+    DESFireStatus AuthenticateEV2End(const byte* u8_RndA, uint32_t* pu32_Time);
+    DESFireStatus ReadData     (const byte* u8_Params, int s32_Len, uint32_t* pu32_Time);
+    DESFireStatus WriteData    (const byte* u8_Params, int s32_Len, uint32_t* pu32_Time);
+    DESFireStatus GetVersion   ();
+    DESFireStatus GetCardUID   ();
+    bool          UpdateCmac   (const byte* u8_Data, int s32_Len, byte* u8_Cmac);
+    bool          CalcEV2Mac   (byte u8_Head, uint16_t u16_CmdCtr, const byte* u8_Data, int s32_Len, byte u8_MacT[8]);
+
+    byte     mu8_UID[7];
+    kApp     mk_Picc;
+    kApp     mk_Apps[DFCARD_MAX_APPS];
+    kApp*    mpk_Selected;
+    uint32_t mu32_Random;
+
+    // Authentication
+    eAuthState  me_AuthState;
+    byte        mu8_AuthKeyNo;     // NOT_AUTHENTICATED if no session
+    byte        mu8_PendingKeyNo;  // key number during the 3 pass authentication
+    byte        mu8_AuthCommand;   // the command that started the authentication
+    int         ms32_RandomSize;
+    byte        mu8_RndB[16];
+    DESFireKey* mpi_AuthKey;
+    DESFireKey* mpi_SessionKey;
+    AES         mi_AuthAes;
+    DES         mi_AuthDes;
+    AES         mi_AesSessionKey;
+    DES         mi_DesSessionKey;
+    // EV2 secure messaging (mi_AesSessionKey = SesAuthENCKey)
+    bool        mb_EV2Session;
+    AES         mi_EV2MacKey;
+    byte        mu8_TI[4];
+    uint16_t    mu16_CmdCtr;
+
+    // The response is stored here and sent in one or multiple frames
+    byte mu8_Resp[DFCARD_RESP_BUFFSIZE];
+    int  ms32_RespLen;
+    int  ms32_RespPos;
+    int  ms32_FrameEnd[DFCARD_MAX_FRAMES];
+    int  ms32_FrameCount;
+    int  ms32_FrameIdx;
+    bool mb_RespCrypt;  // true -> the response is encrypted (no CMAC appended)
+};
+
+#endif // DESFIRE_CARD_H
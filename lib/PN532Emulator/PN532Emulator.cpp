@@ -0,0 +1,1012 @@
+/**************************************************************************
+
+    Software model of a PN532 for the host (native) build.
+    See PN532Emulator.h
+
+**************************************************************************/
+
+#include "PN532Emulator.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+// Time (real milliseconds) that the other end of the pty may need to see the written bytes
+#define PN532EMU_PTY_TIMEOUT  1000
+
+PN532Emulator::PN532Emulator(byte u8_SelPin, byte u8_ResetPin, byte u8_IrqPin)
+{
+    mu8_SelPin    = u8_SelPin;
+    mu8_ResetPin  = u8_ResetPin;
+    mu8_IrqPin    = u8_IrqPin;
+    mu8_IrqLevel  = HIGH;
+    mb_PowerDown  = false;
+    mu8_ClkPin    = PN532EMU_NO_PIN;
+    mu8_MisoPin   = PN532EMU_NO_PIN;
+    mu8_MosiPin   = PN532EMU_NO_PIN;
+    mu8_ClkLevel  = HIGH;
+    mu8_MosiLevel = LOW;
+    ms32_BitPos   = 0;
+    mu8_BitOut    = 0;
+    mu8_BitIn     = 0;
+    mpi_Card      = NULL;
+    mu32_Commands = 0;
+    mu32_StatusReads = 0;
+    mu32_RfBytes  = 0;
+    ms32_Master   = -1;
+    ms32_Slave    = -1;
+    mu32_SlaveDev = 0;
+    mu32_SentBytes= 0;
+    mu32_MaxStableBaud = PN532_HSU_MAX_BAUD;
+    mu32_MaxStableSpiClock = PN532_MAX_SPI_CLOCK;
+    mu8_MaxStableBitRate   = BITRATE_848;
+
+    mk_Timing.u32_AckUs        =  350;
+    mk_Timing.u32_LocalCmdUs   =  250;
+    mk_Timing.u32_ActivationUs = 4500;
+    mk_Timing.u32_PollUs       = 1000;
+    mk_Timing.u32_ExchangeUs   =  300;
+    mk_Timing.u32_RfByteNs     = 85000;
+
+    PowerOn();
+    Host::AttachDevice(this);
+}
+
+PN532Emulator::~PN532Emulator()
+{
+    Host::DetachDevice(this);
+    if (ms32_Master >= 0) close(ms32_Master);
+    if (ms32_Slave  >= 0) close(ms32_Slave);
+}
+
+void PN532Emulator::PlaceCard(DesfireCard* pi_Card)
+{
+    mpi_Card = pi_Card;
+    mpi_Card->Reset();
+
+    // A pending InListPassiveTarget with infinite retries finds the card now.
+    // InAutoPoll finds it with the next poll.
+    if (mb_WaitCard)
+    {
+        mb_WaitCard = false;
+        mu64_AckAt  = Host::GetNanos();
+        if (mb_AutoPoll)
+        {
+            uint64_t u64_Period = (uint64_t)mu32_PollPeriodUs * 1000;
+            mu64_AckAt += u64_Period - (mu64_AckAt - mu64_PollStart) % u64_Period;
+            InAutoPoll(NULL, 0);
+        }
+        else
+        {
+            InListPassiveTarget(NULL, 0);
+        }
+    }
+}
+
+// The card leaves the field. The PN532 does not notice this until it talks to the card.
+void PN532Emulator::RemoveCard()
+{
+    if (mpi_Card) mpi_Card->Reset();
+    mpi_Card      = NULL;
+    mb_TargetLost = true; // the card has lost its state, also if it comes back
+}
+
+// Reset pin high after power down or constructor
+void PN532Emulator::PowerOn()
+{
+    me_SpiState      = SPI_Idle;
+    ms32_InLen       = 0;
+    ms32_QueueCount  = 0;
+    mb_HeadRead      = false;
+    mb_FieldOn       = false;
+    mb_TargetActive  = false;
+    mb_TargetKnown   = false;
+    mb_TargetLost    = false;
+    mb_WaitCard      = false;
+    mb_AutoPoll      = false;
+    mu64_PollStart   = 0;
+    mu32_PollPeriodUs= 150000;
+    mu8_MaxRetries   = 0xFF; // infinite
+    mu8_RetryTimeout = 0x0A; // 51.2 ms
+    mu8_MaxRtyCom    = 0;
+    mu8_BitRate      = BITRATE_106;
+    mu64_AckAt       = 0;
+    mu32_Baud        = PN532_HSU_BAUD;
+    mu32_NewBaud     = 0;
+
+    if (mpi_Card) mpi_Card->Reset();
+}
+
+// ########################################################################
+// ####                           HOST BUS                            #####
+// ########################################################################
+
+void PN532Emulator::OnPinWrite(byte u8_Pin, byte u8_Level)
+{
+    if (u8_Pin == mu8_ResetPin)
+    {
+        if (u8_Level == LOW)
+        {
+            mb_PowerDown = true;
+        }
+        else if (mb_PowerDown)
+        {
+            mb_PowerDown = false;
+            PowerOn();
+        }
+        UpdateIrq();
+        return;
+    }
+
+    if (u8_Pin == mu8_MosiPin)
+    {
+        mu8_MosiLevel = u8_Level;
+        return;
+    }
+    if (u8_Pin == mu8_ClkPin)
+    {
+        OnClockWrite(u8_Level);
+        return;
+    }
+
+    if (u8_Pin != mu8_SelPin || mb_PowerDown)
+        return;
+
+    if (u8_Level == LOW)
+    {
+        if (me_SpiState == SPI_Idle)
+        {
+            me_SpiState = SPI_Op;
+            ms32_BitPos = 0;
+            mu8_BitOut  = 0;
+            mu8_BitIn   = 0;
+        }
+        return;
+    }
+
+    // Chip select high -> the transfer is complete
+    if (me_SpiState == SPI_Write)
+    {
+        ReceiveFrame();
+    }
+    else if (me_SpiState == SPI_Read && mb_HeadRead)
+    {
+        // The frame is consumed even if the host has not read all bytes
+        ms32_QueueCount--;
+        for (int i=0; i<ms32_QueueCount; i++)
+        {
+            mk_Queue[i] = mk_Queue[i+1];
+        }
+    }
+    me_SpiState = SPI_Idle;
+    UpdateIrq();
+}
+
+bool PN532Emulator::OnPinRead(byte u8_Pin, byte* pu8_Level)
+{
+    // MISO is only driven while the chip is selected (other readers may share the bus)
+    if (u8_Pin == mu8_MisoPin && me_SpiState != SPI_Idle && !mb_PowerDown)
+    {
+        *pu8_Level = (mu8_BitIn >> ms32_BitPos) & 1;
+        return true;
+    }
+    if (u8_Pin != mu8_IrqPin)
+        return false;
+
+    *pu8_Level = mu8_IrqLevel;
+    return true;
+}
+
+void PN532Emulator::AttachSoftSpi(byte u8_ClkPin, byte u8_MisoPin, byte u8_MosiPin)
+{
+    mu8_ClkPin  = u8_ClkPin;
+    mu8_MisoPin = u8_MisoPin;
+    mu8_MosiPin = u8_MosiPin;
+}
+
+// Software SPI: MOSI is sampled on the rising edge. After the 8th bit the byte is processed
+// like a Hardware SPI byte and the next byte for MISO is prepared.
+void PN532Emulator::OnClockWrite(byte u8_Level)
+{
+    bool b_Rising = (mu8_ClkLevel == LOW && u8_Level == HIGH);
+    mu8_ClkLevel = u8_Level;
+    if (!b_Rising || me_SpiState == SPI_Idle || mb_PowerDown)
+        return;
+
+    mu8_BitOut |= mu8_MosiLevel << ms32_BitPos;
+    if (++ms32_BitPos < 8)
+        return;
+
+    TransferByte(mu8_BitOut);
+    ms32_BitPos = 0;
+    mu8_BitOut  = 0;
+    mu8_BitIn   = PeekByte();
+}
+
+void PN532Emulator::OnTick()
+{
+    UpdateIrq();
+    SendSerialFrames();
+}
+
+// The IRQ pin is low while a frame is ready
+void PN532Emulator::UpdateIrq()
+{
+    if (mu8_IrqPin == PN532_NO_IRQ)
+        return;
+
+    byte u8_Level = (!mb_PowerDown && IsHeadReady()) ? LOW : HIGH;
+    if (u8_Level == mu8_IrqLevel)
+        return;
+
+    mu8_IrqLevel = u8_Level;
+    Host::PinChanged(mu8_IrqPin, u8_Level);
+}
+
+bool PN532Emulator::OnSpiTransfer(byte u8_Out, byte* pu8_In)
+{
+    if (me_SpiState == SPI_Idle || mb_PowerDown)
+        return false; // not selected
+
+    *pu8_In = TransferByte(u8_Out);
+    return true;
+}
+
+// The byte that the next TransferByte() will return (Software SPI shifts it out before the host byte is complete)
+byte PN532Emulator::PeekByte()
+{
+    switch (me_SpiState)
+    {
+        case SPI_Status:
+            return IsHeadReady() ? PN532_SPI_READY : 0x00;
+        case SPI_Read:
+            if (IsHeadReady() && mk_Queue[0].s32_Pos < mk_Queue[0].s32_Len)
+                return mk_Queue[0].u8_Data[mk_Queue[0].s32_Pos];
+            return 0x00;
+        default:
+            return 0x00;
+    }
+}
+
+// One byte in both directions while the chip is selected
+byte PN532Emulator::TransferByte(byte u8_Out)
+{
+    byte u8_In = 0x00;
+    switch (me_SpiState)
+    {
+        case SPI_Op:
+            switch (u8_Out)
+            {
+                case PN532_SPI_STATUSREAD: me_SpiState = SPI_Status; mu32_StatusReads ++; break;
+                case PN532_SPI_DATAWRITE:  me_SpiState = SPI_Write;  ms32_InLen  = 0;     break;
+                case PN532_SPI_DATAREAD:   me_SpiState = SPI_Read;   mb_HeadRead = false; break;
+                default: break;
+            }
+            break;
+
+        case SPI_Status:
+            u8_In = IsHeadReady() ? PN532_SPI_READY : 0x00;
+            break;
+
+        case SPI_Write:
+            if (ms32_InLen < PN532EMU_FRAME_SIZE)
+                mu8_InBuf[ms32_InLen++] = u8_Out;
+            break;
+
+        case SPI_Read:
+            if (IsHeadReady())
+            {
+                kFrame* pk_Head = &mk_Queue[0];
+                if (pk_Head->s32_Pos < pk_Head->s32_Len)
+                    u8_In = pk_Head->u8_Data[pk_Head->s32_Pos++];
+                if (SPI.getFrequency() > mu32_MaxStableSpiClock && (++mu32_SentBytes % 32) == 0)
+                    u8_In ^= 0x10;
+                mb_HeadRead = true;
+            }
+            break;
+
+        default:
+            break;
+    }
+    return u8_In;
+}
+
+bool PN532Emulator::IsHeadReady()
+{
+    return ms32_QueueCount > 0 && Host::GetNanos() >= mk_Queue[0].u64_ReadyAt;
+}
+
+// Parses the frame that the host has written
+void PN532Emulator::ReceiveFrame()
+{
+    int P = -1;
+    for (int i=0; i<ms32_InLen-1; i++)
+    {
+        if (mu8_InBuf[i] == PN532_STARTCODE1 && mu8_InBuf[i+1] == PN532_STARTCODE2)
+        {
+            P = i + 2;
+            break;
+        }
+    }
+    if (P < 0 || P + 2 > ms32_InLen)
+        return; // wake up sequence (0x55) or garbage
+
+    // An ACK frame from the host aborts the current command
+    if (mu8_InBuf[P] == 0x00 && mu8_InBuf[P+1] == 0xFF)
+    {
+        ms32_QueueCount = 0;
+        mb_WaitCard     = false;
+        mb_AutoPoll     = false;
+
+        // SetSerialBaudRate is executed after the ACK of the host
+        if (mu32_NewBaud)
+        {
+            mu32_Baud    = mu32_NewBaud;
+            mu32_NewBaud = 0;
+        }
+        return;
+    }
+
+    int s32_DataLen;
+    if (mu8_InBuf[P] == 0xFF && mu8_InBuf[P+1] == 0xFF) // extended frame
+    {
+        if (P + 5 > ms32_InLen) return;
+        s32_DataLen = (mu8_InBuf[P+2] << 8) | mu8_InBuf[P+3];
+        if ((byte)(mu8_InBuf[P+2] + mu8_InBuf[P+3] + mu8_InBuf[P+4]) != 0) return;
+        P += 5;
+    }
+    else
+    {
+        s32_DataLen = mu8_InBuf[P];
+        if ((byte)(mu8_InBuf[P] + mu8_InBuf[P+1]) != 0) return;
+        P += 2;
+    }
+
+    if (s32_DataLen < 2 || P + s32_DataLen + 1 > ms32_InLen || mu8_InBuf[P] != PN532_HOSTTOPN532)
+        return;
+
+    byte u8_Sum = 0;
+    for (int i=0; i<=s32_DataLen; i++) // data + DCS
+    {
+        u8_Sum += mu8_InBuf[P + i];
+    }
+    if (u8_Sum != 0)
+        return; // a real PN532 sends a NACK here
+
+    // A new command replaces a pending one
+    ms32_QueueCount = 0;
+    mb_WaitCard     = false;
+    mb_AutoPoll     = false;
+    mu32_Commands  ++;
+
+    QueueAck();
+    ExecuteCommand(mu8_InBuf + P + 1, s32_DataLen - 1);
+}
+
+void PN532Emulator::QueueAck()
+{
+    const byte u8_Ack[] = { 0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00 };
+
+    mu64_AckAt = Host::GetNanos() + (uint64_t)mk_Timing.u32_AckUs * 1000;
+
+    kFrame* pk_Frame = &mk_Queue[ms32_QueueCount++];
+    memcpy(pk_Frame->u8_Data, u8_Ack, sizeof(u8_Ack));
+    pk_Frame->s32_Len     = sizeof(u8_Ack);
+    pk_Frame->s32_Pos     = 0;
+    pk_Frame->u64_ReadyAt = mu64_AckAt;
+}
+
+// u8_Data starts with the command code of the response (without D5)
+// The response is ready u32_DelayUs after the ACK.
+void PN532Emulator::QueueResponse(const byte* u8_Data, int s32_Len, uint32_t u32_DelayUs)
+{
+    if (ms32_QueueCount >= PN532EMU_QUEUE_SIZE)
+        return;
+
+    kFrame* pk_Frame = &mk_Queue[ms32_QueueCount++];
+    byte* u8_Frame = pk_Frame->u8_Data;
+    int   P = 0;
+    int   s32_DataLen = s32_Len + 1; // + D5
+
+    u8_Frame[P++] = PN532_PREAMBLE;
+    u8_Frame[P++] = PN532_STARTCODE1;
+    u8_Frame[P++] = PN532_STARTCODE2;
+    if (s32_DataLen > 255)
+    {
+        u8_Frame[P++] = 0xFF;
+        u8_Frame[P++] = 0xFF;
+        u8_Frame[P++] = (byte)(s32_DataLen >> 8);
+        u8_Frame[P++] = (byte)(s32_DataLen);
+        u8_Frame[P++] = (byte)(0x100 - (byte)((s32_DataLen >> 8) + s32_DataLen));
+    }
+    else
+    {
+        u8_Frame[P++] = (byte)s32_DataLen;
+        u8_Frame[P++] = (byte)(0x100 - s32_DataLen);
+    }
+
+    byte u8_Sum = PN532_PN532TOHOST;
+    u8_Frame[P++] = PN532_PN532TOHOST;
+    for (int i=0; i<s32_Len; i++)
+    {
+        u8_Frame[P++] = u8_Data[i];
+        u8_Sum += u8_Data[i];
+    }
+    u8_Frame[P++] = (byte)(0x100 - u8_Sum);
+    u8_Frame[P++] = PN532_POSTAMBLE;
+
+    pk_Frame->s32_Len     = P;
+    pk_Frame->s32_Pos     = 0;
+    pk_Frame->u64_ReadyAt = mu64_AckAt + (uint64_t)u32_DelayUs * 1000;
+}
+
+// Syntax error (application level error) -> chapter 6.2.1.5
+void PN532Emulator::QueueErrorFrame()
+{
+    const byte u8_Error[] = { 0x00, 0x00, 0xFF, 0x01, 0xFF, 0x7F, 0x81, 0x00 };
+
+    kFrame* pk_Frame = &mk_Queue[ms32_QueueCount++];
+    memcpy(pk_Frame->u8_Data, u8_Error, sizeof(u8_Error));
+    pk_Frame->s32_Len     = sizeof(u8_Error);
+    pk_Frame->s32_Pos     = 0;
+    pk_Frame->u64_ReadyAt = mu64_AckAt + (uint64_t)mk_Timing.u32_LocalCmdUs * 1000;
+}
+
+// ########################################################################
+// ####                           COMMANDS                            #####
+// ########################################################################
+
+void PN532Emulator::ExecuteCommand(const byte* u8_Cmd, int s32_Len)
+{
+    const byte* u8_Params = u8_Cmd + 1;
+    int s32_ParamLen = s32_Len - 1;
+    byte u8_Resp[8];
+    u8_Resp[0] = u8_Cmd[0] + 1;
+
+    switch (u8_Cmd[0])
+    {
+        case PN532_COMMAND_DIAGNOSE:
+        {
+            // Attention request test / card presence detection (NumTst = 6):
+            // the PN532 sends R(NAK) to the active ISO14443-4 target and waits for R(ACK)
+            if (s32_ParamLen >= 1 && u8_Params[0] == 0x06)
+            {
+                uint32_t u32_Time = mk_Timing.u32_LocalCmdUs;
+                if (!mb_TargetActive)
+                {
+                    u8_Resp[1] = 0x27; // command not acceptable
+                }
+                else if (IsTargetLost())
+                {
+                    u8_Resp[1] = 0x01; // timeout
+                    u32_Time  += mk_Timing.u32_ExchangeUs + RfTimeUs(3) + GetTimeoutUs();
+                }
+                else
+                {
+                    u8_Resp[1] = 0x00;
+                    u32_Time  += mk_Timing.u32_ExchangeUs + RfTimeUs(3) * 2;
+                    mu32_RfBytes += 6;
+                }
+                QueueResponse(u8_Resp, 2, u32_Time);
+                return;
+            }
+
+            // Otherwise only the communication line test (NumTst = 0): the parameters are returned unchanged
+            if (s32_ParamLen < 1 || u8_Params[0] != 0x00)
+                break;
+
+            byte u8_Echo[PN532EMU_FRAME_SIZE];
+            u8_Echo[0] = u8_Resp[0];
+            memcpy(u8_Echo + 1, u8_Params, s32_ParamLen);
+            QueueResponse(u8_Echo, 1 + s32_ParamLen, mk_Timing.u32_LocalCmdUs);
+            return;
+        }
+
+        case PN532_COMMAND_GETFIRMWAREVERSION:
+            u8_Resp[1] = 0x32; // PN532
+            u8_Resp[2] = 0x01; // version 1.6
+            u8_Resp[3] = 0x06;
+            u8_Resp[4] = 0x07; // ISO14443A + B + ISO18092
+            QueueResponse(u8_Resp, 5, mk_Timing.u32_LocalCmdUs);
+            return;
+
+        case PN532_COMMAND_SETSERIALBAUDRATE:
+        {
+            const uint32_t u32_Rates[] = { 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600, 1288000 };
+            if (s32_ParamLen < 1 || u8_Params[0] >= sizeof(u32_Rates) / sizeof(u32_Rates[0]))
+                break;
+
+            mu32_NewBaud = u32_Rates[u8_Params[0]];
+            QueueResponse(u8_Resp, 1, mk_Timing.u32_LocalCmdUs);
+            return;
+        }
+
+        case PN532_COMMAND_SAMCONFIGURATION:
+        case PN532_COMMAND_WRITEGPIO:
+            QueueResponse(u8_Resp, 1, mk_Timing.u32_LocalCmdUs);
+            return;
+
+        case PN532_COMMAND_RFCONFIGURATION:
+            if (s32_ParamLen < 2)
+                break;
+            switch (u8_Params[0])
+            {
+                case 1: // RF field
+                    mb_FieldOn = (u8_Params[1] & 1) != 0;
+                    if (!mb_FieldOn)
+                    {
+                        mb_TargetActive = false;
+                        mb_TargetKnown  = false;
+                        mu8_BitRate     = BITRATE_106;
+                        if (mpi_Card) mpi_Card->Reset();
+                    }
+                    break;
+                case 2: // timings
+                    if (s32_ParamLen >= 4) mu8_RetryTimeout = u8_Params[3];
+                    break;
+                case 4: // exchange retries
+                    mu8_MaxRtyCom = u8_Params[1];
+                    break;
+                case 5: // retries
+                    if (s32_ParamLen >= 4) mu8_MaxRetries = u8_Params[3];
+                    break;
+                default:
+                    break;
+            }
+            QueueResponse(u8_Resp, 1, mk_Timing.u32_LocalCmdUs);
+            return;
+
+        case PN532_COMMAND_INLISTPASSIVETARGET:
+            InListPassiveTarget(u8_Params, s32_ParamLen);
+            return;
+
+        case PN532_COMMAND_INAUTOPOLL:
+            InAutoPoll(u8_Params, s32_ParamLen);
+            return;
+
+        case PN532_COMMAND_INDATAEXCHANGE:
+            InDataExchange(u8_Params, s32_ParamLen);
+            return;
+
+        case PN532_COMMAND_INPSL:
+            InPSL(u8_Params, s32_ParamLen);
+            return;
+
+        case PN532_COMMAND_INDESELECT:
+        case PN532_COMMAND_INRELEASE:
+        {
+            uint32_t u32_Time = mk_Timing.u32_LocalCmdUs;
+            if (mb_TargetActive && mpi_Card)
+            {
+                mpi_Card->Reset(); // S(DESELECT) -> the card goes into HALT state
+                u32_Time += RfTimeUs(3) * 2;
+            }
+            mb_TargetActive = false;
+            mu8_BitRate     = BITRATE_106;
+            if (u8_Cmd[0] == PN532_COMMAND_INRELEASE)
+                mb_TargetKnown = false;
+
+            u8_Resp[1] = 0x00;
+            QueueResponse(u8_Resp, 2, u32_Time);
+            return;
+        }
+
+        case PN532_COMMAND_INSELECT:
+        {
+            uint32_t u32_Time = mk_Timing.u32_LocalCmdUs;
+            if (!mb_TargetKnown)
+            {
+                u8_Resp[1] = 0x27; // command not acceptable
+            }
+            else if (!mpi_Card)
+            {
+                u8_Resp[1] = 0x01; // timeout
+                u32_Time  += GetPollTimeUs();
+            }
+            else
+            {
+                mpi_Card->Reset();
+                mb_TargetActive = true;
+                mb_TargetLost   = false;
+                mu8_BitRate     = BITRATE_106;
+                u8_Resp[1] = 0x00;
+                u32_Time  += mk_Timing.u32_ActivationUs;
+            }
+            QueueResponse(u8_Resp, 2, u32_Time);
+            return;
+        }
+
+        default:
+            break;
+    }
+
+    QueueErrorFrame();
+}
+
+/**************************************************************************
+    u8_Params = NULL if called from PlaceCard() while waiting for a card
+**************************************************************************/
+void PN532Emulator::InListPassiveTarget(const byte* u8_Params, int s32_Len)
+{
+    if (u8_Params && (s32_Len < 2 || u8_Params[0] < 1 || u8_Params[0] > 2 || u8_Params[1] != CARD_TYPE_106KB_ISO14443A))
+    {
+        QueueErrorFrame(); // only ISO14443A is emulated
+        return;
+    }
+
+    mb_FieldOn      = true;
+    mb_TargetActive = false;
+    mb_TargetKnown  = false;
+
+    byte u8_Resp[32];
+    int  P = 0;
+    u8_Resp[P++] = PN532_COMMAND_INLISTPASSIVETARGET + 1;
+
+    if (!mpi_Card)
+    {
+        if (mu8_MaxRetries == 0xFF)
+        {
+            mb_WaitCard = true; // no response until a card enters the field
+            return;
+        }
+
+        u8_Resp[P++] = 0; // no target found
+        QueueResponse(u8_Resp, P, (mu8_MaxRetries + 1) * mk_Timing.u32_PollUs);
+        return;
+    }
+
+    u8_Resp[P++] = 1; // targets found
+    P += ActivateTarget(u8_Resp + P);
+
+    QueueResponse(u8_Resp, P, mk_Timing.u32_ActivationUs);
+}
+
+/**************************************************************************
+    Polls every Period * 150 ms. The RF field is off between the polls and 
+    there is no communication with the host until a card has been found.
+    u8_Params = NULL if called from PlaceCard() while waiting for a card
+**************************************************************************/
+void PN532Emulator::InAutoPoll(const byte* u8_Params, int s32_Len)
+{
+    byte u8_PollNr = 0xFF;
+    if (u8_Params)
+    {
+        bool b_TypeA = false;
+        for (int i=2; i<s32_Len; i++)
+        {
+            b_TypeA |= (u8_Params[i] == 0x00 || u8_Params[i] == 0x10 || u8_Params[i] == 0x20);
+        }
+        if (s32_Len < 3 || u8_Params[0] == 0 || u8_Params[1] < 1 || u8_Params[1] > 15 || !b_TypeA)
+        {
+            QueueErrorFrame(); // only ISO14443A is emulated
+            return;
+        }
+        u8_PollNr         = u8_Params[0];
+        mu32_PollPeriodUs = u8_Params[1] * 150000;
+        mu64_PollStart    = mu64_AckAt;
+    }
+
+    mb_TargetActive = false;
+    mb_TargetKnown  = false;
+
+    byte u8_Resp[40];
+    int  P = 0;
+    u8_Resp[P++] = PN532_COMMAND_INAUTOPOLL + 1;
+
+    if (!mpi_Card)
+    {
+        mb_FieldOn = false;
+        if (u8_PollNr == 0xFF)
+        {
+            mb_WaitCard = true; // no response until a card enters the field
+            mb_AutoPoll = true;
+            return;
+        }
+
+        u8_Resp[P++] = 0; // no target found
+        QueueResponse(u8_Resp, P, u8_PollNr * (mk_Timing.u32_PollUs + mu32_PollPeriodUs));
+        return;
+    }
+
+    mb_FieldOn   = true;
+    u8_Resp[P++] = 1;    // targets found
+    u8_Resp[P++] = 0x20; // type: ISO14443-4A
+    int s32_TgLen= ActivateTarget(u8_Resp + P + 1);
+    u8_Resp[P++] = (byte)s32_TgLen;
+    P += s32_TgLen;
+
+    QueueResponse(u8_Resp, P, mk_Timing.u32_ActivationUs);
+}
+
+// Activates the card as target 1 and writes the target data of InListPassiveTarget / InAutoPoll
+int PN532Emulator::ActivateTarget(byte* u8_Target)
+{
+    mpi_Card->Reset();
+    mb_TargetActive = true;
+    mb_TargetKnown  = true;
+    mb_TargetLost   = false;
+    mu8_BitRate     = BITRATE_106;
+
+    int P = 0;
+    u8_Target[P++] = 1;    // target number
+    u8_Target[P++] = 0x03; // SENS_RES (ATQA) of a Desfire with 7 byte UID
+    u8_Target[P++] = 0x44;
+    u8_Target[P++] = 0x20; // SEL_RES (SAK)
+    u8_Target[P++] = 7;    // UID length
+    mpi_Card->GetUID(u8_Target + P);
+    P += 7;
+    P += mpi_Card->GetATS(u8_Target + P);
+    return P;
+}
+
+void PN532Emulator::InDataExchange(const byte* u8_Params, int s32_Len)
+{
+    byte u8_Resp[PN532EMU_FRAME_SIZE];
+    u8_Resp[0] = PN532_COMMAND_INDATAEXCHANGE + 1;
+
+    if (s32_Len < 2 || u8_Params[0] != 1 || !mb_TargetActive)
+    {
+        u8_Resp[1] = 0x27; // command not acceptable
+        QueueResponse(u8_Resp, 2, mk_Timing.u32_LocalCmdUs);
+        return;
+    }
+
+    // The card has left the field -> the PN532 waits for the timeout
+    if (IsTargetLost())
+    {
+        u8_Resp[1] = 0x01; // timeout after MaxRtyCOM retries
+        uint32_t u32_TryUs = mk_Timing.u32_ExchangeUs + RfTimeUs(s32_Len + 2) + GetTimeoutUs();
+        QueueResponse(u8_Resp, 2, u32_TryUs * (mu8_MaxRtyCom + 1));
+        return;
+    }
+
+    int s32_CardLen;
+    uint32_t u32_CardUs = mpi_Card->Process(u8_Params + 1, s32_Len - 1, u8_Resp + 2, &s32_CardLen);
+    u8_Resp[1] = 0x00;
+
+    // ISO14443-4 block: PCB + INF + CRC16
+    int s32_RfBytes = (s32_Len - 1 + 3) + (s32_CardLen + 3);
+    mu32_RfBytes += s32_RfBytes;
+
+    QueueResponse(u8_Resp, 2 + s32_CardLen, mk_Timing.u32_ExchangeUs + RfTimeUs(s32_RfBytes) + u32_CardUs);
+}
+
+/**************************************************************************
+    Parameter selection (PPS) at 106 kbit, then both sides use the new bit rate.
+    Only the same bit rate in both directions is emulated (the maximum of BRit and BRti is used).
+**************************************************************************/
+void PN532Emulator::InPSL(const byte* u8_Params, int s32_Len)
+{
+    byte u8_Resp[2];
+    u8_Resp[0] = PN532_COMMAND_INPSL + 1;
+    uint32_t u32_Time = mk_Timing.u32_LocalCmdUs;
+
+    if (s32_Len < 3 || u8_Params[0] != 1 || u8_Params[1] > BITRATE_848 || u8_Params[2] > BITRATE_848 || !mb_TargetActive)
+    {
+        u8_Resp[1] = 0x27; // command not acceptable
+    }
+    else if (!mpi_Card || mb_TargetLost)
+    {
+        u8_Resp[1] = 0x01; // timeout
+        u32_Time  += mk_Timing.u32_ExchangeUs + RfTimeUs(5) + GetTimeoutUs();
+    }
+    else
+    {
+        // PPS request (PPSS, PPS0, PPS1 + CRC) and PPS response (PPSS + CRC) at the old bit rate
+        u32_Time += mk_Timing.u32_ExchangeUs + RfTimeUs(5 + 3);
+        mu32_RfBytes += 8;
+        mu8_BitRate = max(u8_Params[1], u8_Params[2]);
+        u8_Resp[1]  = 0x00;
+    }
+    QueueResponse(u8_Resp, 2, u32_Time);
+}
+
+// The active target does not answer: it has left the field or the bit rate is too high
+bool PN532Emulator::IsTargetLost()
+{
+    return !mpi_Card || mb_TargetLost || mu8_BitRate > mu8_MaxStableBitRate;
+}
+
+// The time of one InListPassiveTarget attempt that does not find a card
+uint32_t PN532Emulator::GetPollTimeUs()
+{
+    return mk_Timing.u32_PollUs;
+}
+
+// The time that the PN532 waits for the answer of a card (RFConfiguration item 2)
+uint32_t PN532Emulator::GetTimeoutUs()
+{
+    return mu8_RetryTimeout ? (100u << (mu8_RetryTimeout - 1)) : 0;
+}
+
+uint32_t PN532Emulator::RfTimeUs(int s32_Bytes)
+{
+    return (uint32_t)(((uint64_t)s32_Bytes * mk_Timing.u32_RfByteNs) / 1000) >> mu8_BitRate;
+}
+
+// ########################################################################
+// ####                              HSU                              #####
+// ########################################################################
+
+bool PN532Emulator::OpenSerial(char* s8_Path, int s32_Size)
+{
+    ms32_Master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (ms32_Master < 0 || grantpt(ms32_Master) != 0 || unlockpt(ms32_Master) != 0)
+        return false;
+
+    const char* s8_Slave = ptsname(ms32_Master);
+    ms32_Slave = s8_Slave ? open(s8_Slave, O_RDWR | O_NOCTTY | O_NONBLOCK) : -1;
+    if (ms32_Slave < 0)
+        return false;
+
+    // Raw mode until the host opens the pty
+    termios k_Tio;
+    tcgetattr(ms32_Slave, &k_Tio);
+    cfmakeraw(&k_Tio);
+    cfsetispeed(&k_Tio, B115200);
+    cfsetospeed(&k_Tio, B115200);
+    tcsetattr(ms32_Slave, TCSANOW, &k_Tio);
+
+    struct stat k_Stat;
+    fstat(ms32_Slave, &k_Stat);
+    mu32_SlaveDev = k_Stat.st_rdev;
+
+    fcntl(ms32_Master, F_SETFL, O_NONBLOCK);
+    snprintf(s8_Path, s32_Size, "%s", s8_Slave);
+    return true;
+}
+
+// HardwareSerial has written to a tty. If it is the pty of this emulator the bytes are received now.
+void PN532Emulator::OnSerialWrite(int s32_Fd, int s32_Bytes)
+{
+    struct stat k_Stat;
+    if (ms32_Master < 0 || fstat(s32_Fd, &k_Stat) != 0 || k_Stat.st_rdev != mu32_SlaveDev)
+        return;
+
+    ReceiveSerial(s32_Bytes);
+    SendSerialFrames();
+}
+
+// The baud rate that the host has set on the slave side of the pty
+uint32_t PN532Emulator::GetHostBaud()
+{
+    const speed_t  u32_Speeds[] = { B9600, B19200, B38400, B57600, B115200, B230400, B460800, B921600 };
+    const uint32_t u32_Rates [] = { 9600,  19200,  38400,  57600,  115200,  230400,  460800,  921600  };
+
+    termios k_Tio;
+    if (tcgetattr(ms32_Master, &k_Tio) != 0)
+        return 0;
+
+    speed_t u32_Speed = cfgetospeed(&k_Tio);
+    for (int i=0; i<(int)(sizeof(u32_Speeds) / sizeof(u32_Speeds[0])); i++)
+    {
+        if (u32_Speeds[i] == u32_Speed)
+            return u32_Rates[i];
+    }
+    return 0;
+}
+
+// Receives the s32_Expected bytes that the host has just written.
+// They are read only here (not in OnTick) so the frame is received at the end of its transfer time.
+void PN532Emulator::ReceiveSerial(int s32_Expected)
+{
+    bool b_BaudOK = (GetHostBaud() == mu32_Baud) && !mb_PowerDown;
+    while (s32_Expected > 0)
+    {
+        byte u8_Buf[64];
+        int s32_Read = read(ms32_Master, u8_Buf, min((int)sizeof(u8_Buf), s32_Expected));
+        if (s32_Read <= 0)
+        {
+            // The pty may need some time to pass the bytes
+            pollfd k_Poll = { ms32_Master, POLLIN, 0 };
+            if (poll(&k_Poll, 1, PN532EMU_PTY_TIMEOUT) <= 0)
+                break;
+            continue;
+        }
+
+        s32_Expected -= s32_Read;
+        if (!b_BaudOK)
+            continue; // the UART of the PN532 does not recognize the bytes
+
+        for (int i=0; i<s32_Read; i++)
+        {
+            ReceiveSerialByte(u8_Buf[i]);
+        }
+    }
+}
+
+// Collects the bytes of the next frame. Bytes before the start code (wake up sequence, postamble) are ignored.
+void PN532Emulator::ReceiveSerialByte(byte u8_Data)
+{
+    if (ms32_InLen >= PN532EMU_FRAME_SIZE)
+        ms32_InLen = 0;
+
+    mu8_InBuf[ms32_InLen++] = u8_Data;
+
+    int P = -1;
+    for (int i=0; i<ms32_InLen-1; i++)
+    {
+        if (mu8_InBuf[i] == PN532_STARTCODE1 && mu8_InBuf[i+1] == PN532_STARTCODE2)
+        {
+            P = i + 2;
+            break;
+        }
+    }
+    if (P < 0)
+    {
+        // Only the last byte may be the beginning of a start code
+        mu8_InBuf[0] = mu8_InBuf[ms32_InLen - 1];
+        ms32_InLen   = 1;
+        return;
+    }
+    if (ms32_InLen < P + 2)
+        return;
+
+    int s32_Total;
+    if ((mu8_InBuf[P] == 0x00 && mu8_InBuf[P+1] == 0xFF) || // ACK
+        (mu8_InBuf[P] == 0xFF && mu8_InBuf[P+1] == 0x00))   // NACK
+    {
+        s32_Total = P + 2;
+    }
+    else if (mu8_InBuf[P] == 0xFF && mu8_InBuf[P+1] == 0xFF) // extended frame
+    {
+        if (ms32_InLen < P + 5)
+            return;
+        s32_Total = P + 5 + ((mu8_InBuf[P+2] << 8) | mu8_InBuf[P+3]) + 1;
+    }
+    else
+    {
+        s32_Total = P + 2 + mu8_InBuf[P] + 1;
+    }
+
+    if (ms32_InLen < s32_Total)
+        return;
+
+    ReceiveFrame();
+    ms32_InLen = 0;
+}
+
+// Writes the frames whose time has come to the pty
+void PN532Emulator::SendSerialFrames()
+{
+    if (ms32_Master < 0 || mb_PowerDown || !IsHeadReady())
+        return;
+
+    uint32_t u32_HostBaud = GetHostBaud();
+    while (IsHeadReady())
+    {
+        kFrame* pk_Head = &mk_Queue[0];
+        byte u8_Data[PN532EMU_FRAME_SIZE];
+        for (int i=0; i<pk_Head->s32_Len; i++)
+        {
+            u8_Data[i] = pk_Head->u8_Data[i];
+            if (u32_HostBaud != mu32_Baud)
+                u8_Data[i] ^= 0xA5; // the host samples with the wrong baud rate
+            else if (mu32_Baud > mu32_MaxStableBaud && (++mu32_SentBytes % 32) == 0)
+                u8_Data[i] ^= 0x10; // a bit error on the line
+        }
+
+        int s32_Before = 0;
+        ioctl(ms32_Slave, FIONREAD, &s32_Before);
+        if (write(ms32_Master, u8_Data, pk_Head->s32_Len) != pk_Head->s32_Len)
+            fprintf(stderr, "PN532Emulator -> pty write failed\n");
+
+        // Wait until the host can read the frame, otherwise the result depends on the scheduling of the kernel
+        for (int s32_Wait=0; s32_Wait<PN532EMU_PTY_TIMEOUT; s32_Wait++)
+        {
+            int s32_Now = 0;
+            ioctl(ms32_Slave, FIONREAD, &s32_Now);
+            if (s32_Now >= s32_Before + pk_Head->s32_Len)
+                break;
+            usleep(1000);
+        }
+
+        ms32_QueueCount--;
+        for (int i=0; i<ms32_QueueCount; i++)
+        {
+            mk_Queue[i] = mk_Queue[i+1];
+        }
+    }
+}
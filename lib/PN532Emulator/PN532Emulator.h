@@ -0,0 +1,196 @@
+/**************************************************************************
+
+    Software model of a PN532 connected over SPI or HSU for the host (native) build.
+
+    The emulator is a HostDevice: it watches the chip select and reset pins and
+    answers the SPI bytes while it is selected. It implements the SPI framing
+    (status read 0x02, data write 0x01, data read 0x03), normal and extended
+    frames, ACK and error frames and the commands used by the PN532 / Desfire classes:
+    Diagnose (communication line test, card presence), GetFirmwareVersion, SAMConfiguration,
+    RFConfiguration, WriteGPIO, InListPassiveTarget, InAutoPoll, InDataExchange, InDeselect,
+    InRelease, InSelect.
+
+    The commands are executed immediately but each response only becomes
+    ready after the time that a real PN532 + card would need (ACK time,
+    card activation time, RF transfer time at 106 kbit and the processing time
+    of the DesfireCard). This time is measured on the simulated clock of HostArduino.
+
+    A card is placed into the RF field with PlaceCard() and removed with RemoveCard().
+
+    HSU: OpenSerial() creates a pty. The host opens its slave side with HardwareSerial
+    and talks to the emulator with the PN532Hsu transport. The emulator reads the baud rate
+    that the host has set on the pty: if it differs from its own (SetSerialBaudRate)
+    the bytes are lost or garbled like on a real UART. Above mu32_MaxStableBaud
+    every 32nd byte that the emulator sends is corrupted (a long cable).
+    The same happens on SPI when the host clock is above mu32_MaxStableSpiClock.
+
+    InPSL changes the RF bit rate of the card, the RF transfer time is divided accordingly.
+    Above mu8_MaxStableBitRate the card does not answer anymore (a card at the edge of the field)
+    until it is activated again.
+
+    Software SPI: AttachSoftSpi() connects the emulator to the CLK, MISO and MOSI pins.
+    It samples MOSI on the rising clock edge and presents the next bit on MISO after it
+    (the bit sequence of SoftSpiBus / FastSoftSpiBus). The bus costs only the delays of the host.
+
+    If an IRQ pin is passed to the constructor, the emulator pulls it low while a
+    frame is ready to be read (like P70_IRQ) and runs the interrupt attached to it (SPI only).
+
+    Several emulators with different chip select, reset and IRQ pins can share the SPI bus
+    (up to HOST_MAX_DEVICES) to simulate the readers of a ReaderManager.
+
+**************************************************************************/
+
+#ifndef PN532_EMULATOR_H
+#define PN532_EMULATOR_H
+
+#include <sys/types.h>
+
+#include "DesfireCard.h"
+#include <PN532.h>
+
+// Pass as u8_SelPin if the emulator is only connected via HSU
+#define PN532EMU_NO_PIN  0xFF
+
+// The largest frame: extended frame with 264 data bytes + header
+#define PN532EMU_FRAME_SIZE   280
+// ACK + response
+#define PN532EMU_QUEUE_SIZE     2
+
+// Rough timing of a PN532 with a Desfire card at 106 kbit
+struct PN532EmulatorTiming
+{
+    uint32_t u32_AckUs;          // from the end of the command frame until the ACK is ready
+    uint32_t u32_LocalCmdUs;     // commands that do not communicate with the card
+    uint32_t u32_ActivationUs;   // REQA, anticollision, select and RATS of a Desfire card
+    uint32_t u32_PollUs;         // one unsuccessful activation attempt (no card in the field)
+    uint32_t u32_ExchangeUs;     // overhead of InDataExchange (ISO14443-4 block handling)
+    uint32_t u32_RfByteNs;       // transfer of one byte over RF at 106 kbit (9 bits + framing)
+};
+
+class PN532Emulator : public HostDevice
+{
+public:
+    PN532Emulator(byte u8_SelPin, byte u8_ResetPin, byte u8_IrqPin = PN532_NO_IRQ);
+    ~PN532Emulator();
+
+    void PlaceCard(DesfireCard* pi_Card);
+    void RemoveCard();
+
+    // Software SPI: the emulator listens to these pins (default: not connected)
+    void AttachSoftSpi(byte u8_ClkPin, byte u8_MisoPin, byte u8_MosiPin);
+
+    // HSU: creates a pty and copies the path of its slave side (e.g. /dev/pts/3) to s8_Path
+    bool OpenSerial(char* s8_Path, int s32_Size);
+    uint32_t GetSerialBaud()   { return mu32_Baud; }
+
+    // Statistics
+    uint32_t GetCommandCount() { return mu32_Commands; }
+    uint32_t GetStatusReads()  { return mu32_StatusReads; }
+    uint32_t GetRfBytes()      { return mu32_RfBytes;  }
+
+    PN532EmulatorTiming mk_Timing;
+    uint32_t            mu32_MaxStableBaud;     // HSU: higher baud rates corrupt bytes
+    uint32_t            mu32_MaxStableSpiClock; // SPI: higher clocks corrupt bytes
+    byte                mu8_MaxStableBitRate;   // RF: the card does not answer at higher bit rates (ePN532BitRate)
+
+    // HostDevice
+    virtual void OnPinWrite   (byte u8_Pin, byte u8_Level);
+    virtual bool OnPinRead    (byte u8_Pin, byte* pu8_Level);
+    virtual bool OnSpiTransfer(byte u8_Out, byte* pu8_In);
+    virtual void OnTick();
+    virtual void OnSerialWrite(int s32_Fd, int s32_Bytes);
+
+private:
+    enum eSpiState
+    {
+        SPI_Idle,    // chip select is high
+        SPI_Op,      // chip select is low, waiting for the operation byte
+        SPI_Status,
+        SPI_Write,
+        SPI_Read,
+    };
+    struct kFrame
+    {
+        byte     u8_Data[PN532EMU_FRAME_SIZE];
+        int      s32_Len;
+        int      s32_Pos;
+        uint64_t u64_ReadyAt; // simulated nanoseconds
+    };
+
+    void PowerOn();
+    byte TransferByte(byte u8_Out);
+    byte PeekByte();
+    void OnClockWrite(byte u8_Level);
+    bool IsHeadReady();
+    void UpdateIrq();
+    void ReceiveFrame();
+    void QueueAck();
+    void QueueResponse(const byte* u8_Data, int s32_Len, uint32_t u32_DelayUs);
+    void QueueErrorFrame();
+    void ExecuteCommand(const byte* u8_Cmd, int s32_Len);
+    void InListPassiveTarget(const byte* u8_Params, int s32_Len);
+    void InAutoPoll         (const byte* u8_Params, int s32_Len);
+    int  ActivateTarget     (byte* u8_Target);
+    void InPSL              (const byte* u8_Params, int s32_Len);
+    bool IsTargetLost();
+    void InDataExchange     (const byte* u8_Params, int s32_Len);
+    uint32_t GetPollTimeUs();
+    uint32_t GetTimeoutUs();
+    uint32_t RfTimeUs(int s32_Bytes);
+    void     ReceiveSerial(int s32_Expected);
+    void     ReceiveSerialByte(byte u8_Data);
+    void     SendSerialFrames();
+    uint32_t GetHostBaud();
+
+    byte mu8_SelPin;
+    byte mu8_ResetPin;
+    byte mu8_IrqPin;
+    byte mu8_IrqLevel;
+    bool mb_PowerDown;
+
+    eSpiState me_SpiState;
+    byte      mu8_ClkPin;   // Software SPI pins, PN532EMU_NO_PIN = Hardware SPI only
+    byte      mu8_MisoPin;
+    byte      mu8_MosiPin;
+    byte      mu8_ClkLevel;
+    byte      mu8_MosiLevel;
+    int       ms32_BitPos;  // Software SPI: bits of the current byte that have been clocked
+    byte      mu8_BitOut;   // Software SPI: the byte from the host (MOSI)
+    byte      mu8_BitIn;    // Software SPI: the byte to the host (MISO)
+    byte      mu8_InBuf[PN532EMU_FRAME_SIZE];
+    int       ms32_InLen;
+    bool      mb_HeadRead; // at least one byte of the head frame has been read
+
+    kFrame   mk_Queue[PN532EMU_QUEUE_SIZE];
+    int      ms32_QueueCount;
+    uint64_t mu64_AckAt;  // the time when the ACK of the current command is ready
+
+    // RF state
+    DesfireCard* mpi_Card;
+    bool         mb_FieldOn;
+    bool         mb_TargetActive;  // target number 1 has been activated
+    bool         mb_TargetKnown;   // the PN532 has the data of target 1 (also after InDeselect)
+    bool         mb_TargetLost;    // the card has left the field after it was activated
+    bool         mb_WaitCard;      // InListPassiveTarget with infinite retries or InAutoPoll is waiting for a card
+    bool         mb_AutoPoll;      // mb_WaitCard was set by InAutoPoll
+    uint64_t     mu64_PollStart;   // InAutoPoll: the time of the first poll
+    uint32_t     mu32_PollPeriodUs;// InAutoPoll: time between two polls
+    byte         mu8_MaxRetries;   // MxRtyPassiveActivation (RFConfiguration item 5)
+    byte         mu8_RetryTimeout; // TimeOut (RFConfiguration item 2)
+    byte         mu8_MaxRtyCom;    // MaxRtyCOM (RFConfiguration item 4)
+    byte         mu8_BitRate;      // ePN532BitRate of target 1 (InPSL)
+
+    // HSU
+    int      ms32_Master;     // pty master, -1 = SPI mode
+    int      ms32_Slave;      // kept open to check when the host can read the sent bytes
+    dev_t    mu32_SlaveDev;
+    uint32_t mu32_Baud;
+    uint32_t mu32_NewBaud;    // SetSerialBaudRate: used after the ACK of the host
+    uint32_t mu32_SentBytes;
+
+    uint32_t mu32_Commands;
+    uint32_t mu32_StatusReads; // SPI status read operations
+    uint32_t mu32_RfBytes;
+};
+
+#endif // PN532_EMULATOR_H
@@ -0,0 +1,72 @@
+/**************************************************************************
+
+    Transport wrapper for the host build that counts the bus traffic.
+
+    RecordingTransport<PN532HardSpi> behaves exactly like PN532HardSpi (or any other transport) but
+    counts the status checks, frames and bytes in both directions.
+    The calls to the wrapped transport are resolved at compile time, so the
+    wrapper does not change the measured timing.
+
+**************************************************************************/
+
+#ifndef RECORDING_TRANSPORT_H
+#define RECORDING_TRANSPORT_H
+
+#include <PN532.h>
+
+struct kTransportStats
+{
+    uint32_t u32_StatusChecks; // IsReady() calls
+    uint32_t u32_FramesOut;    // frames written (commands, ACK, wake up)
+    uint32_t u32_BytesOut;
+    uint32_t u32_FramesIn;     // BeginRead() ... EndRead() transfers (ACK, response)
+    uint32_t u32_BytesIn;
+};
+
+template <class Inner>
+class RecordingTransport : public Inner
+{
+public:
+    // The parameters are passed to the constructor of Inner
+    template <typename... Args>
+    RecordingTransport(Args... args) : Inner(args...)
+    {
+        Reset();
+    }
+
+    void Reset()
+    {
+        memset(&mk_Stats, 0, sizeof(mk_Stats));
+    }
+    const kTransportStats* GetStats()
+    {
+        return &mk_Stats;
+    }
+
+    virtual bool IsReady()
+    {
+        mk_Stats.u32_StatusChecks ++;
+        return Inner::IsReady();
+    }
+    virtual void WriteFrame(const byte* u8_Frame, int s32_Len)
+    {
+        mk_Stats.u32_FramesOut ++;
+        mk_Stats.u32_BytesOut += s32_Len;
+        Inner::WriteFrame(u8_Frame, s32_Len);
+    }
+    virtual void BeginRead(int s32_MaxLen)
+    {
+        mk_Stats.u32_FramesIn ++;
+        Inner::BeginRead(s32_MaxLen);
+    }
+    virtual void ReadBytes(byte* u8_Buff, int s32_Len)
+    {
+        mk_Stats.u32_BytesIn += s32_Len;
+        Inner::ReadBytes(u8_Buff, s32_Len);
+    }
+
+private:
+    kTransportStats mk_Stats;
+};
+
+#endif // RECORDING_TRANSPORT_H
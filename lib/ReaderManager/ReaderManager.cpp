@@ -0,0 +1,81 @@
+#include "ReaderManager.h"
+
+// The reader must have been started with begin(). It must outlive the manager.
+// name is reported with each tap (publishRFID), e.g. "in" or "out".
+bool ReaderManager::addReader(DesfireService* reader, const char* name) {
+    if (count >= MAX_READERS) {
+        Serial.printf("[ERROR] Too many readers, %s ignored\n", name);
+        return false;
+    }
+    readers[count] = reader;
+    names[count] = name;
+    count++;
+    Serial.printf("[OK] Reader %d: %s\n", count - 1, name);
+    return true;
+}
+
+// Non-blocking: calls pollCard() of each reader once. Returns the index of the first reader that has
+// detected a card or -1. The next call starts with the reader after it, so a reader with a card
+// that is processed slowly does not delay the taps on the other readers.
+int ReaderManager::poll(byte* uid, byte* uidLength, eCardType* cardType) {
+    for (int i = 0; i < count; i++) {
+        int index = (next + i) % count;
+        if (readers[index]->pollCard(uid, uidLength, cardType)) {
+            next = (index + 1) % count;
+            return index;
+        }
+    }
+    return -1;
+}
+
+void ReaderManager::setAutoPoll(bool enable, uint8_t period) {
+    for (int i = 0; i < count; i++) {
+        readers[i]->setAutoPoll(enable, period);
+    }
+}
+
+void ReaderManager::setMaxBitRate(byte rate) {
+    for (int i = 0; i < count; i++) {
+        readers[i]->setMaxBitRate(rate);
+    }
+}
+
+void ReaderManager::setEV2(bool enable) {
+    for (int i = 0; i < count; i++) {
+        readers[i]->setEV2(enable);
+    }
+}
+
+// All readers share the cache of diversified keys: a card that was tapped on one lane is known on the other
+bool ReaderManager::setKeyDiversifier(KeyDiversifier* diversifier) {
+    bool success = true;
+    for (int i = 0; i < count; i++) {
+        success &= readers[i]->setKeyDiversifier(diversifier);
+    }
+    return success;
+}
+
+// The latency of the taps on all readers goes into the same histograms
+void ReaderManager::setMetrics(TapMetrics* metrics) {
+    for (int i = 0; i < count; i++) {
+        readers[i]->setMetrics(metrics);
+    }
+}
+
+bool ReaderManager::setRfProfile(ePN532RfProfile profile) {
+    bool success = true;
+    for (int i = 0; i < count; i++) {
+        success &= readers[i]->setRfProfile(profile);
+    }
+    return success;
+}
+
+// The name of the profile as in the MQTT control message ("fast_gate", "long_range", "conservative")
+bool ReaderManager::setRfProfile(const char* name) {
+    ePN532RfProfile profile;
+    if (!PN532::FindRfProfile(name, &profile)) {
+        Serial.printf("[ERROR] Unknown RF profile: %s\n", name);
+        return false;
+    }
+    return setRfProfile(profile);
+}
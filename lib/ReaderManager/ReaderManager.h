@@ -0,0 +1,35 @@
+#ifndef READER_MANAGER_H
+#define READER_MANAGER_H
+#include <Arduino.h>
+#include <DesfireService.h>
+
+// Maximum count of PN532 readers (each one needs its own PN532_SS and PN532_RST pin)
+#define MAX_READERS  4
+
+// Drives several PN532 readers (e.g. the inbound and outbound lane of a gate) in round-robin.
+// The card detection of all readers runs at the same time: each PN532 executes its InListPassiveTarget,
+// InAutoPoll or presence check by itself and poll() only checks one reader after the other,
+// so the waits of one reader are used to service the others.
+class ReaderManager {
+public:
+    bool addReader(DesfireService* reader, const char* name);
+    int poll(byte* uid, byte* uidLength, eCardType* cardType);
+    DesfireService* getReader(int index) { return readers[index]; }
+    const char* getName(int index) { return names[index]; }
+    int getCount() { return count; }
+    void setAutoPoll(bool enable, uint8_t period = PN532_AUTOPOLL_PERIOD);
+    void setMaxBitRate(byte rate);
+    void setEV2(bool enable);
+    bool setKeyDiversifier(KeyDiversifier* diversifier);
+    void setMetrics(TapMetrics* metrics);
+    bool setRfProfile(ePN532RfProfile profile);
+    bool setRfProfile(const char* name);
+
+private:
+    DesfireService* readers[MAX_READERS] = {nullptr};
+    const char* names[MAX_READERS] = {nullptr};
+    int count = 0;
+    int next = 0; // poll() starts with this reader
+};
+
+#endif
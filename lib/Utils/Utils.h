@@ -14,27 +14,14 @@
     #define FALSE  false
 #endif
 
-// *********************************************************************************
-// The following switches define how the Teensy communicates with the PN532 board.
-// For the DoorOpener sketch the only valid option is Software SPI.
-// For other projects with the PN532 you may change this.
-// ATTENTION: Only one of the following defines must be set to true!
-// NOTE: In Software SPI mode there is no external libraray required. Only 4 regular digital pins are used.
-// If you want to transfer the code to another processor the easiest way will be to use Software SPI mode.
-#define USE_SOFTWARE_SPI   FALSE   // Visual Studio needs this in upper case
-#define USE_HARDWARE_SPI   TRUE  // Visual Studio needs this in upper case
-#define USE_HARDWARE_I2C   FALSE  // Visual Studio needs this in upper case
-// ********************************************************************************/
-
-
-#if USE_HARDWARE_SPI
-    #include <SPI.h>  // Hardware SPI bus
-#elif USE_HARDWARE_I2C
-    #include <Wire.h> // Hardware I2C bus
-#elif USE_SOFTWARE_SPI
-    // no #include required
-#else
-    #error "You must specify the PN532 communication mode."
+// The bus that connects the PN532 is not selected here anymore.
+// Each PN532 instance gets its transport (Hardware SPI, Software SPI, I2C) in PN532::Init(), see PN532Transport.h.
+// NOTE: Software SPI mode needs no external library. Only 4 regular digital pins are used.
+#include <SPI.h>  // Hardware SPI bus
+#include <Wire.h> // Hardware I2C bus
+
+#if defined(ESP32)
+    #include <soc/gpio_reg.h> // GPIO registers for FastPin
 #endif
 
 #define LF  "\r\n" // LineFeed 
@@ -81,69 +68,148 @@ public:
 
 // -------------------------------------------------------------------------------------------------------------------
 
-#if USE_HARDWARE_SPI
-    // This class implements Hardware SPI (4 wire bus). It is not used for the DoorOpener sketch.
-    // NOTE: This class is not used when you switched to I2C mode with PN532::InitI2C() or Software SPI mode with PN532::InitSoftwareSPI().
-    class SpiClass
-    {  
-    public:
-        static inline void Begin(uint32_t u32_Clock) 
+// This class implements Hardware SPI (4 wire bus).
+// It is used by the transport PN532HardSpi (see PN532Transport.h).
+class SpiClass
+{  
+public:
+    // Several PN532 may share the bus: only the first call starts it, the others change the clock.
+    static inline void Begin(uint32_t u32_Clock) 
+    {
+        if (ActiveClock() == 0)
         {
             SPI.begin();
             SPI.beginTransaction(SPISettings(u32_Clock, LSBFIRST, SPI_MODE0));
+            ActiveClock() = u32_Clock;
         }
-        // Write one byte to the MOSI pin and at the same time receive one byte on the MISO pin.
-        static inline byte Transfer(byte u8_Data) 
-        {
-            return SPI.transfer(u8_Data);
-        }
-    };
-#endif
+        else SetClock(u32_Clock);
+    }
+    // Change the clock while the bus is running.
+    // The ESP32 holds a lock during a transaction, so setFrequency() would block: restart the transaction instead.
+    static inline void SetClock(uint32_t u32_Clock) 
+    {
+        SPI.endTransaction();
+        SPI.beginTransaction(SPISettings(u32_Clock, LSBFIRST, SPI_MODE0));
+        ActiveClock() = u32_Clock;
+    }
+    // Switches the clock only if another device on the bus has used a different one
+    static inline void UseClock(uint32_t u32_Clock)
+    {
+        if (ActiveClock() != u32_Clock)
+            SetClock(u32_Clock);
+    }
+    // Write one byte to the MOSI pin and at the same time receive one byte on the MISO pin.
+    static inline byte Transfer(byte u8_Data) 
+    {
+        return SPI.transfer(u8_Data);
+    }
+    // Transfer a block of bytes in one transaction (the ESP32 uses the SPI FIFO / DMA instead of a call per byte).
+    // pu8_In may be the same buffer as pu8_Out or NULL if the received bytes are not needed.
+    static inline void TransferBytes(const byte* pu8_Out, byte* pu8_In, uint32_t u32_Count) 
+    {
+        SPI.transferBytes(pu8_Out, pu8_In, u32_Count);
+    }
+
+private:
+    // The clock of the running transaction, 0 = the bus has not been started yet
+    static inline uint32_t& ActiveClock()
+    {
+        static uint32_t u32_Clock = 0;
+        return u32_Clock;
+    }
+};
 
 // -------------------------------------------------------------------------------------------------------------------
 
-#if USE_HARDWARE_I2C
-    // This class implements Hardware I2C (2 wire bus with pull-up resistors). It is not used for the DoorOpener sketch.
-    // NOTE: This class is not used when you switched to SPI mode with PN532::InitSoftwareSPI() or PN532::InitHardwareSPI().
-    class I2cClass
-    {  
-    public:
-        // Initialize the I2C pins
-        static inline void Begin() 
-        {
-            Wire.begin();
-        }
-        // --------------------- READ -------------------------
-        // Read the requested amount of bytes at once from the I2C bus into an internal buffer.
-        // ATTENTION: The Arduino library is extremely primitive. A timeout has not been implemented.
-        // When the CLK line is permanently low this function hangs forever!
-        static inline byte RequestFrom(byte u8_Address, byte u8_Quantity)
-        {
-            return Wire.requestFrom(u8_Address, u8_Quantity);
-        }
-        // Read one byte from the buffer that has been read when calling RequestFrom()
-        static inline int Read()
-        {
-            return Wire.read();
-        }
-        // --------------------- WRITE -------------------------
-        // Initiates a Send transmission
-        static inline void BeginTransmission(byte u8_Address)
-        {
-            Wire.beginTransmission(u8_Address);
-        }
-        // Write one byte to the I2C bus
-        static inline void Write(byte u8_Data)
-        {
-            Wire.write(u8_Data);
-        }
-        // Ends a Send transmission
-        static inline void EndTransmission()
-        {
-            Wire.endTransmission();
-        }
-    };
-#endif
+// This class implements Hardware I2C (2 wire bus with pull-up resistors).
+// It is used by the transport PN532I2c (see PN532Transport.h).
+class I2cClass
+{  
+public:
+    // Initialize the I2C pins
+    static inline void Begin() 
+    {
+        Wire.begin();
+    }
+    // --------------------- READ -------------------------
+    // Read the requested amount of bytes at once from the I2C bus into an internal buffer.
+    // ATTENTION: The Arduino library is extremely primitive. A timeout has not been implemented.
+    // When the CLK line is permanently low this function hangs forever!
+    static inline byte RequestFrom(byte u8_Address, byte u8_Quantity)
+    {
+        return Wire.requestFrom(u8_Address, u8_Quantity);
+    }
+    // Read one byte from the buffer that has been read when calling RequestFrom()
+    static inline int Read()
+    {
+        return Wire.read();
+    }
+    // --------------------- WRITE -------------------------
+    // Initiates a Send transmission
+    static inline void BeginTransmission(byte u8_Address)
+    {
+        Wire.beginTransmission(u8_Address);
+    }
+    // Write one byte to the I2C bus
+    static inline void Write(byte u8_Data)
+    {
+        Wire.write(u8_Data);
+    }
+    // Ends a Send transmission
+    static inline void EndTransmission()
+    {
+        Wire.endTransmission();
+    }
+};
+
+// -------------------------------------------------------------------------------------------------------------------
+
+// A digital pin that is written and read directly over the GPIO registers (fast Software SPI).
+// On the ESP32 digitalWrite() needs approx 100 ns, a register write only a few CPU cycles.
+// On other platforms this falls back to digitalWrite() / digitalRead().
+class FastPin
+{
+public:
+    inline void Attach(byte u8_Pin)
+    {
+        #if defined(ESP32)
+            // GPIO 0...31 are in the first register set, 32...39 in the second
+            mu32_Mask   = 1UL << (u8_Pin & 31);
+            mpu32_Set   = (volatile uint32_t*)(u8_Pin < 32 ? GPIO_OUT_W1TS_REG : GPIO_OUT1_W1TS_REG);
+            mpu32_Clear = (volatile uint32_t*)(u8_Pin < 32 ? GPIO_OUT_W1TC_REG : GPIO_OUT1_W1TC_REG);
+            mpu32_In    = (volatile uint32_t*)(u8_Pin < 32 ? GPIO_IN_REG       : GPIO_IN1_REG);
+        #else
+            mu8_Pin = u8_Pin;
+        #endif
+    }
+    // u8_Level = HIGH or LOW
+    inline void Write(byte u8_Level)
+    {
+        #if defined(ESP32)
+            *(u8_Level ? mpu32_Set : mpu32_Clear) = mu32_Mask;
+        #else
+            digitalWrite(mu8_Pin, u8_Level);
+        #endif
+    }
+    inline byte Read()
+    {
+        #if defined(ESP32)
+            return (*mpu32_In & mu32_Mask) ? HIGH : LOW;
+        #else
+            return digitalRead(mu8_Pin);
+        #endif
+    }
+
+private:
+    #if defined(ESP32)
+        uint32_t           mu32_Mask;
+        volatile uint32_t* mpu32_Set;
+        volatile uint32_t* mpu32_Clear;
+        volatile uint32_t* mpu32_In;
+    #else
+        byte mu8_Pin;
+    #endif
+};
 
 // -------------------------------------------------------------------------------------------------------------------
 
@@ -157,6 +223,12 @@ public:
         return millis();
     }
 
+    // returns the current microsecond counter
+    static inline uint32_t GetMicros()
+    {
+        return micros();
+    }
+
     // If you compile on Visual Studio see WinDefines.h
     static inline void DelayMilli(int s32_MilliSeconds)
     {
@@ -170,6 +242,33 @@ public:
         delayMicroseconds(s32_MicroSeconds);
     }
     
+    // Sub-microsecond busy wait for the fast Software SPI.
+    // GetDelayTicks() converts the nanoseconds once into the unit of DelayTicks(), so the bit loop only spins:
+    // ESP32: CPU cycles, host build: simulated nanoseconds, other platforms: microseconds (rounded up).
+    static inline uint32_t GetDelayTicks(uint32_t u32_Nanos)
+    {
+        #if defined(ESP32)
+            return u32_Nanos * getCpuFrequencyMhz() / 1000;
+        #elif defined(HOST_ARDUINO_H)
+            return u32_Nanos;
+        #else
+            return (u32_Nanos + 999) / 1000;
+        #endif
+    }
+    static inline void DelayTicks(uint32_t u32_Ticks)
+    {
+        #if defined(ESP32)
+            uint32_t u32_Start = ESP.getCycleCount();
+            while (ESP.getCycleCount() - u32_Start < u32_Ticks)
+            {
+            }
+        #elif defined(HOST_ARDUINO_H)
+            delayNanoseconds(u32_Ticks);
+        #else
+            delayMicroseconds(u32_Ticks);
+        #endif
+    }
+
     // Defines if a digital processor pin is used as input or output
     // u8_Mode = INPUT or OUTPUT
     // If you compile on Visual Studio see WinDefines.h   
@@ -212,6 +311,14 @@ public:
         return digitalRead(u8_Pin);
     }
 
+    // Calls pf_Isr(pv_Arg) from the interrupt when the level of the pin changes.
+    // s32_Mode = RISING, FALLING or CHANGE
+    // The interrupt routine must be declared with IRAM_ATTR on the ESP32.
+    static inline void AttachInterrupt(byte u8_Pin, void (*pf_Isr)(void*), void* pv_Arg, int s32_Mode)
+    {
+        attachInterruptArg(digitalPinToInterrupt(u8_Pin), pf_Isr, pv_Arg, s32_Mode);
+    }
+
     static uint64_t GetMillis64();
     static void     Print(const char*   s8_Text,  const char* s8_LF=NULL);
     static void     PrintDec  (int      s32_Data, const char* s8_LF=NULL);
@@ -0,0 +1,455 @@
+/**************************************************************************
+
+    Tap benchmark for the native (host) build.
+
+    Runs the card reading sequence of the smart-gate sketch against the
+    PN532 emulator with a provisioned Desfire EV1 card:
+    ReadPassiveTargetID -> access script (select -> auth with the file read key -> read file)
+    With --full-auth the former sequence with three authentications is measured:
+    ReadPassiveTargetID -> authenticatePiccMaster -> authenticateApp -> access script
+
+    The latency is measured on the simulated clock (micros()), which models the
+    SPI bus, the PN532 and the RF transfer. So the result only depends on the code
+    and not on the machine that runs it. The CPU time of the host is reported
+    separately for profiling the crypto and protocol code.
+
+    pio run -e native && .pio/build/native/program --taps 100
+    Options:
+    --taps N    count of card taps (default 50)
+    --irq       connect the IRQ pin of the PN532 (otherwise the status is polled)
+    --fast      use the fast transport timing (burst SPI) instead of the safe timing
+    --async     detect the card with the non-blocking DesfireService::pollCard() like the sketch
+                instead of the blocking DesfireService::readCard() (ReadPassiveTargetID)
+    --calibrate use the SPI clock calibration of DesfireService::begin()
+    --spi-stable HZ  the emulated bus corrupts bytes above this SPI clock (default 5 MHz)
+    --trace     print the PN532 frame trace of the last tap
+    --autopoll  detect the card with InAutoPoll (implies --async)
+    --bitrate KBPS   negotiate up to this RF bit rate after the detection (106, 212, 424, 848, default 106)
+    --rf-stable KBPS the emulated card does not answer above this RF bit rate (default 848)
+    --rf-profile NAME  RF timeouts and retries: conservative (default), fast_gate, long_range
+    --readers N several PN532 on one SPI bus (ReaderManager, implies --async). In each round a card is
+                placed on every reader at the same time, the latency of a tap includes the waiting for the
+                taps on the other readers.
+    --encrypted the PID file uses the communication mode CM_ENCRYPT instead of CM_PLAIN (+ CMAC)
+    --full-auth authenticate with the PICC master key and the application master key before the read
+    --diversify the application master key of each card is derived from its UID (AN10922, KeyDiversifier),
+                implies --full-auth
+    --rollout   key rollout of the file read key: every second tap the card still has the previous key
+                version, the key ring picks the key by GetKeyVersion
+    --ev2       Desfire EV2 card: AuthenticateEV2First / NonFirst and EV2 secure messaging, the PID file
+                uses CM_MAC. With --full-auth the read key is authenticated with AuthenticateEV2NonFirst.
+    -v          show the Serial output of the libraries
+
+**************************************************************************/
+
+#include <Arduino.h>
+#include <chrono>
+#include <memory>
+#include <DesfireService.h>
+#include <ReaderManager.h>
+#include <PN532Emulator.h>
+#include <TapMetrics.h>
+#include "Secrets.h"
+#include "Config.h"
+
+// A free pin for the IRQ line in the benchmark if Config.h does not define one
+#define BENCH_IRQ_PIN  4
+
+// Pins of the additional readers (--readers), reader 0 uses the pins of Config.h
+static const byte BENCH_SS_PINS [MAX_READERS] = { PN532_SS,      15, 13, 12 };
+static const byte BENCH_RST_PINS[MAX_READERS] = { PN532_RST,     22, 25, 26 };
+static const byte BENCH_IRQ_PINS[MAX_READERS] = { BENCH_IRQ_PIN, 27, 32, 33 };
+
+// The time that the other work in loop() takes (MQTT, ultrasonic sensor) between two card polls
+#define BENCH_LOOP_WORK_MS  1
+
+// The time between taking one card away and the next tap. The loop() keeps running (--async).
+#define BENCH_TAP_GAP_MS  300
+
+static const byte CARD_UID[7]  = { 0x04, 0x5A, 0x2C, 0x72, 0x8B, 0x61, 0x80 };
+static const char CARD_PID[]   = "PID-2024-000123";
+
+// The file read key before the rollout (--rollout), SECRET_FILE_READ_ACCESS has the next version
+static const byte BENCH_OLD_READ_KEY[16] = { 0x0A, 0x1B, 0x2C, 0x3D, 0x4E, 0x5F, 0x60, 0x71, 0x82, 0x93, 0xA4, 0xB5, 0xC6, 0xD7, 0xE8, 0xF9 };
+
+struct kPhase
+{
+    const char* s8_Name;
+    uint64_t    u64_Sum;
+    uint32_t    u32_Min;
+    uint32_t    u32_Max;
+};
+
+// Detects the card either blocking (only reader 0) or by calling ReaderManager::poll() in a simulated loop()
+// ps32_Reader receives the reader that has found a card
+// pu32_MaxStall receives the longest time that one call has blocked the loop
+static bool DetectCard(ReaderManager* pi_Readers, bool b_Async, uint32_t u32_TimeoutMs, int* ps32_Reader, uint32_t* pu32_MaxStall)
+{
+    byte      u8_UID[8];
+    byte      u8_UidLength = 0;
+    eCardType e_CardType;
+
+    *pu32_MaxStall = 0;
+    uint32_t u32_Start = millis();
+    do
+    {
+        uint32_t u32_Call = micros();
+        if (b_Async)
+        {
+            *ps32_Reader = pi_Readers->poll(u8_UID, &u8_UidLength, &e_CardType);
+        }
+        else
+        {
+            bool b_Found = pi_Readers->getReader(0)->readCard(u8_UID, &u8_UidLength, &e_CardType);
+            *ps32_Reader = b_Found ? 0 : -1;
+        }
+        *pu32_MaxStall = max(*pu32_MaxStall, micros() - u32_Call);
+        if (*ps32_Reader >= 0)
+            return true;
+
+        delay(BENCH_LOOP_WORK_MS);
+    }
+    while (millis() - u32_Start < u32_TimeoutMs);
+    return false;
+}
+
+// 106, 212, 424, 848 kbps -> ePN532BitRate
+static byte BitRateFromKbps(uint32_t u32_Kbps)
+{
+    byte u8_Rate = BITRATE_106;
+    while (u8_Rate < BITRATE_848 && PN532::GetBitRateKbps(u8_Rate) < u32_Kbps)
+    {
+        u8_Rate++;
+    }
+    return u8_Rate;
+}
+
+static void AddSample(kPhase* pk_Phase, uint32_t u32_Micros)
+{
+    pk_Phase->u64_Sum += u32_Micros;
+    pk_Phase->u32_Min  = min(pk_Phase->u32_Min, u32_Micros);
+    pk_Phase->u32_Max  = max(pk_Phase->u32_Max, u32_Micros);
+}
+
+// The card as it is personalized for the gate: AES PICC master key,
+// application CARD_APPLICATION_ID with AES keys and the PID in file CARD_FILE_ID (read access = key READ_ACCESS_INDEX)
+// b_Diversify: the application master key is derived from the UID and SECRET_APPLICATION_KEY (otherwise the default key)
+static void ProvisionCard(DesfireCard* pi_Card, DESFireFileEncryption e_CommMode, bool b_Diversify)
+{
+    pi_Card->SetPiccKey(SECRET_PICC_MASTER_KEY, 16, DF_KEY_AES, CARD_KEY_VERSION);
+    pi_Card->AddApplication(CARD_APPLICATION_ID, KS_FACTORY_DEFAULT, READ_ACCESS_INDEX + 1, DF_KEY_AES);
+    if (b_Diversify)
+    {
+        byte u8_Input[10];
+        pi_Card->GetUID(u8_Input);
+        u8_Input[7] = (byte)(CARD_APPLICATION_ID);
+        u8_Input[8] = (byte)(CARD_APPLICATION_ID >> 8);
+        u8_Input[9] = (byte)(CARD_APPLICATION_ID >> 16);
+
+        AES  i_Master;
+        byte u8_AppKey[16];
+        i_Master.SetKeyData(SECRET_APPLICATION_KEY, 16, 0);
+        i_Master.DiversifyKey(u8_Input, sizeof(u8_Input), u8_AppKey);
+        pi_Card->SetAppKey(CARD_APPLICATION_ID, 0, u8_AppKey, 16, CARD_KEY_VERSION);
+    }
+    pi_Card->SetAppKey(CARD_APPLICATION_ID, READ_ACCESS_INDEX, SECRET_FILE_READ_ACCESS, 16, CARD_KEY_VERSION);
+
+    DESFireFilePermissions k_Permis;
+    k_Permis.e_ReadAccess         = (DESFireAccessRights)READ_ACCESS_INDEX;
+    k_Permis.e_WriteAccess        = AR_KEY0;
+    k_Permis.e_ReadAndWriteAccess = AR_KEY0;
+    k_Permis.e_ChangeAccess       = AR_KEY0;
+
+    byte u8_Data[32] = {0};
+    memcpy(u8_Data, CARD_PID, strlen(CARD_PID));
+    pi_Card->AddStdDataFile(CARD_APPLICATION_ID, CARD_FILE_ID, e_CommMode, &k_Permis, sizeof(u8_Data), u8_Data);
+}
+
+int main(int argc, char* argv[])
+{
+    int  s32_Taps    = 50;
+    bool b_Verbose   = false;
+    byte u8_IrqPin   = PN532_NO_IRQ;
+    ePN532Timing e_Timing = TIMING_Safe;
+    bool b_Async     = false;
+    bool b_Calibrate = false;
+    bool b_Trace     = false;
+    bool b_AutoPoll  = false;
+    uint32_t u32_SpiStable = PN532_MAX_SPI_CLOCK;
+    byte u8_BitRate  = BITRATE_106;
+    byte u8_RfStable = BITRATE_848;
+    ePN532RfProfile e_RfProfile = RFPROFILE_Conservative;
+    int  s32_Readers = 1;
+    bool b_FullAuth  = false;
+    bool b_EV2       = false;
+    bool b_Diversify = false;
+    bool b_Rollout   = false;
+    DESFireFileEncryption e_CommMode = CM_PLAIN;
+    for (int i=1; i<argc; i++)
+    {
+        if      (strcmp(argv[i], "--taps") == 0 && i+1 < argc) s32_Taps  = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-v")     == 0)               b_Verbose = true;
+        else if (strcmp(argv[i], "--irq")  == 0)               u8_IrqPin = (PN532_IRQ != PN532_NO_IRQ) ? PN532_IRQ : BENCH_IRQ_PIN;
+        else if (strcmp(argv[i], "--fast") == 0)               e_Timing  = TIMING_Fast;
+        else if (strcmp(argv[i], "--async")== 0)               b_Async   = true;
+        else if (strcmp(argv[i], "--calibrate") == 0)          b_Calibrate = true;
+        else if (strcmp(argv[i], "--trace") == 0)              b_Trace     = true;
+        else if (strcmp(argv[i], "--autopoll") == 0)           b_AutoPoll  = b_Async = true;
+        else if (strcmp(argv[i], "--spi-stable") == 0 && i+1 < argc) u32_SpiStable = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--bitrate")    == 0 && i+1 < argc) u8_BitRate    = BitRateFromKbps(strtoul(argv[++i], NULL, 10));
+        else if (strcmp(argv[i], "--rf-stable")  == 0 && i+1 < argc) u8_RfStable   = BitRateFromKbps(strtoul(argv[++i], NULL, 10));
+        else if (strcmp(argv[i], "--rf-profile") == 0 && i+1 < argc && PN532::FindRfProfile(argv[i+1], &e_RfProfile)) i++;
+        else if (strcmp(argv[i], "--full-auth")  == 0)               b_FullAuth    = true;
+        else if (strcmp(argv[i], "--encrypted")  == 0)               e_CommMode    = CM_ENCRYPT;
+        else if (strcmp(argv[i], "--ev2")        == 0)               b_EV2         = true;
+        else if (strcmp(argv[i], "--diversify")  == 0)               b_Diversify   = b_FullAuth = true;
+        else if (strcmp(argv[i], "--rollout")    == 0)               b_Rollout     = true;
+        else if (strcmp(argv[i], "--readers")    == 0 && i+1 < argc) s32_Readers   = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "Usage: %s [--taps N] [--irq] [--fast] [--async] [--calibrate] [--spi-stable HZ] [--trace] [--autopoll] [--bitrate KBPS] [--rf-stable KBPS] [--rf-profile NAME] [--readers N] [--full-auth] [--diversify] [--rollout] [--encrypted] [--ev2] [-v]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (b_EV2)
+    {
+        if (e_CommMode == CM_ENCRYPT)
+        {
+            fprintf(stderr, "--encrypted requires an EV1 authentication\n");
+            return 1;
+        }
+        e_CommMode = CM_MAC; // EV2 secure messaging does not MAC a CM_PLAIN file
+    }
+    Host::SetSerialEcho(b_Verbose);
+
+    s32_Readers = constrain(s32_Readers, 1, MAX_READERS);
+    if (s32_Readers > 1)
+        b_Async = true; // the blocking detection can only wait on one reader
+
+    // Each reader has its own card with a different UID, all PN532 share the SPI bus
+    std::unique_ptr<DesfireCard>    i_Cards [MAX_READERS];
+    std::unique_ptr<PN532Emulator>  i_PN532s[MAX_READERS];
+    std::unique_ptr<DesfireService> i_Nfcs  [MAX_READERS];
+    ReaderManager readers;
+    KeyDiversifier i_AppKeys;
+    TapMetrics     i_Metrics;
+    static const char* s8_Names[MAX_READERS] = { "in", "out", "r2", "r3" };
+
+    uint32_t u32_Start = micros();
+    for (int R=0; R<s32_Readers; R++)
+    {
+        byte u8_UID[7];
+        memcpy(u8_UID, CARD_UID, sizeof(u8_UID));
+        u8_UID[6] += R;
+        byte u8_Irq = (u8_IrqPin == PN532_NO_IRQ) ? PN532_NO_IRQ : (R == 0 ? u8_IrqPin : BENCH_IRQ_PINS[R]);
+
+        i_Cards[R].reset(new DesfireCard(u8_UID));
+        i_Cards[R]->mb_EV2 = b_EV2;
+        i_PN532s[R].reset(new PN532Emulator(BENCH_SS_PINS[R], BENCH_RST_PINS[R], u8_Irq));
+        i_PN532s[R]->mu32_MaxStableSpiClock = u32_SpiStable;
+        i_PN532s[R]->mu8_MaxStableBitRate   = u8_RfStable;
+        ProvisionCard(i_Cards[R].get(), e_CommMode, b_Diversify);
+
+        i_Nfcs[R].reset(new DesfireService(SECRET_PICC_MASTER_KEY, CARD_KEY_VERSION));
+        if (!i_Nfcs[R]->begin(BENCH_SS_PINS[R], BENCH_RST_PINS[R], u8_Irq, e_Timing, b_Calibrate))
+        {
+            fprintf(stderr, "PN532 initialization of reader %d failed\n", R);
+            return 1;
+        }
+        readers.addReader(i_Nfcs[R].get(), s8_Names[R]);
+    }
+    uint32_t u32_Init = micros() - u32_Start;
+    readers.setAutoPoll(b_AutoPoll);
+    readers.setMaxBitRate(u8_BitRate);
+    readers.setEV2(b_EV2);
+    readers.setMetrics(&i_Metrics);
+    if (b_Diversify && i_AppKeys.begin(DF_KEY_AES, SECRET_APPLICATION_KEY))
+        readers.setKeyDiversifier(&i_AppKeys);
+    if (e_RfProfile != RFPROFILE_Conservative) readers.setRfProfile(e_RfProfile);
+
+    DesfireService& nfc = *i_Nfcs[0];
+
+    // The access script of the sketch, the read key comes from the key ring
+    KeyRing i_ReadKeys;
+    if (b_Rollout)
+        i_ReadKeys.addKey(CARD_KEY_VERSION, BENCH_OLD_READ_KEY);
+    const byte u8_NewVersion = b_Rollout ? CARD_KEY_VERSION + 1 : CARD_KEY_VERSION;
+    i_ReadKeys.addKey(u8_NewVersion, SECRET_FILE_READ_ACCESS);
+    byte u8_PidData[32];
+    char s8_PidText[64];
+    const CardStep k_Script[] =
+    {
+        CardStep::select(CARD_APPLICATION_ID),
+        CardStep::auth(READ_ACCESS_INDEX, &i_ReadKeys),
+        CardStep::readFile(CARD_FILE_ID, 0, sizeof(u8_PidData), u8_PidData, e_CommMode),
+    };
+    const int SCRIPT_STEPS = sizeof(k_Script) / sizeof(k_Script[0]);
+    CardScriptResult k_Result;
+    uint32_t u32_Skipped = 0;
+
+    // Polling without card for one second (the sketch does this in every loop)
+    uint32_t u32_Idle;
+    uint32_t u32_IdleStatus = 0;
+    uint32_t u32_IdleCmds   = 0;
+    for (int R=0; R<s32_Readers; R++)
+    {
+        u32_IdleStatus -= i_PN532s[R]->GetStatusReads();
+        u32_IdleCmds   -= i_PN532s[R]->GetCommandCount();
+    }
+    int s32_Reader;
+    DetectCard(&readers, b_Async, 1000, &s32_Reader, &u32_Idle);
+    for (int R=0; R<s32_Readers; R++)
+    {
+        u32_IdleStatus += i_PN532s[R]->GetStatusReads();
+        u32_IdleCmds   += i_PN532s[R]->GetCommandCount();
+    }
+
+    kPhase k_Phases[] =
+    {
+        { "detect",   0, 0xFFFFFFFF, 0 },
+        { "auth_picc",0, 0xFFFFFFFF, 0 },
+        { "auth_app", 0, 0xFFFFFFFF, 0 },
+        { "read_file",0, 0xFFFFFFFF, 0 },
+        { "tap_total",0, 0xFFFFFFFF, 0 },
+    };
+    const int PHASES = sizeof(k_Phases) / sizeof(k_Phases[0]);
+
+    // In each round a card is placed on every reader at once and the readers are served in the order
+    // in which ReaderManager::poll() reports them. The phases of a tap are measured from placing the card.
+    int s32_Success = 0;
+    int s32_Total   = 0;
+    uint32_t u32_Auths = 0;
+    auto k_CpuStart = std::chrono::steady_clock::now();
+    for (int T=0; T<s32_Taps; T++)
+    {
+        for (int R=0; R<s32_Readers; R++)
+        {
+            i_Nfcs[R]->desfireReader.ClearTrace();
+            if (b_Rollout) // every second card has not been updated to the new key yet
+            {
+                bool b_Old = ((T + R) % 2) == 0;
+                i_Cards[R]->SetAppKey(CARD_APPLICATION_ID, READ_ACCESS_INDEX, b_Old ? BENCH_OLD_READ_KEY : SECRET_FILE_READ_ACCESS, 16,
+                                      b_Old ? CARD_KEY_VERSION : u8_NewVersion);
+            }
+            i_PN532s[R]->PlaceCard(i_Cards[R].get());
+        }
+
+        uint32_t u32_T0 = micros();
+        for (int N=0; N<s32_Readers; N++)
+        {
+            s32_Total++;
+            uint32_t u32_Times[5];
+            uint32_t u32_Stall;
+            bool b_OK = DetectCard(&readers, b_Async, 1000, &s32_Reader, &u32_Stall);
+            DesfireService* pi_Nfc = b_OK ? readers.getReader(s32_Reader) : &nfc;
+            u32_Times[0] = micros();
+            uint32_t u32_AuthStart = pi_Nfc->getAuthCount();
+            b_OK = b_OK && (!b_FullAuth || pi_Nfc->authenticatePiccMaster());
+            u32_Times[1] = micros();
+            b_OK = b_OK && (!b_FullAuth || pi_Nfc->authenticateApp(CARD_APPLICATION_ID));
+            u32_Times[2] = micros();
+            String s_PID;
+            if (b_OK && pi_Nfc->runScript(k_Script, &k_Result))
+            {
+                uint32_t u32_Convert = micros();
+                Utils::HexBufToAsciiBuf(u8_PidData, sizeof(u8_PidData), s8_PidText, sizeof(s8_PidText));
+                s_PID = String(s8_PidText);
+                i_Metrics.record(PHASE_CONVERT, micros() - u32_Convert);
+                for (int S=0; S<SCRIPT_STEPS; S++)
+                {
+                    if (k_Result.steps[S].status == STEP_SKIPPED) u32_Skipped++;
+                }
+            }
+            u32_Times[3] = micros();
+            u32_Auths += pi_Nfc->getAuthCount() - u32_AuthStart;
+            u32_Times[4] = u32_Times[3];
+
+            if (b_OK)
+                i_PN532s[s32_Reader]->RemoveCard();
+
+            if (!b_OK || s_PID != CARD_PID)
+                continue;
+
+            s32_Success++;
+            i_Metrics.record(PHASE_TAP, u32_Times[3] - u32_Times[0]); // the sketch measures from the detected card
+            uint32_t u32_Prev = u32_T0;
+            for (int P=0; P<PHASES-1; P++)
+            {
+                AddSample(&k_Phases[P], u32_Times[P] - u32_Prev);
+                u32_Prev = u32_Times[P];
+            }
+            AddSample(&k_Phases[PHASES-1], u32_Times[4] - u32_T0);
+        }
+
+        for (int R=0; R<s32_Readers; R++)
+        {
+            i_PN532s[R]->RemoveCard();
+        }
+
+        // pollCard() notices that the card has left (presence check) while nobody is at the gate
+        if (b_Async)
+        {
+            uint32_t u32_GapStall;
+            DetectCard(&readers, b_Async, BENCH_TAP_GAP_MS, &s32_Reader, &u32_GapStall);
+            u32_Idle = max(u32_Idle, u32_GapStall);
+        }
+    }
+    double d_CpuUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - k_CpuStart).count();
+
+    printf("readers:         %d\n", s32_Readers);
+    printf("taps:            %d (%d successful)\n", s32_Total, s32_Success);
+    printf("ready detection: %s\n", u8_IrqPin == PN532_NO_IRQ ? "status polling" : "IRQ pin");
+    printf("transport:       %s\n", e_Timing == TIMING_Fast ? "fast (burst)" : "safe");
+    printf("spi clock:       %u Hz%s\n", (unsigned)nfc.getSpiClock(), b_Calibrate ? " (calibrated)" : "");
+    printf("rf bit rate:     %u kbps (max %u kbps)\n", nfc.getBitRate(), PN532::GetBitRateKbps(u8_BitRate));
+    printf("rf profile:      %s\n", PN532::GetRfProfileName(e_RfProfile));
+    printf("file comm mode:  %s\n", e_CommMode == CM_ENCRYPT ? "encrypted" : e_CommMode == CM_MAC ? "MAC" : "plain + CMAC");
+    printf("authentication:  %s\n", b_EV2 ? "EV2 (First / NonFirst)" : "EV1");
+    if (i_AppKeys.isEnabled())
+        printf("app master key:  diversified (AN10922), %u derived, %u from cache\n", (unsigned)i_AppKeys.getMisses(), (unsigned)i_AppKeys.getHits());
+    printf("init:            %.2f ms\n", u32_Init / 1000.0);
+    printf("card detection:  %s\n", b_AutoPoll ? "InAutoPoll (pollCard)" : b_Async ? "non-blocking (pollCard)" : "blocking (readCard)");
+    printf("idle loop stall: %.2f ms (longest blocking call without card)\n", u32_Idle / 1000.0);
+    printf("idle bus load:   %u commands, %u status reads per second\n", (unsigned)u32_IdleCmds, (unsigned)u32_IdleStatus);
+    uint32_t u32_Commands = 0;
+    for (int R=0; R<s32_Readers; R++)
+    {
+        u32_Commands += i_PN532s[R]->GetCommandCount();
+    }
+    printf("pn532 commands:  %u\n", (unsigned)u32_Commands);
+    printf("authentications: %.2f per tap\n", s32_Total ? (double)u32_Auths / s32_Total : 0.0);
+    if (b_Rollout)
+    {
+        printf("key rollout:    ");
+        for (int K=0; K<i_ReadKeys.getCount(); K++)
+        {
+            printf(" version %u: %u taps,", i_ReadKeys.getVersion(K), (unsigned)i_ReadKeys.getUseCount(K));
+        }
+        printf(" unknown: %u taps\n", (unsigned)i_ReadKeys.getUnknownCount());
+    }
+    printf("script steps:    %d per tap, %.2f skipped\n", SCRIPT_STEPS, s32_Total ? (double)u32_Skipped / s32_Total : 0.0);
+    for (int P=0; P<PHASES && s32_Success > 0; P++)
+    {
+        printf("%-16s avg %8.2f ms   min %8.2f ms   max %8.2f ms\n", k_Phases[P].s8_Name,
+               k_Phases[P].u64_Sum / 1000.0 / s32_Success, k_Phases[P].u32_Min / 1000.0, k_Phases[P].u32_Max / 1000.0);
+    }
+    printf("host cpu:        %.1f us per tap\n", s32_Total ? d_CpuUs / s32_Total : 0.0);
+
+    // The percentiles as in the MQTT metrics payload of the sketch (TapMetrics, without publish)
+    printf("phase (TapMetrics)   count      p50 us      p95 us      p99 us\n");
+    for (int P=0; P<PHASE_COUNT; P++)
+    {
+        TapPhase e_Phase = (TapPhase)P;
+        if (i_Metrics.getCount(e_Phase) == 0) continue;
+        printf("  %-16s %7u  %10u  %10u  %10u\n", TapMetrics::getPhaseName(e_Phase), (unsigned)i_Metrics.getCount(e_Phase),
+               (unsigned)i_Metrics.getPercentile(e_Phase, 50), (unsigned)i_Metrics.getPercentile(e_Phase, 95), (unsigned)i_Metrics.getPercentile(e_Phase, 99));
+    }
+
+    if (b_Trace)
+    {
+        Host::SetSerialEcho(true);
+        nfc.desfireReader.DumpTrace();
+    }
+
+    return (s32_Success == s32_Total) ? 0 : 2;
+}
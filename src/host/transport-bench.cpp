@@ -0,0 +1,254 @@
+/**************************************************************************
+
+    Transport microbenchmark for the native (host) build.
+
+    Measures the PN532 frame transport alone with the safe and the fast
+    timing profile (see PN532::SetTiming()), each with status polling and
+    with the IRQ pin, over Software SPI (SoftSpiBus with PN532_SOFT_SPI_DELAY and
+    FastSoftSpiBus with the clock of the fast profile) and over HSU (UART) with 115200 baud
+    and with the baud rate that PN532::begin() negotiates (the emulator runs behind a pty):
+
+    firmware  GetFirmwareVersion: short frames, no RF communication
+    select    ReadPassiveTargetID with a card in the field (long response)
+    version   Desfire GetCardVersion: 3 InDataExchange frames
+    echo      Diagnose communication line test with 260 bytes (extended frames)
+
+    The latency is measured on the simulated clock like in tap-bench.cpp.
+    The reader uses a RecordingTransport which additionally counts the bus
+    traffic per operation (status checks, frames and bytes).
+
+    pio run -e native-transport && .pio/build/native-transport/program --count 100
+
+    --hsu-stable BAUD  the emulated line corrupts bytes above this baud rate -> the negotiation falls back
+
+**************************************************************************/
+
+#include <Arduino.h>
+#include <Desfire.h>
+#include <PN532Emulator.h>
+#include <RecordingTransport.h>
+
+#define BENCH_SS_PIN   5
+#define BENCH_RST_PIN  21
+#define BENCH_IRQ_PIN  4
+#define BENCH_CLK_PIN  18
+#define BENCH_MISO_PIN 19
+#define BENCH_MOSI_PIN 23
+
+// The data of the communication line test -> extended frames in both directions
+#define BENCH_ECHO_SIZE  260
+
+static const byte CARD_UID[7] = { 0x04, 0x5A, 0x2C, 0x72, 0x8B, 0x61, 0x80 };
+
+// Gives the benchmark access to the frame level of the PN532 class
+class BenchReader : public Desfire
+{
+public:
+    // Diagnose NumTst = 0: the PN532 returns the data unchanged
+    bool EchoTest(const byte* u8_Data, int s32_Len)
+    {
+        mu8_PacketBuffer[0] = PN532_COMMAND_DIAGNOSE;
+        mu8_PacketBuffer[1] = 0x00;
+        memcpy(mu8_PacketBuffer + 2, u8_Data, s32_Len);
+        int s32_RespLen = ExecuteCommand(mu8_PacketBuffer, 2 + s32_Len);
+        return s32_RespLen == 3 + s32_Len &&
+               mu8_PacketBuffer[1] == PN532_COMMAND_DIAGNOSE + 1 &&
+               memcmp(mu8_PacketBuffer + 3, u8_Data, s32_Len) == 0;
+    }
+};
+
+enum eOperation
+{
+    OP_Firmware = 0,
+    OP_Select,
+    OP_Version,
+    OP_Echo,
+    OP_Count,
+};
+
+static const char* OPERATION_NAMES[OP_Count] = { "firmware", "select", "version", "echo" };
+
+enum eBus
+{
+    BUS_HardSpi = 0,
+    BUS_SoftSpi,
+    BUS_FastSoftSpi,
+    BUS_Hsu,
+};
+
+struct kProfile
+{
+    const char*  s8_Name;
+    ePN532Timing e_Timing;
+    byte         u8_IrqPin;
+    eBus         e_Bus;
+    uint32_t     u32_HsuBaud; // BUS_Hsu: the maximum baud rate of the transport
+};
+
+// Runs each operation s32_Count times and stores the average latency in microseconds
+// and the bus traffic of the last run of each operation.
+// returns false if an operation has failed
+// pu32_Baud receives the HSU baud rate that has been negotiated
+static bool RunProfile(const kProfile* pk_Profile, uint32_t u32_StableBaud, int s32_Count, double d_Avg[OP_Count], kTransportStats k_Traffic[OP_Count], uint32_t* pu32_Baud)
+{
+    bool b_Hsu = pk_Profile->e_Bus == BUS_Hsu;
+
+    DesfireCard   i_Card(CARD_UID);
+    PN532Emulator i_PN532(b_Hsu ? PN532EMU_NO_PIN : BENCH_SS_PIN, BENCH_RST_PIN, pk_Profile->u8_IrqPin);
+    i_PN532.mu32_MaxStableBaud = u32_StableBaud;
+    i_PN532.AttachSoftSpi(BENCH_CLK_PIN, BENCH_MISO_PIN, BENCH_MOSI_PIN);
+
+    HardwareSerial i_Port;
+    char s8_Pty[64];
+    if (b_Hsu)
+    {
+        if (!i_PN532.OpenSerial(s8_Pty, sizeof(s8_Pty)))
+            return false;
+        i_Port.setDevice(s8_Pty);
+    }
+
+    RecordingTransport<PN532HardSpi> i_Spi(BENCH_SS_PIN);
+    RecordingTransport<PN532Hsu>     i_Hsu(&i_Port, pk_Profile->u32_HsuBaud);
+    RecordingTransport<PN532SoftSpi>     i_Soft    (BENCH_SS_PIN, SoftSpiBus    (BENCH_CLK_PIN, BENCH_MISO_PIN, BENCH_MOSI_PIN));
+    RecordingTransport<PN532FastSoftSpi> i_FastSoft(BENCH_SS_PIN, FastSoftSpiBus(BENCH_CLK_PIN, BENCH_MISO_PIN, BENCH_MOSI_PIN));
+
+    BenchReader i_Reader;
+    switch (pk_Profile->e_Bus)
+    {
+        case BUS_Hsu:         i_Reader.Init(&i_Hsu,      BENCH_RST_PIN); break;
+        case BUS_SoftSpi:     i_Reader.Init(&i_Soft,     BENCH_RST_PIN); break;
+        case BUS_FastSoftSpi: i_Reader.Init(&i_FastSoft, BENCH_RST_PIN); break;
+        default:              i_Reader.Init(&i_Spi,      BENCH_RST_PIN); break;
+    }
+    i_Reader.SetIrqPin(pk_Profile->u8_IrqPin);
+    i_Reader.SetTiming(pk_Profile->e_Timing);
+    i_Reader.begin();
+
+    *pu32_Baud = i_Reader.GetSerialBaudRate();
+    if (b_Hsu && *pu32_Baud != i_PN532.GetSerialBaud())
+        return false;
+
+    byte IC, VerHi, VerLo, Flags;
+    if (!i_Reader.GetFirmwareVersion(&IC, &VerHi, &VerLo, &Flags) || !i_Reader.SamConfig())
+        return false;
+
+    i_PN532.PlaceCard(&i_Card);
+
+    byte u8_Echo[BENCH_ECHO_SIZE];
+    for (int i=0; i<BENCH_ECHO_SIZE; i++)
+    {
+        u8_Echo[i] = (byte)(i * 7);
+    }
+
+    for (int O=0; O<OP_Count; O++)
+    {
+        uint64_t u64_Sum = 0;
+        for (int i=0; i<s32_Count; i++)
+        {
+            byte      u8_UID[8];
+            byte      u8_UidLength;
+            eCardType e_CardType;
+            DESFireCardVersion k_Version;
+
+            // The card must be activated for GetCardVersion
+            if (O == OP_Version && !i_Reader.ReadPassiveTargetID(u8_UID, &u8_UidLength, &e_CardType))
+                return false;
+
+            i_Spi.Reset();
+            i_Hsu.Reset();
+            i_Soft.Reset();
+            i_FastSoft.Reset();
+            uint32_t u32_Start = micros();
+            bool b_OK = false;
+            switch (O)
+            {
+                case OP_Firmware: b_OK = i_Reader.GetFirmwareVersion(&IC, &VerHi, &VerLo, &Flags); break;
+                case OP_Select:   b_OK = i_Reader.ReadPassiveTargetID(u8_UID, &u8_UidLength, &e_CardType) && u8_UidLength == 7; break;
+                case OP_Version:  b_OK = i_Reader.GetCardVersion(&k_Version); break;
+                case OP_Echo:     b_OK = i_Reader.EchoTest(u8_Echo, sizeof(u8_Echo)); break;
+            }
+            u64_Sum += micros() - u32_Start;
+            if (!b_OK)
+                return false;
+        }
+        d_Avg[O]     = (double)u64_Sum / s32_Count;
+        switch (pk_Profile->e_Bus)
+        {
+            case BUS_Hsu:         k_Traffic[O] = *i_Hsu.GetStats();      break;
+            case BUS_SoftSpi:     k_Traffic[O] = *i_Soft.GetStats();     break;
+            case BUS_FastSoftSpi: k_Traffic[O] = *i_FastSoft.GetStats(); break;
+            default:              k_Traffic[O] = *i_Spi.GetStats();      break;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    int      s32_Count      = 50;
+    uint32_t u32_StableBaud = PN532_HSU_MAX_BAUD;
+    for (int i=1; i<argc; i++)
+    {
+        if      (strcmp(argv[i], "--count")      == 0 && i+1 < argc) s32_Count      = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--hsu-stable") == 0 && i+1 < argc) u32_StableBaud = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-v")           == 0)               Host::SetSerialEcho(true);
+        else
+        {
+            fprintf(stderr, "Usage: %s [--count N] [--hsu-stable BAUD] [-v]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    const kProfile k_Profiles[] =
+    {
+        { "safe / polling", TIMING_Safe, PN532_NO_IRQ,  BUS_HardSpi,     0 },
+        { "safe / IRQ",     TIMING_Safe, BENCH_IRQ_PIN, BUS_HardSpi,     0 },
+        { "fast / polling", TIMING_Fast, PN532_NO_IRQ,  BUS_HardSpi,     0 },
+        { "fast / IRQ",     TIMING_Fast, BENCH_IRQ_PIN, BUS_HardSpi,     0 },
+        { "hsu / 115200",   TIMING_Fast, PN532_NO_IRQ,  BUS_Hsu,         PN532_HSU_BAUD     },
+        { "hsu / max",      TIMING_Fast, PN532_NO_IRQ,  BUS_Hsu,         PN532_HSU_MAX_BAUD },
+        { "soft / IRQ",     TIMING_Fast, BENCH_IRQ_PIN, BUS_SoftSpi,     0 },
+        { "fast soft / IRQ",TIMING_Fast, BENCH_IRQ_PIN, BUS_FastSoftSpi, 0 },
+    };
+    const int PROFILES  = sizeof(k_Profiles) / sizeof(k_Profiles[0]);
+    const int FAST_IRQ  = 3; // the speedup is calculated against this profile
+
+    double          d_Avg    [PROFILES][OP_Count];
+    kTransportStats k_Traffic[PROFILES][OP_Count];
+    uint32_t        u32_Baud [PROFILES];
+    for (int P=0; P<PROFILES; P++)
+    {
+        if (!RunProfile(&k_Profiles[P], u32_StableBaud, s32_Count, d_Avg[P], k_Traffic[P], &u32_Baud[P]))
+        {
+            fprintf(stderr, "Profile '%s' failed\n", k_Profiles[P].s8_Name);
+            return 2;
+        }
+    }
+
+    printf("operations: %d each, average latency in ms\n", s32_Count);
+    printf("%-16s", "");
+    for (int O=0; O<OP_Count; O++) printf("%12s", OPERATION_NAMES[O]);
+    printf("\n");
+    for (int P=0; P<PROFILES; P++)
+    {
+        printf("%-16s", k_Profiles[P].s8_Name);
+        for (int O=0; O<OP_Count; O++) printf("%12.3f", d_Avg[P][O] / 1000.0);
+        if (u32_Baud[P]) printf("   (%u baud)", u32_Baud[P]);
+        printf("\n");
+    }
+    printf("%-16s", "speedup");
+    for (int O=0; O<OP_Count; O++) printf("%11.1fx", d_Avg[0][O] / d_Avg[FAST_IRQ][O]);
+    printf("\n");
+
+    // The polling profiles need status checks, the frames are the same in all profiles
+    printf("\nbus traffic per operation: status checks (polling / IRQ), frames out/in, bytes out/in\n");
+    for (int O=0; O<OP_Count; O++)
+    {
+        const kTransportStats* pk_Poll = &k_Traffic[0][O];
+        const kTransportStats* pk_Irq  = &k_Traffic[1][O];
+        printf("%-16s%5u /%3u %6u /%2u %6u /%4u\n", OPERATION_NAMES[O],
+               pk_Poll->u32_StatusChecks, pk_Irq->u32_StatusChecks,
+               pk_Poll->u32_FramesOut, pk_Poll->u32_FramesIn, pk_Poll->u32_BytesOut, pk_Poll->u32_BytesIn);
+    }
+    return 0;
+}
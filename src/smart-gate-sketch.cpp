@@ -4,6 +4,8 @@
 #include <PN532.h>
 #include <Desfire.h>
 #include <DesfireService.h>
+#include <ReaderManager.h>
+#include <TapMetrics.h>
 #include <Buffer.h>
 #include <Utils.h>
 #include <Gate.h>
@@ -35,11 +37,17 @@ MqttConfig mqttConfig = {
   .topics = {
     .status   = topic_status,
     .control  = topic_control,
-    .rfid     = topic_rfid
+    .rfid     = topic_rfid,
+    .trace    = topic_trace,
+    .metrics  = topic_metrics
   }
 };
 
-DesfireService nfc(SECRET_PICC_MASTER_KEY, CARD_KEY_VERSION);
+DesfireService nfc(SECRET_PICC_MASTER_KEY, CARD_KEY_VERSION);    // inbound lane
+DesfireService nfcOut(SECRET_PICC_MASTER_KEY, CARD_KEY_VERSION); // outbound lane
+ReaderManager readers;
+KeyDiversifier appKeys;  // application master keys of the cards (CARD_KEY_DIVERSIFICATION), shared by both lanes
+TapMetrics tapMetrics;   // latency histograms of the tap phases of both lanes
 Gate gate;
 Connection conn(mqttConfig, gate);
 
@@ -49,8 +57,26 @@ Connection conn(mqttConfig, gate);
 #define PublishStatusInterval 5000
 
 uint32_t lastStatusPublish = 0;
+uint32_t lastMetricsPublish = 0;
+bool retryTap[MAX_READERS] = {false};  // the last tap on this reader has failed
+uint32_t failedTapTime[MAX_READERS];   // millis() of that tap
+kPN532Trace traceFrames[PN532_TRACE_SIZE];
+
+// The access flow of a tap: only the file read key is authenticated (one 3-pass authentication per tap),
+// the select and auth steps are skipped if the session of the card is still valid
+// The read key is taken from readKeys by the key version on the card (see setup(), key rollout)
+byte pidData[32];
+char pidText[64];
+KeyRing readKeys;
+const CardStep accessScript[] = {
+  CardStep::select(CARD_APPLICATION_ID),
+  CardStep::auth(READ_ACCESS_INDEX, &readKeys),
+  CardStep::readFile(CARD_FILE_ID, 0, sizeof(pidData), pidData, CARD_FILE_COMM_MODE),
+};
+CardScriptResult accessResult;
 
 void handleMqttMessage(const String& topic, const String& message);
+void reportTrace(int reader, uint32_t tapMs);
 
 // ===========================================================================
 void setup() {
@@ -58,9 +84,34 @@ void setup() {
   delay(1000);
   Serial.println("\n========== Smart Gate System ==========");
   
-  nfc.begin(PN532_SS, PN532_RST);
+  // During a key rollout add the previous read key with its version here, e.g. readKeys.addKey(0x01, OLD_KEY).
+  // With only one key no GetKeyVersion is sent. {"key_usage": true} on topic_control shows which versions are still in use.
+  readKeys.addKey(CARD_KEY_VERSION, SECRET_FILE_READ_ACCESS);
+
+  // Each reader is reset by begin(), so every PN532 needs its own RST pin
+  if (nfc.begin(PN532_SS, PN532_RST, PN532_IRQ, PN532_TIMING, PN532_SPI_CALIBRATE)) {
+    readers.addReader(&nfc, "in");
+  }
+  #if PN532_SS_OUT != 0xFF
+    if (nfcOut.begin(PN532_SS_OUT, PN532_RST_OUT, PN532_IRQ_OUT, PN532_TIMING, PN532_SPI_CALIBRATE)) {
+      readers.addReader(&nfcOut, "out");
+    }
+  #endif
+  readers.setAutoPoll(PN532_AUTOPOLL);
+  readers.setMaxBitRate(PN532_BITRATE);
+  readers.setEV2(CARD_AUTH_EV2);
+  #if CARD_KEY_DIVERSIFICATION
+    if (appKeys.begin(USE_AES ? DF_KEY_AES : DF_KEY_3K3DES, SECRET_APPLICATION_KEY)) {
+      readers.setKeyDiversifier(&appKeys);
+    }
+  #endif
+  readers.setRfProfile(PN532_RF_PROFILE);
+  readers.setMetrics(&tapMetrics);
   gate.begin(TRIG_PIN, ECHO_PIN, SERVO_PIN);
   gate.setMode(AUTO);
+  conn.setNfcSpiClock(nfc.getSpiClock());
+  conn.setNfcRfProfile(PN532::GetRfProfileName(nfc.getRfProfile()));
+  conn.setFirmwareVersion(FIRMWARE_VERSION);
   conn.begin();
   conn.setMessageHandler(handleMqttMessage);
 
@@ -88,17 +139,51 @@ void loop() {
     conn.publishStatus();
     lastStatusPublish = millis();
   }
+  if (millis() - lastMetricsPublish > METRICS_PUBLISH_MS) {
+    conn.publishMetrics(tapMetrics);
+    lastMetricsPublish = millis();
+  }
 
-  if (!nfc.desfireReader.ReadPassiveTargetID(uid, &uidLength, &cardType)) return;
-  if (uidLength == 0) return;
+  // The card of a failed tap is only checked for presence, release it so it is read again
+  for (int i = 0; i < readers.getCount(); i++) {
+    if (retryTap[i] && millis() - failedTapTime[i] >= TAP_RETRY_MS) {
+      readers.getReader(i)->releaseCard();
+      retryTap[i] = false;
+    }
+  }
+
+  // All readers detect cards at the same time, the tap is processed on the reader that has found one
+  int reader = readers.poll(uid, &uidLength, &cardType);
+  if (reader < 0) return;
+  DesfireService* lane = readers.getReader(reader);
 
-  nfc.authenticatePiccMaster();
-  nfc.authenticateApp(CARD_APPLICATION_ID);
-  String pid = nfc.readDesfireFile(CARD_FILE_ID, 32, READ_ACCESS_INDEX, SECRET_FILE_READ_ACCESS);
-  conn.publishRFID(pid);
+  // The phases on the card are measured by the DesfireService, convert, publish and the whole tap here
+  uint32_t tapStart = micros();
+  String pid;
+  if (lane->runScript(accessScript, &accessResult)) {
+    uint32_t convertStart = micros();
+    Utils::HexBufToAsciiBuf(pidData, sizeof(pidData), pidText, sizeof(pidText));
+    pid = String(pidText);
+    tapMetrics.record(PHASE_CONVERT, micros() - convertStart);
+  }
+  uint32_t tapMs = (micros() - tapStart) / 1000;
+  Serial.printf("[INFO] Tap on reader %s: %u ms at %u kbps\n", readers.getName(reader), tapMs, lane->getBitRate());
+  uint32_t publishStart = micros();
+  conn.publishRFID(pid, readers.getName(reader), lane->getBitRate(), tapMs);
+  if (accessResult.ok) {
+    tapMetrics.record(PHASE_PUBLISH, micros() - publishStart);
+    tapMetrics.record(PHASE_TAP, micros() - tapStart);
+  }
+  retryTap[reader] = !accessResult.ok;
+  failedTapTime[reader] = millis();
+  if (tapMs > SLOW_TAP_MS) {
+    Serial.printf("[INFO] Slow tap: %u ms\n", tapMs);
+    DesfireService::printScriptResult(accessScript, &accessResult);
+    reportTrace(reader, tapMs);
+  }
   
   conn.publishStatus();
-  delay(1000);
+  // No delay: pollCard() reports the same card only once and detects the next one as soon as this one has left
 }
 // ===========================================================================
 
@@ -143,9 +228,43 @@ void handleMqttMessage(const String& topic, const String& message) {
         Serial.println("Access denied via MQTT");
       }
     }
+    if (doc["trace"].is<bool>() && doc["trace"].as<bool>()) {
+      Serial.println("Trace requested via MQTT");
+      for (int i = 0; i < readers.getCount(); i++) {
+        reportTrace(i, 0);
+      }
+    }
+    if (doc["key_usage"].is<bool>() && doc["key_usage"].as<bool>()) {
+      Serial.println("Key usage requested via MQTT");
+      readKeys.printUsage();
+    }
+    if (doc["metrics"].is<bool>() && doc["metrics"].as<bool>()) {
+      Serial.println("Metrics requested via MQTT");
+      tapMetrics.printReport();
+      conn.publishMetrics(tapMetrics);
+    }
+    if (doc["metrics_reset"].is<bool>() && doc["metrics_reset"].as<bool>()) {
+      tapMetrics.reset();
+      Serial.println("Metrics reset via MQTT");
+    }
+    if (doc["rf_profile"].is<const char*>()) {
+      if (readers.setRfProfile(doc["rf_profile"].as<const char*>())) {
+        Serial.println("RF profile changed via MQTT");
+      }
+      conn.setNfcRfProfile(PN532::GetRfProfileName(nfc.getRfProfile()));
+      conn.publishStatus();
+    }
     if (doc["ping"].is<bool>()) {
       Serial.println("Ping received, publishing status");
       conn.publishStatus();
     }
   }
-}
\ No newline at end of file
+}
+
+// Dumps the PN532 frame trace of a reader over serial and publishes it (tapMs = 0 if requested via MQTT)
+void reportTrace(int reader, uint32_t tapMs) {
+  Desfire& pn532 = readers.getReader(reader)->desfireReader;
+  pn532.DumpTrace();
+  int count = pn532.GetTrace(traceFrames, PN532_TRACE_SIZE);
+  conn.publishTrace(traceFrames, count, tapMs, readers.getName(reader));
+}
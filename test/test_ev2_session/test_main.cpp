@@ -0,0 +1,100 @@
+// Known answer tests of the EV2 secure messaging: session keys (AN12196) and the truncated MAC
+#include <Arduino.h>
+#include <unity.h>
+#include <Desfire.h>
+
+static void HexToBin(const char* s8_Hex, byte* u8_Out, int s32_Length)
+{
+    for (int i=0; i<s32_Length; i++)
+    {
+        char s8_Byte[3] = { s8_Hex[2*i], s8_Hex[2*i + 1], 0 };
+        u8_Out[i] = (byte)strtoul(s8_Byte, NULL, 16);
+    }
+}
+
+void setUp() {}
+void tearDown() {}
+
+// AN12196 AuthenticateEV2First with the default AES key: SV1 -> SesAuthENCKey, SV2 -> SesAuthMACKey
+void test_ev2_session_keys()
+{
+    byte u8_Zero[16] = {0}, u8_RndA[16], u8_RndB[16], u8_EncKey[16], u8_MacKey[16];
+    HexToBin("B04D0787C93EE0CC8CACC8E86F16C6FE", u8_RndA, 16);
+    HexToBin("FA659AD0DCA738DD65DC7DC38612AD81", u8_RndB, 16);
+    HexToBin("63DC07286289A7A6C0334CA31C314A04", u8_EncKey, 16);
+    HexToBin("774F26743ECE6AF5033B6AE8522946F6", u8_MacKey, 16);
+
+    AES i_Key, i_SesEnc, i_SesMac;
+    i_Key.SetKeyData(u8_Zero, 16, 0);
+    TEST_ASSERT_TRUE(Desfire::GenerateEV2SessionKeys(&i_Key, u8_RndA, u8_RndB, &i_SesEnc, &i_SesMac));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(u8_EncKey, i_SesEnc.Data(), 16);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(u8_MacKey, i_SesMac.Data(), 16);
+}
+
+// MACt = the bytes S1, S3, ... S15 of the CMAC
+void test_ev2_mac_truncation()
+{
+    byte u8_Mac[16], u8_MacT[8];
+    for (int i=0; i<16; i++)
+    {
+        u8_Mac[i] = i;
+    }
+    const byte u8_Expect[8] = { 0x01, 0x03, 0x05, 0x07, 0x09, 0x0B, 0x0D, 0x0F };
+    Desfire::TruncateEV2Mac(u8_Mac, u8_MacT);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(u8_Expect, u8_MacT, 8);
+}
+
+// RFC 4493 AES-CMAC examples 1 and 2, truncated like an EV2 MAC
+void test_ev2_mac_rfc4493()
+{
+    byte u8_Key[16], u8_Msg[16], u8_Expect[16], u8_Mac[16], u8_MacT[8];
+    HexToBin("2B7E151628AED2A6ABF7158809CF4F3C", u8_Key, 16);
+    HexToBin("6BC1BEE22E409F96E93D7E117393172A", u8_Msg, 16);
+
+    AES i_Key;
+    i_Key.SetKeyData(u8_Key, 16, 0);
+    TEST_ASSERT_TRUE(i_Key.GenerateCmacSubkeys());
+
+    TX_BUFFER(i_Empty, 16);
+    i_Key.ClearIV();
+    TEST_ASSERT_TRUE(i_Key.CalculateCmac(i_Empty, u8_Mac));
+    HexToBin("BB1D6929E95937287FA37D129B756746", u8_Expect, 16);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(u8_Expect, u8_Mac, 16);
+    Desfire::TruncateEV2Mac(u8_Mac, u8_MacT);
+    HexToBin("1D295928A3127546", u8_Expect, 8);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(u8_Expect, u8_MacT, 8);
+
+    TX_BUFFER(i_Block, 16);
+    i_Block.AppendBuf(u8_Msg, 16);
+    i_Key.ClearIV();
+    TEST_ASSERT_TRUE(i_Key.CalculateCmac(i_Block, u8_Mac));
+    HexToBin("070A16B46B4D4144F79BDD9DD04A287C", u8_Expect, 16);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(u8_Expect, u8_Mac, 16);
+    Desfire::TruncateEV2Mac(u8_Mac, u8_MacT);
+    HexToBin("0AB44D449B9D4A7C", u8_Expect, 8);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(u8_Expect, u8_MacT, 8);
+}
+
+int RunTests()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_ev2_session_keys);
+    RUN_TEST(test_ev2_mac_truncation);
+    RUN_TEST(test_ev2_mac_rfc4493);
+    return UNITY_END();
+}
+
+#ifdef ARDUINO
+void setup()
+{
+    delay(2000); // the serial monitor of the test runner must be connected
+    RunTests();
+}
+
+void loop() {}
+#else
+int main(int argc, char** argv)
+{
+    return RunTests();
+}
+#endif
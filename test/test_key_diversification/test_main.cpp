@@ -0,0 +1,91 @@
+// Known answer tests of the AN10922 key diversification (DESFireKey::DiversifyKey)
+#include <Arduino.h>
+#include <unity.h>
+#include <Desfire.h>
+
+static void HexToBin(const char* s8_Hex, byte* u8_Out, int s32_Length)
+{
+    for (int i=0; i<s32_Length; i++)
+    {
+        char s8_Byte[3] = { s8_Hex[2*i], s8_Hex[2*i + 1], 0 };
+        u8_Out[i] = (byte)strtoul(s8_Byte, NULL, 16);
+    }
+}
+
+// M = UID 04782E21801D80 + AID 3042F5 + system identifier "NXP Abu"
+static const char* DIV_INPUT = "04782E21801D803042F54E585020416275";
+
+void setUp() {}
+void tearDown() {}
+
+// AN10922 2.2.1: AES-128 key diversification
+void test_diversify_aes()
+{
+    byte u8_Master[16], u8_Input[17], u8_Expect[16], u8_Key[16];
+    HexToBin("00112233445566778899AABBCCDDEEFF", u8_Master, 16);
+    HexToBin(DIV_INPUT, u8_Input, 17);
+    HexToBin("A8DD63A3B89D54B37CA802473FDA9175", u8_Expect, 16);
+
+    AES i_Master;
+    i_Master.SetKeyData(u8_Master, 16, 0);
+    TEST_ASSERT_TRUE(i_Master.DiversifyKey(u8_Input, 17, u8_Key));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(u8_Expect, u8_Key, 16);
+}
+
+// AN10922 2.3.1: 2K3DES key diversification with the first 15 bytes of M.
+// The application note sets the DES parity bits of the result, DiversifyKey() does not (they hold the key version).
+void test_diversify_2k3des()
+{
+    byte u8_Master[16], u8_Input[15], u8_Expect[16], u8_Key[16];
+    HexToBin("00112233445566778899AABBCCDDEEFF", u8_Master, 16);
+    HexToBin(DIV_INPUT, u8_Input, 15);
+    HexToBin("16F9587D9E8910C96B9648D006107DD7", u8_Expect, 16);
+
+    DES i_Master;
+    i_Master.SetKeyData(u8_Master, 16, 0);
+    TEST_ASSERT_TRUE(i_Master.DiversifyKey(u8_Input, 15, u8_Key));
+    for (int i=0; i<16; i++)
+    {
+        TEST_ASSERT_EQUAL_HEX8(u8_Expect[i] & 0xFE, u8_Key[i] & 0xFE);
+    }
+}
+
+// The input M must not fill the 2 blocks of the padded message
+void test_diversify_invalid_input()
+{
+    byte u8_Master[16] = {0}, u8_Input[32] = {0}, u8_Key[24];
+    AES i_Aes;
+    i_Aes.SetKeyData(u8_Master, 16, 0);
+    TEST_ASSERT_FALSE(i_Aes.DiversifyKey(u8_Input, 0,  u8_Key));
+    TEST_ASSERT_TRUE (i_Aes.DiversifyKey(u8_Input, 31, u8_Key));
+    TEST_ASSERT_FALSE(i_Aes.DiversifyKey(u8_Input, 32, u8_Key));
+
+    DES i_Des;
+    i_Des.SetKeyData(u8_Master, 16, 0);
+    TEST_ASSERT_TRUE (i_Des.DiversifyKey(u8_Input, 15, u8_Key));
+    TEST_ASSERT_FALSE(i_Des.DiversifyKey(u8_Input, 16, u8_Key));
+}
+
+int RunTests()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_diversify_aes);
+    RUN_TEST(test_diversify_2k3des);
+    RUN_TEST(test_diversify_invalid_input);
+    return UNITY_END();
+}
+
+#ifdef ARDUINO
+void setup()
+{
+    delay(2000); // the serial monitor of the test runner must be connected
+    RunTests();
+}
+
+void loop() {}
+#else
+int main(int argc, char** argv)
+{
+    return RunTests();
+}
+#endif
@@ -0,0 +1,111 @@
+// Histogram buckets and percentiles of TapMetrics
+#include <Arduino.h>
+#include <unity.h>
+#include <TapMetrics.h>
+
+static TapMetrics metrics; // too large for the stack of the ESP32 loop task
+
+void setUp() { metrics.reset(); }
+void tearDown() {}
+
+void test_bucket_linear() {
+    for (uint32_t us = 0; us < HIST_LINEAR_LIMIT; us++) {
+        TEST_ASSERT_EQUAL_INT(us, TapMetrics::getBucket(us));
+        TEST_ASSERT_EQUAL_UINT32(us, TapMetrics::getBucketLimit(us));
+    }
+}
+
+void test_bucket_boundaries() {
+    TEST_ASSERT_EQUAL_INT(16, TapMetrics::getBucket(16));
+    TEST_ASSERT_EQUAL_INT(16, TapMetrics::getBucket(17));
+    TEST_ASSERT_EQUAL_INT(17, TapMetrics::getBucket(18));
+    TEST_ASSERT_EQUAL_UINT32(17, TapMetrics::getBucketLimit(16));
+    TEST_ASSERT_EQUAL_INT(23, TapMetrics::getBucket(31));
+    TEST_ASSERT_EQUAL_UINT32(31, TapMetrics::getBucketLimit(23));
+    TEST_ASSERT_EQUAL_INT(24, TapMetrics::getBucket(32));
+    TEST_ASSERT_EQUAL_INT(24, TapMetrics::getBucket(35));
+    TEST_ASSERT_EQUAL_INT(25, TapMetrics::getBucket(36));
+
+    // each power of two starts a new group of HIST_SUB_BUCKETS buckets
+    for (int exponent = 4; exponent <= HIST_MAX_EXPONENT; exponent++) {
+        int first = HIST_LINEAR_LIMIT + (exponent - HIST_SUB_BITS - 1) * HIST_SUB_BUCKETS;
+        TEST_ASSERT_EQUAL_INT(first, TapMetrics::getBucket(1UL << exponent));
+        TEST_ASSERT_EQUAL_INT(first - 1, TapMetrics::getBucket((1UL << exponent) - 1));
+    }
+}
+
+void test_bucket_overflow() {
+    TEST_ASSERT_EQUAL_INT(HIST_BUCKETS - 1, TapMetrics::getBucket(HIST_MAX_MICROS - 1));
+    TEST_ASSERT_EQUAL_INT(HIST_BUCKETS - 1, TapMetrics::getBucket(HIST_MAX_MICROS));
+    TEST_ASSERT_EQUAL_INT(HIST_BUCKETS - 1, TapMetrics::getBucket(0xFFFFFFFF));
+    TEST_ASSERT_EQUAL_UINT32(HIST_MAX_MICROS - 1, TapMetrics::getBucketLimit(HIST_BUCKETS - 1));
+}
+
+// The limit is the highest value of the bucket, the next value starts the next bucket
+void test_bucket_limits() {
+    for (int bucket = 0; bucket < HIST_BUCKETS - 1; bucket++) {
+        uint32_t limit = TapMetrics::getBucketLimit(bucket);
+        TEST_ASSERT_EQUAL_INT(bucket, TapMetrics::getBucket(limit));
+        TEST_ASSERT_EQUAL_INT(bucket + 1, TapMetrics::getBucket(limit + 1));
+    }
+}
+
+void test_percentile() {
+    TEST_ASSERT_EQUAL_UINT32(0, metrics.getPercentile(PHASE_TAP, 50));
+    for (uint32_t i = 1; i <= 1000; i++) {
+        metrics.record(PHASE_TAP, i * 100);
+    }
+    TEST_ASSERT_EQUAL_UINT32(1000, metrics.getCount(PHASE_TAP));
+    TEST_ASSERT_EQUAL_UINT32(100, metrics.getMin(PHASE_TAP));
+    TEST_ASSERT_EQUAL_UINT32(100000, metrics.getMax(PHASE_TAP));
+    // at most 1/HIST_SUB_BUCKETS too high, never above the maximum
+    uint32_t p50 = metrics.getPercentile(PHASE_TAP, 50);
+    TEST_ASSERT_TRUE(p50 >= 50000 && p50 <= 50000 + 50000 / HIST_SUB_BUCKETS);
+    uint32_t p99 = metrics.getPercentile(PHASE_TAP, 99);
+    TEST_ASSERT_TRUE(p99 >= 99000 && p99 <= 100000);
+    TEST_ASSERT_EQUAL_UINT32(100000, metrics.getPercentile(PHASE_TAP, 100));
+}
+
+// A single value is reported exactly (the percentile is limited to min / max)
+void test_percentile_single_value() {
+    metrics.record(PHASE_SELECT, 0xFFFFFFFF);
+    TEST_ASSERT_EQUAL_UINT32(0xFFFFFFFF, metrics.getPercentile(PHASE_SELECT, 50));
+    metrics.record(PHASE_DETECT, 12345);
+    TEST_ASSERT_EQUAL_UINT32(12345, metrics.getPercentile(PHASE_DETECT, 99));
+}
+
+// A full counter halves all counters of the phase
+void test_counter_overflow() {
+    for (uint32_t i = 0; i < 0x10000; i++) {
+        metrics.record(PHASE_DETECT, 7);
+    }
+    metrics.record(PHASE_DETECT, 1000);
+    TEST_ASSERT_EQUAL_UINT32(0x10001, metrics.getCount(PHASE_DETECT));
+    TEST_ASSERT_EQUAL_UINT32(7, metrics.getPercentile(PHASE_DETECT, 99));
+    TEST_ASSERT_EQUAL_UINT32(1000, metrics.getMax(PHASE_DETECT));
+}
+
+int runTests() {
+    UNITY_BEGIN();
+    RUN_TEST(test_bucket_linear);
+    RUN_TEST(test_bucket_boundaries);
+    RUN_TEST(test_bucket_overflow);
+    RUN_TEST(test_bucket_limits);
+    RUN_TEST(test_percentile);
+    RUN_TEST(test_percentile_single_value);
+    RUN_TEST(test_counter_overflow);
+    return UNITY_END();
+}
+
+#ifdef ARDUINO
+void setup() {
+    delay(2000); // the serial monitor of the test runner must be connected
+    runTests();
+}
+
+void loop() {}
+#else
+int main(int argc, char** argv) {
+    return runTests();
+}
+#endif